@@ -3,25 +3,255 @@
  * Please see COPYING for license terms.
  */
 
+#include <ctype.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <set>
+#include <vector>
 #include "events.h"
+#include "formatter.h"
+#include "tracereader.h"
+#include "workqueue.h"
+
+#define OUTBUF_SIZE (4<<20)
 
 bool header_only = false;
+static bool merge_by_time = false;
+static int jobs = 0;
+static OutputFormat format = FMT_XML;
+static std::set<std::string> path_filter;   // printable path IDs to keep
+static bool have_start = false, have_end = false;
+static timeval start_tv, end_tv;
+
+/* one input file's formatted output; past OUTBUF_SIZE, what waits for
+ * the files before it goes to a temporary file, so each job's memory
+ * stays bounded however big its trace is */
+struct LogOutput {
+	LogOutput(void) : spill(NULL) {}
+	std::string text;
+	FILE *spill;
+};
+struct Translation {
+	char **files;
+	LogOutput *logs;
+	EventFormatter *fmt;
+	bool stream;   // one job, no merge: write output as soon as it is made
+};
+
+static std::string outbuf;
+
+static void flush_output(void) {
+	if (outbuf.empty()) return;
+	if (fwrite(outbuf.data(), outbuf.size(), 1, stdout) != 1) {
+		perror("fwrite");
+		exit(1);
+	}
+	outbuf.clear();
+}
+
+static void emit(const char *p, size_t len) {
+	outbuf.append(p, len);
+	if (outbuf.size() >= OUTBUF_SIZE) flush_output();
+}
 
 static void usage(const char *prog) {
-	fprintf(stderr, "Usage:\n  %s [-H] file [file [file [...]]]\n\n", prog);
-	fprintf(stderr, "  -H = show headers only\n");
+	fprintf(stderr, "Usage:\n  %s [options] file [file [file [...]]]\n\n", prog);
+	fprintf(stderr, "  -H           show headers only\n");
+	fprintf(stderr, "  -f FORMAT    output xml (default), jsonl, or csv\n");
+	fprintf(stderr, "  -p PATHID    only show events in this path (may be repeated)\n");
+	fprintf(stderr, "  -s SEC[.US]  only show events at or after this time\n");
+	fprintf(stderr, "  -e SEC[.US]  only show events at or before this time\n");
+	fprintf(stderr, "  -j N         translate up to N files at once (default: one per CPU;\n");
+	fprintf(stderr, "               -m reads them all at once instead)\n");
+	fprintf(stderr, "  -m           merge all files into one stream in time order\n");
 	exit(1);
 }
 
+static bool parse_tv(const char *str, timeval *tv) {
+	char *end;
+	tv->tv_sec = strtol(str, &end, 10);
+	tv->tv_usec = 0;
+	if (*end == '.') {
+		int digits = 0;
+		for (end++; isdigit(*end); end++)
+			if (digits++ < 6) tv->tv_usec = 10*tv->tv_usec + (*end - '0');
+		for (; digits < 6; digits++) tv->tv_usec *= 10;
+	}
+	return *end == '\0' && end != str;
+}
+
+static void print_header(const char *fn, Header *hdr) {
+	const char *slash;
+	if (!strcmp(fn, "-"))
+		slash = "<stdin>";
+	else {
+		slash = strrchr(fn, '/');
+		slash = slash ? slash+1 : fn;
+	}
+	printf("%s:  %-12s %s   pid=%d tid=%d ppid=%d uid=%d   %s",
+		slash, hdr->processname, hdr->hostname, hdr->pid, hdr->tid, hdr->ppid, hdr->uid, ctime(&hdr->tv.tv_sec));
+}
+
+static inline bool in_time_range(const timeval &tv) {
+	if (have_start && tv < start_tv) return false;
+	if (have_end && tv > end_tv) return false;
+	return true;
+}
+
+static bool path_wanted(const std::string &path_id) {
+	if (path_filter.empty()) return true;
+	char buf[1024];
+	return path_filter.count(ID_to_string(path_id, buf)) != 0;
+}
+
+/* per-thread state; a merged stream (from tracemerge) has many threads */
+struct ThreadState {
+	ThreadState(void) : path_ok(path_wanted("")) {}
+	std::string path_id;
+	bool path_ok;
+	std::string logname;
+};
+
+/* whether to show an event, following its thread's path IDs */
+static bool keep_event(Event *e, ThreadState *ts, const EventFormatter *fmt) {
+	switch (e->type()) {
+		case EV_HEADER:
+			return fmt->fmt != FMT_XML;   // XML never showed headers; -H does
+		case EV_BELIEF_FIRST:   // no path, no timestamp
+			return true;
+		case EV_SET_PATH_ID:
+			ts->path_id = ((NewPathID*)e)->path_id;
+			ts->path_ok = path_wanted(ts->path_id);
+			return ts->path_ok && in_time_range(e->tv);
+		case EV_END_PATH_ID:
+			return path_wanted(((EndPathID*)e)->path_id) && in_time_range(e->tv);
+		default:
+			return ts->path_ok && in_time_range(e->tv);
+	}
+}
+
+/* events from a merged stream always say which thread they are from */
+static void set_logname(ThreadState *ts, const char *fn, int thread) {
+	char num[16];
+	sprintf(num, ":%d", thread);
+	ts->logname.assign(fn).append(num);
+}
+
+static void spill_log(LogOutput *log) {
+	if (!log->spill && (log->spill = tmpfile()) == NULL) {
+		perror("tmpfile");
+		exit(1);
+	}
+	if (fwrite(log->text.data(), log->text.size(), 1, log->spill) != 1) {
+		perror("spill");
+		exit(1);
+	}
+}
+
+static void translate(int idx, void *arg) {
+	Translation *tr = (Translation*)arg;
+	const char *fn = tr->files[idx];
+	LogOutput *log = &tr->logs[idx];
+	const char *logname = tr->fmt->fmt != FMT_XML ? fn : NULL;
+
+	TraceReader reader;
+	if (!reader.open(fn)) return;
+	tr->fmt->begin_log(&log->text, fn);
+
+	std::vector<ThreadState> threads;
+	int thread;
+	Event *e;
+	while ((e = reader.next(&thread)) != NULL) {
+		if (thread >= (int)threads.size()) threads.resize(thread+1);
+		ThreadState *ts = &threads[thread];
+		if (keep_event(e, ts, tr->fmt)) {
+			if (reader.is_merged() && ts->logname.empty()) set_logname(ts, fn, thread);
+			tr->fmt->event(&log->text, e, ts->path_id,
+				reader.is_merged() ? ts->logname.c_str() : logname);
+			if (log->text.size() >= OUTBUF_SIZE) {
+				if (tr->stream)
+					emit(log->text.data(), log->text.size());
+				else
+					spill_log(log);
+				log->text.clear();
+			}
+		}
+		delete e;
+	}
+
+	tr->fmt->end_log(&log->text);
+}
+
+static void write_log(int idx, void *arg) {
+	LogOutput *log = &((Translation*)arg)->logs[idx];
+	if (log->spill) {
+		char buf[65536];
+		size_t len;
+		rewind(log->spill);
+		while ((len = fread(buf, 1, sizeof(buf), log->spill)) > 0)
+			emit(buf, len);
+		if (ferror(log->spill)) {
+			perror("spill");
+			exit(1);
+		}
+		fclose(log->spill);
+		log->spill = NULL;
+	}
+	emit(log->text.data(), log->text.size());
+	std::string().swap(log->text);
+}
+
+/* -m: reads all of the files at once through a TraceMerger, which holds
+ * just one event of each, and formats the events as they come out, so
+ * memory stays the same however big the traces are.  Ties go to the file
+ * named first on the command line. */
+static void translate_merged(char **files, int nfiles, const EventFormatter *fmt) {
+	TraceMerger merger;
+	for (int i=0; i<nfiles; i++)
+		merger.add(files[i]);
+
+	std::vector<ThreadState> threads;
+	int thread;
+	Event *e;
+	while ((e = merger.next(&thread)) != NULL) {
+		if (thread >= (int)threads.size()) threads.resize(thread+1);
+		ThreadState *ts = &threads[thread];
+		if (keep_event(e, ts, fmt)) {
+			if (ts->logname.empty()) {
+				if (merger.from_merged(thread))
+					set_logname(ts, merger.filename(thread), merger.input_thread(thread));
+				else
+					ts->logname = merger.filename(thread);
+			}
+			fmt->event(&outbuf, e, ts->path_id, ts->logname.c_str());
+			if (outbuf.size() >= OUTBUF_SIZE) flush_output();
+		}
+		delete e;
+	}
+}
+
 int main(int argc, char **argv) {
 	int i;
 	char c;
-	while ((c = getopt(argc, argv, "H")) != -1) {
+	while ((c = getopt(argc, argv, "He:f:j:mp:s:")) != -1) {
 		switch (c) {
 			case 'H':  header_only = true; break;
+			case 'e':
+				if (!parse_tv(optarg, &end_tv)) usage(argv[0]);
+				have_end = true;
+				break;
+			case 'f':
+				if (!EventFormatter::parse_format(optarg, &format)) usage(argv[0]);
+				break;
+			case 'j':  jobs = atoi(optarg); break;
+			case 'm':  merge_by_time = true; break;
+			case 'p':  path_filter.insert(optarg); break;
+			case 's':
+				if (!parse_tv(optarg, &start_tv)) usage(argv[0]);
+				have_start = true;
+				break;
 			default:   usage(argv[0]);
 		}
 	}
@@ -29,39 +259,35 @@ int main(int argc, char **argv) {
 	if (argc-optind < 1)
 		usage(argv[0]);
 
-	if (!header_only) printf("<trace>\n");
-	for (i=optind; i<argc; i++) {
-		int version = -1;
-		FILE *fp = !strcmp(argv[i], "-") ? stdin : fopen(argv[i], "r");
-		if (!fp) { perror(argv[i]); continue; }
-		if (!header_only) printf("  <log name=\"%s\">\n", argv[i]); 
-		Event *e = read_event(version, fp);
-		while (e) {
-			if (e->type() == EV_HEADER) {
-				Header *hdr = (Header*)e;
-				version = hdr->version;
-				if (header_only) {
-					const char *slash;
-					if (!strcmp(argv[i], "-"))
-						slash = "<stdin>";
-					else {
-						slash = strrchr(argv[i], '/');
-						slash = slash ? slash+1 : argv[i];
-					}
-					printf("%s:  %-12s %s   pid=%d tid=%d ppid=%d uid=%d   %s",
-						slash, hdr->processname, hdr->hostname, hdr->pid, hdr->tid, hdr->ppid, hdr->uid, ctime(&hdr->tv.tv_sec));
-					delete e;
-					break;
-				}
+	if (header_only) {
+		for (i=optind; i<argc; i++) {
+			TraceReader reader;
+			if (!reader.open(argv[i])) continue;
+			int thread;
+			Event *e;
+			while ((e = reader.next(&thread)) != NULL) {
+				bool header = e->type() == EV_HEADER;
+				if (header) print_header(argv[i], (Header*)e);
+				delete e;
+				if (header && !reader.is_merged()) break;   // merged streams have one per thread
 			}
-			else if (!header_only)
-				e->print(stdout, 2);
-			delete e;
-			e = read_event(version, fp);
 		}
-		if (!header_only) printf("  </log>\n");
-		fclose(fp);
+		return 0;
+	}
+
+	int nfiles = argc-optind;
+	EventFormatter fmt(format);
+	fmt.begin(&outbuf);
+	if (merge_by_time)
+		translate_merged(argv+optind, nfiles, &fmt);
+	else {
+		Translation tr = { argv+optind, new LogOutput[nfiles], &fmt, false };
+		if (jobs <= 0) jobs = default_jobs();
+		tr.stream = jobs == 1;
+		run_ordered(nfiles, jobs, translate, write_log, &tr);
+		delete[] tr.logs;
 	}
-	if (!header_only) printf("</trace>\n");
+	fmt.end(&outbuf);
+	flush_output();
 	return 0;
 }
@@ -3,64 +3,366 @@
  * Please see COPYING for license terms.
  */
 
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <map>
+#include <vector>
 #include "events.h"
+#include "tracereader.h"
+#include "workqueue.h"
 
 struct BeliefStat {
 	BeliefFirst *bf;
 	int yes, no;
 };
 
-int main(int argc, char **argv) {
-	int i;
-	if (argc < 2) {
-		fprintf(stderr, "Usage:\n  %s file [file [file [...]]]\n", argv[0]);
-		return 1;
+/* belief sequence numbers are per thread; a merged stream has many */
+typedef std::pair<int, int> ThreadSeq;
+
+/* Aggregate mode (-a): beliefs are identified by where they appear in the
+ * source rather than by their per-process sequence number, so the same
+ * belief in every trace of a program lands in one BeliefTotal. */
+struct BeliefKey {
+	std::string file, cond;
+	int line;
+	bool operator<(const BeliefKey &other) const {
+		int cmp = file.compare(other.file);
+		if (cmp != 0) return cmp < 0;
+		if (line != other.line) return line < other.line;
+		return cond < other.cond;
+	}
+};
+
+struct Counts {
+	Counts(void) : yes(0), no(0) {}
+	void add(const Counts &other) { yes += other.yes; no += other.no; }
+	int yes, no;
+};
+
+struct BeliefTotal {
+	float max_fail_rate;
+	Counts all;
+	std::map<time_t, Counts> windows;   // keyed by window start time
+};
+
+typedef std::map<BeliefKey, BeliefTotal> BeliefTable;
+
+/* A process declares each belief once, in the trace of whichever thread
+ * reaches it first, and its other threads' traces use the sequence
+ * number alone, so a use is matched to its declaration by host, pid,
+ * and sequence number, across files.  Sorting by host and pid first
+ * keeps each process's beliefs together, so they can be dropped as a
+ * range once its files are merged. */
+struct ProcSeq {
+	ProcSeq(void) : pid(0), seq(0) {}
+	bool same_process(const ProcSeq &other) const {
+		return pid == other.pid && hostname == other.hostname;
+	}
+	std::string hostname;
+	int pid, seq;
+	bool operator<(const ProcSeq &other) const {
+		int cmp = hostname.compare(other.hostname);
+		if (cmp != 0) return cmp < 0;
+		if (pid != other.pid) return pid < other.pid;
+		return seq < other.seq;
+	}
+};
+
+struct FileBeliefs {
+	BeliefTable table;                           // declared in this file
+	std::map<ProcSeq, BeliefKey> declared;
+	std::map<ProcSeq, BeliefTotal> undeclared;   // uses declared elsewhere or later
+};
+
+/* Files are read grouped by the process in their header, so that once
+ * the last file of a process is merged, its declarations and any uses
+ * still waiting for one can be let go.  Merged streams, and files with
+ * no header to go by, may hold any process; they come first, and the
+ * processes only they mention are kept until the end. */
+struct InputFile {
+	const char *fn;
+	ProcSeq proc;      // seq unused
+	bool known;        // a plain trace whose header named proc
+	bool opened;
+	bool operator<(const InputFile &other) const {
+		if (known != other.known) return !known;
+		return known && proc < other.proc;
+	}
+};
+
+struct AggregateJob {
+	std::vector<InputFile> files;   // in the order they are read
+	FileBeliefs **partial;          // a ring of the files being read or waiting to merge
+	int nslots;
+	BeliefTable total;
+	std::map<ProcSeq, BeliefKey> declared;       // by every file so far
+	std::map<ProcSeq, BeliefTotal> pending;      // uses not yet declared
+};
+
+static bool aggregate = false;
+static int jobs = 0;
+static int window = 0;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage:\n  %s [options] file [file [file [...]]]\n\n", prog);
+	fprintf(stderr, "  -a           aggregate beliefs across all files\n");
+	fprintf(stderr, "  -w SECONDS   with -a, also report fail rates per time window\n");
+	fprintf(stderr, "  -j N         with -a, read up to N files at once (default: one per CPU)\n\n");
+	fprintf(stderr, "With -a, memory grows with the beliefs and the processes being read, not\n");
+	fprintf(stderr, "the number of files, except for processes found only in merged streams,\n");
+	fprintf(stderr, "whose beliefs are kept until the end.\n");
+	exit(1);
+}
+
+static bool fails(const Counts &c, float max_fail_rate) {
+	return (float)c.no / (c.yes + c.no) > max_fail_rate;
+}
+
+static void add_counts(BeliefTotal *to, const BeliefTotal &from) {
+	to->all.add(from.all);
+	for (std::map<time_t, Counts>::const_iterator wp=from.windows.begin(); wp!=from.windows.end(); wp++)
+		to->windows[wp->first].add(wp->second);
+}
+
+/* Reads just far enough into each file to find the process it is from.
+ * stdin can't be read twice, so it is left for later. */
+static void sort_files(std::vector<InputFile> *files) {
+	for (unsigned int i=0; i<files->size(); i++) {
+		InputFile *in = &(*files)[i];
+		in->known = false;
+		in->opened = true;
+		if (!strcmp(in->fn, "-")) continue;
+		TraceReader reader;
+		if (!reader.open(in->fn)) {
+			in->opened = false;
+			continue;
+		}
+		int thread;
+		Event *e = reader.next(&thread);
+		if (e && e->type() == EV_HEADER && !reader.is_merged()) {
+			Header *h = (Header*)e;
+			in->proc.hostname = h->hostname ? h->hostname : "";
+			in->proc.pid = h->pid;
+			in->known = true;
+		}
+		delete e;
+	}
+	std::stable_sort(files->begin(), files->end());
+}
+
+static void count_beliefs(int idx, void *arg) {
+	AggregateJob *job = (AggregateJob*)arg;
+	const InputFile &in = job->files[idx];
+	FileBeliefs *fb = job->partial[idx % job->nslots] = new FileBeliefs;
+	BeliefTable *table = &fb->table;
+	std::map<ProcSeq, BeliefTotal*> by_seq;
+	std::map<int, ProcSeq> procs;   // by thread, from its header
+
+	TraceReader reader;
+	if (!in.opened || !reader.open(in.fn)) return;
+	int thread;
+	Event *e;
+	while ((e = reader.next(&thread)) != NULL) {
+		switch (e->type()) {
+			case EV_HEADER:{
+				Header *h = (Header*)e;
+				ProcSeq &ps = procs[thread];
+				ps.hostname = h->hostname ? h->hostname : "";
+				ps.pid = h->pid;
+				break;
+			}
+			case EV_BELIEF_FIRST:{
+				BeliefFirst *bf = (BeliefFirst*)e;
+				BeliefKey key;
+				key.file = bf->file ? bf->file : "";
+				key.cond = bf->cond ? bf->cond : "";
+				key.line = bf->line;
+				BeliefTable::iterator tp = table->find(key);
+				if (tp == table->end()) {
+					tp = table->insert(std::make_pair(key, BeliefTotal())).first;
+					tp->second.max_fail_rate = bf->max_fail_rate;
+				}
+				ProcSeq ps = procs[thread];
+				ps.seq = bf->seq;
+				by_seq[ps] = &tp->second;
+				fb->declared[ps] = key;
+				break;
+			}
+			case EV_BELIEF:{
+				Belief *b = (Belief*)e;
+				ProcSeq ps = procs[thread];
+				ps.seq = b->seq;
+				std::map<ProcSeq, BeliefTotal*>::iterator sp = by_seq.find(ps);
+				// declared in another file, or later in this one
+				BeliefTotal *bt = sp != by_seq.end() ? sp->second : &fb->undeclared[ps];
+				if (b->cond) bt->all.yes++; else bt->all.no++;
+				if (window > 0) {
+					Counts &wc = bt->windows[b->tv.tv_sec - b->tv.tv_sec % window];
+					if (b->cond) wc.yes++; else wc.no++;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+		delete e;
 	}
+}
+
+/* uses still pending in [begin, end) were never declared in any file */
+static void warn_undeclared(std::map<ProcSeq, BeliefTotal>::iterator begin,
+		std::map<ProcSeq, BeliefTotal>::iterator end) {
+	for (std::map<ProcSeq, BeliefTotal>::const_iterator pp=begin; pp!=end; pp++)
+		fprintf(stderr, "%s pid %d: belief %d used but never declared (%d uses skipped)\n",
+			pp->first.hostname.c_str(), pp->first.pid, pp->first.seq,
+			pp->second.all.yes + pp->second.all.no);
+}
+
+/* Declarations are merged before uses, so a use resolves against any
+ * file merged so far, including its own; the rest wait in pending for a
+ * later file to declare them.  After a process's last file, nothing
+ * later can declare or use its beliefs. */
+static void merge_beliefs(int idx, void *arg) {
+	AggregateJob *job = (AggregateJob*)arg;
+	FileBeliefs *fb = job->partial[idx % job->nslots];
+	for (BeliefTable::const_iterator bp=fb->table.begin(); bp!=fb->table.end(); bp++) {
+		BeliefTable::iterator tp = job->total.find(bp->first);
+		if (tp == job->total.end())
+			job->total.insert(*bp);
+		else
+			add_counts(&tp->second, bp->second);
+	}
+	for (std::map<ProcSeq, BeliefKey>::const_iterator dp=fb->declared.begin(); dp!=fb->declared.end(); dp++) {
+		job->declared[dp->first] = dp->second;
+		std::map<ProcSeq, BeliefTotal>::iterator pp = job->pending.find(dp->first);
+		if (pp == job->pending.end()) continue;
+		add_counts(&job->total[dp->second], pp->second);
+		job->pending.erase(pp);
+	}
+	for (std::map<ProcSeq, BeliefTotal>::const_iterator up=fb->undeclared.begin(); up!=fb->undeclared.end(); up++) {
+		std::map<ProcSeq, BeliefKey>::const_iterator dp = job->declared.find(up->first);
+		if (dp != job->declared.end())
+			add_counts(&job->total[dp->second], up->second);
+		else
+			add_counts(&job->pending[up->first], up->second);
+	}
+	delete fb;
+	job->partial[idx % job->nslots] = NULL;
 
-	std::map<int, BeliefStat> beliefs;
+	const InputFile &in = job->files[idx];
+	if (!in.known) return;
+	if (idx+1 < (int)job->files.size() && job->files[idx+1].known && job->files[idx+1].proc.same_process(in.proc))
+		return;
+	ProcSeq lo = in.proc, hi = in.proc;
+	lo.seq = INT_MIN;
+	hi.seq = INT_MAX;
+	std::map<ProcSeq, BeliefTotal>::iterator pbegin = job->pending.lower_bound(lo), pend = job->pending.upper_bound(hi);
+	warn_undeclared(pbegin, pend);
+	job->pending.erase(pbegin, pend);
+	job->declared.erase(job->declared.lower_bound(lo), job->declared.upper_bound(hi));
+}
 
-	for (i=1; i<argc; i++) {
-		int version = -1;
-		FILE *fp = fopen(argv[i], "r");
-		if (!fp) { perror(argv[i]); continue; }
-		Event *e = read_event(version, fp);
+static void print_aggregate(const BeliefTable &total, int nfiles) {
+	printf("%zd beliefs in %d files\n", total.size(), nfiles);
+	for (BeliefTable::const_iterator bp=total.begin(); bp!=total.end(); bp++) {
+		const BeliefTotal &bt = bp->second;
+		printf("  <belief max_fail_rate=\"%.6f\" cond=\"%s\" loc=\"%s:%d\" />\n",
+			bt.max_fail_rate, bp->first.cond.c_str(), bp->first.file.c_str(), bp->first.line);
+		int n = bt.all.yes + bt.all.no;
+		if (n == 0) { puts("    never checked"); continue; }
+		printf("    fail rate = %d/%d = %f\n", bt.all.no, n, (float)bt.all.no / n);
+		puts(fails(bt.all, bt.max_fail_rate) ? "    oops!" : "    OK!");
+		for (std::map<time_t, Counts>::const_iterator wp=bt.windows.begin(); wp!=bt.windows.end(); wp++) {
+			const Counts &wc = wp->second;
+			printf("    %ld+%d: fail rate = %d/%d = %f%s\n", (long)wp->first, window,
+				wc.no, wc.yes+wc.no, (float)wc.no / (wc.yes+wc.no),
+				fails(wc, bt.max_fail_rate) ? "  oops!" : "");
+		}
+	}
+}
+
+static void check_each_file(int argc, char **argv) {
+	int i;
+	std::map<ThreadSeq, BeliefStat> beliefs;
+
+	for (i=0; i<argc; i++) {
+		TraceReader reader;
+		if (!reader.open(argv[i])) continue;
+		int thread;
+		Event *e = reader.next(&thread);
 		while (e) {
 			switch (e->type()) {
-				case EV_HEADER:
-					version = ((Header*)e)->version;
-					delete e;
 				case EV_BELIEF_FIRST:{
 					BeliefFirst *bf = (BeliefFirst*)e;
-					beliefs[bf->seq].bf = bf;
-					beliefs[bf->seq].yes = beliefs[bf->seq].no = 0;
+					BeliefStat &stat = beliefs[ThreadSeq(thread, bf->seq)];
+					delete stat.bf;
+					stat.bf = bf;
+					stat.yes = stat.no = 0;
 					break;
 				}
 				case EV_BELIEF:{
 					Belief *b = (Belief*)e;
 					if (b->cond)
-						beliefs[b->seq].yes++;
+						beliefs[ThreadSeq(thread, b->seq)].yes++;
 					else
-						beliefs[b->seq].no++;
+						beliefs[ThreadSeq(thread, b->seq)].no++;
 					delete e;
 					break;
 				}
 				default:
 					delete e;
 			}
-			e = read_event(version, fp);
+			e = reader.next(&thread);
 		}
-		fclose(fp);
+		reader.close();
 		printf("%zd beliefs\n", beliefs.size());
-		for (std::map<int, BeliefStat>::const_iterator bp=beliefs.begin(); bp!=beliefs.end(); bp++) {
+		for (std::map<ThreadSeq, BeliefStat>::const_iterator bp=beliefs.begin(); bp!=beliefs.end(); bp++) {
+			if (!bp->second.bf) continue;   // used but never declared
 			bp->second.bf->print(stdout, 1);
 			float fail_rate = (float)bp->second.no / (bp->second.yes + bp->second.no);
 			printf("    fail rate = %d/%d = %f\n", bp->second.no, bp->second.yes+bp->second.no, fail_rate);
 			if (fail_rate > bp->second.bf->max_fail_rate) puts("    oops!"); else puts("    OK!");
+			delete bp->second.bf;
 		}
 		beliefs.clear();
 	}
+}
+
+int main(int argc, char **argv) {
+	int c, i;
+	while ((c = getopt(argc, argv, "aj:w:")) != -1) {
+		switch (c) {
+			case 'a':  aggregate = true; break;
+			case 'j':  jobs = atoi(optarg); break;
+			case 'w':  window = atoi(optarg); break;
+			default:   usage(argv[0]);
+		}
+	}
+	if (argc-optind < 1 || window < 0)
+		usage(argv[0]);
+
+	if (!aggregate) {
+		check_each_file(argc-optind, argv+optind);
+		return 0;
+	}
+
+	AggregateJob job;
+	for (i=optind; i<argc; i++) {
+		InputFile in;
+		in.fn = argv[i];
+		job.files.push_back(in);
+	}
+	sort_files(&job.files);
+	// run_ordered reads at most 2*jobs files ahead of the merge
+	job.nslots = 2 * (jobs > 0 ? jobs : default_jobs());
+	job.partial = new FileBeliefs*[job.nslots];
+	run_ordered(job.files.size(), jobs, count_beliefs, merge_beliefs, &job);
+	warn_undeclared(job.pending.begin(), job.pending.end());
+	print_aggregate(job.total, job.files.size());
+	delete[] job.partial;
 	return 0;
 }
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <pthread.h>
+#include <deque>
+#include "phasestats.h"
+
+/* A FIFO between the threads of two pipeline stages.  push blocks while
+ * the queue is full and pop while it is empty, so a fast stage can get
+ * only so far ahead of a slow one.  Both add the seconds they spent
+ * blocked to *waited, if not NULL, for reporting how busy each stage
+ * was. */
+template<class T> class BoundedQueue {
+public:
+	BoundedQueue(size_t _max) : max(_max), closed(false) {
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&not_empty, NULL);
+		pthread_cond_init(&not_full, NULL);
+	}
+	~BoundedQueue(void) {
+		pthread_cond_destroy(&not_full);
+		pthread_cond_destroy(&not_empty);
+		pthread_mutex_destroy(&lock);
+	}
+
+	void push(const T &item, double *waited) {
+		pthread_mutex_lock(&lock);
+		if (items.size() >= max) {
+			double start = PhaseStats::now();
+			while (items.size() >= max)
+				pthread_cond_wait(&not_full, &lock);
+			if (waited) *waited += PhaseStats::now() - start;
+		}
+		items.push_back(item);
+		pthread_cond_signal(&not_empty);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/* Returns false once the queue is closed and empty. */
+	bool pop(T *item, double *waited) {
+		pthread_mutex_lock(&lock);
+		if (items.empty() && !closed) {
+			double start = PhaseStats::now();
+			while (items.empty() && !closed)
+				pthread_cond_wait(&not_empty, &lock);
+			if (waited) *waited += PhaseStats::now() - start;
+		}
+		bool ret = !items.empty();
+		if (ret) {
+			*item = items.front();
+			items.pop_front();
+			pthread_cond_signal(&not_full);
+		}
+		pthread_mutex_unlock(&lock);
+		return ret;
+	}
+
+	/* as pop, but returns false at once if the queue is empty */
+	bool try_pop(T *item) {
+		pthread_mutex_lock(&lock);
+		bool ret = !items.empty();
+		if (ret) {
+			*item = items.front();
+			items.pop_front();
+			pthread_cond_signal(&not_full);
+		}
+		pthread_mutex_unlock(&lock);
+		return ret;
+	}
+
+	/* no more pushes: pop drains what is left, then returns false */
+	void close(void) {
+		pthread_mutex_lock(&lock);
+		closed = true;
+		pthread_cond_broadcast(&not_empty);
+		pthread_mutex_unlock(&lock);
+	}
+
+private:
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	std::deque<T> items;
+	size_t max;
+	bool closed;
+};
+
+#endif
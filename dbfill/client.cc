@@ -19,10 +19,33 @@ static std::map<std::string, int> path_ids;
 
 static void reconcile(Message *send, Message *recv, bool is_send, int thread_id, int path_id);
 
-Client::Client(void) : handle(-1), buf(NULL), bufhead(0), buflen(0),
-		bufsiz(0), header(NULL), thread_id(-1), current_id(-1) { }
+Client::Client(const char *_name) : handle(-1), events(0), name(_name ? _name : ""), buf(NULL), bufhead(0), buflen(0),
+		bufsiz(0), offset(0), version(-1), parse_errors(0), resyncing(false),
+		eof(false), bad_offset(0), header(NULL), thread_id(-1), current_id(-1) { }
 
 void Client::append(const char *newbuf, int len) {
+	fill(newbuf, len);
+	Event *ev;
+	while ((ev = get_event()) != NULL) {
+		handle_event(ev);
+	}
+	compact();
+}
+
+void Client::parse(const char *newbuf, int len, std::vector<Event*> *out) {
+	fill(newbuf, len);
+	Event *ev;
+	while ((ev = get_event()) != NULL)
+		out->push_back(ev);
+	compact();
+}
+
+void Client::handle_events(const std::vector<Event*> &evs) {
+	for (unsigned int i=0; i<evs.size(); i++)
+		handle_event(evs[i]);
+}
+
+void Client::fill(const char *newbuf, int len) {
 	assert(bufhead == 0);
 	if (buflen + len > bufsiz) {
 		bufsiz = MAX(bufsiz*2, buflen + len);
@@ -30,30 +53,76 @@ void Client::append(const char *newbuf, int len) {
 	}
 	memcpy(buf+buflen, newbuf, len);
 	buflen += len;
+}
 
-	Event *ev;
-	while ((ev = get_event()) != NULL) {
-		handle_event(ev);
-	}
+void Client::compact(void) {
 	if (bufhead != 0) {
 		memmove(buf, buf+bufhead, buflen);
 		bufhead = 0;
 	}
 }
 
+/* The parser keeps its own copy of the header's version, since the
+ * header itself belongs to handle_event. */
 Event *Client::get_event(void) {
+	if (skip_corrupt) return get_event_recover();
 	if (buflen < 2) return NULL;
 	int len = (buf[bufhead] << 8) + buf[bufhead+1];
 	if (buflen < len) return NULL;
-	Event *ret = parse_event(header ? header->version : -1, buf+bufhead+2);
-	bufhead += len;
-	buflen -= len;
+	Event *ret = parse_event(version, buf+bufhead+2);
+	consume(len);
+	if (ret && version == -1 && ret->type() == EV_HEADER) version = ((Header*)ret)->version;
 	return ret;
 }
 
+/* Names the trace file, if known, at the start of a message. */
+void Client::warn_prefix(void) const {
+	if (!name.empty()) fprintf(stderr, "%s: ", name.c_str());
+}
+
+/* Like get_event, but checks each frame before parsing it.  After a
+ * corrupt frame, throws data away until the next good frame shows up. */
+Event *Client::get_event_recover(void) {
+	const char *why;
+	while (1) {
+		if (resyncing) {
+			long ofs = buflen > 0 ? find_frame(version, buf+bufhead, buflen, eof) : -1;
+			if (ofs < 0) {
+				// only the last two frames' worth of data can still match
+				if (eof) consume(buflen);
+				else if (buflen > 2*MAX_FRAME) consume(buflen - 2*MAX_FRAME);
+				return NULL;
+			}
+			consume(ofs);
+			warn_prefix();
+			fprintf(stderr, "skipped %ld bytes, resuming at offset %ld\n", offset - bad_offset, offset);
+			resyncing = false;
+		}
+		int len = check_frame(version, buf+bufhead, buflen, &why);
+		if (len == 0) return NULL;
+		if (len > 0) {
+			Event *ret = parse_event(version, buf+bufhead+2);
+			consume(len);
+			if (ret && version == -1 && ret->type() == EV_HEADER) version = ((Header*)ret)->version;
+			return ret;
+		}
+		warn_prefix();
+		fprintf(stderr, "%s at offset %ld\n", why, offset);
+		parse_errors++;
+		bad_offset = offset;
+		consume(1);
+		resyncing = true;
+	}
+}
+
 static int next_id = 1;
+int path_count(void) {
+	return next_id - 1;
+}
+
 void Client::handle_event(Event *ev) {
 	assert(ev);
+	events++;
 
 	switch (ev->type()) {
 		case EV_HEADER:
@@ -97,8 +166,8 @@ void Client::handle_event(Event *ev) {
 			//ev->print();
 			if (path_ids.count(((NewPathID*)ev)->path_id) == 0) {
 				current_id = path_ids[((NewPathID*)ev)->path_id] = next_id++;
-				SqlBuffer::insert(table_paths, "(%d,'%s')",
-					current_id, ID_to_string(((NewPathID*)ev)->path_id));
+				SqlBuffer::Row(table_paths).add(current_id)
+					.add(ID_to_string(((NewPathID*)ev)->path_id)).end();
 			}
 			else
 				current_id = path_ids[((NewPathID*)ev)->path_id];
@@ -111,9 +180,9 @@ void Client::handle_event(Event *ev) {
 		case EV_NOTICE:{
 			Notice *n = (Notice*)ev;
 			assert(thread_id != -1);
-			SqlBuffer::insert(table_notices, "(%d,\"%s\",%d,\"%s\",%lld,%d)",
-				current_id, n->roles ? n->roles : "", n->level,
-				n->str, tv_to_ts(n->tv), thread_id);
+			SqlBuffer::Row(table_notices).add(current_id)
+				.add(n->roles ? n->roles : "").add(n->level)
+				.add(n->str).add(tv_to_ts(n->tv)).add(thread_id).end();
 			delete ev;
 			break;
 			}
@@ -137,9 +206,38 @@ void Client::handle_event(Event *ev) {
 }
 
 void Client::end(void) {
+	std::vector<Event*> evs;
+	finish(&evs);
+	handle_events(evs);
+	close();
+}
+
+void Client::finish(std::vector<Event*> *out) {
+	if (skip_corrupt) {
+		eof = true;
+		Event *ev;
+		while ((ev = get_event()) != NULL)
+			out->push_back(ev);
+		if (resyncing) {
+			warn_prefix();
+			fprintf(stderr, "no good frames after offset %ld\n", bad_offset);
+		}
+		else if (buflen > 0) {
+			warn_prefix();
+			fprintf(stderr, "truncated frame at offset %ld\n", offset);
+			parse_errors++;
+		}
+	}
+}
+
+void Client::close(void) {
+	errors += parse_errors;
+	parse_errors = 0;
+
 	// put all starts left in start_task into unpaired_tasks to be checked later
 	if (!header) {
-		fprintf(stderr, "%s: no header -- zero-length log file?\n", "fn");
+		warn_prefix();
+		fprintf(stderr, "no header -- zero-length log file?\n");
 		errors++;
 	}
 	for (PathNameTaskMap::const_iterator pathp=start_task.begin(); pathp!=start_task.end(); pathp++)
@@ -168,11 +266,10 @@ static void reconcile(Message *send, Message *recv, bool is_send, int thread_id,
 			//abort();
 			errors++;
 		}
-		SqlBuffer::insert(table_messages, "(%d,\"%s\",%d,'%s',%lld,%lld,%d,%d,%d)",
-			path_id,
-			send->roles ? send->roles : "", send->level,
-			ID_to_string(send->msgid), tv_to_ts(send->tv), tv_to_ts(recv->tv),
-			send->size, send->thread_id, recv->thread_id);
+		SqlBuffer::Row(table_messages).add(path_id)
+			.add(send->roles ? send->roles : "").add(send->level)
+			.add(ID_to_string(send->msgid)).add(tv_to_ts(send->tv)).add(tv_to_ts(recv->tv))
+			.add(send->size).add(send->thread_id).add(recv->thread_id).end();
 do_not_insert:
 		if (is_send)
 			receives.erase(recv->msgid);
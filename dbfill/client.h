@@ -14,23 +14,51 @@
 
 class Client {
 public:
-	Client(void);
+	/* "name" is the trace file, for messages, or NULL */
+	Client(const char *_name = NULL);
 	~Client(void) { if (header) delete header; }
 	void append(const char *newbuf, int len);
 	void end(void);
 
+	/* append and end in halves, for dbfill's pipeline: parse and finish
+	 * pass back the events they find, for handle_events and close to
+	 * reconcile, maybe on another thread */
+	void parse(const char *newbuf, int len, std::vector<Event*> *out);
+	void finish(std::vector<Event*> *out);
+	void handle_events(const std::vector<Event*> &evs);
+	void close(void);
+
 	int handle;
+	long events;        // handled so far
 
 private:
+	void fill(const char *newbuf, int len);
+	void compact(void);
 	Event *get_event(void);
+	Event *get_event_recover(void);
 	void handle_event(Event *ev);
+	inline void consume(int n) { bufhead += n; buflen -= n; offset += n; }
+	void warn_prefix(void) const;
+
+	std::string name;
 
 	unsigned char *buf;
 	int bufhead, buflen, bufsiz;
+	long offset;        // stream offset of buf[bufhead]
+
+	int version;        // from the header, once parsed
+	int parse_errors;   // not yet added to errors
+
+	// for skip_corrupt
+	bool resyncing, eof;
+	long bad_offset;
 
 	Header *header;
 	int thread_id, current_id;
 	PathNameTaskMap start_task;  // stack of start events for <pathid, name>
 };
 
+/* how many path IDs the clients have numbered so far */
+int path_count(void);
+
 #endif
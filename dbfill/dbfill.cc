@@ -5,24 +5,88 @@
 
 #include <getopt.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <algorithm>
 #include <string>
+#include <vector>
+#include "boundedqueue.h"
 #include "client.h"
+#include "insertbuffer.h"
+#include "workqueue.h"
+
+/* dbfill is a pipeline of three stages.  Parser threads, up to -j of them
+ * at once, each read one trace file and cut it into events.  The main
+ * thread reconciles the events, a batch at a time, since it alone owns
+ * the path IDs, the unpaired messages and tasks, and the connection that
+ * numbers threads.  Each table's rows go to a writer thread with a MySQL
+ * connection of its own.  Bounded queues between the stages keep any one
+ * from getting far ahead of the next.  Each file has a queue of its own,
+ * and the reconciler drains them in the order the files are listed, so
+ * threads and paths are numbered the same way on every run; a parser
+ * that gets ahead blocks on its own queue. */
+
+#define BATCH_EVENTS 4096    // events a parser passes along at once
+#define BATCHES_PER_FILE 4   // how many batches each parser may have queued
+
+/* A run of events from one file.  The last one from a file says it
+ * parsed completely. */
+struct Batch {
+	Client *cl;
+	std::vector<Event*> events;
+	bool last;
+	const char *fn;
+	long long bytes;       // in the whole file, in the last batch
+	double start;          // when the parser opened the file
+};
 
 static void usage(const char *prog);
-static void read_file(const char *fn);
+static FILE *open_trace(const char *fn, bool *is_pipe);
+static void *parse_files(void *arg);
+static void parse_file(int i, void *arg);
+
+static PhaseStats stats;
+static bool stats_json = false;
+static int jobs = 0;
+static std::vector<std::string> files;
+static std::vector<BoundedQueue<Batch*>*> batches;   // per file
+static std::vector<double> parse_busy, parse_blocked;   // per file
+static double parse_wall;
+
+static const struct option long_options[] = {
+	{ "skip-corrupt", no_argument, NULL, 'S' },
+	{ "stats", optional_argument, NULL, 'M' },
+	{ "load-data", no_argument, NULL, 'L' },
+	{ "defer-indexes", no_argument, NULL, 'D' },
+	{ "partitions", required_argument, NULL, 'P' },
+	{ NULL, 0, NULL, 0 }
+};
 
 int main(int argc, char **argv) {
 	char c;
-	while ((c = getopt(argc, argv, "u")) != -1) {
+	while ((c = getopt_long(argc, argv, "j:u", long_options, NULL)) != -1) {
 		switch (c) {
+			case 'j':  jobs = atoi(optarg);  break;
 			case 'u':  save_unmatched_sends = true;  break;
+			case 'S':  skip_corrupt = true;  break;
+			case 'L':  SqlBuffer::load_data = true;  break;
+			case 'D':  defer_indexes = true;  break;
+			case 'P':
+				partitions = atoi(optarg);
+				if (partitions <= 0) usage(argv[0]);
+				break;
+			case 'M':
+				phase_stats = &stats;
+				if (optarg) {
+					if (strcmp(optarg, "json") != 0) usage(argv[0]);
+					stats_json = true;
+				}
+				break;
 			default:   usage(argv[0]);
 		}
 	}
 	if (argc - optind < 2) usage(argv[0]);
-
-	reconcile_init(argv[optind]);
+	if (jobs <= 0) jobs = default_jobs();
 
 	for (int i=optind+1; i<argc; i++)
 		if (!strcmp(argv[i], "-")) {
@@ -30,57 +94,162 @@ int main(int argc, char **argv) {
 			while (fgets(buf, sizeof(buf), stdin)) {
 				char *p = strchr(buf, '\n');
 				if (p) { *p = '\0'; if (p > buf && *(p-1) == '\r') *(p-1) = '\0'; }
-				read_file(buf);
+				files.push_back(buf);
 			}
 		}
 		else
-			read_file(argv[i]);
+			files.push_back(argv[i]);
+
+	SqlBuffer::writer_threads = true;
+	reconcile_init(argv[optind]);
+	if (phase_stats) phase_stats->begin("read");
+
+	batches.resize(files.size());
+	for (unsigned int i=0; i<files.size(); i++)
+		batches[i] = new BoundedQueue<Batch*>(BATCHES_PER_FILE);
+	parse_busy.assign(files.size(), 0);
+	parse_blocked.assign(files.size(), 0);
+	pthread_t parser;
+	double start = PhaseStats::now();
+	if (pthread_create(&parser, NULL, parse_files, NULL) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+
+	Batch *b;
+	double busy = 0, starved = 0;
+	for (unsigned int i=0; i<files.size(); i++) {
+		while (batches[i]->pop(&b, &starved)) {
+			double t = PhaseStats::now();
+			b->cl->handle_events(b->events);
+			if (b->last) {
+				b->cl->close();
+				if (phase_stats)
+					phase_stats->file(b->fn, b->bytes, b->cl->events, PhaseStats::now() - b->start);
+				delete b->cl;
+			}
+			delete b;
+			busy += PhaseStats::now() - t;
+		}
+		delete batches[i];
+	}
+	pthread_join(parser, NULL);
+	double wall = PhaseStats::now() - start;
+	double blocked = SqlBuffer::blocked_seconds();
 
 	reconcile_done();
+	if (phase_stats) {
+		double pbusy = 0, pblocked = 0;
+		for (unsigned int i=0; i<files.size(); i++) {
+			pbusy += parse_busy[i];
+			pblocked += parse_blocked[i];
+		}
+		int nparsers = std::min((size_t)jobs, files.size());
+		phase_stats->stage("parse", nparsers, parse_wall, pbusy - pblocked, 0, pblocked);
+		phase_stats->stage("reconcile", 1, wall, busy - blocked, starved, blocked);
+		SqlBuffer::stages(phase_stats);
+		phase_stats->print(stderr, stats_json);
+	}
 
 	printf("There were %d error%s\n", errors, errors==1?"":"s");
 	return errors > 0;
 }
 
-static void read_file(const char *fn) {
-	fprintf(stderr, "Reading %s\n", fn);
-	FILE *fp;
-	int is_pipe = 0;
+static FILE *open_trace(const char *fn, bool *is_pipe) {
+	*is_pipe = true;
 	if (!strcmp(fn+strlen(fn)-4, ".bz2")) {
 		std::string cmd("bunzip2 -c ");
 		cmd.append(fn);
-		fp = popen(cmd.c_str(), "r");
-		is_pipe = 1;
+		return popen(cmd.c_str(), "r");
 	}
 	else if (!strcmp(fn+strlen(fn)-3, ".gz")) {
 		std::string cmd("gunzip -c ");
 		cmd.append(fn);
-		fp = popen(cmd.c_str(), "r");
-		is_pipe = 1;
+		return popen(cmd.c_str(), "r");
 	}
-	else
-		fp = fopen(fn, "r");
-	if (!fp) { perror(fn); return; }
+	*is_pipe = false;
+	return fopen(fn, "r");
+}
 
-	Client cl;
+/* The parse stage: runs parse_file on each file, -j at a time, taking
+ * them in order so the file the reconciler is waiting on always has a
+ * parser. */
+static void *parse_files(void *arg) {
+	double start = PhaseStats::now();
+	run_ordered(files.size(), jobs, parse_file, NULL, NULL);
+	parse_wall = PhaseStats::now() - start;
+	return NULL;
+}
+
+/* Fills file i's queue, and closes it to tell the reconciler the file is
+ * done. */
+
+static void parse_file(int i, void *arg) {
+	const char *fn = files[i].c_str();
+	fprintf(stderr, "Reading %s\n", fn);
+	double start = PhaseStats::now();
+	bool is_pipe;
+	FILE *fp = open_trace(fn, &is_pipe);
+	if (!fp) { perror(fn); batches[i]->close(); return; }
+
+	Batch *b = new Batch;
+	b->cl = new Client(fn);
+	b->last = false;
+	b->fn = fn;
+	b->start = start;
 
 	int n;
 	char buf[65536];
+	long long bytes = 0;
 	while ((n = fread(buf, 1, sizeof(buf), fp)) != 0) {
 		if (n == -1) {
 			perror("fread");
 			exit(1);
 		}
-		cl.append(buf, n);
+		b->cl->parse(buf, n, &b->events);
+		bytes += n;
+		if (b->events.size() >= BATCH_EVENTS) {
+			Client *cl = b->cl;
+			batches[i]->push(b, &parse_blocked[i]);
+			b = new Batch;
+			b->cl = cl;
+			b->last = false;
+			b->fn = fn;
+			b->start = start;
+		}
 	}
 
 	if (is_pipe) pclose(fp); else fclose(fp);
-	cl.end();
+	b->cl->finish(&b->events);
+	b->last = true;
+	b->bytes = bytes;
+	batches[i]->push(b, &parse_blocked[i]);
+	batches[i]->close();
+	parse_busy[i] = PhaseStats::now() - start;
 }
 
 static void usage(const char *prog) {
-	fprintf(stderr, "Usage:  %s [-u] table-name trace-file [trace-file [...]]\n\n", prog);
+	fprintf(stderr, "Usage:  %s [-j jobs] [-u] [--skip-corrupt] [--load-data] [--defer-indexes]\n"
+		"          [--partitions=N] [--stats[=json]] table-name trace-file [trace-file [...]]\n\n", prog);
+	fprintf(stderr, "  -j    How many files to parse at once (default: one per CPU).\n");
 	fprintf(stderr, "  -u    Add unreceived sends to the database.\n");
-	fprintf(stderr, "        The default behavior is to ignore them.\n\n");
+	fprintf(stderr, "        The default behavior is to ignore them.\n");
+	fprintf(stderr, "  --skip-corrupt\n");
+	fprintf(stderr, "        Skip damaged or truncated parts of trace files instead of\n");
+	fprintf(stderr, "        aborting.\n");
+	fprintf(stderr, "  --load-data\n");
+	fprintf(stderr, "        Load rows with LOAD DATA LOCAL INFILE, which is faster than\n");
+	fprintf(stderr, "        INSERT but needs local_infile enabled on the server.\n");
+	fprintf(stderr, "  --defer-indexes\n");
+	fprintf(stderr, "        Index the tasks, notices, and messages tables after loading\n");
+	fprintf(stderr, "        them, rather than a row at a time.\n");
+	fprintf(stderr, "  --partitions=N\n");
+	fprintf(stderr, "        Split the tasks, notices, and messages tables into N\n");
+	fprintf(stderr, "        partitions by ranges of path IDs, so that reading a path\n");
+	fprintf(stderr, "        reads only one partition.\n");
+	fprintf(stderr, "  --stats[=json]\n");
+	fprintf(stderr, "        Report time, I/O, and table sizes for each phase,\n");
+	fprintf(stderr, "        throughput for each file, and how busy each pipeline\n");
+	fprintf(stderr, "        stage was.\n\n");
 	exit(1);
 }
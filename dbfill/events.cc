@@ -12,6 +12,9 @@
 #include <sys/time.h>
 #include "events.h"
 #include <string>
+#include <vector>
+
+#define TRACE_MAGIC 0x416e6e6f   // 'Anno'
 
 typedef enum { STRING, VOIDP, CHAR, INT, END } InType;
 static int readblock(FILE *_fp, unsigned char *buf);
@@ -29,6 +32,12 @@ static const int printable[96] = {  /* characters 32-127 */
 
 const char *ID_to_string(const std::string &id) {
 	static char buf[1024];
+	return ID_to_string(id, buf);
+}
+
+/* reentrant version: buf must hold at least 1024 bytes */
+const char *ID_to_string(const std::string &id, char *buf) {
+	static const char hex[] = "0123456789abcdef";
 	char *p = buf;
 	bool inbin = false;
 	const char *data = id.data();
@@ -48,8 +57,8 @@ const char *ID_to_string(const std::string &id) {
 		}
 		else {
 			if (!inbin) { *(p++) = '{'; inbin = true; }
-			sprintf(p, "%02x", (unsigned char)data[i]);
-			p += 2;
+			*(p++) = hex[(data[i] >> 4) & 0xf];
+			*(p++) = hex[data[i] & 0xf];
 		}
 	}
 	if (inbin) { *(p++) = '}'; inbin = false; }
@@ -192,7 +201,7 @@ void Notice::print(FILE *fp, int depth) {
 		2*depth, "", roles, level, tv.tv_sec, tv.tv_usec, str);
 }
 
-Message::Message(int version, const unsigned char *buf) {
+Message::Message(int version, const unsigned char *buf) : thread_id(-1) {
 	char *idbuf;
 	int len;
 
@@ -333,7 +342,7 @@ loop_break:
 }
 
 Event *read_event(int version, FILE *_fp) {
-	unsigned char buf[2048];
+	unsigned char buf[MAX_FRAME];
 	if (readblock(_fp, buf) == -1) return NULL;
 	return parse_event(version, buf);
 }
@@ -356,3 +365,161 @@ Event *parse_event(int version, const unsigned char *buf) {
 			return NULL;
 	}
 }
+
+/* walks a record's fields the way the constructors above scan() them,
+ * but only checks that each one fits in the frame, and that a resource
+ * mark's timestamp gets past ResourceMark's asserts; no other record
+ * bounds its timestamp */
+struct FrameCheck {
+	FrameCheck(const unsigned char *_p, const unsigned char *_end) : p(_p), end(_end), why(NULL) {}
+	bool bytes(int n) {
+		if (end - p < n) { why = "record overruns its frame"; return false; }
+		p += n;
+		return true;
+	}
+	bool integer(int *ip) {
+		if (!bytes(4)) return false;
+		*ip = (p[-4] << 24) | (p[-3] << 16) | (p[-2] << 8) | p[-1];
+		return true;
+	}
+	bool string(void) { return bytes(2) && bytes((p[-2] << 8) | p[-1]); }
+	bool id(void) { return bytes(1) && bytes(p[-1]); }
+	bool timestamp(void) { return bytes(2*4); }
+	bool roles(int version) { return version < 3 || (string() && bytes(1)); }
+	bool resource_mark(int version) {
+		int sec, usec;
+		if (!roles(version) || !integer(&sec) || !integer(&usec)) return false;
+		if (sec > 2100000000 || usec > 999999) {
+			why = "bad timestamp";
+			return false;
+		}
+		return bytes(8*4);
+	}
+
+	const unsigned char *p, *end;
+	const char *why;
+};
+
+static const char *check_record(int version, const unsigned char *buf, const unsigned char *end) {
+	FrameCheck fc(buf+1, end);
+	int magic, v;
+	bool ok;
+	if (version == -1 && buf[0] != 'H') return "record before header";
+	switch (buf[0]) {
+		case 'H':
+			ok = fc.integer(&magic) && fc.integer(&v) && fc.string()
+				&& fc.timestamp() && fc.bytes(5*4) && fc.string();
+			if (ok && magic != TRACE_MAGIC) return "bad magic number";
+			if (ok && (v < 2 || v > 3)) return "unknown trace version";
+			break;
+		case 'T': case 't':
+			ok = fc.resource_mark(version) && fc.string();
+			break;
+		case 'P':
+			ok = fc.resource_mark(version) && fc.id();
+			break;
+		case 'p':
+			ok = fc.roles(version) && fc.timestamp() && fc.id();
+			break;
+		case 'N':
+			ok = fc.roles(version) && fc.timestamp() && fc.string();
+			break;
+		case 'M': case 'm':
+			ok = fc.roles(version) && fc.id() && fc.bytes(4) && fc.timestamp();
+			break;
+		case 'B':
+			if (version < 3) return "belief in a version 2 trace";
+			ok = fc.bytes(2*4) && fc.string() && fc.string() && fc.bytes(4);
+			break;
+		case 'b':
+			if (version < 3) return "belief in a version 2 trace";
+			ok = fc.roles(version) && fc.timestamp() && fc.bytes(4+1);
+			break;
+		default:
+			return "unknown record type";
+	}
+	if (!ok) return fc.why;
+	if (fc.p != end) return "record shorter than its frame";
+	return NULL;
+}
+
+int check_frame(int version, const unsigned char *data, size_t size, const char **why) {
+	if (size < 2) return 0;
+	int len = (data[0] << 8) + data[1];
+	if (len < 3) { *why = "frame too short"; return -1; }
+	if (len > MAX_FRAME) { *why = "frame too long"; return -1; }
+	if (size < (size_t)len) return 0;
+	*why = check_record(version, data+2, data+len);
+	return *why ? -1 : len;
+}
+
+long find_frame(int version, const unsigned char *data, size_t size, bool at_eof) {
+	const char *why;
+	for (size_t i=0; i<size; i++) {
+		int len = check_frame(version, data+i, size-i, &why);
+		if (len == -1) continue;
+		if (len == 0) {
+			if (at_eof) continue;
+			return -1;
+		}
+		int next = check_frame(version, data+i+len, size-i-len, &why);
+		if (next > 0 || (next == 0 && at_eof)) return i;
+		if (next == 0) return -1;
+	}
+	return -1;
+}
+
+/* Skips ahead from offset "from" to the next good frame.  Returns false
+ * if there is none or fp cannot seek. */
+static bool resync(int version, FILE *fp, long from, const char *fn) {
+	std::vector<unsigned char> data;
+	unsigned char chunk[65536];
+	long base = from;   // file offset of data[0]
+	if (from < 0 || fseek(fp, from, SEEK_SET) != 0) {
+		if (fn) fprintf(stderr, "%s: cannot seek, dropping the rest of the file\n", fn);
+		return false;
+	}
+	while (1) {
+		size_t n = fread(chunk, 1, sizeof(chunk), fp);
+		bool at_eof = n < sizeof(chunk);
+		data.insert(data.end(), chunk, chunk+n);
+		long ofs = data.empty() ? -1 : find_frame(version, &data[0], data.size(), at_eof);
+		if (ofs >= 0) {
+			if (fn) fprintf(stderr, "%s: skipped %ld bytes, resuming at offset %ld\n",
+				fn, base+ofs - (from-1), base+ofs);
+			return fseek(fp, base+ofs, SEEK_SET) == 0;
+		}
+		if (at_eof) {
+			if (fn) fprintf(stderr, "%s: no good frames after offset %ld\n", fn, from-1);
+			return false;
+		}
+		// nothing before the last two frames' worth of data can match later
+		if (data.size() > 2*MAX_FRAME) {
+			size_t drop = data.size() - 2*MAX_FRAME;
+			data.erase(data.begin(), data.begin()+drop);
+			base += drop;
+		}
+	}
+}
+
+Event *read_event_recover(int version, FILE *fp, const char *fn, int *corrupt) {
+	unsigned char buf[MAX_FRAME];
+	const char *why;
+	while (1) {
+		size_t n = fread(buf, 1, 2, fp);
+		if (n == 0) return NULL;
+		int len = n == 2 ? (buf[0] << 8) + buf[1] : 0;
+		if (len > 2 && len <= MAX_FRAME) n += fread(buf+2, 1, len-2, fp);
+		int ret = check_frame(version, buf, n, &why);
+		if (ret > 0) return parse_event(version, buf+2);
+
+		long start = ftell(fp);
+		if (start >= 0) start -= n;
+		if (corrupt) (*corrupt)++;
+		if (ret == 0) why = "truncated frame";
+		if (fn && start >= 0) fprintf(stderr, "%s: %s at offset %ld\n", fn, why, start);
+		else if (fn) fprintf(stderr, "%s: %s\n", fn, why);
+		if (ret == 0) return NULL;
+		if (!resync(version, fp, start < 0 ? -1 : start+1, fn)) return NULL;
+	}
+}
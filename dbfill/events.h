@@ -166,8 +166,32 @@ public:
 	bool cond;
 };
 
+#define MAX_FRAME 2048   // libannotate never writes a longer record
+
 Event *read_event(int version, FILE *_fp);
 Event *parse_event(int version, const unsigned char *buf);
+
+/* Checks the frame (2-byte length, then the record) at the start of
+ * data[0..size) without building an Event.  Returns the frame length if
+ * it is complete and well formed, 0 if it runs past the end of the data,
+ * or -1 if it is corrupt, in which case *why says what is wrong.
+ * "version" is -1 before the header has been read. */
+int check_frame(int version, const unsigned char *data, size_t size, const char **why);
+
+/* Finds the first offset in data[0..size) where a good frame starts and
+ * is followed by another good frame or by the end of the file, for
+ * resynchronizing after corruption.  Returns -1 if there is none yet;
+ * unless at_eof, later data may still turn up a frame in the last
+ * 2*MAX_FRAME bytes, but never earlier. */
+long find_frame(int version, const unsigned char *data, size_t size, bool at_eof);
+
+/* Like read_event, but checks every frame first instead of asserting on
+ * bad input.  Each corrupt region is reported on stderr (unless fn is
+ * NULL), counted in *corrupt, and skipped by resynchronizing on the next
+ * good frame.  If fp cannot seek, the rest of the file is dropped. */
+Event *read_event_recover(int version, FILE *fp, const char *fn, int *corrupt);
+
 const char *ID_to_string(const std::string &str);
+const char *ID_to_string(const std::string &str, char *buf);
 
 #endif
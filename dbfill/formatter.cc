@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "formatter.h"
+
+static const char *csv_columns =
+	"log,type,ts,path_id,roles,level,name,utime,stime,minflt,majflt,vcs,ivcs,"
+	"msg_id,size,seq,cond,max_fail_rate,held,loc,host,pid,tid\n";
+
+static const char *type_name[] = { "header", "start_task", "end_task",
+	"new_path_id", "end_path_id", "notice", "send", "recv", "belief_first",
+	"belief" };
+
+/* same as printf("%0*ld", width, n) */
+static void put_int(std::string *out, long n, int width = 0) {
+	char buf[24], *p = buf + sizeof(buf);
+	unsigned long u = n < 0 ? -(unsigned long)n : n;
+	do { *--p = '0' + u % 10; u /= 10; } while (u);
+	if (n < 0) width--;
+	while (buf + sizeof(buf) - p < width) *--p = '0';
+	if (n < 0) *--p = '-';
+	out->append(p, buf + sizeof(buf) - p);
+}
+
+static inline void put_tv(std::string *out, const timeval &tv) {
+	put_int(out, tv.tv_sec);
+	out->push_back('.');
+	put_int(out, tv.tv_usec, 6);
+}
+
+/* same as printf("%s", s), including glibc's "(null)" */
+static inline void put_str(std::string *out, const char *s) {
+	out->append(s ? s : "(null)");
+}
+
+static void put_json_str(std::string *out, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+	if (!s) { out->append("null"); return; }
+	out->push_back('"');
+	for (const unsigned char *p=(const unsigned char*)s; *p; p++) {
+		if (*p == '"' || *p == '\\') { out->push_back('\\'); out->push_back(*p); }
+		else if (*p == '\n') out->append("\\n");
+		else if (*p == '\t') out->append("\\t");
+		else if (*p == '\r') out->append("\\r");
+		else if (*p < 0x20 || *p >= 0x7f) {
+			// treat raw bytes as Latin-1 so the output stays valid UTF-8
+			out->append("\\u00");
+			out->push_back(hex[*p >> 4]);
+			out->push_back(hex[*p & 0xf]);
+		}
+		else out->push_back(*p);
+	}
+	out->push_back('"');
+}
+
+static void put_csv_str(std::string *out, const char *s) {
+	if (!s) return;
+	if (!strpbrk(s, ",\"\r\n")) { out->append(s); return; }
+	out->push_back('"');
+	for (const char *p=s; *p; p++) {
+		if (*p == '"') out->push_back('"');
+		out->push_back(*p);
+	}
+	out->push_back('"');
+}
+
+bool EventFormatter::parse_format(const char *name, OutputFormat *fmt) {
+	if (!strcmp(name, "xml")) *fmt = FMT_XML;
+	else if (!strcmp(name, "jsonl")) *fmt = FMT_JSONL;
+	else if (!strcmp(name, "csv")) *fmt = FMT_CSV;
+	else return false;
+	return true;
+}
+
+void EventFormatter::begin(std::string *out) const {
+	switch (fmt) {
+		case FMT_XML:   out->append("<trace>\n"); break;
+		case FMT_CSV:   out->append(csv_columns); break;
+		case FMT_JSONL: break;
+	}
+}
+
+void EventFormatter::end(std::string *out) const {
+	if (fmt == FMT_XML) out->append("</trace>\n");
+}
+
+void EventFormatter::begin_log(std::string *out, const char *log) const {
+	if (fmt == FMT_XML) { out->append("  <log name=\""); out->append(log); out->append("\">\n"); }
+}
+
+void EventFormatter::end_log(std::string *out) const {
+	if (fmt == FMT_XML) out->append("  </log>\n");
+}
+
+void EventFormatter::event(std::string *out, Event *e, const std::string &path_id, const char *log) const {
+	switch (fmt) {
+		case FMT_XML:   xml_event(out, e, log); break;
+		case FMT_JSONL: jsonl_event(out, e, path_id, log); break;
+		case FMT_CSV:   csv_event(out, e, path_id, log); break;
+	}
+}
+
+/* XML: must match the Event::print methods byte for byte */
+
+static void xml_rusage(std::string *out, const ResourceMark *rm) {
+	out->append(" tv=\""); put_tv(out, rm->tv);
+	out->append("\" utime=\""); put_tv(out, rm->utime);
+	out->append("\" stime=\""); put_tv(out, rm->stime);
+	out->append("\" minflt=\""); put_int(out, rm->minor_fault);
+	out->append("\" majflt=\""); put_int(out, rm->major_fault);
+	out->append("\" vcs=\""); put_int(out, rm->vol_cs);
+	out->append("\" ivcs=\""); put_int(out, rm->invol_cs);
+	out->append("\" />\n");
+}
+
+static void xml_roles(std::string *out, const Event *e) {
+	out->append(" roles=\""); put_str(out, e->roles);
+	out->append("\" level="); put_int(out, e->level);
+}
+
+void EventFormatter::xml_event(std::string *out, Event *e, const char *log) const {
+	char idbuf[1024];
+	out->append("    <");
+	out->append(type_name[e->type()]);
+	if (log) { out->append(" log=\""); out->append(log); out->push_back('"'); }
+	switch (e->type()) {
+		case EV_HEADER:{
+			Header *h = (Header*)e;
+			char magic[16];
+			sprintf(magic, "%x", h->magic);
+			out->append(" magic=\""); out->append(magic);
+			out->append("\" version=\""); put_int(out, h->version);
+			out->append("\" host=\""); put_str(out, h->hostname);
+			out->append("\" tv=\""); put_tv(out, h->tv);
+			out->append("\" tz=\""); out->append(h->tz < 0 ? "+" : "-");
+			put_int(out, abs(h->tz)/60, 2); put_int(out, abs(h->tz)%60, 2);
+			out->append("\" pid=\""); put_int(out, h->pid);
+			out->append("\" tid=\""); put_int(out, h->tid);
+			out->append("\" ppid=\""); put_int(out, h->ppid);
+			out->append("\" uid=\""); put_int(out, h->uid);
+			out->append("\" process=\""); put_str(out, h->processname);
+			out->append("\" />\n");
+			}break;
+		case EV_START_TASK:
+		case EV_END_TASK:
+			out->append(" name=\""); put_str(out, ((Task*)e)->name); out->push_back('"');
+			xml_roles(out, e);
+			xml_rusage(out, (Task*)e);
+			break;
+		case EV_SET_PATH_ID:
+			out->append(" path_id=\""); out->append(ID_to_string(((NewPathID*)e)->path_id, idbuf));
+			out->push_back('"');
+			xml_roles(out, e);
+			xml_rusage(out, (NewPathID*)e);
+			break;
+		case EV_END_PATH_ID:
+			out->append(" path_id=\""); out->append(ID_to_string(((EndPathID*)e)->path_id, idbuf));
+			out->push_back('"');
+			xml_roles(out, e);
+			out->append(" tv=\""); put_tv(out, e->tv);
+			out->append("\" />\n");
+			break;
+		case EV_NOTICE:
+			xml_roles(out, e);
+			out->append(" tv=\""); put_tv(out, e->tv);
+			out->append("\" str=\""); put_str(out, ((Notice*)e)->str);
+			out->append("\" />\n");
+			break;
+		case EV_SEND:
+		case EV_RECV:{
+			Message *m = (Message*)e;
+			out->append(" msg_id=\""); out->append(ID_to_string(m->msgid, idbuf));
+			out->push_back('"');
+			xml_roles(out, e);
+			out->append(" size=\""); put_int(out, m->size);
+			out->append("\" tv=\""); put_tv(out, m->tv);
+			out->append("\" thread_id=\""); put_int(out, m->thread_id);
+			out->append("\" />\n");
+			}break;
+		case EV_BELIEF_FIRST:{
+			BeliefFirst *bf = (BeliefFirst*)e;
+			char rate[32];
+			sprintf(rate, "%.6f", bf->max_fail_rate);
+			out->append(" seq=\""); put_int(out, bf->seq);
+			out->append("\" max_fail_rate=\""); out->append(rate);
+			out->append("\" cond=\""); put_str(out, bf->cond);
+			out->append("\" loc=\""); put_str(out, bf->file);
+			out->push_back(':'); put_int(out, bf->line);
+			out->append("\" />\n");
+			}break;
+		case EV_BELIEF:
+			out->append(" seq=\""); put_int(out, ((Belief*)e)->seq);
+			out->append("\" cond=\""); out->append(((Belief*)e)->cond ? "true" : "false");
+			out->push_back('"');
+			xml_roles(out, e);
+			out->append(" tv=\""); put_tv(out, e->tv);
+			out->append("\" />\n");
+			break;
+	}
+}
+
+/* JSON Lines: one object per event */
+
+static void json_key(std::string *out, const char *key) {
+	out->append(",\"");
+	out->append(key);
+	out->append("\":");
+}
+
+static void json_rusage(std::string *out, const ResourceMark *rm) {
+	json_key(out, "utime"); put_tv(out, rm->utime);
+	json_key(out, "stime"); put_tv(out, rm->stime);
+	json_key(out, "minflt"); put_int(out, rm->minor_fault);
+	json_key(out, "majflt"); put_int(out, rm->major_fault);
+	json_key(out, "vcs"); put_int(out, rm->vol_cs);
+	json_key(out, "ivcs"); put_int(out, rm->invol_cs);
+}
+
+/* An end_path_id event belongs to the path it ends, which need not be
+ * the current one. */
+static const std::string &event_path_id(Event *e, const std::string &current) {
+	return e->type() == EV_END_PATH_ID ? ((EndPathID*)e)->path_id : current;
+}
+
+/* Each key has one type: a belief_first's cond is the condition's text,
+ * and a belief's held is whether it held. */
+void EventFormatter::jsonl_event(std::string *out, Event *e, const std::string &path_id, const char *log) const {
+	char idbuf[1024];
+	out->append("{\"log\":");
+	put_json_str(out, log);
+	json_key(out, "type"); put_json_str(out, type_name[e->type()]);
+	if (e->type() != EV_BELIEF_FIRST) { json_key(out, "ts"); put_tv(out, e->tv); }
+	if (e->type() != EV_HEADER && e->type() != EV_BELIEF_FIRST) {
+		json_key(out, "path_id"); put_json_str(out, ID_to_string(event_path_id(e, path_id), idbuf));
+		json_key(out, "roles"); put_json_str(out, e->roles);
+		json_key(out, "level"); put_int(out, e->level);
+	}
+	switch (e->type()) {
+		case EV_HEADER:{
+			Header *h = (Header*)e;
+			json_key(out, "version"); put_int(out, h->version);
+			json_key(out, "host"); put_json_str(out, h->hostname);
+			json_key(out, "process"); put_json_str(out, h->processname);
+			json_key(out, "tz"); put_int(out, h->tz);
+			json_key(out, "pid"); put_int(out, h->pid);
+			json_key(out, "tid"); put_int(out, h->tid);
+			json_key(out, "ppid"); put_int(out, h->ppid);
+			json_key(out, "uid"); put_int(out, h->uid);
+			}break;
+		case EV_START_TASK:
+		case EV_END_TASK:
+			json_key(out, "name"); put_json_str(out, ((Task*)e)->name);
+			json_rusage(out, (Task*)e);
+			break;
+		case EV_SET_PATH_ID:
+			json_rusage(out, (NewPathID*)e);
+			break;
+		case EV_END_PATH_ID:
+			break;
+		case EV_NOTICE:
+			json_key(out, "str"); put_json_str(out, ((Notice*)e)->str);
+			break;
+		case EV_SEND:
+		case EV_RECV:
+			json_key(out, "msg_id"); put_json_str(out, ID_to_string(((Message*)e)->msgid, idbuf));
+			json_key(out, "size"); put_int(out, ((Message*)e)->size);
+			break;
+		case EV_BELIEF_FIRST:{
+			BeliefFirst *bf = (BeliefFirst*)e;
+			char rate[32];
+			sprintf(rate, "%.6f", bf->max_fail_rate);
+			json_key(out, "seq"); put_int(out, bf->seq);
+			json_key(out, "max_fail_rate"); out->append(rate);
+			json_key(out, "cond"); put_json_str(out, bf->cond);
+			json_key(out, "file"); put_json_str(out, bf->file);
+			json_key(out, "line"); put_int(out, bf->line);
+			}break;
+		case EV_BELIEF:
+			json_key(out, "seq"); put_int(out, ((Belief*)e)->seq);
+			json_key(out, "held"); out->append(((Belief*)e)->cond ? "true" : "false");
+			break;
+	}
+	out->append("}\n");
+}
+
+/* CSV: one row per event, fixed columns (see csv_columns) */
+
+void EventFormatter::csv_event(std::string *out, Event *e, const std::string &path_id, const char *log) const {
+	char idbuf[1024];
+	const char *name = NULL, *held = NULL;
+	ResourceMark *rm = NULL;
+	Message *msg = NULL;
+	Header *hdr = NULL;
+	BeliefFirst *bf = NULL;
+	bool has_seq = false;
+	int seq = 0;
+	switch (e->type()) {
+		case EV_HEADER:      hdr = (Header*)e; name = hdr->processname; break;
+		case EV_START_TASK:
+		case EV_END_TASK:    name = ((Task*)e)->name; rm = (Task*)e; break;
+		case EV_SET_PATH_ID: rm = (NewPathID*)e; break;
+		case EV_END_PATH_ID: break;
+		case EV_NOTICE:      name = ((Notice*)e)->str; break;
+		case EV_SEND:
+		case EV_RECV:        msg = (Message*)e; break;
+		case EV_BELIEF_FIRST:
+			bf = (BeliefFirst*)e;
+			has_seq = true; seq = bf->seq;
+			break;
+		case EV_BELIEF:
+			has_seq = true; seq = ((Belief*)e)->seq;
+			held = ((Belief*)e)->cond ? "true" : "false";
+			break;
+	}
+	bool in_path = !hdr && !bf;
+
+	put_csv_str(out, log);
+	out->push_back(','); out->append(type_name[e->type()]);
+	out->push_back(','); if (!bf) put_tv(out, e->tv);
+	out->push_back(','); if (in_path) put_csv_str(out, ID_to_string(event_path_id(e, path_id), idbuf));
+	out->push_back(','); if (in_path) put_csv_str(out, e->roles);
+	out->push_back(','); if (in_path) put_int(out, e->level);
+	out->push_back(','); put_csv_str(out, name);
+	if (rm) {
+		out->push_back(','); put_tv(out, rm->utime);
+		out->push_back(','); put_tv(out, rm->stime);
+		out->push_back(','); put_int(out, rm->minor_fault);
+		out->push_back(','); put_int(out, rm->major_fault);
+		out->push_back(','); put_int(out, rm->vol_cs);
+		out->push_back(','); put_int(out, rm->invol_cs);
+	}
+	else
+		out->append(",,,,,,");
+	out->push_back(','); if (msg) put_csv_str(out, ID_to_string(msg->msgid, idbuf));
+	out->push_back(','); if (msg) put_int(out, msg->size);
+	out->push_back(','); if (has_seq) put_int(out, seq);
+	out->push_back(','); if (bf) put_csv_str(out, bf->cond);
+	out->push_back(',');
+	if (bf) {
+		char rate[32];
+		sprintf(rate, "%.6f", bf->max_fail_rate);
+		out->append(rate);
+	}
+	out->push_back(','); if (held) out->append(held);
+	out->push_back(',');
+	if (bf) {
+		std::string loc(bf->file ? bf->file : "");
+		loc.push_back(':');
+		put_int(&loc, bf->line);
+		put_csv_str(out, loc.c_str());
+	}
+	out->push_back(','); if (hdr) put_csv_str(out, hdr->hostname);
+	out->push_back(','); if (hdr) put_int(out, hdr->pid);
+	out->push_back(','); if (hdr) put_int(out, hdr->tid);
+	out->push_back('\n');
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef FORMATTER_H
+#define FORMATTER_H
+
+#include <string>
+#include "events.h"
+
+typedef enum { FMT_XML, FMT_JSONL, FMT_CSV } OutputFormat;
+
+/* Formats events as text by appending to a caller-supplied string, with
+ * no stdio calls and no per-field formatting overhead.  The XML output is
+ * identical to Event::print.  Callers write the string out in large
+ * chunks. */
+class EventFormatter {
+public:
+	EventFormatter(OutputFormat _fmt) : fmt(_fmt) {}
+	static bool parse_format(const char *name, OutputFormat *fmt);
+
+	void begin(std::string *out) const;
+	void end(std::string *out) const;
+	void begin_log(std::string *out, const char *log) const;
+	void end_log(std::string *out) const;
+
+	/* "path_id" is the path the event belongs to ("" if none).  "log" names
+	 * the source file; XML only shows it when it is not NULL, which is
+	 * what callers want when several logs are interleaved. */
+	void event(std::string *out, Event *e, const std::string &path_id, const char *log) const;
+
+	OutputFormat fmt;
+
+private:
+	void xml_event(std::string *out, Event *e, const char *log) const;
+	void jsonl_event(std::string *out, Event *e, const std::string &path_id, const char *log) const;
+	void csv_event(std::string *out, Event *e, const std::string &path_id, const char *log) const;
+};
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+/* Open-addressing hash tables with linear probing, for reconcile state
+ * that would otherwise be a std::map node per key.  All entries live in
+ * one array of a power-of-two size, grown when it is 3/4 full.  Erasing
+ * shifts later entries of the same run back instead of leaving
+ * tombstones.  Inserting may move entries, so an Entry pointer is good
+ * only until the next insert or erase. */
+
+static inline unsigned int hash_bytes(const char *p, int len) {
+	unsigned int h = 2166136261u;   // FNV-1a
+	for (; len; p++, len--) {
+		h ^= (unsigned char)*p;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static inline unsigned int hash_int(int key) {
+	return (unsigned int)key * 2654435769u;
+}
+
+/* Maps byte strings (which may contain NULs) to V.  The table owns a
+ * copy of each key, which does not move for as long as the key is in
+ * the table. */
+template<class V> class StringMap {
+public:
+	struct Entry {
+		Entry(void) : key(NULL), len(0), hash(0) {}
+		char *key;          // NULL if the slot is empty
+		int len;
+		unsigned int hash;
+		V value;
+	};
+
+	StringMap(void) : slots(NULL), mask(0), count(0), key_bytes(0) {}
+	~StringMap(void) { clear(); }
+
+	/* NULL if absent */
+	Entry *find(const char *key, int len) const {
+		if (!slots) return NULL;
+		unsigned int h = hash_bytes(key, len);
+		for (unsigned int i=h&mask; slots[i].key; i=(i+1)&mask)
+			if (slots[i].hash == h && slots[i].len == len && !memcmp(slots[i].key, key, len))
+				return &slots[i];
+		return NULL;
+	}
+
+	/* The entry for key, with a default value if it was absent. */
+	Entry *insert(const char *key, int len, bool *created = NULL) {
+		Entry *e = find(key, len);
+		if (created) *created = !e;
+		if (e) return e;
+		if ((count+1)*4 > capacity()*3) grow();
+		unsigned int h = hash_bytes(key, len), i;
+		for (i=h&mask; slots[i].key; i=(i+1)&mask) ;
+		e = &slots[i];
+		e->key = (char*)malloc(len ? len : 1);
+		memcpy(e->key, key, len);
+		e->len = len;
+		e->hash = h;
+		count++;
+		key_bytes += len;
+		return e;
+	}
+
+	void erase(Entry *e) {
+		unsigned int i = e - slots;
+		free(e->key);
+		key_bytes -= e->len;
+		count--;
+		for (unsigned int j=(i+1)&mask; slots[j].key; j=(j+1)&mask) {
+			// move j back to the hole unless its home is in (i, j]
+			if (((j - slots[j].hash) & mask) >= ((j - i) & mask)) {
+				move(&slots[i], &slots[j]);
+				i = j;
+			}
+		}
+		slots[i].key = NULL;
+		slots[i].value = V();
+	}
+
+	void clear(void) {
+		for (size_t i=0; i<capacity(); i++)
+			free(slots[i].key);
+		delete[] slots;
+		slots = NULL;
+		mask = 0;
+		count = 0;
+		key_bytes = 0;
+	}
+
+	size_t size(void) const { return count; }
+	size_t capacity(void) const { return slots ? mask+1 : 0; }
+
+	/* slot i, for walking the table; empty slots have a NULL key */
+	Entry *slot(size_t i) const { return &slots[i]; }
+
+	/* Gives back the room that erases left, since the array never shrinks
+	 * on its own. */
+	void shrink(void) {
+		size_t cap = 16;
+		while (count*4 > cap*3) cap *= 2;
+		if (cap < capacity()) rehash(cap);
+	}
+
+	/* memory held, counting keys but not anything V points to */
+	size_t bytes(void) const { return capacity()*sizeof(Entry) + key_bytes; }
+
+private:
+	StringMap(const StringMap &);
+	StringMap &operator=(const StringMap &);
+
+	static void move(Entry *to, Entry *from) {
+		to->key = from->key;
+		to->len = from->len;
+		to->hash = from->hash;
+		std::swap(to->value, from->value);
+	}
+
+	void grow(void) {
+		rehash(slots ? 2*capacity() : 16);
+	}
+
+	void rehash(size_t cap) {
+		size_t oldcap = capacity();
+		Entry *old = slots;
+		mask = cap-1;
+		slots = new Entry[cap];
+		for (size_t i=0; i<oldcap; i++) {
+			if (!old[i].key) continue;
+			unsigned int j;
+			for (j=old[i].hash&mask; slots[j].key; j=(j+1)&mask) ;
+			move(&slots[j], &old[i]);
+		}
+		delete[] old;
+	}
+
+	Entry *slots;
+	unsigned int mask;
+	size_t count, key_bytes;
+};
+
+/* Maps non-negative ints, such as interned IDs, to V.  Most of these
+ * tables are small and short-lived, so the array is freed as soon as the
+ * last entry is erased. */
+template<class V> class IntMap {
+public:
+	struct Entry {
+		Entry(void) : key(-1) {}
+		int key;            // -1 if the slot is empty
+		V value;
+	};
+
+	IntMap(void) : slots(NULL), mask(0), count(0) {}
+	IntMap(const IntMap &other) : slots(NULL), mask(0), count(0) { *this = other; }
+	~IntMap(void) { clear(); }
+
+	IntMap &operator=(const IntMap &other) {
+		if (this == &other) return *this;
+		clear();
+		if (other.slots) {
+			mask = other.mask;
+			count = other.count;
+			slots = new Entry[mask+1];
+			std::copy(other.slots, other.slots+mask+1, slots);
+		}
+		return *this;
+	}
+
+	/* NULL if absent */
+	Entry *find(int key) const {
+		if (!slots) return NULL;
+		for (unsigned int i=hash_int(key)&mask; slots[i].key != -1; i=(i+1)&mask)
+			if (slots[i].key == key)
+				return &slots[i];
+		return NULL;
+	}
+
+	/* The entry for key, with a default value if it was absent. */
+	Entry *insert(int key) {
+		Entry *e = find(key);
+		if (e) return e;
+		if ((count+1)*4 > capacity()*3) grow();
+		unsigned int i;
+		for (i=hash_int(key)&mask; slots[i].key != -1; i=(i+1)&mask) ;
+		slots[i].key = key;
+		count++;
+		return &slots[i];
+	}
+
+	void erase(Entry *e) {
+		if (--count == 0) {
+			clear();
+			return;
+		}
+		unsigned int i = e - slots;
+		for (unsigned int j=(i+1)&mask; slots[j].key != -1; j=(j+1)&mask) {
+			if (((j - hash_int(slots[j].key)) & mask) >= ((j - i) & mask)) {
+				slots[i].key = slots[j].key;
+				std::swap(slots[i].value, slots[j].value);
+				i = j;
+			}
+		}
+		slots[i].key = -1;
+		slots[i].value = V();
+	}
+
+	void clear(void) {
+		delete[] slots;
+		slots = NULL;
+		mask = 0;
+		count = 0;
+	}
+
+	size_t size(void) const { return count; }
+	size_t capacity(void) const { return slots ? mask+1 : 0; }
+	size_t bytes(void) const { return capacity()*sizeof(Entry); }
+
+	/* slot i, for walking the table; empty slots have a key of -1 */
+	Entry *slot(size_t i) const { return &slots[i]; }
+
+private:
+	void grow(void) {
+		size_t oldcap = capacity();
+		Entry *old = slots;
+		mask = oldcap ? 2*oldcap-1 : 3;
+		slots = new Entry[mask+1];
+		for (size_t i=0; i<oldcap; i++) {
+			if (old[i].key == -1) continue;
+			unsigned int j;
+			for (j=hash_int(old[i].key)&mask; slots[j].key != -1; j=(j+1)&mask) ;
+			slots[j].key = old[i].key;
+			std::swap(slots[j].value, old[i].value);
+		}
+		delete[] old;
+	}
+
+	Entry *slots;
+	unsigned int mask;
+	size_t count;
+};
+
+/* Numbers byte strings densely, from 0, in order of first appearance. */
+class Interner {
+public:
+	int intern(const char *s, int len) {
+		bool created;
+		StringMap<int>::Entry *e = ids.insert(s, len, &created);
+		if (created) {
+			e->value = names.size();
+			names.push_back(e->key);
+			lengths.push_back(len);
+		}
+		return e->value;
+	}
+
+	/* -1 if s was never interned */
+	int find(const char *s, int len) const {
+		StringMap<int>::Entry *e = ids.find(s, len);
+		return e ? e->value : -1;
+	}
+
+	const char *name(int id) const { return names[id]; }
+	int length(int id) const { return lengths[id]; }
+	int size(void) const { return names.size(); }
+
+	/* IDs ordered as std::string would order their names */
+	std::vector<int> sorted(void) const {
+		std::vector<int> ret(names.size());
+		for (unsigned int i=0; i<ret.size(); i++) ret[i] = i;
+		std::sort(ret.begin(), ret.end(), ByName(*this));
+		return ret;
+	}
+
+	void clear(void) {
+		ids.clear();
+		std::vector<const char*>().swap(names);
+		std::vector<int>().swap(lengths);
+	}
+
+	size_t bytes(void) const {
+		return ids.bytes() + names.capacity()*sizeof(const char*) + lengths.capacity()*sizeof(int);
+	}
+
+private:
+	struct ByName {
+		ByName(const Interner &_in) : in(_in) {}
+		bool operator()(int a, int b) const {
+			int la = in.lengths[a], lb = in.lengths[b];
+			int c = memcmp(in.names[a], in.names[b], la < lb ? la : lb);
+			return c < 0 || (c == 0 && la < lb);
+		}
+		const Interner &in;
+	};
+
+	StringMap<int> ids;
+	std::vector<const char*> names;   // keys owned by ids
+	std::vector<int> lengths;
+};
+
+#endif
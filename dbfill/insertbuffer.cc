@@ -4,42 +4,131 @@
  */
 
 #include <assert.h>
-#include <stdarg.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <mysql/mysql.h>
 #include <map>
 #include <string>
+#include "boundedqueue.h"
 #include "insertbuffer.h"
+#include "rcfile.h"
 
-#define MAX_LEN 4000000
+#define MAX_LEN 4000000      // one INSERT statement
+#define LOAD_LEN 16000000    // one LOAD DATA
+#define WRITER_DEPTH 2       // full buffers waiting for each writer
+
+bool SqlBuffer::load_data = false;
+bool SqlBuffer::writer_threads = false;
+
+/* A table's writer thread and the buffers on their way to it.  Spent
+ * buffers come back through "spare", so their memory gets reused. */
+struct Writer {
+	Writer(void) : full(WRITER_DEPTH), spare(WRITER_DEPTH+2), busy(0), starved(0) {}
+	std::string table;
+	MYSQL conn;
+	pthread_t thread;
+	BoundedQueue<std::string*> full, spare;
+	double wall, busy, starved;
+};
 
 static std::map<std::string, std::string> buffers;
+static std::map<std::string, Writer*> writers;
+static std::vector<StageStat> writer_stats;
+static double ship_wait = 0;
 namespace SqlBuffer {
 static void init_buffer(const std::string &table, std::string &buf);
-static void flush_one(const std::string &buf);
+static size_t header_len(const std::string &table);
+static void ship(const std::string &table, std::string &buf);
+static void flush_one(MYSQL *conn, const std::string &table, const std::string &buf);
 }
 
-void SqlBuffer::insert(const std::string &table, const std::string &content) {
-	std::string &buf = buffers[table];
-	//printf("appending %d bytes to table %s\n", content.length(), table.c_str());
-	if (buf.empty())
-		init_buffer(table, buf);
-	else if (buf.length() + content.length() + 3 > MAX_LEN) {
-		flush_one(buf);
-		init_buffer(table, buf);
+SqlBuffer::Row::Row(const std::string &_table)
+		: table(_table), buf(buffers[_table]), first(true) {
+	if (load_data) {
+		start = buf.size();
+		return;
 	}
-	else
-		buf.append(",");
-	buf.append(content);
+	if (buf.empty()) init_buffer(table, buf);
+	start = buf.size();
+	if (start > header_len(table)) buf += ',';
+	buf += '(';
+}
+
+void SqlBuffer::Row::sep(void) {
+	if (!first) buf += load_data ? '\t' : ',';
+	first = false;
 }
 
-void SqlBuffer::insert(const std::string &table, const char *fmt, ...) {
-	char buf[65536];
-	va_list arg;
-	va_start(arg, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, arg);
-	va_end(arg);
-	insert(table, std::string(buf));
+SqlBuffer::Row &SqlBuffer::Row::add(int n) {
+	return add((long long)n);
+}
+
+SqlBuffer::Row &SqlBuffer::Row::add(long n) {
+	return add((long long)n);
+}
+
+SqlBuffer::Row &SqlBuffer::Row::add(long long n) {
+	char tmp[24];
+	sep();
+	buf.append(tmp, sprintf(tmp, "%lld", n));
+	return *this;
+}
+
+/* LOAD DATA's defaults (fields end at a tab, lines at a newline, escapes
+ * start with a backslash) need only those three escaped; a quoted SQL
+ * string needs the quotes too, and \r and ^Z, as mysql_escape_string
+ * does them. */
+SqlBuffer::Row &SqlBuffer::Row::add(const char *s) {
+	if (!s) return null();
+	sep();
+	const char *special = load_data ? "\\\t\n" : "\\'\"\n\r\032";
+	if (!load_data) buf += '\'';
+	for (;;) {
+		size_t n = strcspn(s, special);
+		buf.append(s, n);
+		s += n;
+		if (!*s) break;
+		buf += '\\';
+		switch (*s) {
+			case '\t':  buf += 't';  break;
+			case '\n':  buf += 'n';  break;
+			case '\r':  buf += 'r';  break;
+			case '\032':  buf += 'Z';  break;
+			default:    buf += *s;
+		}
+		s++;
+	}
+	if (!load_data) buf += '\'';
+	return *this;
+}
+
+SqlBuffer::Row &SqlBuffer::Row::null(void) {
+	sep();
+	buf += load_data ? "\\N" : "NULL";
+	return *this;
+}
+
+/* Flushes the buffer if it is full.  An INSERT that would be too long
+ * goes without this row, which starts the next one. */
+void SqlBuffer::Row::end(void) {
+	if (load_data) {
+		buf += '\n';
+		if (buf.size() >= LOAD_LEN) ship(table, buf);
+		return;
+	}
+	buf += ')';
+	if (buf.size() <= MAX_LEN) return;
+	if (start > header_len(table)) {
+		std::string row(buf, start+1);   // past the comma
+		buf.resize(start);
+		ship(table, buf);
+		init_buffer(table, buf);
+		buf.append(row);
+	}
+	else
+		ship(table, buf);
 }
 
 static void SqlBuffer::init_buffer(const std::string &table, std::string &buf) {
@@ -48,21 +137,153 @@ static void SqlBuffer::init_buffer(const std::string &table, std::string &buf) {
 	buf.append(" VALUES ");
 }
 
-extern void run_sql(const char *cmd);
-static void SqlBuffer::flush_one(const std::string &buf) {
+static size_t SqlBuffer::header_len(const std::string &table) {
+	return strlen("INSERT INTO ") + table.size() + strlen(" VALUES ");
+}
+
+/* The client library asks for the contents of a LOAD DATA LOCAL INFILE
+ * through these instead of opening the file it names. */
+struct Infile {
+	const std::string *buf;
+	size_t pos;
+};
+
+static int infile_init(void **ptr, const char *filename, void *userdata) {
+	*ptr = userdata;
+	return 0;
+}
+
+static int infile_read(void *ptr, char *dst, unsigned int len) {
+	Infile *in = (Infile*)ptr;
+	size_t n = in->buf->size() - in->pos;
+	if (n > len) n = len;
+	memcpy(dst, in->buf->data() + in->pos, n);
+	in->pos += n;
+	return n;
+}
+
+static void infile_end(void *ptr) {}
+
+static int infile_error(void *ptr, char *msg, unsigned int len) {
+	snprintf(msg, len, "error reading the row buffer");
+	return 2000;   // CR_UNKNOWN_ERROR
+}
+
+extern MYSQL mysql;
+extern void run_sql(MYSQL *conn, const char *cmd);
+extern void db_connect(MYSQL *conn, const char *db);
+static void SqlBuffer::flush_one(MYSQL *conn, const std::string &table, const std::string &buf) {
 	//printf("flushing %d bytes to sql\n", buf.length());
-	run_sql(buf.c_str());
+	if (buf.empty()) return;
+	if (!load_data) {
+		run_sql(conn, buf.c_str());
+		return;
+	}
+	Infile in;
+	in.buf = &buf;
+	in.pos = 0;
+	mysql_set_local_infile_handler(conn, infile_init, infile_read, infile_end,
+		infile_error, &in);
+	std::string query("LOAD DATA LOCAL INFILE '");
+	query.append(table);
+	query.append("' INTO TABLE ");
+	query.append(table);
+	run_sql(conn, query.c_str());
+}
+
+static void *writer_main(void *arg) {
+	Writer *w = (Writer*)arg;
+	double start = PhaseStats::now();
+	mysql_thread_init();
+	std::string *buf;
+	while (w->full.pop(&buf, &w->starved)) {
+		double t = PhaseStats::now();
+		SqlBuffer::flush_one(&w->conn, w->table, *buf);
+		w->busy += PhaseStats::now() - t;
+		buf->clear();
+		w->spare.push(buf, NULL);
+	}
+	run_sql(&w->conn, "UNLOCK TABLES");
+	mysql_close(&w->conn);
+	mysql_thread_end();
+	w->wall = PhaseStats::now() - start;
+	return NULL;
+}
+
+/* Starts the table's writer the first time it has a buffer to send. */
+static Writer *get_writer(const std::string &table) {
+	Writer *&w = writers[table];
+	if (w) return w;
+	w = new Writer;
+	w->table = table;
+	db_connect(&w->conn, config.get("db.name", "pip"));
+	std::string lock("LOCK TABLES ");
+	lock.append(table);
+	lock.append(" WRITE");
+	run_sql(&w->conn, lock.c_str());
+	if (pthread_create(&w->thread, NULL, writer_main, w) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	return w;
+}
+
+/* Sends a full buffer and leaves it empty: right away on the main
+ * connection, or by handing it to the table's writer in exchange for a
+ * spare one. */
+static void SqlBuffer::ship(const std::string &table, std::string &buf) {
+	if (!writer_threads) {
+		flush_one(&mysql, table, buf);
+		buf.clear();
+		return;
+	}
+	Writer *w = get_writer(table);
+	std::string *full;
+	if (!w->spare.try_pop(&full)) full = new std::string;
+	full->swap(buf);
+	w->full.push(full, &ship_wait);
 }
 
 void SqlBuffer::flush_all(void) {
 	//printf("flushing everything\n");
-	std::map<std::string, std::string>::const_iterator bp;
+	std::map<std::string, std::string>::iterator bp;
 	for (bp=buffers.begin(); bp!=buffers.end(); bp++) {
 		//printf("  %s => %d bytes\n", bp->first.c_str(), bp->second.size());
-		flush_one(bp->second);
+		if (!bp->second.empty()) ship(bp->first, bp->second);
 	}
 	buffers.clear();
 	assert(buffers.size() == 0);
+
+	std::map<std::string, Writer*>::iterator wp;
+	for (wp=writers.begin(); wp!=writers.end(); wp++) {
+		Writer *w = wp->second;
+		w->full.close();
+		pthread_join(w->thread, NULL);
+		StageStat ss;
+		ss.name = "write " + w->table;
+		ss.threads = 1;
+		ss.wall = w->wall;
+		ss.busy = w->busy;
+		ss.starved = w->starved;
+		ss.blocked = 0;
+		writer_stats.push_back(ss);
+		std::string *buf;
+		while (w->spare.try_pop(&buf))
+			delete buf;
+		delete w;
+	}
+	writers.clear();
+}
+
+double SqlBuffer::blocked_seconds(void) {
+	return ship_wait;
+}
+
+void SqlBuffer::stages(PhaseStats *ps) {
+	for (unsigned int i=0; i<writer_stats.size(); i++) {
+		const StageStat &ss = writer_stats[i];
+		ps->stage(ss.name.c_str(), ss.threads, ss.wall, ss.busy, ss.starved, ss.blocked);
+	}
 }
 
 static void check_empty(void) __attribute__((destructor));
@@ -8,11 +8,46 @@
 
 #include <map>
 #include <string>
+#include "phasestats.h"
 
+/* Rows bound for MySQL are gathered, a buffer per table, into multi-row
+ * INSERT statements, or, with load_data set, into tab-separated text that
+ * goes in through LOAD DATA LOCAL INFILE, which the server parses several
+ * times faster.  load_data must be set before reconcile_init connects.
+ *
+ * A row is written field by field straight into its table's buffer:
+ *   SqlBuffer::Row(table_paths).add(id).add(blob).end();
+ *
+ * With writer_threads set, also before reconcile_init, each table gets a
+ * connection and a thread of its own, and a full buffer is queued for it
+ * instead of sent on the spot. */
 namespace SqlBuffer {
-void insert(const std::string &table, const std::string &content);
-void insert(const std::string &table, const char *fmt, ...) __attribute__((__format__(printf,2,3)));
+extern bool load_data;
+extern bool writer_threads;
+
+class Row {
+public:
+	Row(const std::string &table);
+	Row &add(int n);
+	Row &add(long n);
+	Row &add(long long n);
+	Row &add(const char *s);   // NULL is SQL NULL
+	Row &null(void);
+	void end(void);
+private:
+	void sep(void);
+	const std::string &table;
+	std::string &buf;
+	size_t start;      // where this row begins in buf
+	bool first;
+};
+
 void flush_all(void);
+
+/* For --stats: the seconds Row::end has spent waiting for a writer to
+ * catch up, and, after flush_all, how each writer spent its time. */
+double blocked_seconds(void);
+void stages(PhaseStats *ps);
 }
 
 #endif
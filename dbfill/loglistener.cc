@@ -4,38 +4,148 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <set>
+#include <string>
+#include <vector>
 #include <piki/mainloop.h>
 #include <piki/socklib.h>
 #include "client.h"
 #include "reconcile.h"
 
+/* With --pipdb, nothing goes to MySQL.  Each connection's stream is
+ * spooled, a frame at a time, to a trace file of its own next to the
+ * manifest.  Every --interval minutes, on a timer so that a quiet
+ * listener still rolls, and at exit, the spool files are closed and
+ * handed to "new-reconcile --append" as the manifest's next segment,
+ * which carries whatever they leave unpaired into the segment after it,
+ * unless the path has been idle for --close-idle minutes.  A connection
+ * that stays open gets a new spool file starting with copies of its
+ * header frame and its latest path ID frame, so that each file reads as
+ * a trace by itself. */
+struct Spool {
+	int handle;
+	FILE *fp;
+	std::string fn;
+	std::string header;     // the connection's first frame
+	std::string path_id;    // its latest path ID frame, if any
+	std::string partial;    // the start of a frame not all here yet
+	int frames;             // in this file, not counting the header
+};
+
+static void usage(const char *prog);
 static void on_new_connection(int fd, IOCondition cond, void *data);
 static void on_readable(int fd, IOCondition cond, void *data);
+static void on_spool_readable(int fd, IOCondition cond, void *data);
+static void on_roll_timer(int fd, IOCondition cond, void *data);
 static void on_sigint(int sig) { mainloop_quit(); }
+static void open_spool(Spool *sp);
+static void close_spool(Spool *sp);
+static void roll_segment(void);
+static void reap_reconciler(bool block);
+
+static const char *manifest = NULL;
+static const char *reconciler = "new-reconcile";
+static int interval = 5*60;
+static int close_idle = 60*60;
+static int nrolls = 0, nspools = 0;
+static std::set<Spool*> live;
+static std::vector<std::string> ready;     // closed spool files for the next segment
+static pid_t child = -1;                   // new-reconcile, if running
+static std::vector<std::string> child_files;
+
+static const struct option long_options[] = {
+	{ "pipdb", required_argument, NULL, 'p' },
+	{ "interval", required_argument, NULL, 'i' },
+	{ "close-idle", required_argument, NULL, 'c' },
+	{ "reconciler", required_argument, NULL, 'r' },
+	{ NULL, 0, NULL, 0 }
+};
 
 int main(int argc, char **argv) {
-	if (argc != 3) {
-		fprintf(stderr, "Usage:\n  %s table-name port\n\n", argv[0]);
-		return 1;
+	char c;
+	while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p':  manifest = optarg;  break;
+			case 'i':
+				interval = atoi(optarg) * 60;
+				if (interval <= 0) usage(argv[0]);
+				break;
+			case 'c':
+				close_idle = atoi(optarg) * 60;
+				if (close_idle <= 0) usage(argv[0]);
+				break;
+			case 'r':  reconciler = optarg;  break;
+			default:   usage(argv[0]);
+		}
 	}
-	reconcile_init(argv[1]);
-	int port = atoi(argv[2]);
+	if (argc - optind != (manifest ? 1 : 2)) usage(argv[0]);
+
+	if (!manifest) reconcile_init(argv[optind++]);
+	int port = atoi(argv[optind]);
 	int lfd = sock_listen(port);
 	mainloop_add_input(lfd, IO_READ, on_new_connection, NULL);
+	if (manifest) {
+		int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = its.it_interval.tv_sec = interval;
+		if (tfd == -1 || timerfd_settime(tfd, 0, &its, NULL) == -1) {
+			perror("timerfd");
+			exit(1);
+		}
+		mainloop_add_input(tfd, IO_READ, on_roll_timer, NULL);
+	}
 
 	signal(SIGINT, on_sigint);
 	mainloop_run();
 
-	reconcile_done();
+	if (manifest) {
+		std::vector<Spool*> left(live.begin(), live.end());
+		for (unsigned int i=0; i<left.size(); i++)
+			close_spool(left[i]);
+		roll_segment();
+		reap_reconciler(true);
+		if (!ready.empty())
+			fprintf(stderr, "%zd spool files were not added to %s; they are left in place\n",
+				ready.size(), manifest);
+	}
+	else
+		reconcile_done();
 
 	printf("There were %d error%s\n", errors, errors==1?"":"s");
 	return errors > 0;
 }
 
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage:\n  %s table-name port\n"
+		"  %s --pipdb=manifest [--interval=minutes] [--close-idle=minutes]\n"
+		"      [--reconciler=path] port\n\n", prog, prog);
+	fprintf(stderr, "  --pipdb=manifest\n");
+	fprintf(stderr, "        Add what arrives to a segmented pipdb, a segment at a time,\n");
+	fprintf(stderr, "        instead of to MySQL.  Runs until interrupted.\n");
+	fprintf(stderr, "  --interval=minutes\n");
+	fprintf(stderr, "        Start a new segment this often (default 5).\n");
+	fprintf(stderr, "  --close-idle=minutes\n");
+	fprintf(stderr, "        Stop carrying a path's unpaired messages and open tasks into\n");
+	fprintf(stderr, "        new segments once it has had no events for this long\n");
+	fprintf(stderr, "        (default 60).\n");
+	fprintf(stderr, "  --reconciler=path\n");
+	fprintf(stderr, "        Where new-reconcile is (default: found in $PATH).\n\n");
+	exit(1);
+}
+
 static int nclients = 0;
 static void on_new_connection(int fd, IOCondition cond, void *data) {
 	assert(cond == IO_READ);
@@ -47,6 +157,14 @@ static void on_new_connection(int fd, IOCondition cond, void *data) {
 	printf("New connection from %s:%d on fd=%d\n",
 		inet_ntoa(sock.sin_addr), ntohs(sock.sin_port), afd);
 
+	if (manifest) {
+		Spool *sp = new Spool;
+		sp->handle = mainloop_add_input(afd, IO_READ, on_spool_readable, sp);
+		open_spool(sp);
+		live.insert(sp);
+		return;
+	}
+
 	++nclients;
 	Client *cl = new Client;
 	int handle = mainloop_add_input(afd, IO_READ, on_readable, cl);
@@ -71,3 +189,144 @@ static void on_readable(int fd, IOCondition cond, void *data) {
 	}
 	cl->append(buf, n);
 }
+
+static void on_spool_readable(int fd, IOCondition cond, void *data) {
+	assert(cond == IO_READ);
+	Spool *sp = (Spool*)data;
+	assert(sp);
+
+	char buf[4096];
+	int n = read(fd, buf, sizeof(buf));
+	if (n == -1) { perror("read"); exit(1); }
+	if (n > 0) sp->partial.append(buf, n);
+
+	// pass along whole frames; a frame's length includes its own two bytes
+	const unsigned char *p = (const unsigned char*)sp->partial.data();
+	size_t ofs = 0;
+	bool bad = false;
+	while (sp->partial.size() - ofs >= 2) {
+		size_t len = (p[ofs] << 8) | p[ofs+1];
+		if (len < 3) { bad = true; break; }
+		if (sp->partial.size() - ofs < len) break;
+		if (sp->header.empty()) sp->header.assign(sp->partial, ofs, len);
+		else sp->frames++;
+		if (p[ofs+2] == 'P') sp->path_id.assign(sp->partial, ofs, len);
+		if (fwrite(p+ofs, len, 1, sp->fp) != 1) { perror(sp->fn.c_str()); exit(1); }
+		ofs += len;
+	}
+	sp->partial.erase(0, ofs);
+
+	if (n == 0 || bad) {
+		if (bad)
+			fprintf(stderr, "%s: bad frame length; dropping the connection\n", sp->fn.c_str());
+		else if (!sp->partial.empty())
+			fprintf(stderr, "%s: truncated frame at end of stream\n", sp->fn.c_str());
+		if (bad || !sp->partial.empty()) errors++;
+		close(fd);
+		mainloop_remove_input(sp->handle);
+		close_spool(sp);
+	}
+
+	reap_reconciler(false);
+}
+
+static void on_roll_timer(int fd, IOCondition cond, void *data) {
+	assert(cond == IO_READ);
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) == -1) {
+		perror("read");
+		exit(1);
+	}
+	roll_segment();
+}
+
+static void open_spool(Spool *sp) {
+	char suffix[64];
+	sprintf(suffix, ".spool-%d-%d", nrolls, nspools++);
+	sp->fn = std::string(manifest) + suffix;
+	sp->fp = fopen(sp->fn.c_str(), "w");
+	if (!sp->fp) { perror(sp->fn.c_str()); exit(1); }
+	sp->frames = 0;
+	std::string start = sp->header + sp->path_id;
+	if (!start.empty() && fwrite(start.data(), start.size(), 1, sp->fp) != 1) {
+		perror(sp->fn.c_str());
+		exit(1);
+	}
+}
+
+/* Closes the connection's current file and queues it for the next
+ * segment.  A file with nothing past the header is just removed. */
+static void close_spool(Spool *sp) {
+	if (fclose(sp->fp) != 0) { perror(sp->fn.c_str()); exit(1); }
+	if (sp->frames > 0)
+		ready.push_back(sp->fn);
+	else
+		unlink(sp->fn.c_str());
+	live.erase(sp);
+	delete sp;
+}
+
+/* Starts new-reconcile on everything spooled so far, after waiting for
+ * the one before, since each segment starts from what the last left. */
+static void roll_segment(void) {
+	reap_reconciler(true);
+	nrolls++;
+	for (std::set<Spool*>::iterator sp=live.begin(); sp!=live.end(); sp++) {
+		if ((*sp)->frames == 0) continue;
+		if (fclose((*sp)->fp) != 0) { perror((*sp)->fn.c_str()); exit(1); }
+		ready.push_back((*sp)->fn);
+		open_spool(*sp);
+	}
+	if (ready.empty()) return;
+
+	char idle_arg[32];
+	sprintf(idle_arg, "--close-idle=%d", close_idle);
+	std::vector<const char*> args;
+	args.push_back(reconciler);
+	args.push_back("--append");
+	args.push_back(idle_arg);
+	args.push_back("-o");
+	args.push_back(manifest);
+	for (unsigned int i=0; i<ready.size(); i++)
+		args.push_back(ready[i].c_str());
+	args.push_back(NULL);
+
+	fflush(stdout);
+	child = fork();
+	if (child == -1) { perror("fork"); exit(1); }
+	if (child == 0) {
+		// Ctrl-C stops us; the segment in progress should still finish
+		signal(SIGINT, SIG_IGN);
+		execvp(reconciler, (char**)&args[0]);
+		perror(reconciler);
+		_exit(127);
+	}
+	child_files.swap(ready);
+	ready.clear();
+}
+
+/* Removes the spool files of a segment new-reconcile has finished.
+ * "new-reconcile --append" exits with 2 when it did not add the segment
+ * to the manifest, and otherwise with 0, or 1 if it printed errors about
+ * the segment it added.  If the segment was not added, or new-reconcile
+ * could not be run or was killed before it could say, the files go back
+ * at the front of the queue, to be tried again with the next segment. */
+#define EXIT_NOT_APPENDED 2
+static void reap_reconciler(bool block) {
+	if (child == -1) return;
+	int status;
+	pid_t pid = waitpid(child, &status, block ? 0 : WNOHANG);
+	if (pid == 0) return;
+	if (pid == child && WIFEXITED(status) && WEXITSTATUS(status) != EXIT_NOT_APPENDED
+			&& WEXITSTATUS(status) != 127)
+		for (unsigned int i=0; i<child_files.size(); i++)
+			unlink(child_files[i].c_str());
+	else {
+		fprintf(stderr, "%s --append -o %s did not add a segment; keeping its %zd spool files for the next one\n",
+			reconciler, manifest, child_files.size());
+		ready.insert(ready.begin(), child_files.begin(), child_files.end());
+		errors++;
+	}
+	child = -1;
+	child_files.clear();
+}
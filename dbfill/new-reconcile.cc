@@ -4,19 +4,28 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <deque>
+#include <limits>
 #include <map>
 #include <vector>
 #include "events.h"
+#include "hashtable.h"
+#include "phasestats.h"
 #include "pipdb.h"
-
-#define PIPDB_VERSION 1
+#include "radixsort.h"
+#include "workqueue.h"
 
 #if 0
 static void safe_seek(FILE *fp, int ofs, int whence) {
@@ -34,111 +43,408 @@ static void safe_seek(FILE *fp, int ofs, int whence) {
 #define fseek safe_seek
 #endif
 
-struct ltstr {
-  bool operator()(const char* s1, const char* s2) const { return strcmp(s1, s2) < 0; }
+/* The parts of a task start or end that go into its record. */
+struct TaskMark {
+	TaskMark(const Task *t, int thread) : tv(t->tv), utime(t->utime), stime(t->stime),
+		major_fault(t->major_fault), minor_fault(t->minor_fault),
+		vol_cs(t->vol_cs), invol_cs(t->invol_cs), thread_id(thread), seq(0) {}
+	TaskMark(void) {}
+	timeval tv, utime, stime;
+	int major_fault, minor_fault, vol_cs, invol_cs, thread_id;
+	int64_t seq;               // --max-memory: the event it came from
+};
+typedef std::vector<TaskMark> StartList;
+enum { PART_TASKS, PART_NOTICES, PART_MESSAGES };
+/* Pending writes to one run of consecutive offsets in the output.  Pass
+ * 2 appends to every path region and task index strictly in order, so
+ * each gets one of these instead of an fseek+fwrite per record. */
+struct WriteBuffer {
+	WriteBuffer(void) : ofs(0), queued(false) {}
+	off_t ofs;                 // file offset of data[0]
+	std::string data;
+	bool queued;               // on the dirty list
 };
-typedef std::vector<StartTask *> StartList;
-typedef std::map<const char *, StartList, ltstr> NameTaskMap;
-typedef std::map<std::string, Message*> MessageMap;
 struct Path {
-	Path(void) { tasks = notices = messages = 0; }
-	int tasks, notices, messages;
-	NameTaskMap start_task;    // mapping from task name to stack of task-start events
-	std::map<std::string, std::vector<Task*> > unpaired_tasks;
-	int total(void) const { return tasks + notices + messages; }
+	Path(void) { tasks = notices = messages = 0; id = -1; task_records = 0; index_entry = 0; last_tv.tv_sec = last_tv.tv_usec = 0; }
+	off_t tasks, notices, messages;
+	int id;                    // interned path ID: index in path_info
+	int task_records;          // pass 1: how many tasks are in "tasks"
+	off_t index_entry;         // --compress: where its path index offsets go
+	WriteBuffer out[3];        // pass 2: pending tasks, notices, messages
+	IntMap<StartList> start_task;  // interned task name -> stack of open task starts
+	IntMap<int> spilled_starts;    // --max-memory: task name -> starts under those, on disk
+	timeval last_tv;           // --append: its latest event, in this segment or before
+	off_t total(void) const { return tasks + notices + messages; }
 };
 struct TaskEnt {
-	int tasks, name_ofs;
-	TaskEnt(void) : tasks(0), name_ofs(0) {}
+	off_t tasks, name_ofs;
+	int nameidx;               // what task records store to name this task
+	WriteBuffer slots;         // pass 2: pending index entries
+	TaskEnt(void) : tasks(0), name_ofs(0), nameidx(0) {}
+};
+struct PathSizes {
+	PathSizes(void) : tasks(0), notices(0), messages(0), task_records(0) {}
+	off_t tasks, notices, messages;
+	int task_records;
+};
+typedef std::pair<int, int> PathTask;   // (path number, task name number)
+/* pass 1: a task start or end that its own file could not pair */
+struct LooseEnd {
+	LooseEnd(int _path, int _name, bool _is_start, const TaskMark &_mark)
+		: path(_path), name(_name), is_start(_is_start), mark(_mark) {}
+	int path, name;
+	bool is_start;
+	TaskMark mark;
+};
+/* A send or receive waiting for its other half.  The message ID is its
+ * key in "sends" or "receives"; the rest of the event is dropped, but
+ * for its roles and level, which diagnostics print. */
+struct PendingMessage {
+	timeval tv;
+	int size, thread_id;
+	int roles;                 // in role_names, or -1 if the event had none
+	char level;
+	Path *path;
+	int64_t seq;               // the event it came from
+};
+/* Everything pass 1 learns from one trace file.  Workers fill these in
+ * independently; the main thread merges them in command-line order. */
+struct FirstPassResult {
+	FirstPassResult(void) : header(NULL), errors(0), bytes(0), events(0), seconds(0) {
+		first_ts.tv_sec = first_ts.tv_usec = INT_MAX;
+		last_ts.tv_sec = last_ts.tv_usec = 0;
+	}
+	Header *header;               // first header in the file, if any
+	std::string messages;         // diagnostics, printed at merge time
+	int errors;
+	timeval first_ts, last_ts;
+	Interner path_names, task_names;  // numbered just for this file
+	std::vector<PathSizes> paths;     // byte counts, by local path number
+	std::vector<int> tasks;           // count, by local task number
+
+	/* A task's record size depends on its start, so pass 1 pairs tasks
+	 * just as pass 2 will.  Starts not yet ended, by local numbers: */
+	std::map<PathTask, std::vector<TaskMark> > started;
+	/* Ends this file had no start for, in order, then starts it never
+	 * ended; merge_first_pass pairs these across files.  For any one path
+	 * and name, all the ends come before all the starts. */
+	std::vector<LooseEnd> loose;
+
+	int64_t bytes, events;        // for --stats
+	double seconds;
 };
 
 static void usage(const char *prog);
-static void first_pass(FILE *outp, const char *fn);
-static void second_pass(FILE *outp, const char *fn, int thread_id);
+static Path *get_path(const char *id, int len);
+static int get_task(const char *name, int len);
+static Event *next_event(int version, FILE *fp, const char *fn, int *corrupt);
+static void run_first_pass(FILE *outp, char **files, int nfiles);
+static void first_pass(const char *fn, int thread_id, FirstPassResult *res);
+static void merge_first_pass(FILE *outp, FirstPassResult *res);
+static void reconcile_file(FILE *outp, const char *fn, int thread_id);
+static void copy_spilled_records(FILE *outp);
 static void pipdb_write_task_index(FILE *outp);
 static void pipdb_write_path_index(FILE *outp);
 static void pipdb_write_thread(FILE *outp, Header *hdr);
-static int pipdb_task_length(StartTask *start, EndTask *end);
+static PipDBTask make_task(const TaskMark &start, const TaskMark &end, int nameidx);
+static int pipdb_task_length(const PipDBTask &task);
 static int pipdb_notice_length(Notice *notice);
-static int pipdb_message_length(Message *send, Message *recv);
-static void pipdb_write_task(FILE *outp, Task *start, Task *end, Path *current_path);
+static int pipdb_message_length(int idlen, int size, int thread_id);
+static void pipdb_write_task(FILE *outp, const TaskMark &start, Task *end, int name, Path *current_path);
 static void pipdb_write_notice(FILE *outp, Notice *notice, int thread_id, Path *current_path);
-static void pipdb_write_message(FILE *outp, Message *send, Message *recv, Path *current_path);
-bool handle_end_task(FILE *outp, Task *end, Path *path);
-static void reconcile(FILE *outp, Message *send, Message *recv, bool is_send, int thread_id, Path *path);
+static void pipdb_write_message(FILE *outp, const char *msgid, int idlen,
+	const PendingMessage *send, const PendingMessage *recv, Path *current_path);
+static void push_start(Path *path, int name, const TaskMark &start);
+static bool defer_end(Task *end, int name, Path *path);
+static bool defer_message(Message *msg, const PendingMessage &pm, bool is_send);
+static void replay_unmatched(FILE *outp, FILE *run);
+bool handle_end_task(FILE *outp, Task *end, int name, Path *path);
+static void reconcile(FILE *outp, Message *msg, bool is_send, int thread_id, Path *path);
 static void check_unpaired_tasks(FILE *outp);
 static void check_unpaired_messages(FILE *outp);
 static void sort_task_indices(int fd);
+static void pipdb_write_task_columns(int fd);
+static void pipdb_write_time_index(int fd, off_t records_end);
+static void pipdb_write_path_names(int fd);
+static void pipdb_write_path_summaries(int fd, off_t records_end, int first_thread);
+static void pipdb_write_sections(int fd);
+static void pwrite_all(int fd, const char *data, size_t len, off_t ofs);
+static std::string begin_segment(const char *manifest, std::vector<PipDBSegment> *merged);
+static void read_segments(FILE *outp, const char *manifest, const std::vector<PipDBSegment> &merged);
+static bool finish_append(const char *manifest);
+static void exit_not_appended(void);
+static bool finish_compact(const char *manifest, const std::vector<PipDBSegment> &merged);
+static void check_memory(void);
+static void merge_spilled_state(FILE *outp);
+static void note_memory(void);
+static void print_memory(void);
+static void stats_phase(const char *name);
+static int pack_ofs(off_t ofs, char *buf);
+static inline bool compact_records(void);
 static bool save_unmatched_sends = false;
+static bool skip_corrupt = false;
+static bool one_pass = false;
+static bool show_stats = false;
+static bool stats_json = false;    // --stats=json
+static PhaseStats phase_stats;
+static bool task_columns = true;   // write TASK-METRICS
+static int time_buckets = 1024;    // TIME-INDEX buckets, or 0 for none
+static bool name_index = true;     // write PATH-NAMES
+static bool path_summaries = true; // write PATH-SUMMARY
+static bool wide_names = true;     // task records need 32-bit name indices
+static bool append = false;        // -o names a segment manifest to add to
+static bool compact = false;       // merge the segments it names
+static int close_idle = 0;         // --append: seconds a path may be quiet before its state is dropped
+static bool appended = false;      // --append: the manifest lists the new segment
+#define EXIT_NOT_APPENDED 2        // see exit_not_appended
+static int thread_base = 0;        // threads in earlier segments
+static int nfiles;                 // thread_base + nfiles is the highest thread number
+static int jobs = 0;
+static size_t max_memory = 0;      // for unmatched state, or 0 for no limit
+static int64_t event_seq = 0;      // events read so far
+static off_t records_offset;       // where the records start, after the indices
 static size_t _ign;
 
-PipDBHeader pipdb_header = {
-	magic: { 'P', 'I', 'P' },
-	version: PIPDB_VERSION,
-	first_ts: {INT_MAX, INT_MAX},
-	last_ts: {0, 0},
-	// all others zero
-};
+PipDBHeader pipdb_header;   // set up at the start of main
 
-/* HACK: reused structures!
- * After the first pass, "paths" maps path ID to the lengths (in bytes) of
- * the tasks, notices, and messages for each path.  "tasks" maps task name
- * to the number of tasks.
+/* Path IDs and task names are interned once, and everything else refers
+ * to them by number.  A name's number indexes path_info or task_info;
+ * these are deques so that pointers into them stay valid as they grow.
+ *
+ * HACK: reused structures!
+ * After the first pass, "path_info" holds the lengths (in bytes) of the
+ * tasks, notices, and messages for each path.  "task_info" holds the
+ * number of tasks of each name.
  * Writing the task and path indices changes the contents of both
  * structures.
- * For the second pass, "paths" contains the current offset for tasks,
- * notices, and messages in each path.  "tasks" contains the current
- * offset in the task index. */
-static std::map<std::string, Path> paths;     // maps path id to path info
-static std::map<std::string, TaskEnt> tasks;  // maps task name to index entry offset
+ * For the second pass, "path_info" contains the current offset for tasks,
+ * notices, and messages in each path.  "task_info" contains the current
+ * offset in the task index.
+ * Names seen only on task starts get a number but no index entry; their
+ * count stays 0. */
+static Interner path_names, task_names;
+static Interner role_names;       // for pending messages' diagnostics
+static std::deque<Path> path_info;
+static std::deque<TaskEnt> task_info;
+
+// pass 1: starts left open by earlier files, by global numbers
+static std::map<PathTask, std::vector<TaskMark> > carried_starts;
+
+// tasks ended without a start, by host; never reported (see check_unpaired_tasks)
+static std::map<std::string, std::vector<Task*> > unpaired_tasks;
 
-static MessageMap sends, receives;
+static StringMap<PendingMessage> sends, receives;
 static int errors;
 
+/* --stats: largest size seen, between files, of each structure (open
+ * tasks are tracked as they change) */
+enum { MEM_PATH_NAMES, MEM_PATHS, MEM_TASK_NAMES, MEM_TASKS, MEM_OPEN_TASKS,
+	MEM_SENDS, MEM_RECEIVES, MEM_WRITE_BUFFERS, NMEM };
+static const char *mem_names[NMEM] = { "path names", "paths", "task names",
+	"task index", "open tasks", "pending sends", "pending receives", "write buffers" };
+static size_t peak_memory[NMEM];
+static size_t open_tasks;   // bytes of start_task tables
+
+/* One-pass mode (-1) reads each trace only once.  Records go to spill
+ * buckets (temporary files, each holding a shard of the paths) while the
+ * same pass gathers the sizes that pass 1 would have.  After the indices
+ * are written, copy_spilled_records moves each path's records into place,
+ * one shard at a time.  The output is the same as the two-pass output. */
+#define SPILL_SHARDS 64
+struct SpillHeader {
+	int path, len;
+	unsigned char part;   // PART_*
+	int64_t seq;   // the event that made it
+} __attribute__((__packed__));
+static FILE *spill[SPILL_SHARDS];
+static bool late_records = false;   // merge_spilled_state spilled records out of order
+
+#define WRITE_BUFFER_MAX (64<<10)     // flush one buffer at this size
+#define WRITE_BUFFERS_MAX (64<<20)    // flush all of them at this total
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+static int out_fd;
+static std::vector<WriteBuffer*> dirty;
+static size_t buffered_bytes;
+static void buffered_write(WriteBuffer *wb, off_t ofs, const void *data, size_t len);
+static void flush_write_buffers(void);
+
+static const struct option long_options[] = {
+	{ "skip-corrupt", no_argument, NULL, 'S' },
+	{ "one-pass", no_argument, NULL, '1' },
+	{ "stats", optional_argument, NULL, 'M' },
+	{ "format-version", required_argument, NULL, 'V' },
+	{ "compress", required_argument, NULL, 'C' },
+	{ "no-task-columns", no_argument, NULL, 'T' },
+	{ "time-buckets", required_argument, NULL, 'B' },
+	{ "no-path-names", no_argument, NULL, 'N' },
+	{ "no-path-summary", no_argument, NULL, 'P' },
+	{ "append", no_argument, NULL, 'A' },
+	{ "compact", no_argument, NULL, 'K' },
+	{ "max-memory", required_argument, NULL, 'm' },
+	{ "close-idle", required_argument, NULL, 'I' },
+	{ NULL, 0, NULL, 0 }
+};
+
 int main(int argc, char **argv) {
 	int i;
 	char c;
 	const char *outfn = NULL;
 
-	while ((c = getopt(argc, argv, "o:")) != -1)
+	memset(&pipdb_header, 0, sizeof(pipdb_header));
+	memcpy(pipdb_header.magic, "PIP", 3);
+	pipdb_header.version = PIPDB_VERSION;
+	pipdb_header.first_ts.tv_sec = INT_MAX;
+	pipdb_header.first_ts.tv_usec = INT_MAX;
+
+	while ((c = getopt_long(argc, argv, "1j:o:", long_options, NULL)) != -1)
 		switch (c) {
+			case '1': one_pass = true; break;
+			case 'j': jobs = atoi(optarg); break;
 			case 'o': outfn = optarg; break;
 			case 's': save_unmatched_sends = true; break;
+			case 'S': skip_corrupt = true; break;
+			case 'M':
+				show_stats = true;
+				if (optarg) {
+					if (strcmp(optarg, "json") != 0) usage(argv[0]);
+					stats_json = true;
+				}
+				break;
+			case 'V':
+				pipdb_header.version = atoi(optarg);
+				if (pipdb_header.version < 1 || pipdb_header.version > PIPDB_VERSION) usage(argv[0]);
+				break;
+			case 'T': task_columns = false; break;
+			case 'N': name_index = false; break;
+			case 'P': path_summaries = false; break;
+			case 'A': append = true; break;
+			case 'K': compact = true; break;
+			case 'I':
+				close_idle = atoi(optarg);
+				if (close_idle <= 0) usage(argv[0]);
+				break;
+			case 'm': {
+					char *end;
+					max_memory = strtoul(optarg, &end, 10);
+					switch (*end) {
+						case 'G': case 'g': max_memory <<= 10;
+							// fall through
+						case 'M': case 'm': max_memory <<= 10;
+							// fall through
+						case 'K': case 'k': max_memory <<= 10; end++;
+					}
+					if (max_memory == 0 || *end) usage(argv[0]);
+				}
+				break;
+			case 'B':
+				time_buckets = atoi(optarg);
+				if (time_buckets < 0) usage(argv[0]);
+				break;
+			case 'C':
+				pipdb_header.compression = pipdb_compression_by_name(optarg);
+				if (pipdb_header.compression == -1) usage(argv[0]);
+				break;
 			default:  usage(argv[0]);
 		}
 
-	if (!outfn || argc-optind < 1)
+	if (append) atexit(exit_not_appended);
+	if (!outfn || (append && compact) || (compact ? argc-optind != 0 : argc-optind < 1))
 		usage(argv[0]);
+	nfiles = argc-optind;
+	if (pipdb_header.compression) {
+		if (pipdb_header.version < 3) {
+			fprintf(stderr, "--compress needs --format-version=3 or later\n");
+			return 1;
+		}
+		one_pass = true;   // blocks are built from the spill buckets
+	}
+	if (max_memory) one_pass = true;   // late records are placed in the spill buckets
+	const char *manifest = NULL;
+	std::string segment_path;
+	std::vector<PipDBSegment> merged;   // --compact: what the new segment replaces
+	if (append || compact) {
+		if (pipdb_header.version < 2) {
+			fprintf(stderr, "--append and --compact need --format-version=2 or later\n");
+			return 1;
+		}
+		if (compact) one_pass = true;   // segments are read into the spill buckets
+		manifest = outfn;
+		segment_path = begin_segment(manifest, &merged);
+		outfn = segment_path.c_str();
+	}
 
 	FILE *op = fopen(outfn, "w");
+	if (!op) { perror(outfn); return 1; }
+	out_fd = fileno(op);
 	pipdb_header.threads_offset = pipdb_header.pack().size();
 	fseek(op, pipdb_header.threads_offset, SEEK_SET);
 
-	fprintf(stderr, "Pass 1");
-	for (i=optind; i<argc; i++) {
-		first_pass(op, argv[i]);
-		fputc('.', stderr);
+	if (compact) {
+		stats_phase("read segments");
+		read_segments(op, manifest, merged);
 	}
-	fputc('\n', stderr);
+	else if (one_pass) {
+		stats_phase("one pass");
+		fprintf(stderr, "Reading");
+		for (i=optind; i<argc; i++) {
+			reconcile_file(op, argv[i], thread_base + i-optind+1);
+			fputc('.', stderr);
+		}
+		fputc('\n', stderr);
+		merge_spilled_state(op);
+		if (!append) {   // or carried to the next segment
+			stats_phase("unmatched check");
+			check_unpaired_messages(op);
+		}
+	}
+	else {
+		stats_phase("pass 1");
+		fprintf(stderr, "Pass 1");
+		run_first_pass(op, argv+optind, argc-optind);
+		fputc('\n', stderr);
+	}
+
+	pipdb_header.npaths = path_info.size();
+	pipdb_header.ntasks = 0;
+	for (i=0; i<(int)task_info.size(); i++)
+		if (task_info[i].tasks > 0) pipdb_header.ntasks++;
 
-	pipdb_header.npaths = paths.size();
-	pipdb_header.ntasks = tasks.size();
-	fprintf(stderr, "%d paths, %d threads, %d tasks, start=%ld.%06ld, end=%ld.%06ld\n",
-		pipdb_header.npaths, pipdb_header.nthreads, pipdb_header.ntasks,
+	// task sizes so far assume 16-bit name indices
+	wide_names = !compact_records() || pipdb_header.ntasks > 0x10000;
+	if (compact_records() && wide_names)
+		for (i=0; i<(int)path_info.size(); i++)
+			path_info[i].tasks += 2 * path_info[i].task_records;
+
+	fprintf(stderr, "%lld paths, %lld threads, %lld tasks, start=%ld.%06ld, end=%ld.%06ld\n",
+		(long long)pipdb_header.npaths, (long long)pipdb_header.nthreads, (long long)pipdb_header.ntasks,
 		pipdb_header.first_ts.tv_sec, pipdb_header.first_ts.tv_usec,
 		pipdb_header.last_ts.tv_sec, pipdb_header.last_ts.tv_usec);
 
+	stats_phase("index writing");
 	pipdb_write_task_index(op);
 	pipdb_write_path_index(op);
 
-	fprintf(stderr, "Pass 2");
-	for (i=optind; i<argc; i++) {
-		second_pass(op, argv[i], i-optind+1);
-		fputc('.', stderr);
+	if (one_pass) {
+		stats_phase("copy records");
+		copy_spilled_records(op);
 	}
-	fputc('\n', stderr);
+	else {
+		stats_phase("pass 2");
+		fflush(op);   // records go around stdio from here on
+		fprintf(stderr, "Pass 2");
+		for (i=optind; i<argc; i++) {
+			reconcile_file(op, argv[i], thread_base + i-optind+1);
+			fputc('.', stderr);
+		}
+		fputc('\n', stderr);
 
-	check_unpaired_messages(op);
+		stats_phase("unmatched check");
+		if (!append) check_unpaired_messages(op);
+		note_memory();
+		flush_write_buffers();
+	}
 
 	fseek(op, 0, SEEK_SET);
 	std::string header_str = pipdb_header.pack();
@@ -146,55 +452,131 @@ int main(int argc, char **argv) {
 
 	fclose(op);
 	int fd = open(outfn, O_RDWR);
+	off_t records_end = lseek(fd, 0, SEEK_END);
+	stats_phase("sort_task_indices");
 	sort_task_indices(fd);
+	if (pipdb_header.version >= 3) {
+		stats_phase("extra sections");
+		if (task_columns) pipdb_write_task_columns(fd);
+		if (time_buckets > 0) pipdb_write_time_index(fd, records_end);
+		if (name_index) pipdb_write_path_names(fd);
+		if (path_summaries)
+			pipdb_write_path_summaries(fd, records_end, compact ? merged[0].thread_base : thread_base);
+		pipdb_write_sections(fd);
+	}
 	close(fd);
+	if (append) {
+		appended = finish_append(manifest);
+		if (!appended) errors++;
+	}
+	if (compact && !finish_compact(manifest, merged)) errors++;
+	stats_phase(NULL);
+	if (show_stats) print_memory();
 	printf("There were %d error%s\n", errors, errors==1?"":"s");
+	if (append && !appended) return EXIT_NOT_APPENDED;
 	return errors > 0;
 }
 
+/* Pass 1 parses files in parallel.  Each file gets its own
+ * FirstPassResult; merge_first_pass folds them into the global tables
+ * strictly in file order, so thread numbering, diagnostics, and the
+ * resulting pipdb are the same as a serial run. */
+struct FirstPassJob {
+	FILE *outp;
+	char **files;
+	FirstPassResult *results;
+};
+
+static void first_pass_work(int idx, void *arg) {
+	FirstPassJob *job = (FirstPassJob*)arg;
+	first_pass(job->files[idx], thread_base + idx+1, &job->results[idx]);
+}
+
+static void first_pass_merge(int idx, void *arg) {
+	FirstPassJob *job = (FirstPassJob*)arg;
+	FirstPassResult *res = &job->results[idx];
+	if (show_stats) phase_stats.file(job->files[idx], res->bytes, res->events, res->seconds);
+	merge_first_pass(job->outp, res);
+	note_memory();
+	fputc('.', stderr);
+}
+
+static void run_first_pass(FILE *outp, char **files, int nfiles) {
+	FirstPassJob job = { outp, files, new FirstPassResult[nfiles] };
+	run_ordered(nfiles, jobs, first_pass_work, first_pass_merge, &job);
+	delete[] job.results;
+	carried_starts.clear();   // never ended
+}
+
 /* !! this could be made a bit faster.  we don't need to parse all fields
  * of all events, just enough to get the lengths, path names, and task
  * names. */
-static void first_pass(FILE *outp, const char *fn) {
+static void first_pass(const char *fn, int thread_id, FirstPassResult *res) {
 	int version = -1;
+	double start = PhaseStats::now();
 	FILE *fp = !strcmp(fn, "-") ? stdin : fopen(fn, "r");
-	if (!fp) { perror(fn); return; }
+	if (!fp) {
+		res->messages.append(fn).append(": ").append(strerror(errno)).append("\n");
+		return;
+	}
 	Event *e;
-	Path *current_path = NULL;
+	Message *mev;
+	int current_path = -1;
+	int n;
 
-	while ((e = read_event(version, fp)) != NULL) {
-		if (e->tv < pipdb_header.first_ts) pipdb_header.first_ts = e->tv;
-		if (e->tv > pipdb_header.last_ts) pipdb_header.last_ts = e->tv;
+	int corrupt = 0;
+	while ((e = next_event(version, fp, fn, &corrupt)) != NULL) {
+		res->events++;
+		if (e->tv < res->first_ts) res->first_ts = e->tv;
+		if (e->tv > res->last_ts) res->last_ts = e->tv;
 /* !! we need smarter reconciling logic here.  task and message sizes
  * depend on pairing end+start, recv+send.  so we need to keep big tables
  * of all open tasks and messages.  that's expensive. */
 		switch (e->type()) {
 			case EV_HEADER:
 				if (version != -1) {
-					fprintf(stderr, "%s: multiple headers -- did you call ANNOTATE_INIT twice?\n", fn);
-					errors++;
+					res->messages.append(fn).append(": multiple headers -- did you call ANNOTATE_INIT twice?\n");
+					res->errors++;
 				}
 				else {
 					version = dynamic_cast<Header*>(e)->version;
-					pipdb_write_thread(outp, dynamic_cast<Header*>(e));
-					pipdb_header.nthreads++;
+					res->header = dynamic_cast<Header*>(e);
+					continue;   // merge_first_pass deletes it
 				}
 				break;
-			case EV_SET_PATH_ID:
-				current_path = &paths[dynamic_cast<NewPathID*>(e)->path_id];
+			case EV_SET_PATH_ID:{
+					const std::string &id = dynamic_cast<NewPathID*>(e)->path_id;
+					current_path = res->path_names.intern(id.data(), id.size());
+					if (current_path == (int)res->paths.size()) res->paths.push_back(PathSizes());
+				}
 				break;
-			case EV_END_TASK:
-				tasks[dynamic_cast<EndTask*>(e)->name].tasks++;
-				current_path->tasks += pipdb_task_length(NULL, dynamic_cast<EndTask*>(e));
+			case EV_START_TASK:
+			case EV_END_TASK:{
+					Task *task = dynamic_cast<Task*>(e);
+					n = res->task_names.intern(task->name, strlen(task->name));
+					if (n == (int)res->tasks.size()) res->tasks.push_back(0);
+					std::vector<TaskMark> &starts = res->started[PathTask(current_path, n)];
+					if (e->type() == EV_START_TASK)
+						starts.push_back(TaskMark(task, thread_id));
+					else if (starts.empty())
+						res->loose.push_back(LooseEnd(current_path, n, false, TaskMark(task, thread_id)));
+					else {
+						PathSizes &ps = res->paths.at(current_path);
+						ps.tasks += pipdb_task_length(make_task(starts.back(), TaskMark(task, thread_id), 0));
+						ps.task_records++;
+						res->tasks[n]++;
+						starts.pop_back();
+					}
+				}
 				break;
 			case EV_NOTICE:
-				current_path->notices += pipdb_notice_length(dynamic_cast<Notice*>(e));
+				res->paths.at(current_path).notices += pipdb_notice_length(dynamic_cast<Notice*>(e));
 				break;
 			case EV_RECV:
-				current_path->messages += pipdb_message_length(dynamic_cast<Message*>(e), NULL);
+				mev = dynamic_cast<Message*>(e);
+				res->paths.at(current_path).messages += pipdb_message_length(mev->msgid.size(), mev->size, thread_id);
 				break;
 			case EV_SEND:
-			case EV_START_TASK:
 			case EV_END_PATH_ID:
 			case EV_BELIEF_FIRST:
 			case EV_BELIEF:;
@@ -203,18 +585,150 @@ static void first_pass(FILE *outp, const char *fn) {
 		delete e;
 	}
 	if (version == -1) {
-		fprintf(stderr, "%s: no header -- zero-length log file?\n", fn);
-		errors++;
+		res->messages.append(fn).append(": no header -- zero-length log file?\n");
+		res->errors++;
 	}
+	res->errors += corrupt;
+	res->bytes = std::max((off_t)0, ftello(fp));   // -1 for a pipe
+	res->seconds = PhaseStats::now() - start;
 	fclose(fp);
+
+	std::map<PathTask, std::vector<TaskMark> >::const_iterator sp;
+	for (sp=res->started.begin(); sp!=res->started.end(); sp++)
+		for (unsigned int i=0; i<sp->second.size(); i++)
+			res->loose.push_back(LooseEnd(sp->first.first, sp->first.second, true, sp->second[i]));
+	res->started.clear();
+}
+
+/* Fold one file's pass-1 results into the global header, path, and task
+ * tables, and write its thread record.  Must be called in file order. */
+static void merge_first_pass(FILE *outp, FirstPassResult *res) {
+	fputs(res->messages.c_str(), stderr);
+	errors += res->errors;
+
+	if (res->header) {
+		pipdb_write_thread(outp, res->header);
+		pipdb_header.nthreads++;
+		delete res->header;
+		res->header = NULL;
+	}
+	if (res->first_ts < pipdb_header.first_ts) pipdb_header.first_ts = res->first_ts;
+	if (res->last_ts > pipdb_header.last_ts) pipdb_header.last_ts = res->last_ts;
+
+	unsigned int i;
+	std::vector<int> path_num(res->paths.size()), task_num(res->tasks.size());
+	for (i=0; i<res->paths.size(); i++) {
+		Path *path = get_path(res->path_names.name(i), res->path_names.length(i));
+		path_num[i] = path->id;
+		path->tasks += res->paths[i].tasks;
+		path->notices += res->paths[i].notices;
+		path->messages += res->paths[i].messages;
+		path->task_records += res->paths[i].task_records;
+	}
+	for (i=0; i<res->tasks.size(); i++) {
+		task_num[i] = get_task(res->task_names.name(i), res->task_names.length(i));
+		task_info[task_num[i]].tasks += res->tasks[i];
+	}
+
+	// pair what this file left open with what earlier files did
+	for (i=0; i<res->loose.size(); i++) {
+		const LooseEnd &le = res->loose[i];
+		PathTask key(path_num[le.path], task_num[le.name]);
+		if (le.is_start) {
+			carried_starts[key].push_back(le.mark);
+			continue;
+		}
+		std::map<PathTask, std::vector<TaskMark> >::iterator sp = carried_starts.find(key);
+		if (sp == carried_starts.end()) continue;   // pass 2 won't pair it either
+		Path *path = &path_info[key.first];
+		path->tasks += pipdb_task_length(make_task(sp->second.back(), le.mark, 0));
+		path->task_records++;
+		task_info[key.second].tasks++;
+		sp->second.pop_back();
+		if (sp->second.empty()) carried_starts.erase(sp);
+	}
+	std::vector<LooseEnd>().swap(res->loose);
+
+	res->path_names.clear();
+	res->task_names.clear();
+	std::vector<PathSizes>().swap(res->paths);
+	std::vector<int>().swap(res->tasks);
+}
+
+/* the Path for a path ID, created if it is new */
+static Path *get_path(const char *id, int len) {
+	int n = path_names.intern(id, len);
+	if (n == (int)path_info.size()) {
+		path_info.push_back(Path());
+		path_info.back().id = n;
+	}
+	return &path_info[n];
+}
+
+/* the number of a task name, with a TaskEnt created if it is new */
+static int get_task(const char *name, int len) {
+	int n = task_names.intern(name, len);
+	if (n == (int)task_info.size()) task_info.push_back(TaskEnt());
+	return n;
+}
+
+static Event *next_event(int version, FILE *fp, const char *fn, int *corrupt) {
+	if (skip_corrupt) return read_event_recover(version, fp, fn, corrupt);
+	return read_event(version, fp);
 }
 
 static void usage(const char *prog) {
-	fprintf(stderr, "Usage:\n  %s -o outputfile file [file [file [...]]]\n\n", prog);
+	fprintf(stderr, "Usage:\n  %s [-1] [-j jobs] [--skip-corrupt] [--stats[=json]] [--format-version=N]\n"
+		"      [--compress=lz4|zlib] [--no-task-columns] [--time-buckets=N] [--no-path-names]\n"
+		"      [--no-path-summary] [--max-memory=N[KMG]] [--append [--close-idle=seconds]]\n"
+		"      -o outputfile file [file [file [...]]]\n"
+		"  %s --compact [options] -o manifest\n\n", prog, prog);
+	fprintf(stderr, "  -1     read each file only once, spilling records to temporary files\n");
+	fprintf(stderr, "         (works with pipes; reads the files one at a time)\n");
+	fprintf(stderr, "  -j N   parse up to N files at once in pass 1, and sort the task index with\n");
+	fprintf(stderr, "         N threads (default: one per CPU)\n");
+	fprintf(stderr, "  --skip-corrupt\n");
+	fprintf(stderr, "         skip damaged or truncated parts of trace files instead of aborting\n");
+	fprintf(stderr, "  --stats[=json]\n");
+	fprintf(stderr, "         report time, I/O, and table sizes for each phase, throughput for\n");
+	fprintf(stderr, "         each file, and the memory used by each table\n");
+	fprintf(stderr, "  --max-memory=N[KMG]\n");
+	fprintf(stderr, "         keep at most about N bytes of unmatched messages and open tasks in\n");
+	fprintf(stderr, "         memory, spilling the oldest to temporary files (implies -1)\n");
+	fprintf(stderr, "  --format-version=N\n");
+	fprintf(stderr, "         write pipdb format version N (default %d; 1 is limited to 2GB)\n", PIPDB_VERSION);
+	fprintf(stderr, "  --compress=lz4|zlib\n");
+	fprintf(stderr, "         compress each path's records as a separate block (implies -1;\n");
+	fprintf(stderr, "         needs version 3)\n");
+	fprintf(stderr, "  --no-task-columns\n");
+	fprintf(stderr, "         leave out the per-task metric columns that speed up graphs\n");
+	fprintf(stderr, "  --time-buckets=N\n");
+	fprintf(stderr, "         split the time index for time-range queries into at most N\n");
+	fprintf(stderr, "         buckets (default 1024; 0 leaves it out)\n");
+	fprintf(stderr, "  --no-path-names\n");
+	fprintf(stderr, "         leave out the printable path names and their substring index\n");
+	fprintf(stderr, "  --no-path-summary\n");
+	fprintf(stderr, "         leave out each path's precomputed totals\n");
+	fprintf(stderr, "  --append\n");
+	fprintf(stderr, "         add these files as a new segment of the segmented pipdb whose\n");
+	fprintf(stderr, "         manifest is outputfile, carrying what they leave unpaired to the\n");
+	fprintf(stderr, "         next segment; exits with status 2 if the manifest was not\n");
+	fprintf(stderr, "         changed, and 1 only for errors in a segment it did add\n");
+	fprintf(stderr, "  --close-idle=seconds\n");
+	fprintf(stderr, "         with --append, carry nothing for a path with no events in the last\n");
+	fprintf(stderr, "         this many seconds of the segment; its unpaired sends and receives\n");
+	fprintf(stderr, "         are reported, and its open task starts dropped, as a run without\n");
+	fprintf(stderr, "         --append would at the end\n");
+	fprintf(stderr, "  --compact\n");
+	fprintf(stderr, "         merge all of a segmented pipdb's segments into one; appends may\n");
+	fprintf(stderr, "         go on meanwhile\n\n");
 	exit(1);
 }
 
-static void second_pass(FILE *outp, const char *fn, int thread_id) {
+/* Pass 2, or the only pass with -1: pair up events and write records.
+ * In one-pass mode this also does pass 1's bookkeeping: thread records,
+ * timestamps, and the sizes of every path and task index. */
+static void reconcile_file(FILE *outp, const char *fn, int thread_id) {
 	Header *header = NULL;
 	Path *current_path = NULL;
 	FILE *fp = !strcmp(fn, "-") ? stdin : fopen(fn, "r");
@@ -223,36 +737,62 @@ static void second_pass(FILE *outp, const char *fn, int thread_id) {
 	Message *mev;
 	StartTask *stev;
 	EndTask *etev;
-	MessageMap::const_iterator pair_mev;
-	while ((ev = read_event(header ? header->version : -1, fp)) != NULL) {
+	int name;
+	// in two-pass mode, pass 1 already reported any corruption
+	int corrupt = 0;
+	double start = PhaseStats::now();
+	int64_t first_seq = event_seq;
+	while ((ev = next_event(header ? header->version : -1, fp, one_pass ? fn : NULL, &corrupt)) != NULL) {
+		event_seq++;
+		if (max_memory) check_memory();
+		if (current_path && ev->tv > current_path->last_tv) current_path->last_tv = ev->tv;
+		if (one_pass) {
+			if (ev->tv < pipdb_header.first_ts) pipdb_header.first_ts = ev->tv;
+			if (ev->tv > pipdb_header.last_ts) pipdb_header.last_ts = ev->tv;
+		}
 		switch (ev->type()) {
 			case EV_HEADER:
-				if (header)
+				if (header) {
 					fprintf(stderr, "%s: multiple headers -- did you call ANNOTATE_INIT twice?\n", fn);
-				else
+					if (one_pass) errors++;
+					delete ev;
+				}
+				else {
 					header = dynamic_cast<Header*>(ev);
+					if (one_pass) {
+						pipdb_write_thread(outp, header);
+						pipdb_header.nthreads++;
+					}
+				}
 				break;
-			case EV_SET_PATH_ID:
-				current_path = &paths[dynamic_cast<NewPathID*>(ev)->path_id];
+			case EV_SET_PATH_ID:{
+					const std::string &id = dynamic_cast<NewPathID*>(ev)->path_id;
+					current_path = get_path(id.data(), id.size());
+				}
 				delete ev;
 				break;
-			case EV_START_TASK:
-				stev = dynamic_cast<StartTask*>(ev);
-				stev->thread_id = thread_id;
-				stev->path_id.v = current_path;
-				current_path->start_task[stev->name].push_back(stev);
+			case EV_START_TASK:{
+					stev = dynamic_cast<StartTask*>(ev);
+					name = get_task(stev->name, strlen(stev->name));
+					TaskMark start(stev, thread_id);
+					start.seq = event_seq;
+					push_start(current_path, name, start);
+				}
+				delete ev;
 				break;
 			case EV_END_TASK:
 				etev = dynamic_cast<EndTask*>(ev);
 				etev->thread_id = thread_id;
 				etev->path_id.v = current_path;
-				if (!handle_end_task(outp, etev, current_path)) {
+				name = get_task(etev->name, strlen(etev->name));
+				if (!handle_end_task(outp, etev, name, current_path)) {
 					assert(header);
-					current_path->unpaired_tasks[header->hostname].push_back(etev);
+					unpaired_tasks[header->hostname].push_back(etev);
 					break;
 				}
 				break;
 			case EV_NOTICE:
+				if (one_pass) current_path->notices += pipdb_notice_length(dynamic_cast<Notice*>(ev));
 				pipdb_write_notice(outp, dynamic_cast<Notice*>(ev), thread_id, current_path);
 				delete ev;
 				break;
@@ -260,19 +800,14 @@ static void second_pass(FILE *outp, const char *fn, int thread_id) {
 				mev = dynamic_cast<Message*>(ev);
 				mev->thread_id = thread_id;
 				mev->path_id.v = current_path;
-				pair_mev = receives.find(mev->msgid);
-				reconcile(outp, mev,
-					pair_mev == receives.end() ? NULL : pair_mev->second,
-					true, thread_id, current_path);
+				reconcile(outp, mev, true, thread_id, current_path);
 				break;
 			case EV_RECV:
 				mev = dynamic_cast<Message*>(ev);
 				mev->thread_id = thread_id;
 				mev->path_id.v = current_path;
-				pair_mev = sends.find(mev->msgid);
-				reconcile(outp,
-					pair_mev == sends.end() ? NULL : pair_mev->second,
-					mev, false, thread_id, current_path);
+				if (one_pass) current_path->messages += pipdb_message_length(mev->msgid.size(), mev->size, thread_id);
+				reconcile(outp, mev, false, thread_id, current_path);
 				break;
 			case EV_END_PATH_ID:
 			case EV_BELIEF_FIRST:
@@ -281,60 +816,126 @@ static void second_pass(FILE *outp, const char *fn, int thread_id) {
 				break;
 		}
 	}
+	if (one_pass) {
+		if (!header) {
+			fprintf(stderr, "%s: no header -- zero-length log file?\n", fn);
+			errors++;
+		}
+		errors += corrupt;
+	}
 	if (header) delete header;
 
 	check_unpaired_tasks(outp);
+	note_memory();
 
-	fclose(fp);
+	if (show_stats)
+		phase_stats.file(fn, std::max((off_t)0, ftello(fp)), event_seq - first_seq, PhaseStats::now() - start);
+	if (fp != stdin) fclose(fp);
+}
+
+/* Versions 2 and later start each section 8-byte aligned. */
+static void align_output(FILE *outp) {
+	if (pipdb_header.version < 2) return;
+	for (off_t ofs=ftello(outp); ofs & 7; ofs++)
+		fputc('\0', outp);
 }
 
 static void pipdb_write_task_index(FILE *outp) {
-	pipdb_header.task_idx_offset = ftell(outp);
+	align_output(outp);
+	pipdb_header.task_idx_offset = ftello(outp);
+	int ofs_size = pipdb_header.offset_size();
+	char buf[8];
 
-	/* each task */
-	std::map<std::string, TaskEnt>::iterator tp;
-	for (tp=tasks.begin(); tp!=tasks.end(); tp++) {
-		tp->second.name_ofs = ftell(outp);  // offset to the name
-		_ign = fwrite(tp->first.data(), 1, tp->first.size(), outp);
+	/* each task, in name order */
+	std::vector<int> order = task_names.sorted();
+	int nameidx = 0;
+	for (unsigned int i=0; i<order.size(); i++) {
+		TaskEnt *te = &task_info[order[i]];
+		if (te->tasks == 0) continue;   // only ever started
+		te->name_ofs = ftello(outp);  // offset to the name
+		te->nameidx = pipdb_header.version >= 2 ? nameidx++ : te->name_ofs;
+		_ign = fwrite(task_names.name(order[i]), 1, task_names.length(order[i]), outp);
 		fputc('\0', outp);
-		_ign = fwrite(&tp->second, sizeof(int), 1, outp);  /* number of task events */
-		int temp_ofs = ftell(outp);  // offset to the first slot of this task's index
-		fseek(outp, tp->second.tasks*sizeof(int), SEEK_CUR);
-		tp->second.tasks = temp_ofs;
+		_ign = fwrite(buf, pack_ofs(te->tasks, buf), 1, outp);  /* number of task events */
+		off_t temp_ofs = ftello(outp);  // offset to the first slot of this task's index
+		fseeko(outp, te->tasks*ofs_size, SEEK_CUR);
+		te->tasks = temp_ofs;
 	}
 }
 
 static void pipdb_write_path_index(FILE *outp) {
-	pipdb_header.path_idx_offset = ftell(outp);
-	int path_idx_size = 0;
+	align_output(outp);
+	pipdb_header.path_idx_offset = ftello(outp);
+	off_t path_idx_size = 0;
+	char buf[8];
 
-	std::map<std::string, Path>::iterator pp;
-	for (pp=paths.begin(); pp!=paths.end(); pp++)
-		path_idx_size += sizeof(short) + pp->first.size() + 3*sizeof(int);
+	unsigned int i;
+	for (i=0; i<path_info.size(); i++)
+		path_idx_size += sizeof(short) + path_names.length(i) + pipdb_header.path_offsets()*pipdb_header.offset_size();
 
-	int ofs = pipdb_header.path_idx_offset + path_idx_size;
+	off_t ofs = pipdb_header.path_idx_offset + path_idx_size;
+	if (pipdb_header.version >= 2) ofs = (ofs + 7) & ~(off_t)7;
+	records_offset = ofs;
 
-	/* each path */
-	for (pp=paths.begin(); pp!=paths.end(); pp++) {
-		short s_temp = pp->first.size();
+	/* each path, in path ID order */
+	std::vector<int> order = path_names.sorted();
+	for (i=0; i<order.size(); i++) {
+		Path *path = &path_info[order[i]];
+		short s_temp = path_names.length(order[i]);
 		_ign = fwrite(&s_temp, sizeof(short), 1, outp);
-		_ign = fwrite(pp->first.data(), 1, pp->first.size(), outp);
+		_ign = fwrite(path_names.name(order[i]), 1, s_temp, outp);
 
-		int temp = pp->second.tasks;
-		_ign = fwrite(&ofs, sizeof(int), 1, outp);
-		pp->second.tasks = ofs;
+		if (pipdb_header.compression) {
+			// copy_spilled_records fills in the offsets once the blocks are written
+			memset(buf, 0, sizeof(buf));
+			for (int j=0; j<pipdb_header.path_offsets(); j++)
+				_ign = fwrite(buf, pipdb_header.offset_size(), 1, outp);
+			path->index_entry = ftello(outp) - pipdb_header.path_offsets()*pipdb_header.offset_size();
+			// index slots are (path number, offset in the uncompressed block)
+			path->tasks = (off_t)i << 32;
+			continue;
+		}
+
+		off_t temp = path->tasks;
+		_ign = fwrite(buf, pack_ofs(ofs, buf), 1, outp);
+		path->tasks = ofs;
 		ofs += temp;
 
-		temp = pp->second.notices;
-		_ign = fwrite(&ofs, sizeof(int), 1, outp);
-		pp->second.notices = ofs;
+		temp = path->notices;
+		_ign = fwrite(buf, pack_ofs(ofs, buf), 1, outp);
+		path->notices = ofs;
 		ofs += temp;
 
-		temp = pp->second.messages;
-		_ign = fwrite(&ofs, sizeof(int), 1, outp);
-		pp->second.messages = ofs;
+		temp = path->messages;
+		_ign = fwrite(buf, pack_ofs(ofs, buf), 1, outp);
+		path->messages = ofs;
 		ofs += temp;
 	}
+
+	// ofs is now the end of the file
+	if (pipdb_header.version < 2 && ofs > INT_MAX) {
+		fprintf(stderr, "Output would be %lld bytes, too big for pipdb version %d\n",
+			(long long)ofs, pipdb_header.version);
+		exit(1);
+	}
+}
+
+/* Whether records use version 2's compact encodings. */
+static inline bool compact_records(void) {
+	return pipdb_header.version >= 2;
+}
+
+/* Puts "ofs" in buf as this version's indices store offsets and counts.
+ * Returns its size. */
+static int pack_ofs(off_t ofs, char *buf) {
+	if (pipdb_header.version >= 2) {
+		int64_t v = ofs;
+		memcpy(buf, &v, sizeof(v));
+		return sizeof(v);
+	}
+	int v = ofs;
+	memcpy(buf, &v, sizeof(v));
+	return sizeof(v);
 }
 
 static void pipdb_write_thread(FILE *outp, Header *hdr) {
@@ -351,139 +952,411 @@ static void pipdb_write_thread(FILE *outp, Header *hdr) {
 	_ign = fwrite(&hdr->tz, sizeof(int), 1, outp);
 }
 
-/* be clever with flags fields to save space */
-static int pipdb_task_length(StartTask *start, EndTask *end) {
-	return 2 + 4 + 2*8 + 9*4;
+static PipDBTask make_task(const TaskMark &start, const TaskMark &end, int nameidx) {
+	PipDBTask ret = { nameidx,
+		(int)start.tv.tv_sec, (int)start.tv.tv_usec,
+		(int)end.tv.tv_sec, (int)end.tv.tv_usec,
+		(int)(end.tv - start.tv),
+		(int)(end.utime - start.utime),
+		(int)(end.stime - start.stime),
+		end.major_fault - start.major_fault,
+		end.minor_fault - start.minor_fault,
+		end.vol_cs - start.vol_cs,
+		end.invol_cs - start.invol_cs,
+		start.thread_id, end.thread_id
+	};
+	return ret;
+}
+
+/* Version 2 records are only as big as their contents need.  Until the
+ * task index is written, assume 16-bit name indices; main() adds the
+ * rest if there turn out to be too many names. */
+static int pipdb_task_length(const PipDBTask &task) {
+	return PipDBTask::length(task.flags(compact_records(), false));
 }
 
 static int pipdb_notice_length(Notice *notice) {
 	return strlen(notice->str) + 1 + 8 + 4;
 }
 
-static int pipdb_message_length(Message *send, Message *recv) {
-	return 1 + 2 + send->msgid.size() + 2*8 + 3*4;
-}
-
-// !! use the flags field
-static void pipdb_write_task(FILE *outp, Task *start, Task *end, Path *current_path) {
-	// seek to where it actually goes, write it
-	fseek(outp, current_path->tasks, SEEK_SET);
-	struct {
-		unsigned short flags;
-		int nameidx;
-		int start_sec, start_usec, end_sec, end_usec;
-		int realtime, utime, stime, minfault, majfault, volcs, involcs, s_thread, e_thread;
-	} __attribute__((__packed__)) outbuf = { 0xffff, tasks[end->name].name_ofs,
-		start->tv.tv_sec, start->tv.tv_usec,
-		end->tv.tv_sec, end->tv.tv_usec,
-		end->tv - start->tv,
-		end->utime - start->utime,
-		end->stime - start->stime,
-		end->major_fault - start->major_fault,
-		end->minor_fault - start->minor_fault,
-		end->vol_cs - start->vol_cs,
-		end->invol_cs - start->invol_cs,
-		start->thread_id, end->thread_id
-	};
+/* Room for a message, judged from its receive alone: the send's time
+ * and thread aren't known until pass 2, so allow for a full receive time
+ * and the highest thread number. */
+static int pipdb_message_length(int idlen, int size, int thread_id) {
+	PipDBMessage msg = { NULL, idlen, 0, 0, 0, 0, size, thread_base + nfiles, thread_id };
+	unsigned char flags = msg.flags(compact_records());
+	if (compact_records()) flags |= MSG_RECV_TV;
+	return PipDBMessage::length(flags, msg.idlen);
+}
+
+/* one-pass mode: save a record for copy_spilled_records to place */
+static void spill_record(Path *path, int part, const void *data, int len) {
+	FILE *&fp = spill[path->id % SPILL_SHARDS];
+	if (!fp && (fp = tmpfile()) == NULL) {
+		perror("tmpfile");
+		exit(1);
+	}
+	assert(part >= PART_TASKS && part <= PART_MESSAGES);
+	SpillHeader sh = { path->id, len, (unsigned char)part, event_seq };
+	if (fwrite(&sh, sizeof(sh), 1, fp) != 1 || fwrite(data, len, 1, fp) != 1) {
+		perror("spill");
+		exit(1);
+	}
+}
+
+/* one-pass mode: count a task and spill it */
+static void spill_task(PipDBTask task, int name, Path *path) {
+	std::string rec;
+	task_info[name].tasks++;
+	path->tasks += pipdb_task_length(task);
+	path->task_records++;
+	// the name's index entry isn't known yet; copy_spilled_records re-packs it
+	task.nameidx = name;
+	task.pack(&rec, task.flags(compact_records(), true));
+	spill_record(path, PART_TASKS, rec.data(), rec.size());
+}
 
-	_ign = fwrite(&outbuf, sizeof(outbuf), 1, outp);
-	
-	// seek to its spot in the index and write the offset
-	fseek(outp, tasks[end->name].tasks, SEEK_SET);
-	_ign = fwrite(&current_path->tasks, sizeof(int), 1, outp);
+static void pipdb_write_task(FILE *outp, const TaskMark &start, Task *end, int name, Path *current_path) {
+	TaskEnt *te = &task_info[name];
+	PipDBTask task = make_task(start, TaskMark(end, end->thread_id), te->nameidx);
+	std::string rec;
 
-	current_path->tasks += sizeof(outbuf);
-	tasks[end->name].tasks += sizeof(int);
+	if (one_pass) {
+		spill_task(task, name, current_path);
+		return;
+	}
+
+	// write it where it actually goes, and its offset to its spot in the index
+	task.pack(&rec, task.flags(compact_records(), wide_names));
+	buffered_write(&current_path->out[PART_TASKS], current_path->tasks, rec.data(), rec.size());
+	char slot[8];
+	int slotlen = pack_ofs(current_path->tasks, slot);
+	buffered_write(&te->slots, te->tasks, slot, slotlen);
+
+	current_path->tasks += rec.size();
+	te->tasks += slotlen;
 }
 
 static void pipdb_write_notice(FILE *outp, Notice *notice, int thread_id, Path *current_path) {
-	// seek to where it actually goes, write it
-	fseek(outp, current_path->notices, SEEK_SET);
-	fputs(notice->str, outp);
-	fputc('\0', outp);
-	int sec = notice->tv.tv_sec;  _ign = fwrite(&sec, sizeof(sec), 1, outp);
-	int usec = notice->tv.tv_usec;  _ign = fwrite(&usec, sizeof(usec), 1, outp);
-	_ign = fwrite(&thread_id, sizeof(thread_id), 1, outp);
-	current_path->notices += strlen(notice->str) + 1 + 8 + 4;
-}
-
-// !! use the flags field
-static void pipdb_write_message(FILE *outp, Message *send, Message *recv, Path *current_path) {
-	// seek to where it actually goes, write it
-	fseek(outp, current_path->messages, SEEK_SET);
-	fputc(0xff, outp);  // flags
-	short idlen = send->msgid.size();
-	_ign = fwrite(&idlen, sizeof(idlen), 1, outp);
-	_ign = fwrite(send->msgid.data(), send->msgid.size(), 1, outp);
-	struct {
-		int send_sec, send_usec, recv_sec, recv_usec;
-		int size, s_thread, r_thread;
-	} __attribute__((__packed__)) outbuf = {
-		send->tv.tv_sec, send->tv.tv_usec,
-		recv ? recv->tv.tv_sec : send->tv.tv_sec, recv ? recv->tv.tv_usec : send->tv.tv_usec,
+	std::string rec(notice->str, strlen(notice->str)+1);
+	int sec = notice->tv.tv_sec;  rec.append((char*)&sec, sizeof(sec));
+	int usec = notice->tv.tv_usec;  rec.append((char*)&usec, sizeof(usec));
+	rec.append((char*)&thread_id, sizeof(thread_id));
+
+	if (one_pass) {
+		spill_record(current_path, PART_NOTICES, rec.data(), rec.size());
+		return;
+	}
+
+	buffered_write(&current_path->out[PART_NOTICES], current_path->notices, rec.data(), rec.size());
+	current_path->notices += rec.size();
+}
+
+static void pipdb_write_message(FILE *outp, const char *msgid, int idlen,
+		const PendingMessage *send, const PendingMessage *recv, Path *current_path) {
+	PipDBMessage msg = { msgid, idlen,
+		(int)send->tv.tv_sec, (int)send->tv.tv_usec,
+		(int)(recv ? recv->tv : send->tv).tv_sec, (int)(recv ? recv->tv : send->tv).tv_usec,
 		send->size,
 		send->thread_id,
 		recv ? recv->thread_id : -1
 	};
+	std::string rec;
+	msg.pack(&rec, msg.flags(compact_records()));
+
+	if (one_pass) {
+		spill_record(current_path, PART_MESSAGES, rec.data(), rec.size());
+		return;
+	}
 
-	_ign = fwrite(&outbuf, sizeof(outbuf), 1, outp);
-	current_path->messages += 1 + 2 + send->msgid.size() + sizeof(outbuf);
+	buffered_write(&current_path->out[PART_MESSAGES], current_path->messages, rec.data(), rec.size());
+	current_path->messages += rec.size();
 }
 
-bool handle_end_task(FILE *outp, Task *end, Path *path) {
-	//!! use find() so it doesn't auto-create entire vectors
-	StartList *evl = &path->start_task[end->name];
-	if (evl == NULL || evl->empty())
-		return false;
-	Task *start = (Task*)evl->back();
-	evl->pop_back();
-	assert(start->path_id.v == end->path_id.v);
-	if (evl->empty()) path->start_task.erase(start->name);
-	pipdb_write_task(outp, start, end, path);
-	delete start;
+static void pwrite_all(int fd, const char *data, size_t len, off_t ofs) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, data, len, ofs);
+		if (n <= 0) { perror("pwrite"); exit(1); }
+		data += n;
+		len -= n;
+		ofs += n;
+	}
+}
+
+/* Grows "block" with zeros to "len" bytes.  The sizes gathered while
+ * reading are upper bounds, so this never needs to shrink it. */
+static void pad_to(std::string *block, size_t len) {
+	if (block->size() < len) block->resize(len, '\0');
+}
+
+static void flush_write_buffer(WriteBuffer *wb) {
+	pwrite_all(out_fd, wb->data.data(), wb->data.size(), wb->ofs);
+	buffered_bytes -= wb->data.size();
+	wb->ofs += wb->data.size();
+	wb->data.clear();
+}
+
+static void buffered_write(WriteBuffer *wb, off_t ofs, const void *data, size_t len) {
+	if (!wb->data.empty() && wb->ofs + (off_t)wb->data.size() != ofs)
+		flush_write_buffer(wb);
+	if (wb->data.empty()) wb->ofs = ofs;
+	if (!wb->queued) {
+		dirty.push_back(wb);
+		wb->queued = true;
+	}
+	wb->data.append((const char*)data, len);
+	buffered_bytes += len;
+	if (wb->data.size() >= WRITE_BUFFER_MAX) flush_write_buffer(wb);
+	if (buffered_bytes >= WRITE_BUFFERS_MAX) flush_write_buffers();
+}
+
+static bool by_offset(const WriteBuffer *a, const WriteBuffer *b) { return a->ofs < b->ofs; }
+
+/* Writes out every pending buffer in offset order.  Buffers that happen
+ * to be adjacent in the file go out together in one pwritev. */
+static void flush_write_buffers(void) {
+	std::sort(dirty.begin(), dirty.end(), by_offset);
+	std::vector<struct iovec> iov;
+	off_t start = 0, end = 0;
+	for (unsigned int i=0; i<=dirty.size(); i++) {
+		WriteBuffer *wb = i < dirty.size() ? dirty[i] : NULL;
+		if (wb && wb->data.empty()) continue;
+		if (!iov.empty() && (!wb || wb->ofs != end || iov.size() == IOV_MAX)) {
+			ssize_t n = pwritev(out_fd, &iov[0], iov.size(), start);
+			if (n == -1) { perror("pwritev"); exit(1); }
+			// finish any short write by hand
+			for (unsigned int j=0; j<iov.size(); j++) {
+				size_t done = (size_t)n < iov[j].iov_len ? n : iov[j].iov_len;
+				if (done < iov[j].iov_len)
+					pwrite_all(out_fd, (const char*)iov[j].iov_base + done, iov[j].iov_len - done, start + done);
+				start += iov[j].iov_len;
+				n -= done;
+			}
+			iov.clear();
+		}
+		if (!wb) break;
+		if (iov.empty()) start = end = wb->ofs;
+		struct iovec v = { (void*)wb->data.data(), wb->data.size() };
+		iov.push_back(v);
+		end += wb->data.size();
+	}
+	for (unsigned int i=0; i<dirty.size(); i++) {
+		dirty[i]->ofs += dirty[i]->data.size();
+		dirty[i]->data.clear();
+		dirty[i]->queued = false;
+	}
+	dirty.clear();
+	buffered_bytes = 0;
+}
+
+struct PathBlock {
+	std::string part[3];   // tasks, notices, messages
+};
+struct SpillRef {
+	SpillHeader sh;
+	off_t ofs;             // of the record, in the shard
+};
+/* A part's records go in the order of the events that made them, which
+ * is file order except for the ones merge_spilled_state made. */
+static bool by_event(const SpillRef &a, const SpillRef &b) {
+	if (a.sh.path != b.sh.path) return a.sh.path < b.sh.path;
+	if (a.sh.part != b.sh.part) return a.sh.part < b.sh.part;
+	if (a.sh.seq != b.sh.seq) return a.sh.seq < b.sh.seq;
+	return a.ofs < b.ofs;
+}
+
+/* Compresses one path's records, which need no padding in between,
+ * writes them at "ofs", and fills in the path's index entry.  Returns
+ * where the next block goes. */
+static off_t write_compressed_block(int fd, off_t ofs, const Path *path, const std::string *part) {
+	std::string raw(part[PART_TASKS]);
+	raw.append(part[PART_NOTICES]);
+	raw.append(part[PART_MESSAGES]);
+	if (raw.size() > 0xffffffffu) {
+		fprintf(stderr, "Path %s is too big to compress (%zd bytes)\n",
+			ID_to_string(std::string(path_names.name(path->id), path_names.length(path->id))), raw.size());
+		exit(1);
+	}
+	std::string block;
+	pipdb_compress(pipdb_header.compression, raw.data(), raw.size(), &block);
+	if (block.size() >= raw.size())
+		block = raw;   // stored as is: blocklen == rawlen says so
+	pwrite_all(fd, block.data(), block.size(), ofs);
+
+	// blockofs blocklen rawlen noticeofs messageofs; see pip-database-format
+	off_t entry[5] = { ofs, (off_t)block.size(), (off_t)raw.size(),
+		(off_t)part[PART_TASKS].size(), (off_t)(part[PART_TASKS].size() + part[PART_NOTICES].size()) };
+	std::string packed;
+	char buf[8];
+	for (int i=0; i<5; i++)
+		packed.append(buf, pack_ofs(entry[i], buf));
+	pwrite_all(fd, packed.data(), packed.size(), path->index_entry);
+	return ofs + block.size();
+}
+
+/* One-pass mode: after the indices are written, "paths" holds each
+ * path's region offsets and "tasks" each index's first slot, just as for
+ * pass 2.  Load one spill shard at a time, assemble each path's records,
+ * and write each path with a single pwrite. */
+static void copy_spilled_records(FILE *outp) {
+	unsigned int i;
+	fflush(outp);
+	int fd = fileno(outp);
+	std::vector<std::string> slots(task_info.size());
+	char slot[8];
+	off_t block_ofs = records_offset;   // compressed blocks go after the indices
+
+	fprintf(stderr, "Copying records");
+	for (int shard=0; shard<SPILL_SHARDS; shard++) {
+		FILE *fp = spill[shard];
+		if (!fp) continue;
+		off_t size = ftello(fp);
+		std::vector<char> data(size);
+		rewind(fp);
+		if (size > 0 && fread(&data[0], size, 1, fp) != 1) {
+			perror("fread spill");
+			exit(1);
+		}
+		fclose(fp);
+		spill[shard] = NULL;
+
+		std::vector<SpillRef> refs;
+		for (off_t ofs=0; ofs<size; ) {
+			SpillRef ref;
+			memcpy(&ref.sh, &data[ofs], sizeof(ref.sh));
+			ref.ofs = ofs + sizeof(ref.sh);
+			refs.push_back(ref);
+			ofs = ref.ofs + ref.sh.len;
+		}
+		if (late_records) std::sort(refs.begin(), refs.end(), by_event);
+
+		std::map<int, PathBlock> blocks;
+		for (std::vector<SpillRef>::const_iterator rp=refs.begin(); rp!=refs.end(); rp++) {
+			const SpillHeader &sh = rp->sh;
+			off_t ofs = rp->ofs;
+			std::string &part = blocks[sh.path].part[(int)sh.part];
+			if (sh.part == PART_TASKS) {
+				// swap in the real name index and remember the index slot
+				PipDBTask task;
+				task.unpack(&data[ofs]);
+				int id = task.nameidx;
+				slots[id].append(slot, pack_ofs(path_info[sh.path].tasks + part.size(), slot));
+				task.nameidx = task_info[id].nameidx;
+				task.pack(&part, task.flags(compact_records(), wide_names));
+			}
+			else
+				part.append(&data[ofs], sh.len);
+		}
+		std::vector<char>().swap(data);
+
+		for (std::map<int, PathBlock>::const_iterator bp=blocks.begin(); bp!=blocks.end(); bp++) {
+			const Path *path = &path_info[bp->first];
+			const std::string *part = bp->second.part;
+			if (pipdb_header.compression) {
+				block_ofs = write_compressed_block(fd, block_ofs, path, part);
+				continue;
+			}
+			std::string block(part[PART_TASKS]);
+			if (!part[PART_NOTICES].empty() || !part[PART_MESSAGES].empty()) {
+				pad_to(&block, path->notices - path->tasks);
+				block.append(part[PART_NOTICES]);
+			}
+			if (!part[PART_MESSAGES].empty()) {
+				pad_to(&block, path->messages - path->tasks);
+				block.append(part[PART_MESSAGES]);
+			}
+			pwrite_all(fd, block.data(), block.size(), path->tasks);
+		}
+		fputc('.', stderr);
+	}
+	fputc('\n', stderr);
+
+	for (i=0; i<slots.size(); i++)
+		if (!slots[i].empty())
+			pwrite_all(fd, slots[i].data(), slots[i].size(), task_info[i].tasks);
+}
+
+static void push_start(Path *path, int name, const TaskMark &start) {
+	open_tasks -= path->start_task.bytes();
+	path->start_task.insert(name)->value.push_back(start);
+	open_tasks += path->start_task.bytes() + sizeof(TaskMark);
+	if (open_tasks > peak_memory[MEM_OPEN_TASKS]) peak_memory[MEM_OPEN_TASKS] = open_tasks;
+}
+
+bool handle_end_task(FILE *outp, Task *end, int name, Path *path) {
+	IntMap<StartList>::Entry *evl = path->start_task.find(name);
+	if (evl == NULL)
+		return defer_end(end, name, path);
+	TaskMark start = evl->value.back();
+	evl->value.pop_back();
+	open_tasks -= path->start_task.bytes() + sizeof(TaskMark);
+	if (evl->value.empty()) path->start_task.erase(evl);
+	open_tasks += path->start_task.bytes();
+	pipdb_write_task(outp, start, end, name, path);
 	delete end;
 	return true;
 }
 
-static void reconcile(FILE *outp, Message *send, Message *recv, bool is_send, int thread_id, Path *path) {
-	assert(thread_id != -1);
-	if (is_send)
-		send->thread_id = thread_id;
+static int get_roles(const char *roles) {
+	return roles ? role_names.intern(roles, strlen(roles)) : -1;
+}
+
+static void print_pending(FILE *fp, const char *what, const char *msgid, int idlen, const PendingMessage *pm) {
+	const char *roles = pm->roles == -1 ? "(null)" : role_names.name(pm->roles);
+	int rlen = pm->roles == -1 ? strlen(roles) : role_names.length(pm->roles);
+	fprintf(fp, "<%s msg_id=\"%s\" roles=\"%.*s\" level=%d size=\"%d\" tv=\"%ld.%06ld\" thread_id=\"%d\" />\n",
+		what, ID_to_string(std::string(msgid, idlen)), rlen, roles, pm->level,
+		pm->size, pm->tv.tv_sec, pm->tv.tv_usec, pm->thread_id);
+}
+
+/* Writes the record for a send and its receive, if they agree. */
+static void pair_messages(FILE *outp, const char *msgid, int idlen,
+		const PendingMessage *send, const PendingMessage *recv, Path *path) {
+	if (send->path != recv->path) {
+		fprintf(stderr, "send/recv path_id mismatch:\n  "); print_pending(stderr, "send", msgid, idlen, send);
+		fprintf(stderr, "  "); print_pending(stderr, "recv", msgid, idlen, recv);
+		errors++;
+	}
+	else if (send->size != recv->size) {
+		fprintf(stderr, "packet size mismatch:\n  "); print_pending(stderr, "send", msgid, idlen, send);
+		fprintf(stderr, "  "); print_pending(stderr, "recv", msgid, idlen, recv);
+		//abort();
+		errors++;
+	}
 	else
-		recv->thread_id = thread_id;
-	if (send && recv) {
-		if (send->path_id.v != recv->path_id.v) {
-			fprintf(stderr, "send/recv path_id mismatch:\n  "); send->print(stderr);
-			fprintf(stderr, "  "); recv->print(stderr);
-			errors++;
-		}
-		else if (send->size != recv->size) {
-			fprintf(stderr, "packet size mismatch:\n  "); send->print(stderr);
-			fprintf(stderr, "  "); recv->print(stderr);
-			//abort();
-			errors++;
-		}
-		else
-			pipdb_write_message(outp, send, recv, path);
+		pipdb_write_message(outp, msgid, idlen, send, recv, path);
+}
 
-		if (is_send)
-			receives.erase(recv->msgid);
-		else
-			sends.erase(send->msgid);
-		delete recv;
-		delete send;
+static void reused_message(bool is_send, const char *msgid, int idlen,
+		const PendingMessage *old, const PendingMessage *pm) {
+	const char *what = is_send ? "send" : "recv";
+	fprintf(stderr, "Reused message id:\n  OLD: "); print_pending(stderr, what, msgid, idlen, old);
+	fprintf(stderr, "  NEW: "); print_pending(stderr, what, msgid, idlen, pm);
+	//abort();
+	errors++;
+}
+
+/* Pairs msg with its other half if that has been seen, or else keeps
+ * what pairing will need until it shows up.  Deletes msg either way. */
+static void reconcile(FILE *outp, Message *msg, bool is_send, int thread_id, Path *path) {
+	assert(thread_id != -1);
+	PendingMessage pm = { msg->tv, msg->size, thread_id, get_roles(msg->roles), msg->level, path, event_seq };
+	if (defer_message(msg, pm, is_send)) return;
+	const char *msgid = msg->msgid.data();
+	int idlen = msg->msgid.size();
+	StringMap<PendingMessage> &other_table = is_send ? receives : sends;
+	StringMap<PendingMessage>::Entry *other = other_table.find(msgid, idlen);
+	if (other) {
+		pair_messages(outp, msgid, idlen, is_send ? &pm : &other->value, is_send ? &other->value : &pm, path);
+		other_table.erase(other);
 	}
 	else {
-		MessageMap &table = is_send ? sends : receives;
-		Message *msg = is_send ? send : recv;
-		if (table[msg->msgid] != NULL) {
-			fprintf(stderr, "Reused message id:\n  OLD: "); table[msg->msgid]->print(stderr);
-			fprintf(stderr, "  NEW: "); msg->print(stderr);
-			//abort();
-			errors++;
-		}
-		table[msg->msgid] = msg;
+		bool created;
+		StringMap<PendingMessage>::Entry *e = (is_send ? sends : receives).insert(msgid, idlen, &created);
+		if (!created) reused_message(is_send, msgid, idlen, &e->value, &pm);
+		e->value = pm;
 	}
+	delete msg;
 }
 
 // !! check both unpaired_tasks and all paths
@@ -531,30 +1404,91 @@ static void check_unpaired_tasks(FILE *outp) {
 #endif
 }
 
-// print all sends and receives left in the hash table
-static void check_unpaired_messages(FILE *outp) {
-	MessageMap::const_iterator msgp;
+typedef StringMap<PendingMessage>::Entry PendingEntry;
+static bool by_msgid(const PendingEntry *a, const PendingEntry *b) {
+	int c = memcmp(a->key, b->key, a->len < b->len ? a->len : b->len);
+	return c < 0 || (c == 0 && a->len < b->len);
+}
 
-	fprintf(stderr, "Unmatched send count = %zd\n", sends.size());
-	if (save_unmatched_sends)
-		for (msgp=sends.begin(); msgp!=sends.end(); msgp++)
-			pipdb_write_message(outp, msgp->second, NULL, (Path*)msgp->second->path_id.v);
-	else
-		for (msgp=sends.begin(); msgp!=sends.end(); msgp++) {
-			fprintf(stderr, "Unmatched send: ");
-			msgp->second->print(stderr);
-			errors++;
-		}
+/* the entries of a pending-message table, in message ID order */
+static std::vector<PendingEntry*> sorted_pending(const StringMap<PendingMessage> &table) {
+	std::vector<PendingEntry*> ret;
+	for (size_t i=0; i<table.capacity(); i++)
+		if (table.slot(i)->key) ret.push_back(table.slot(i));
+	std::sort(ret.begin(), ret.end(), by_msgid);
+	return ret;
+}
 
-	fprintf(stderr, "Unmatched recv count = %zd\n", receives.size());
-	for (msgp=receives.begin(); msgp!=receives.end(); msgp++) {
-		fprintf(stderr, "Unmatched recv: ");
-		msgp->second->print(stderr);
+static void unmatched_message(FILE *outp, bool is_send, const char *msgid, int idlen, const PendingMessage *pm) {
+	if (is_send && save_unmatched_sends)
+		pipdb_write_message(outp, msgid, idlen, pm, NULL, pm->path);
+	else {
+		const char *what = is_send ? "send" : "recv";
+		fprintf(stderr, "Unmatched %s: ", what);
+		print_pending(stderr, what, msgid, idlen, pm);
 		errors++;
 	}
 }
+
+static FILE *unmatched_runs[2];          // sends, receives left by merge_spilled_state
+static int64_t unmatched_spilled[2];
+
+// print all sends and receives left in the hash table, or on disk
+static void check_unpaired_messages(FILE *outp) {
+	for (int k=0; k<2; k++) {
+		std::vector<PendingEntry*> left = sorted_pending(k == 0 ? sends : receives);
+		fprintf(stderr, "Unmatched %s count = %lld\n", k == 0 ? "send" : "recv",
+			(long long)(left.size() + unmatched_spilled[k]));
+		for (unsigned int i=0; i<left.size(); i++)
+			unmatched_message(outp, k == 0, left[i]->key, left[i]->len, &left[i]->value);
+		if (unmatched_runs[k]) {
+			replay_unmatched(outp, unmatched_runs[k]);
+			unmatched_runs[k] = NULL;
+		}
+	}
+}
  
-static int cmp_int(const int *a, const int *b) { return *a - *b; }
+/* Pass 2 fills each task name's index slots in file order, so each
+ * list of offsets needs sorting.  Lists of at least SORT_SPLIT slots are
+ * each sorted by all the workers together, one after another; the rest
+ * are spread across the workers, a list at a time.  Index entries are
+ * not aligned, so each list is sorted in a copy. */
+#define SORT_SPLIT (1<<20)
+
+struct SortList {
+	char *slots;
+	int64_t count;
+};
+
+struct SortJob {
+	std::vector<SortList> lists;
+	int jobs;
+};
+
+template<class T> static void sort_slots(const SortList &sl, int jobs) {
+	std::vector<T> keys(sl.count), scratch;
+	memcpy(&keys[0], sl.slots, sl.count*sizeof(T));
+	size_t i;
+	for (i=1; i<keys.size() && keys[i-1] <= keys[i]; i++) ;
+	if (i >= keys.size()) return;   // one file, or paths that never interleave
+	scratch.resize(sl.count);
+	parallel_radix_sort(&keys[0], keys.size(), &scratch[0], jobs);
+	memcpy(sl.slots, &keys[0], sl.count*sizeof(T));
+}
+
+static void sort_slots_work(int idx, void *arg) {
+	SortJob *job = (SortJob*)arg;
+	// version 2 offsets are 64 bits, version 1's 32; neither is ever negative
+	if (pipdb_header.version >= 2)
+		sort_slots<uint64_t>(job->lists[idx], job->jobs);
+	else
+		sort_slots<unsigned int>(job->lists[idx], job->jobs);
+}
+
+static void sort_slots_done(int idx, void *arg) {
+	fputc('.', stderr);
+}
+
 static void sort_task_indices(int fd) {
 	fputs("Sorting task indices", stderr);
 	struct stat st;
@@ -562,15 +1496,1572 @@ static void sort_task_indices(int fd) {
 	char *map = (char*)mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
 	if (map == (char*)-1) { perror("mmap"); exit(1); }
 
-	for (std::map<std::string, TaskEnt>::const_iterator taskp = tasks.begin();
-			taskp != tasks.end();
-			taskp++) {
-		char *name = map + taskp->second.name_ofs;
-		int *count = (int*)(name + taskp->first.size() + 1);
-		qsort(count+1, *count, sizeof(int), (int(*)(const void*, const void*))cmp_int);
-		fputc('.', stderr);
+	SortJob large, small;
+	large.jobs = jobs;
+	small.jobs = 1;
+	int ofs_size = pipdb_header.offset_size();
+	for (unsigned int i=0; i<task_info.size(); i++) {
+		if (task_info[i].name_ofs == 0) continue;   // not in the index
+		char *count = map + task_info[i].name_ofs + task_names.length(i) + 1;
+		SortList sl = { count + ofs_size, 0 };
+		if (pipdb_header.version >= 2)
+			memcpy(&sl.count, count, sizeof(int64_t));
+		else {
+			int n;
+			memcpy(&n, count, sizeof(int));
+			sl.count = n;
+		}
+		if (sl.count < 2) continue;
+		(sl.count >= SORT_SPLIT ? large : small).lists.push_back(sl);
+	}
+	for (unsigned int i=0; i<large.lists.size(); i++) {
+		sort_slots_work(i, &large);
+		sort_slots_done(i, &large);
 	}
+	run_ordered(small.lists.size(), jobs, sort_slots_work, sort_slots_done, &small);
 
 	munmap(map, st.st_size);
 	fputc('\n', stderr);
 }
+
+static void note_memory(void) {
+	size_t now[NMEM] = {
+		path_names.bytes(), path_info.size()*sizeof(Path),
+		task_names.bytes(), task_info.size()*sizeof(TaskEnt),
+		open_tasks, sends.bytes(), receives.bytes(),
+		buffered_bytes + dirty.capacity()*sizeof(WriteBuffer*)
+	};
+	for (int i=0; i<NMEM; i++)
+		if (now[i] > peak_memory[i]) peak_memory[i] = now[i];
+}
+
+/* Ends the current --stats phase, noting the table sizes it left, and
+ * starts "name", if not NULL. */
+static void stats_phase(const char *name) {
+	if (!show_stats) return;
+	int64_t starts = 0;
+	for (size_t i=0; i<path_info.size(); i++)
+		for (size_t j=0; j<path_info[i].start_task.capacity(); j++)
+			if (path_info[i].start_task.slot(j)->key != -1)
+				starts += path_info[i].start_task.slot(j)->value.size();
+	phase_stats.table("path IDs", path_names.size(), path_names.bytes());
+	phase_stats.table("task names", task_names.size(), task_names.bytes());
+	phase_stats.table("open tasks", starts, open_tasks);
+	phase_stats.table("pending sends", sends.size(), sends.bytes());
+	phase_stats.table("pending receives", receives.size(), receives.bytes());
+	if (name)
+		phase_stats.begin(name);
+	else
+		phase_stats.end();
+}
+
+static void print_memory(void) {
+	if (stats_json) {
+		for (int i=0; i<NMEM; i++)
+			phase_stats.total((std::string("peak bytes: ") + mem_names[i]).c_str(), peak_memory[i]);
+		phase_stats.print(stderr, true);
+		return;
+	}
+	phase_stats.print(stderr, false);
+	size_t total = 0;
+	fprintf(stderr, "Peak memory use (bytes):\n");
+	for (int i=0; i<NMEM; i++) {
+		fprintf(stderr, "  %-18s %12zu\n", mem_names[i], peak_memory[i]);
+		total += peak_memory[i];
+	}
+	fprintf(stderr, "  %-18s %12zu\n", "total", total);
+	fprintf(stderr, "  %d path IDs, %d task names, %zd sends and %zd receives unmatched\n",
+		path_names.size(), task_names.size(), sends.size(), receives.size());
+}
+
+/* Where each path's PATH-INDEX offsets start, in index order, in the
+ * mapped file with header "hdr"; see pip-database-format.  The path ID
+ * is just before them, after its length, so they are not aligned:
+ * read them with index_ofs. */
+static std::vector<const char*> path_index_offsets(const char *map, const PipDBHeader &hdr) {
+	std::vector<const char*> ret(hdr.npaths);
+	const char *p = map + hdr.path_idx_offset;
+	for (int64_t i=0; i<hdr.npaths; i++) {
+		short namelen;
+		memcpy(&namelen, p, sizeof(namelen));
+		p += sizeof(short) + namelen;
+		ret[i] = p;
+		p += hdr.path_offsets() * sizeof(int64_t);
+	}
+	return ret;
+}
+
+static inline int64_t index_ofs(const char *ent, int64_t k) {
+	int64_t ret;
+	memcpy(&ret, ent + k*sizeof(int64_t), sizeof(ret));
+	return ret;
+}
+
+/* What path "path"'s record offsets are relative to: the map, or its
+ * block inflated into "scratch".  Fills in ofs[] with where its tasks,
+ * notices, and messages start and where they end; the last path of an
+ * uncompressed file ends at "records_end". */
+static const char *path_records(const char *map, const PipDBHeader &hdr, const std::vector<const char*> &path_ofs,
+		int64_t path, off_t records_end, std::vector<char> *scratch, int64_t *scratch_path, off_t *ofs) {
+	int64_t ent[5];
+	memcpy(ent, path_ofs[path], hdr.path_offsets() * sizeof(int64_t));
+	if (!hdr.compression) {
+		ofs[0] = ent[0];
+		ofs[1] = ent[1];
+		ofs[2] = ent[2];
+		ofs[3] = path+1 < (int64_t)path_ofs.size() ? index_ofs(path_ofs[path+1], 0) : records_end;
+		return map;
+	}
+	// blockofs blocklen rawlen noticeofs messageofs
+	ofs[0] = 0;
+	ofs[1] = ent[3];
+	ofs[2] = ent[4];
+	ofs[3] = ent[2];
+	if (ent[1] == ent[2]) return map + ent[0];
+	if (path != *scratch_path) {
+		scratch->resize(ent[2] + 1);
+		pipdb_decompress(hdr.compression, map + ent[0], ent[1], &(*scratch)[0], ent[2]);
+		(*scratch)[ent[2]] = '\0';
+		*scratch_path = path;
+	}
+	return &(*scratch)[0];
+}
+
+/* Appends TASK-METRICS: every task record, decoded once here, as
+ * columns that get_task_metric can scan without visiting the records.
+ * Runs after sort_task_indices, so each column is in slot order.  Writes
+ * a chunk of each column at a time to bound memory. */
+#define COLUMN_CHUNK 65536
+static void pipdb_write_task_columns(int fd) {
+	fputs("Writing task columns", stderr);
+	struct stat st;
+	fstat(fd, &st);
+	const char *map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == (const char*)-1) { perror("mmap"); exit(1); }
+
+	std::vector<const char*> path_ofs = path_index_offsets(map, pipdb_header);
+	std::vector<off_t> path_start(pipdb_header.npaths);
+	for (int64_t i=0; i<pipdb_header.npaths; i++)
+		path_start[i] = index_ofs(path_ofs[i], 0);
+	std::vector<char> scratch;
+	int64_t scratch_path = -1;
+
+	off_t out = (st.st_size + 7) & ~(off_t)7;
+	pipdb_header.metrics_offset = out;
+	std::vector<int64_t> start(COLUMN_CHUNK);
+	std::vector<int> col[PIPDB_INT_COLUMNS];
+	for (int k=0; k<PIPDB_INT_COLUMNS; k++) col[k].resize(COLUMN_CHUNK);
+
+	std::vector<int> order = task_names.sorted();
+	for (unsigned int i=0; i<order.size(); i++) {
+		const TaskEnt *te = &task_info[order[i]];
+		if (te->name_ofs == 0) continue;   // not in the index
+		const char *slots = map + te->name_ofs + task_names.length(order[i]) + 1;
+		int64_t n = index_ofs(slots, 0);
+		slots += sizeof(int64_t);
+		pwrite_all(fd, (const char*)&n, sizeof(n), out);
+
+		for (int64_t j0=0; j0<n; j0+=COLUMN_CHUNK) {
+			int len = n-j0 < COLUMN_CHUNK ? n-j0 : COLUMN_CHUNK;
+			for (int j=0; j<len; j++) {
+				int64_t slot = index_ofs(slots, j0+j);
+				const char *rec;
+				int pathid;
+				if (pipdb_header.compression) {
+					int64_t path = slot >> 32;
+					off_t ofs[4];
+					rec = path_records(map, pipdb_header, path_ofs, path, 0, &scratch, &scratch_path, ofs);
+					rec += slot & 0xffffffff;
+					pathid = path + 1;
+				}
+				else {
+					rec = map + slot;
+					pathid = std::upper_bound(path_start.begin(), path_start.end(), (off_t)slot) - path_start.begin();
+				}
+				PipDBTask t;
+				t.unpack(rec);
+				start[j] = (int64_t)(t.start_sec - pipdb_header.first_ts.tv_sec) * 1000000
+					+ (t.start_usec - pipdb_header.first_ts.tv_usec);
+				col[0][j] = (int64_t)(t.end_sec - t.start_sec) * 1000000 + (t.end_usec - t.start_usec);
+				col[1][j] = t.utime;
+				col[2][j] = t.stime;
+				col[3][j] = t.majfault;
+				col[4][j] = t.minfault;
+				col[5][j] = t.volcs;
+				col[6][j] = t.involcs;
+				col[7][j] = pathid;
+			}
+			pwrite_all(fd, (const char*)&start[0], len*sizeof(int64_t), out + 8 + 8*j0);
+			for (int k=0; k<PIPDB_INT_COLUMNS; k++)
+				pwrite_all(fd, (const char*)&col[k][0], len*sizeof(int), out + 8 + 8*n + 4*(n*k + j0));
+		}
+		out += pipdb_task_columns_size(n);
+		fputc('.', stderr);
+	}
+
+	munmap((void*)map, st.st_size);
+	if (ftruncate(fd, out) == -1) { perror("ftruncate"); exit(1); }
+	fputc('\n', stderr);
+}
+
+static inline int64_t usec_of(int sec, int usec) { return (int64_t)sec * 1000000 + usec; }
+
+/* Widens [*first, *last] to cover every event of one path, and if
+ * "starts" isn't NULL, appends each task's (start, task index number). */
+static void scan_path_times(const char *base, const off_t *ofs, int64_t *first, int64_t *last,
+		std::vector<std::pair<int64_t, int> > *starts) {
+	const char *p = base + ofs[0];
+	while (p < base + ofs[1]) {
+		PipDBTask t;
+		int len = t.unpack(p);
+		if (!len) break;   // empty space
+		p += len;
+		int64_t start = usec_of(t.start_sec, t.start_usec), end = usec_of(t.end_sec, t.end_usec);
+		*first = std::min(*first, std::min(start, end));
+		*last = std::max(*last, std::max(start, end));
+		if (starts) starts->push_back(std::make_pair(start, t.nameidx));
+	}
+	for (p = base + ofs[1]; p < base + ofs[2] && *p; ) {
+		p += strlen(p) + 1;
+		int tv[2];
+		memcpy(tv, p, sizeof(tv));
+		p += 3 * sizeof(int);
+		*first = std::min(*first, usec_of(tv[0], tv[1]));
+		*last = std::max(*last, usec_of(tv[0], tv[1]));
+	}
+	for (p = base + ofs[2]; p < base + ofs[3]; ) {
+		PipDBMessage m;
+		int len = m.unpack(p);
+		if (!len) break;
+		p += len;
+		int64_t send = usec_of(m.send_sec, m.send_usec), recv = usec_of(m.recv_sec, m.recv_usec);
+		*first = std::min(*first, std::min(send, recv));
+		*last = std::max(*last, std::max(send, recv));
+	}
+}
+
+/* Appends TIME-INDEX.  Reads every path's records twice: once for the
+ * spans, which set the bucket width, and again to count task starts.
+ * The header's first timestamp can't be the base: it counts thread
+ * headers, not just records. */
+#define TIME_INDEX_FANOUT 4
+static void pipdb_write_time_index(int fd, off_t records_end) {
+	fputs("Writing time index", stderr);
+	struct stat st;
+	fstat(fd, &st);
+	const char *map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == (const char*)-1) { perror("mmap"); exit(1); }
+
+	int64_t npaths = pipdb_header.npaths, nbuckets = time_buckets, i, b;
+	std::vector<const char*> path_ofs = path_index_offsets(map, pipdb_header);
+	std::vector<char> scratch;
+	int64_t scratch_path = -1;
+	off_t ofs[4];
+
+	std::vector<int64_t> spans(2*npaths);
+	int64_t lo = INT64_MAX, hi = INT64_MIN;
+	for (i=0; i<npaths; i++) {
+		const char *base = path_records(map, pipdb_header, path_ofs, i, records_end, &scratch, &scratch_path, ofs);
+		spans[2*i] = INT64_MAX;
+		spans[2*i+1] = INT64_MIN;
+		scan_path_times(base, ofs, &spans[2*i], &spans[2*i+1], NULL);
+		if (spans[2*i] > spans[2*i+1]) continue;   // empty
+		lo = std::min(lo, spans[2*i]);
+		hi = std::max(hi, spans[2*i+1]);
+	}
+	if (lo > hi) lo = hi = 0;
+	for (i=0; i<npaths; i++) {
+		if (spans[2*i] > spans[2*i+1]) {
+			spans[2*i] = 0;
+			spans[2*i+1] = -1;
+			continue;
+		}
+		spans[2*i] -= lo;
+		spans[2*i+1] -= lo;
+	}
+
+	// Each path goes in every bucket its span touches.  Paths that are
+	// long next to the buckets would be listed over and over, so use
+	// fewer, wider buckets until there are at most TIME_INDEX_FANOUT
+	// entries per path.
+	int64_t width, entries;
+	for (;;) {
+		width = (hi - lo) / nbuckets + 1;
+		entries = 0;
+		for (i=0; i<npaths; i++)
+			if (spans[2*i] <= spans[2*i+1])
+				entries += spans[2*i+1]/width - spans[2*i]/width + 1;
+		if (nbuckets == 1 || entries <= TIME_INDEX_FANOUT*npaths) break;
+		nbuckets = (nbuckets + 1) / 2;
+	}
+	fputc('.', stderr);
+
+	std::vector<int64_t> path_start(nbuckets+1, 0);
+	for (i=0; i<npaths; i++)
+		if (spans[2*i] <= spans[2*i+1])
+			for (b=spans[2*i]/width; b<=spans[2*i+1]/width; b++)
+				path_start[b+1]++;
+	for (b=0; b<nbuckets; b++)
+		path_start[b+1] += path_start[b];
+	std::vector<int> paths(path_start[nbuckets]);
+	std::vector<int64_t> fill(path_start.begin(), path_start.end()-1);
+	for (i=0; i<npaths; i++)
+		if (spans[2*i] <= spans[2*i+1])
+			for (b=spans[2*i]/width; b<=spans[2*i+1]/width; b++)
+				paths[fill[b]++] = i + 1;
+
+	// each task counts in the bucket it starts in
+	std::vector<std::map<int, int> > counts(nbuckets);
+	std::vector<std::pair<int64_t, int> > starts;
+	for (i=0; i<npaths; i++) {
+		const char *base = path_records(map, pipdb_header, path_ofs, i, records_end, &scratch, &scratch_path, ofs);
+		int64_t first = INT64_MAX, last = INT64_MIN;
+		starts.clear();
+		scan_path_times(base, ofs, &first, &last, &starts);
+		for (unsigned int j=0; j<starts.size(); j++)
+			counts[(starts[j].first - lo) / width][starts[j].second]++;
+	}
+	std::vector<int64_t> task_start(nbuckets+1, 0);
+	std::vector<int> tasks;
+	for (b=0; b<nbuckets; b++) {
+		for (std::map<int, int>::const_iterator cp=counts[b].begin(); cp!=counts[b].end(); cp++) {
+			tasks.push_back(cp->first);
+			tasks.push_back(cp->second);
+		}
+		task_start[b+1] = tasks.size() / 2;
+	}
+	fputc('.', stderr);
+
+	off_t out = (st.st_size + 7) & ~(off_t)7;
+	pipdb_header.time_idx_offset = out;
+	int64_t head[3] = { lo, width, nbuckets };
+	pwrite_all(fd, (const char*)head, sizeof(head), out);
+	out += sizeof(head);
+	if (npaths > 0) pwrite_all(fd, (const char*)&spans[0], spans.size()*sizeof(int64_t), out);
+	out += spans.size()*sizeof(int64_t);
+	pwrite_all(fd, (const char*)&path_start[0], path_start.size()*sizeof(int64_t), out);
+	out += path_start.size()*sizeof(int64_t);
+	pwrite_all(fd, (const char*)&task_start[0], task_start.size()*sizeof(int64_t), out);
+	out += task_start.size()*sizeof(int64_t);
+	if (!paths.empty()) pwrite_all(fd, (const char*)&paths[0], paths.size()*sizeof(int), out);
+	out += paths.size()*sizeof(int);
+	if (!tasks.empty()) pwrite_all(fd, (const char*)&tasks[0], tasks.size()*sizeof(int), out);
+	out += tasks.size()*sizeof(int);
+
+	munmap((void*)map, st.st_size);
+	if (ftruncate(fd, (out + 7) & ~(off_t)7) == -1) { perror("ftruncate"); exit(1); }
+	fputc('\n', stderr);
+}
+
+/* path_names entry "id" as ID_to_string prints it */
+static const char *printable_path_name(int id, std::vector<char> *buf) {
+	int len = path_names.length(id);
+	if ((int)buf->size() < 4*len + 1) buf->resize(std::max(4*len + 1, 1024));
+	return ID_to_string(std::string(path_names.name(id), len), &(*buf)[0]);
+}
+
+/* the distinct trigrams of "name", ascending */
+static void name_trigrams(const char *name, std::vector<int> *tris) {
+	tris->clear();
+	for (int len=strlen(name), i=0; i+3<=len; i++) {
+		int t = pipdb_trigram(name+i);
+		if (t >= 0) tris->push_back(t);
+	}
+	std::sort(tris->begin(), tris->end());
+	tris->erase(std::unique(tris->begin(), tris->end()), tris->end());
+}
+
+/* Appends PATH-NAMES: each path's printable name, and for each trigram
+ * in any of them, the paths that have it.  The postings for a range of
+ * trigrams are built in one pass over the names, to bound memory. */
+#define POSTINGS_CHUNK (16<<20)
+static void pipdb_write_path_names(int fd) {
+	fputs("Writing path names", stderr);
+	std::vector<int> order = path_names.sorted();
+	int64_t npaths = order.size(), i;
+	std::vector<char> buf;
+	std::vector<int> tris;
+
+	std::vector<int64_t> name_ofs(npaths+1, 0);
+	std::vector<int64_t> count(PIPDB_TRIGRAMS, 0);
+	for (i=0; i<npaths; i++) {
+		const char *name = printable_path_name(order[i], &buf);
+		name_ofs[i+1] = name_ofs[i] + strlen(name) + 1;
+		name_trigrams(name, &tris);
+		for (unsigned int j=0; j<tris.size(); j++)
+			count[tris[j]]++;
+	}
+	std::vector<int> trigrams, tri_index(PIPDB_TRIGRAMS, -1);
+	std::vector<int64_t> posting_start(1, 0);
+	for (int t=0; t<PIPDB_TRIGRAMS; t++) {
+		if (!count[t]) continue;
+		tri_index[t] = trigrams.size();
+		trigrams.push_back(t);
+		posting_start.push_back(posting_start.back() + count[t]);
+	}
+	std::vector<int64_t>().swap(count);
+	int64_t ntrigrams = trigrams.size();
+	fputc('.', stderr);
+
+	struct stat st;
+	fstat(fd, &st);
+	off_t out = (st.st_size + 7) & ~(off_t)7;
+	pipdb_header.names_offset = out;
+	pwrite_all(fd, (const char*)&ntrigrams, sizeof(ntrigrams), out);
+	out += sizeof(ntrigrams);
+	pwrite_all(fd, (const char*)&name_ofs[0], name_ofs.size()*sizeof(int64_t), out);
+	out += name_ofs.size()*sizeof(int64_t);
+	pwrite_all(fd, (const char*)&posting_start[0], posting_start.size()*sizeof(int64_t), out);
+	out += posting_start.size()*sizeof(int64_t);
+	if (ntrigrams) pwrite_all(fd, (const char*)&trigrams[0], ntrigrams*sizeof(int), out);
+	out += ntrigrams*sizeof(int);
+
+	for (int64_t t0=0, t1; t0<ntrigrams; t0=t1) {
+		for (t1=t0+1; t1<ntrigrams && posting_start[t1+1]-posting_start[t0] <= POSTINGS_CHUNK; t1++) ;
+		std::vector<int> postings(posting_start[t1] - posting_start[t0]);
+		std::vector<int64_t> fill(posting_start.begin()+t0, posting_start.begin()+t1);
+		for (i=0; i<npaths; i++) {
+			name_trigrams(printable_path_name(order[i], &buf), &tris);
+			for (unsigned int j=0; j<tris.size(); j++) {
+				int k = tri_index[tris[j]];
+				if (k >= t0 && k < t1)
+					postings[fill[k-t0]++ - posting_start[t0]] = i + 1;
+			}
+		}
+		pwrite_all(fd, (const char*)&postings[0], postings.size()*sizeof(int), out);
+		out += postings.size()*sizeof(int);
+		fputc('.', stderr);
+	}
+
+	std::string names;
+	for (i=0; i<npaths; i++) {
+		const char *name = printable_path_name(order[i], &buf);
+		names.append(name, strlen(name)+1);
+		if (names.size() >= WRITE_BUFFER_MAX || i == npaths-1) {
+			pwrite_all(fd, names.data(), names.size(), out);
+			out += names.size();
+			names.clear();
+		}
+	}
+
+	if (ftruncate(fd, (out + 7) & ~(off_t)7) == -1) { perror("ftruncate"); exit(1); }
+	fputc('\n', stderr);
+}
+
+/* A thread pool's part of one path, for PATH-SUMMARY. */
+struct SummaryEvent {
+	int64_t ts;
+	int seq;                    // order of insertion, which breaks ties
+	int msg;                    // the message's number in the path
+	bool recv;
+	bool operator<(const SummaryEvent &other) const {
+		return ts < other.ts || (ts == other.ts && seq < other.seq);
+	}
+};
+struct SummaryPool {
+	SummaryPool(void) : first(INT64_MAX), last(INT64_MIN) {}
+	void cover(int64_t start, int64_t end) {
+		first = std::min(first, start);
+		last = std::max(last, end);
+	}
+	int64_t first, last;
+	std::vector<int64_t> open;  // ends of the latest task at each nesting level
+	std::vector<SummaryEvent> events;   // message sends and receives
+};
+
+static inline bool normal_tv(int sec, int usec) { return usec >= 0 && usec < 1000000; }
+
+/* Fills in "sum" for the path whose records are at "base" and "ofs", as
+ * Path::done_inserting would find it.  Tasks nest the way insert_task
+ * nests them, and each pool's sends and receives fall in timestamp
+ * order, ties in the order the reader inserts them.  Returns false if
+ * the path depends on more than that: tasks that start together, whose
+ * nesting is up to std::sort, tasks that overlap or run backwards,
+ * threads that aren't in the table, or anything done_inserting would
+ * assert about. */
+static bool summarize_path(const char *base, const off_t *ofs, const std::vector<int> &thread_pool,
+		const std::vector<int> &pool_host, int first_thread, PipDBPathSummary *sum) {
+	memset(sum, 0, sizeof(*sum));
+	std::map<int, SummaryPool> pools;
+	std::map<int, SummaryPool>::iterator pp;
+	PathTotals totals;
+	const char *p;
+#define POOL_OF(thread) ((thread) > first_thread && (thread) - first_thread <= (int)thread_pool.size() \
+		? thread_pool[(thread) - first_thread - 1] : -1)
+
+	std::vector<PipDBTask> tasks;
+	std::vector<std::pair<std::pair<int, int64_t>, int> > order;   // ((pool, start), task)
+	for (p = base + ofs[0]; p < base + ofs[1]; ) {
+		PipDBTask t;
+		int len = t.unpack(p);
+		if (!len) break;   // empty space
+		p += len;
+		int pool = POOL_OF(t.s_thread);
+		if (pool == -1 || !normal_tv(t.start_sec, t.start_usec) || !normal_tv(t.end_sec, t.end_usec))
+			return false;
+		int64_t start = usec_of(t.start_sec, t.start_usec), end = usec_of(t.end_sec, t.end_usec);
+		if (end < start) return false;
+		pools[pool].cover(start, end);
+		order.push_back(std::make_pair(std::make_pair(pool, start), (int)tasks.size()));
+		tasks.push_back(t);
+	}
+	std::sort(order.begin(), order.end());
+	for (unsigned int i=0; i<order.size(); i++) {
+		if (i > 0 && order[i].first == order[i-1].first) return false;
+		const PipDBTask &t = tasks[order[i].second];
+		std::vector<int64_t> &open = pools[order[i].first.first].open;
+		int64_t start = order[i].first.second, end = usec_of(t.end_sec, t.end_usec);
+		unsigned int level;
+		for (level=0; level<open.size() && start < open[level]; level++)
+			if (end > open[level]) return false;   // overlaps the end of an enclosing task
+		open.resize(level);
+		open.push_back(end);
+		totals.add_task(level == 0, t.utime, t.stime, t.majfault, t.minfault, t.volcs, t.involcs);
+	}
+
+	for (p = base + ofs[1]; p < base + ofs[2] && *p; ) {
+		p += strlen(p) + 1;
+		int rec[3];   // sec usec thread
+		memcpy(rec, p, sizeof(rec));
+		p += sizeof(rec);
+		int pool = POOL_OF(rec[2]);
+		if (pool == -1 || !normal_tv(rec[0], rec[1])) return false;
+		pools[pool].cover(usec_of(rec[0], rec[1]), usec_of(rec[0], rec[1]));
+	}
+
+	// PathMessage leaves out the receive of a send that never got one
+	std::vector<char> has_recv;
+	int nmsgs = 0, seq = 0;
+	for (p = base + ofs[2]; p < base + ofs[3]; nmsgs++) {
+		PipDBMessage m;
+		int len = m.unpack(p);
+		if (!len) break;
+		p += len;
+		int spool = POOL_OF(m.s_thread);
+		if (spool == -1 || !normal_tv(m.send_sec, m.send_usec)) return false;
+		int64_t send = usec_of(m.send_sec, m.send_usec);
+		SummaryEvent sev = { send, seq++, nmsgs, false };
+		pools[spool].events.push_back(sev);
+		pools[spool].cover(send, send);
+		has_recv.push_back(m.recv_sec && m.r_thread);
+		if (!has_recv.back()) {
+			totals.add_message(m.size, false, 0);
+			continue;
+		}
+		int rpool = POOL_OF(m.r_thread);
+		if (rpool == -1 || !normal_tv(m.recv_sec, m.recv_usec)) return false;
+		int64_t recv = usec_of(m.recv_sec, m.recv_usec);
+		SummaryEvent rev = { recv, seq++, nmsgs, true };
+		pools[rpool].events.push_back(rev);
+		pools[rpool].cover(recv, recv);
+		totals.add_message(m.size, true, recv - send);
+	}
+#undef POOL_OF
+
+	sum->flags = SUMMARY_KNOWN;
+	sum->threads = pools.size();
+	if (pools.empty()) return true;
+	for (pp=pools.begin(); pp!=pools.end(); pp++)
+		std::sort(pp->second.events.begin(), pp->second.events.end());
+
+	// the root is the only pool whose first message is a send
+	int root = pools.begin()->first;
+	if (pools.size() > 1) {
+		int roots = 0;
+		for (pp=pools.begin(); pp!=pools.end(); pp++)
+			if (pp->second.events.empty())
+				return true;   // unconnected: malformed
+		for (pp=pools.begin(); pp!=pools.end(); pp++)
+			if (!pp->second.events[0].recv) {
+				root = pp->first;
+				roots++;
+			}
+		if (roots == 0) return false;
+		if (roots > 1) return true;   // malformed
+	}
+
+	// Each send's predecessor is the receive before it in its pool, and
+	// a receive's depth is one more than its send's.
+	std::vector<int> pred(nmsgs, -1), depth(nmsgs, 0), chain;
+	for (pp=pools.begin(); pp!=pools.end(); pp++) {
+		int last_recv = -1;
+		for (unsigned int i=0; i<pp->second.events.size(); i++) {
+			const SummaryEvent &ev = pp->second.events[i];
+			if (ev.recv) last_recv = ev.msg;
+			else pred[ev.msg] = last_recv;
+		}
+	}
+	int max_depth = 1;
+	for (int m=0; m<nmsgs; m++) {
+		if (!has_recv[m]) continue;
+		chain.clear();
+		int k;
+		for (k=m; k != -1 && depth[k] == 0; k=pred[k]) {
+			depth[k] = -1;
+			chain.push_back(k);
+		}
+		if (k != -1 && depth[k] == -1) return false;   // a cycle: done_inserting would never finish
+		int d = k != -1 ? depth[k] : 1;
+		for (int j=chain.size()-1; j>=0; j--)
+			depth[chain[j]] = ++d;
+		max_depth = std::max(max_depth, depth[m]);
+	}
+
+	std::vector<int> hosts;
+	for (pp=pools.begin(); pp!=pools.end(); pp++)
+		hosts.push_back(pool_host[pp->first]);
+	std::sort(hosts.begin(), hosts.end());
+
+	sum->flags = SUMMARY_KNOWN | SUMMARY_VALID;
+	sum->start = pools[root].first;
+	sum->end = pools[root].last;
+	sum->utime = totals.utime;
+	sum->stime = totals.stime;
+	sum->majfault = totals.majfault;
+	sum->minfault = totals.minfault;
+	sum->volcs = totals.volcs;
+	sum->involcs = totals.involcs;
+	sum->size = totals.size;
+	sum->messages = totals.messages;
+	sum->depth = max_depth;
+	sum->hosts = std::unique(hosts.begin(), hosts.end()) - hosts.begin();
+	sum->latency = totals.latency;
+	return true;
+}
+
+/* Appends PATH-SUMMARY.  Threads are numbered from first_thread + 1 and
+ * grouped into pools by host and pid, as PathFactory readers do. */
+#define SUMMARY_CHUNK 65536
+static void pipdb_write_path_summaries(int fd, off_t records_end, int first_thread) {
+	fputs("Writing path summaries", stderr);
+	struct stat st;
+	fstat(fd, &st);
+	const char *map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == (const char*)-1) { perror("mmap"); exit(1); }
+
+	std::vector<int> thread_pool, pool_host;
+	std::map<std::pair<std::string, int>, int> pool_ids;
+	std::map<std::string, int> host_ids;
+	const char *p = map + pipdb_header.threads_offset;
+	for (int64_t i=0; i<pipdb_header.nthreads; i++) {
+		std::string host(p);
+		p += strlen(p) + 1;
+		p += strlen(p) + 1;   // program
+		int pid;
+		memcpy(&pid, p, sizeof(pid));
+		p += 7 * sizeof(int);
+		std::map<std::pair<std::string, int>, int>::iterator pi = pool_ids.find(std::make_pair(host, pid));
+		if (pi == pool_ids.end()) {
+			pi = pool_ids.insert(std::make_pair(std::make_pair(host, pid), (int)pool_host.size())).first;
+			std::map<std::string, int>::iterator hi = host_ids.insert(std::make_pair(host, (int)host_ids.size())).first;
+			pool_host.push_back(hi->second);
+		}
+		thread_pool.push_back(pi->second);
+	}
+
+	std::vector<const char*> path_ofs = path_index_offsets(map, pipdb_header);
+	std::vector<char> scratch;
+	int64_t scratch_path = -1;
+	off_t ofs[4];
+	std::vector<PipDBPathSummary> sums;
+	int64_t unknown = 0;
+	off_t out = (st.st_size + 7) & ~(off_t)7;
+	pipdb_header.summary_offset = out;
+	for (int64_t i=0; i<pipdb_header.npaths; i++) {
+		const char *base = path_records(map, pipdb_header, path_ofs, i, records_end, &scratch, &scratch_path, ofs);
+		sums.resize(sums.size() + 1);
+		if (!summarize_path(base, ofs, thread_pool, pool_host, first_thread, &sums.back())) {
+			memset(&sums.back(), 0, sizeof(PipDBPathSummary));
+			unknown++;
+		}
+		if (sums.size() == SUMMARY_CHUNK || i == pipdb_header.npaths-1) {
+			pwrite_all(fd, (const char*)&sums[0], sums.size()*sizeof(PipDBPathSummary), out);
+			out += sums.size()*sizeof(PipDBPathSummary);
+			sums.clear();
+			fputc('.', stderr);
+		}
+	}
+
+	munmap((void*)map, st.st_size);
+	if (ftruncate(fd, out) == -1) { perror("ftruncate"); exit(1); }
+	if (unknown) fprintf(stderr, " %lld left for readers to build", (long long)unknown);
+	fputc('\n', stderr);
+}
+
+/* Appends SECTIONS and writes the final header, which points to it, so
+ * this comes last.  Each section runs up to the next one. */
+static void pipdb_write_sections(int fd) {
+	struct stat st;
+	fstat(fd, &st);
+	off_t end = st.st_size;
+	pipdb_header.sections_offset = (end + 7) & ~(off_t)7;
+	std::string header_str = pipdb_header.pack();
+	pwrite_all(fd, header_str.data(), header_str.size(), 0);
+	const char *map = (const char*)mmap(NULL, end, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == (const char*)-1) { perror("mmap"); exit(1); }
+
+	std::vector<std::pair<off_t, int> > starts;
+	starts.push_back(std::make_pair((off_t)0, (int)SECTION_HEADER));
+	starts.push_back(std::make_pair(pipdb_header.threads_offset, (int)SECTION_THREADS));
+	starts.push_back(std::make_pair(pipdb_header.task_idx_offset, (int)SECTION_TASK_INDEX));
+	starts.push_back(std::make_pair(pipdb_header.path_idx_offset, (int)SECTION_PATH_INDEX));
+	starts.push_back(std::make_pair(records_offset, (int)SECTION_RECORDS));
+	off_t appended[4] = { pipdb_header.metrics_offset, pipdb_header.time_idx_offset,
+		pipdb_header.names_offset, pipdb_header.summary_offset };
+	for (int i=0; i<4; i++)
+		if (appended[i]) starts.push_back(std::make_pair(appended[i], SECTION_TASK_METRICS + i));
+	std::sort(starts.begin(), starts.end());
+
+	std::vector<PipDBSection> sections(starts.size());
+	for (unsigned int i=0; i<starts.size(); i++) {
+		sections[i].id = starts[i].second;
+		sections[i].offset = starts[i].first;
+		sections[i].length = std::max((i+1 < starts.size() ? starts[i+1].first : end) - starts[i].first, (off_t)0);
+		pipdb_checksum_section(map + sections[i].offset, &sections[i]);
+	}
+	std::string table = pipdb_pack_sections(sections);
+	pwrite_all(fd, table.data(), table.size(), pipdb_header.sections_offset);
+	munmap((void*)map, end);
+}
+
+/* Segmented pipdbs (--append and --compact).  Each segment but the
+ * first starts with what the one before it left unpaired, saved in
+ * "<segment>.state" next to the newest segment:
+ *   "PIPSTAT3" nsends[64] nrecvs[64] nstarts[64] npaths[64]
+ *   each send, then each receive: msgid path roles sec usec size thread
+ *     level has_roles
+ *   each open task start: path name sec usec utime_sec utime_usec
+ *     stime_sec stime_usec majflt minflt volcs involcs thread
+ *   each path with any of those: path sec usec of its latest event
+ * where each string is an int length and that many bytes, each number
+ * an int, all in native byte order like the pipdb itself.  Appends and
+ * compactions take "<manifest>.lock" before changing the manifest, and
+ * replace it by renaming, so readers never need the lock.  A "PIPSTAT2"
+ * file has no npaths or paths, and a "PIPSTATE" file, from before
+ * messages kept their roles, has no roles, level, or has_roles either;
+ * both are still read. */
+#define STATE_MAGIC "PIPSTAT3"
+#define STATE_MAGIC_V2 "PIPSTAT2"
+#define STATE_MAGIC_V1 "PIPSTATE"
+static int lock_fd = -1;
+static PipDBManifest segments;
+static std::string segment_file;   // the new segment, relative to the manifest
+
+static void lock_manifest(const char *manifest) {
+	std::string fn(manifest);
+	fn.append(".lock");
+	lock_fd = open(fn.c_str(), O_RDWR|O_CREAT, 0666);
+	if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+		perror(fn.c_str());
+		exit(1);
+	}
+}
+
+static void unlock_manifest(void) {
+	close(lock_fd);
+	lock_fd = -1;
+}
+
+static timeval tv_of(int sec, int usec) {
+	timeval tv;
+	tv.tv_sec = sec;
+	tv.tv_usec = usec;
+	return tv;
+}
+
+static void put_str(FILE *fp, const char *s, int len) {
+	_ign = fwrite(&len, sizeof(len), 1, fp);
+	_ign = fwrite(s, 1, len, fp);
+}
+
+static bool get_str(FILE *fp, std::string *s) {
+	int len;
+	if (fread(&len, sizeof(len), 1, fp) != 1 || len < 0 || len > 1<<20) return false;
+	s->resize(len);
+	return len == 0 || fread(&(*s)[0], len, 1, fp) == 1;
+}
+
+static std::string state_file(const char *manifest, const std::string &segment) {
+	return pipdb_segment_path(manifest, segment) + ".state";
+}
+
+/* Carries the previous segment's unpaired sends, receives, and task
+ * starts into this one.  Receives get room in their path's messages,
+ * as pass 1 would have given them; starts go where pass 1 and pass 2
+ * look for them. */
+static void load_state(const char *fn) {
+	FILE *fp = fopen(fn, "r");
+	if (!fp) {
+		if (errno == ENOENT) return;   // nothing was left unpaired
+		perror(fn);
+		exit(1);
+	}
+	char magic[8];
+	int64_t count[4] = { 0, 0, 0, 0 };
+	bool ok = fread(magic, sizeof(magic), 1, fp) == 1
+		&& (!memcmp(magic, STATE_MAGIC, sizeof(magic)) || !memcmp(magic, STATE_MAGIC_V2, sizeof(magic))
+			|| !memcmp(magic, STATE_MAGIC_V1, sizeof(magic)));
+	bool v3 = ok && !memcmp(magic, STATE_MAGIC, sizeof(magic));
+	bool v1 = ok && !memcmp(magic, STATE_MAGIC_V1, sizeof(magic));
+	ok = ok && fread(count, sizeof(int64_t), v3 ? 4 : 3, fp) == (v3 ? 4u : 3u);
+	std::string msgid, path_id, roles, name;
+	for (int k=0; k<2 && ok; k++)
+		for (int64_t i=0; i<count[k] && ok; i++) {
+			int v[6] = { 0, 0, 0, 0, 0, 0 };   // sec usec size thread level has_roles
+			if (!get_str(fp, &msgid) || !get_str(fp, &path_id) || (!v1 && !get_str(fp, &roles))
+					|| fread(v, sizeof(int), v1 ? 4 : 6, fp) != (v1 ? 4u : 6u)) {
+				ok = false;
+				break;
+			}
+			PendingMessage pm = { tv_of(v[0], v[1]), v[2], v[3], v[5] ? role_names.intern(roles.data(), roles.size()) : -1,
+				(char)v[4], get_path(path_id.data(), path_id.size()), ++event_seq };
+			(k == 0 ? sends : receives).insert(msgid.data(), msgid.size())->value = pm;
+			if (k == 1) pm.path->messages += pipdb_message_length(msgid.size(), pm.size, pm.thread_id);
+			if (pm.tv > pm.path->last_tv) pm.path->last_tv = pm.tv;
+		}
+	for (int64_t i=0; i<count[2] && ok; i++) {
+		int v[11];
+		if (!get_str(fp, &path_id) || !get_str(fp, &name) || fread(v, sizeof(v), 1, fp) != 1) {
+			ok = false;
+			break;
+		}
+		TaskMark mark;
+		mark.tv = tv_of(v[0], v[1]);
+		mark.utime = tv_of(v[2], v[3]);
+		mark.stime = tv_of(v[4], v[5]);
+		mark.major_fault = v[6];
+		mark.minor_fault = v[7];
+		mark.vol_cs = v[8];
+		mark.invol_cs = v[9];
+		mark.thread_id = v[10];
+		mark.seq = ++event_seq;
+		Path *path = get_path(path_id.data(), path_id.size());
+		int n = get_task(name.data(), name.size());
+		push_start(path, n, mark);
+		if (!one_pass) carried_starts[PathTask(path->id, n)].push_back(mark);
+		if (mark.tv > path->last_tv) path->last_tv = mark.tv;
+	}
+	for (int64_t i=0; i<count[3] && ok; i++) {
+		int v[2];
+		if (!get_str(fp, &path_id) || fread(v, sizeof(v), 1, fp) != 1) {
+			ok = false;
+			break;
+		}
+		Path *path = get_path(path_id.data(), path_id.size());
+		if (tv_of(v[0], v[1]) > path->last_tv) path->last_tv = tv_of(v[0], v[1]);
+	}
+	fclose(fp);
+	if (!ok) {
+		fprintf(stderr, "%s: damaged state file\n", fn);
+		exit(1);
+	}
+	fprintf(stderr, "Carried in: %lld sends, %lld receives, %lld task starts\n",
+		(long long)count[0], (long long)count[1], (long long)count[2]);
+}
+
+/* --close-idle: whether "path" has had no events for that long before
+ * the end of this segment, so that what it left unpaired is given up on
+ * instead of carried. */
+static bool idle_path(const Path *path) {
+	if (!close_idle) return false;
+	timeval cutoff = pipdb_header.last_ts;
+	cutoff.tv_sec -= close_idle;
+	return path->last_tv < cutoff;
+}
+
+static bool save_state(const char *fn) {
+	FILE *fp = fopen(fn, "w");
+	if (!fp) { perror(fn); return false; }
+	std::vector<PendingEntry*> pending[2];
+	std::vector<bool> carried(path_info.size(), false);
+	int64_t closed[3] = { 0, 0, 0 };
+	unsigned int i;
+	size_t j;
+	for (int k=0; k<2; k++) {
+		const char *what = k == 0 ? "send" : "recv";
+		std::vector<PendingEntry*> left = sorted_pending(k == 0 ? sends : receives);
+		for (i=0; i<left.size(); i++) {
+			const PendingMessage *pm = &left[i]->value;
+			if (idle_path(pm->path)) {
+				fprintf(stderr, "Unmatched %s on an idle path: ", what);
+				print_pending(stderr, what, left[i]->key, left[i]->len, pm);
+				closed[k]++;
+				continue;
+			}
+			pending[k].push_back(left[i]);
+			carried[pm->path->id] = true;
+		}
+	}
+	int64_t count[4] = { (int64_t)pending[0].size(), (int64_t)pending[1].size(), 0, 0 };
+	for (i=0; i<path_info.size(); i++)
+		for (j=0; j<path_info[i].start_task.capacity(); j++)
+			if (path_info[i].start_task.slot(j)->key != -1) {
+				int64_t n = path_info[i].start_task.slot(j)->value.size();
+				if (idle_path(&path_info[i]))
+					closed[2] += n;
+				else {
+					count[2] += n;
+					if (n) carried[i] = true;
+				}
+			}
+	for (i=0; i<path_info.size(); i++)
+		if (carried[i]) count[3]++;
+	_ign = fwrite(STATE_MAGIC, 8, 1, fp);
+	_ign = fwrite(count, sizeof(count), 1, fp);
+
+	for (int k=0; k<2; k++)
+		for (i=0; i<pending[k].size(); i++) {
+			const PendingMessage &pm = pending[k][i]->value;
+			int v[6] = { (int)pm.tv.tv_sec, (int)pm.tv.tv_usec, pm.size, pm.thread_id, pm.level, pm.roles != -1 };
+			put_str(fp, pending[k][i]->key, pending[k][i]->len);
+			put_str(fp, path_names.name(pm.path->id), path_names.length(pm.path->id));
+			if (pm.roles == -1)
+				put_str(fp, "", 0);
+			else
+				put_str(fp, role_names.name(pm.roles), role_names.length(pm.roles));
+			_ign = fwrite(v, sizeof(v), 1, fp);
+		}
+	for (i=0; i<path_info.size(); i++) {
+		if (idle_path(&path_info[i])) continue;
+		for (j=0; j<path_info[i].start_task.capacity(); j++) {
+			const IntMap<StartList>::Entry *e = path_info[i].start_task.slot(j);
+			if (e->key == -1) continue;
+			for (unsigned int k=0; k<e->value.size(); k++) {
+				const TaskMark &m = e->value[k];
+				int v[11] = { (int)m.tv.tv_sec, (int)m.tv.tv_usec, (int)m.utime.tv_sec, (int)m.utime.tv_usec,
+					(int)m.stime.tv_sec, (int)m.stime.tv_usec, m.major_fault, m.minor_fault,
+					m.vol_cs, m.invol_cs, m.thread_id };
+				put_str(fp, path_names.name(i), path_names.length(i));
+				put_str(fp, task_names.name(e->key), task_names.length(e->key));
+				_ign = fwrite(v, sizeof(v), 1, fp);
+			}
+		}
+	}
+	for (i=0; i<path_info.size(); i++) {
+		if (!carried[i]) continue;
+		int v[2] = { (int)path_info[i].last_tv.tv_sec, (int)path_info[i].last_tv.tv_usec };
+		put_str(fp, path_names.name(i), path_names.length(i));
+		_ign = fwrite(v, sizeof(v), 1, fp);
+	}
+	bool ok = !ferror(fp) && fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0) ok = false;
+	if (!ok) perror(fn);
+	fprintf(stderr, "Carried out: %lld sends, %lld receives, %lld task starts\n",
+		(long long)count[0], (long long)count[1], (long long)count[2]);
+	if (closed[0] || closed[1] || closed[2])
+		fprintf(stderr, "Closed out on idle paths: %lld sends, %lld receives, %lld task starts\n",
+			(long long)closed[0], (long long)closed[1], (long long)closed[2]);
+	return ok;
+}
+
+/* Reads the manifest, creating an empty one for the first --append, and
+ * picks the new segment's name.  --append keeps the lock until
+ * finish_append and starts from the newest segment's state.  --compact
+ * merges every segment there is now; it reserves the new segment's
+ * number and lets go of the lock while it works.  Returns the path of
+ * the new segment. */
+static std::string begin_segment(const char *manifest, std::vector<PipDBSegment> *merged) {
+	lock_manifest(manifest);
+	if (!pipdb_read_manifest(manifest, &segments)) {
+		struct stat st;
+		if (compact || stat(manifest, &st) == 0) {
+			fprintf(stderr, "%s: not a segment manifest\n", manifest);
+			exit(1);
+		}
+		segments.next_segment = segments.next_thread = 0;
+	}
+	const char *base = strrchr(manifest, '/');
+	char num[16];
+	sprintf(num, ".%d", segments.next_segment++);
+	segment_file = std::string(base ? base+1 : manifest) + num;
+
+	if (append) {
+		thread_base = segments.next_thread;
+		if (!segments.segments.empty())
+			load_state(state_file(manifest, segments.segments.back().file).c_str());
+	}
+	else {
+		if (segments.segments.size() < 2) {
+			printf("%s: nothing to compact\n", manifest);
+			exit(0);
+		}
+		*merged = segments.segments;
+		if (!pipdb_write_manifest(manifest, segments)) {
+			perror(manifest);
+			exit(1);
+		}
+		unlock_manifest();
+	}
+	return pipdb_segment_path(manifest, segment_file);
+}
+
+/* --append exits with this status, instead of 1, on any failure before
+ * finish_append lists the new segment, even from exit(1) deep inside,
+ * so that a caller such as loglistener can tell a segment that was not
+ * added, and should be tried again, from one that was added with
+ * errors in it. */
+static void exit_not_appended(void) {
+	if (appended) return;
+	fflush(NULL);
+	_exit(EXIT_NOT_APPENDED);
+}
+
+/* Saves what is still unpaired next to the new segment and adds it to
+ * the manifest, which makes it visible; then drops the old state. */
+static bool finish_append(const char *manifest) {
+	std::string state = state_file(manifest, segment_file);
+	if (!save_state(state.c_str())) return false;
+	std::string old_state;
+	if (!segments.segments.empty())
+		old_state = state_file(manifest, segments.segments.back().file);
+	PipDBSegment seg = { segment_file, thread_base };
+	segments.segments.push_back(seg);
+	segments.next_thread = thread_base + nfiles;
+	if (!pipdb_write_manifest(manifest, segments)) {
+		perror(manifest);
+		unlink(state.c_str());
+		return false;
+	}
+	if (!old_state.empty()) unlink(old_state.c_str());
+	unlock_manifest();
+	return true;
+}
+
+/* Swaps the merged segment in for the ones it holds, unless the
+ * manifest no longer starts with them, and removes them.  Appends made
+ * in the meantime stay after it. */
+static bool finish_compact(const char *manifest, const std::vector<PipDBSegment> &merged) {
+	lock_manifest(manifest);
+	PipDBManifest now;
+	unsigned int i;
+	bool ok = pipdb_read_manifest(manifest, &now) && now.segments.size() >= merged.size();
+	for (i=0; ok && i<merged.size(); i++)
+		ok = now.segments[i].file == merged[i].file && now.segments[i].thread_base == merged[i].thread_base;
+	if (!ok) {
+		fprintf(stderr, "%s: changed while compacting; leaving it as it was\n", manifest);
+		unlink(pipdb_segment_path(manifest, segment_file).c_str());
+		return false;
+	}
+
+	// the newest segment's state belongs to whatever segment is newest now
+	std::string old_state = state_file(manifest, merged.back().file);
+	bool newest = now.segments.size() == merged.size();
+	if (newest && link(old_state.c_str(), state_file(manifest, segment_file).c_str()) == -1 && errno != ENOENT) {
+		perror(old_state.c_str());
+		unlink(pipdb_segment_path(manifest, segment_file).c_str());
+		return false;
+	}
+	PipDBSegment seg = { segment_file, merged[0].thread_base };
+	now.segments.erase(now.segments.begin(), now.segments.begin() + merged.size());
+	now.segments.insert(now.segments.begin(), seg);
+	if (!pipdb_write_manifest(manifest, now)) {
+		perror(manifest);
+		return false;
+	}
+	unlock_manifest();
+
+	for (i=0; i<merged.size(); i++)
+		unlink(pipdb_segment_path(manifest, merged[i].file).c_str());
+	if (newest) unlink(old_state.c_str());
+	printf("%s: merged %zd segments into %s\n", manifest, merged.size(), segment_file.c_str());
+	return true;
+}
+
+/* --compact: hands every record of the merged segments to the spill
+ * buckets, as reconcile_file would have, so the rest of a one-pass run
+ * builds the new segment.  Thread tables are copied in order, with
+ * empty entries for numbers a segment's files left unused (files
+ * without headers), so the records' thread numbers stay right. */
+static void read_segments(FILE *outp, const char *manifest, const std::vector<PipDBSegment> &merged) {
+	int next_thread = merged[0].thread_base;
+	static const char empty_thread[2 + 7*sizeof(int)] = { 0 };
+	std::vector<char> scratch;
+
+	fprintf(stderr, "Reading segments");
+	for (unsigned int s=0; s<merged.size(); s++) {
+		std::string fn = pipdb_segment_path(manifest, merged[s].file);
+		int fd = open(fn.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1) { perror(fn.c_str()); exit(1); }
+		const char *map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == (const char*)-1) { perror("mmap"); exit(1); }
+		close(fd);
+		PipDBHeader hdr;
+		if (!PipDBHeader::unpack(map, st.st_size, &hdr) || hdr.version < 2) {
+			fprintf(stderr, "%s: not a version 2 or later pipdb\n", fn.c_str());
+			exit(1);
+		}
+
+		for (; next_thread < merged[s].thread_base; next_thread++) {
+			_ign = fwrite(empty_thread, sizeof(empty_thread), 1, outp);
+			pipdb_header.nthreads++;
+		}
+		const char *tp = map + hdr.threads_offset;
+		for (int64_t t=0; t<hdr.nthreads; t++) {
+			tp += strlen(tp) + 1;   // host
+			tp += strlen(tp) + 1 + 7*sizeof(int);   // program and numbers
+		}
+		_ign = fwrite(map + hdr.threads_offset, tp - (map + hdr.threads_offset), 1, outp);
+		pipdb_header.nthreads += hdr.nthreads;
+		next_thread += hdr.nthreads;
+		if (hdr.first_ts < pipdb_header.first_ts) pipdb_header.first_ts = hdr.first_ts;
+		if (hdr.last_ts > pipdb_header.last_ts) pipdb_header.last_ts = hdr.last_ts;
+
+		// this segment's task index numbers, as ours
+		std::vector<int> name_num(hdr.ntasks);
+		const char *p = map + hdr.task_idx_offset;
+		for (int64_t i=0; i<hdr.ntasks; i++) {
+			int len = strlen(p);
+			name_num[i] = get_task(p, len);
+			p += len + 1;
+			int64_t count;
+			memcpy(&count, p, sizeof(count));
+			p += (count + 1) * sizeof(int64_t);
+		}
+
+		// an uncompressed segment's last path ends where its sections start
+		off_t records_end = st.st_size;
+		off_t sections[5] = { hdr.metrics_offset, hdr.time_idx_offset, hdr.names_offset,
+			hdr.summary_offset, hdr.sections_offset };
+		for (int k=0; k<5; k++)
+			if (sections[k] && sections[k] < records_end) records_end = sections[k];
+
+		std::vector<const char*> path_ofs = path_index_offsets(map, hdr);
+		int64_t scratch_path = -1;
+		const char *idp = map + hdr.path_idx_offset;
+		for (int64_t i=0; i<hdr.npaths; i++) {
+			short namelen;
+			memcpy(&namelen, idp, sizeof(namelen));
+			Path *path = get_path(idp + sizeof(short), namelen);
+			idp = path_ofs[i] + hdr.path_offsets() * sizeof(int64_t);
+			off_t ofs[4];
+			const char *base = path_records(map, hdr, path_ofs, i, records_end, &scratch, &scratch_path, ofs);
+			for (p = base + ofs[0]; p < base + ofs[1]; ) {
+				PipDBTask t;
+				int len = t.unpack(p);
+				if (!len) break;   // empty space
+				p += len;
+				int n = t.nameidx >= 0 && t.nameidx < hdr.ntasks ? name_num[t.nameidx] : -1;
+				if (n == -1) {
+					fprintf(stderr, "%s: task with bad name index %d\n", fn.c_str(), t.nameidx);
+					exit(1);
+				}
+				spill_task(t, n, path);
+			}
+			for (p = base + ofs[1]; p < base + ofs[2] && *p; ) {
+				int len = strlen(p) + 1 + 3*sizeof(int);
+				path->notices += len;
+				spill_record(path, PART_NOTICES, p, len);
+				p += len;
+			}
+			for (p = base + ofs[2]; p < base + ofs[3]; ) {
+				PipDBMessage m;
+				int len = m.unpack(p);
+				if (!len) break;
+				path->messages += len;
+				spill_record(path, PART_MESSAGES, p, len);
+				p += len;
+			}
+		}
+		munmap((void*)map, st.st_size);
+		fputc('.', stderr);
+	}
+	fputc('\n', stderr);
+}
+
+/* --max-memory.  When unmatched sends, receives, and open task starts
+ * outgrow the limit, check_memory moves the oldest half of them, by the
+ * event each came from, to a sorted run in a temporary file.  A send or
+ * receive whose message ID might be on disk (a Bloom filter says which)
+ * is not paired then, and neither is a task end whose start is: they
+ * wait in memory, and go to the next run, for merge_spilled_state.
+ * After the last file, that spills everything left and replays each
+ * message ID's sends and receives, and each path and name's starts and
+ * ends, in event order, as reconcile and handle_end_task would have.
+ * The records it makes carry the number of the event that would have
+ * made them, so copy_spilled_records puts them where a run without the
+ * limit would have, and the pipdb is the same. */
+struct SpilledMessage {
+	std::string msgid;
+	PendingMessage pm;
+	bool is_send;
+};
+struct SpilledTask {       // an open start, or an end waiting for the merge
+	int path, name;
+	bool is_start;
+	TaskMark mark;
+};
+#define MAX_RUNS 64        // merge the runs of a kind into one at this many
+static std::vector<FILE*> message_runs, task_runs;
+static std::vector<SpilledMessage> deferred_messages;
+static std::vector<SpilledTask> deferred_ends;
+static size_t deferred_bytes;
+static std::vector<unsigned int> spilled_ids;   // Bloom filter of spilled message IDs
+static size_t next_spill;  // check_memory spills past this many bytes
+static int nspills;
+
+static void put_spilled(FILE *fp, const SpilledMessage &sm) {
+	int v[8] = { (int)sm.pm.tv.tv_sec, (int)sm.pm.tv.tv_usec, sm.pm.size, sm.pm.thread_id,
+		sm.pm.roles, sm.pm.level, sm.pm.path->id, sm.is_send };
+	_ign = fwrite(&sm.pm.seq, sizeof(sm.pm.seq), 1, fp);
+	_ign = fwrite(v, sizeof(v), 1, fp);
+	put_str(fp, sm.msgid.data(), sm.msgid.size());
+}
+
+static bool get_spilled(FILE *fp, SpilledMessage *sm) {
+	int v[8];
+	if (fread(&sm->pm.seq, sizeof(sm->pm.seq), 1, fp) != 1 || fread(v, sizeof(v), 1, fp) != 1
+			|| !get_str(fp, &sm->msgid))
+		return false;
+	sm->pm.tv = tv_of(v[0], v[1]);
+	sm->pm.size = v[2];
+	sm->pm.thread_id = v[3];
+	sm->pm.roles = v[4];
+	sm->pm.level = v[5];
+	sm->pm.path = &path_info[v[6]];
+	sm->is_send = v[7];
+	return true;
+}
+
+static void put_spilled(FILE *fp, const SpilledTask &st) {
+	_ign = fwrite(&st, sizeof(st), 1, fp);
+}
+
+static bool get_spilled(FILE *fp, SpilledTask *st) {
+	return fread(st, sizeof(*st), 1, fp) == 1;
+}
+
+/* Runs are sorted by message ID, or by path and name; then by event. */
+static bool spilled_before(const SpilledMessage &a, const SpilledMessage &b) {
+	int c = a.msgid.compare(b.msgid);
+	return c < 0 || (c == 0 && a.pm.seq < b.pm.seq);
+}
+
+static bool spilled_before(const SpilledTask &a, const SpilledTask &b) {
+	if (a.path != b.path) return a.path < b.path;
+	if (a.name != b.name) return a.name < b.name;
+	return a.mark.seq < b.mark.seq;
+}
+
+struct SpilledBefore {
+	template<class T> bool operator()(const T &a, const T &b) const { return spilled_before(a, b); }
+};
+
+/* Reads a kind's runs back as one sorted stream. */
+template<class T> class RunMerger {
+public:
+	RunMerger(const std::vector<FILE*> &_runs) : runs(_runs), heads(_runs.size()) {
+		for (unsigned int i=0; i<runs.size(); i++) {
+			rewind(runs[i]);
+			if (get_spilled(runs[i], &heads[i])) heap.push_back(i);
+		}
+		std::make_heap(heap.begin(), heap.end(), Later(heads));
+	}
+
+	bool next(T *out) {
+		if (heap.empty()) return false;
+		std::pop_heap(heap.begin(), heap.end(), Later(heads));
+		int i = heap.back();
+		*out = heads[i];
+		if (get_spilled(runs[i], &heads[i]))
+			std::push_heap(heap.begin(), heap.end(), Later(heads));
+		else
+			heap.pop_back();
+		return true;
+	}
+
+private:
+	struct Later {   // std::*_heap keep the greatest on top
+		Later(const std::vector<T> &_heads) : heads(_heads) {}
+		bool operator()(int a, int b) const { return spilled_before(heads[b], heads[a]); }
+		const std::vector<T> &heads;
+	};
+	const std::vector<FILE*> &runs;
+	std::vector<T> heads;
+	std::vector<int> heap;
+};
+
+static FILE *spill_file(void) {
+	FILE *fp = tmpfile();
+	if (!fp) {
+		perror("tmpfile");
+		exit(1);
+	}
+	return fp;
+}
+
+static void end_run(FILE *fp) {
+	if (fflush(fp) != 0 || ferror(fp)) {
+		perror("spill");
+		exit(1);
+	}
+}
+
+static void close_runs(std::vector<FILE*> *runs) {
+	for (unsigned int i=0; i<runs->size(); i++)
+		fclose((*runs)[i]);
+	runs->clear();
+}
+
+template<class T> static void write_run(std::vector<T> *items, std::vector<FILE*> *runs) {
+	std::sort(items->begin(), items->end(), SpilledBefore());
+	FILE *fp = spill_file();
+	for (unsigned int i=0; i<items->size(); i++)
+		put_spilled(fp, (*items)[i]);
+	end_run(fp);
+	std::vector<T>().swap(*items);
+	runs->push_back(fp);
+	if (runs->size() < MAX_RUNS) return;
+
+	// too many to keep open: merge them into one
+	RunMerger<T> merger(*runs);
+	fp = spill_file();
+	T item;
+	while (merger.next(&item))
+		put_spilled(fp, item);
+	end_run(fp);
+	close_runs(runs);
+	runs->push_back(fp);
+}
+
+static inline unsigned int bloom_hash(unsigned int h, int i) {
+	return h + i * ((h >> 17 | h << 15) | 1);
+}
+
+static void bloom_add(const char *msgid, int idlen) {
+	unsigned int h = hash_bytes(msgid, idlen), bits = spilled_ids.size() * 32;
+	for (int i=0; i<3; i++) {
+		unsigned int b = bloom_hash(h, i) & (bits-1);
+		spilled_ids[b/32] |= 1u << (b%32);
+	}
+}
+
+static bool bloom_has(const char *msgid, int idlen) {
+	unsigned int h = hash_bytes(msgid, idlen), bits = spilled_ids.size() * 32;
+	for (int i=0; i<3; i++) {
+		unsigned int b = bloom_hash(h, i) & (bits-1);
+		if (!(spilled_ids[b/32] & (1u << (b%32)))) return false;
+	}
+	return true;
+}
+
+/* A send or receive whose ID might have been spilled waits for the
+ * merge, which knows what came before it. */
+static bool defer_message(Message *msg, const PendingMessage &pm, bool is_send) {
+	if (spilled_ids.empty() || !bloom_has(msg->msgid.data(), msg->msgid.size())) return false;
+	SpilledMessage sm;
+	sm.msgid = msg->msgid;
+	sm.pm = pm;
+	sm.is_send = is_send;
+	deferred_messages.push_back(sm);
+	deferred_bytes += sizeof(sm) + sm.msgid.size();
+	delete msg;
+	return true;
+}
+
+/* A task end whose start was spilled waits for the merge.  Only the
+ * starts under every one still in memory are spilled, so this is only
+ * when none is. */
+static bool defer_end(Task *end, int name, Path *path) {
+	IntMap<int>::Entry *e = path->spilled_starts.find(name);
+	if (e == NULL)
+		return false;
+	SpilledTask st = { path->id, name, false, TaskMark(end, end->thread_id) };
+	st.mark.seq = event_seq;
+	deferred_ends.push_back(st);
+	deferred_bytes += sizeof(st);
+	open_tasks -= path->spilled_starts.bytes();
+	if (--e->value == 0) path->spilled_starts.erase(e);
+	open_tasks += path->spilled_starts.bytes();
+	delete end;
+	return true;
+}
+
+static size_t pending_bytes(void) {
+	return open_tasks + sends.bytes() + receives.bytes() + deferred_bytes;
+}
+
+/* Moves every entry of "table" from event "limit" or before to "out". */
+static void spill_messages(StringMap<PendingMessage> *table, bool is_send, int64_t limit,
+		std::vector<SpilledMessage> *out) {
+	size_t first = out->size(), i;
+	for (i=0; i<table->capacity(); i++) {
+		const PendingEntry *e = table->slot(i);
+		if (!e->key || e->value.seq > limit) continue;
+		SpilledMessage sm;
+		sm.msgid.assign(e->key, e->len);
+		sm.pm = e->value;
+		sm.is_send = is_send;
+		out->push_back(sm);
+		bloom_add(e->key, e->len);
+	}
+	// erasing moves entries, so only after the walk
+	for (i=first; i<out->size(); i++)
+		table->erase(table->find((*out)[i].msgid.data(), (*out)[i].msgid.size()));
+	table->shrink();
+}
+
+/* Moves the bottom of each of path's start stacks, the starts from event
+ * "limit" or before, to "out". */
+static void spill_starts(Path *path, int64_t limit, std::vector<SpilledTask> *out) {
+	open_tasks -= path->start_task.bytes() + path->spilled_starts.bytes();
+	std::vector<int> emptied;
+	for (size_t i=0; i<path->start_task.capacity(); i++) {
+		IntMap<StartList>::Entry *e = path->start_task.slot(i);
+		if (e->key == -1) continue;
+		StartList &starts = e->value;
+		unsigned int n;
+		for (n=0; n<starts.size() && starts[n].seq <= limit; n++) {
+			SpilledTask st = { path->id, e->key, true, starts[n] };
+			out->push_back(st);
+		}
+		if (n == 0) continue;
+		open_tasks -= n * sizeof(TaskMark);
+		path->spilled_starts.insert(e->key)->value += n;
+		if (n == starts.size())
+			emptied.push_back(e->key);
+		else
+			StartList(starts.begin() + n, starts.end()).swap(starts);
+	}
+	for (unsigned int i=0; i<emptied.size(); i++)
+		path->start_task.erase(path->start_task.find(emptied[i]));
+	open_tasks += path->start_task.bytes() + path->spilled_starts.bytes();
+}
+
+/* Spills everything from event "limit" or before, and everything that
+ * was waiting for the merge. */
+static void spill_pending(int64_t limit) {
+	if (spilled_ids.empty()) {
+		size_t words = 1024;   // about 1 bit per 16 bytes of limit
+		while (words*32*16 < max_memory) words *= 2;
+		spilled_ids.resize(words);
+	}
+	std::vector<SpilledMessage> messages;
+	messages.swap(deferred_messages);
+	spill_messages(&sends, true, limit, &messages);
+	spill_messages(&receives, false, limit, &messages);
+	write_run(&messages, &message_runs);
+
+	std::vector<SpilledTask> tasks;
+	tasks.swap(deferred_ends);
+	for (unsigned int i=0; i<path_info.size(); i++)
+		if (path_info[i].start_task.size() > 0)
+			spill_starts(&path_info[i], limit, &tasks);
+	write_run(&tasks, &task_runs);
+	deferred_bytes = 0;
+	nspills++;
+}
+
+/* Spills the oldest half of the unmatched state if it is over the
+ * limit.  At least half the limit comes in between spills, so state
+ * that spilling can't shrink doesn't get spilled at every event. */
+static void check_memory(void) {
+	if (pending_bytes() <= std::max(max_memory, next_spill)) return;
+	note_memory();
+	std::vector<int64_t> seqs;
+	size_t i, j;
+	for (int k=0; k<2; k++) {
+		const StringMap<PendingMessage> &table = k == 0 ? sends : receives;
+		for (i=0; i<table.capacity(); i++)
+			if (table.slot(i)->key) seqs.push_back(table.slot(i)->value.seq);
+	}
+	for (i=0; i<path_info.size(); i++)
+		for (j=0; j<path_info[i].start_task.capacity(); j++) {
+			const IntMap<StartList>::Entry *e = path_info[i].start_task.slot(j);
+			if (e->key == -1) continue;
+			for (unsigned int n=0; n<e->value.size(); n++)
+				seqs.push_back(e->value[n].seq);
+		}
+	int64_t limit = -1;
+	if (!seqs.empty()) {
+		std::nth_element(seqs.begin(), seqs.begin() + seqs.size()/2, seqs.end());
+		limit = seqs[seqs.size()/2];
+	}
+	std::vector<int64_t>().swap(seqs);
+	spill_pending(limit);
+	next_spill = pending_bytes() + max_memory/2;
+}
+
+static void unpaired_after_merge(const SpilledMessage &sm) {
+	if (append) {   // to be carried out
+		(sm.is_send ? sends : receives).insert(sm.msgid.data(), sm.msgid.size())->value = sm.pm;
+		return;
+	}
+	int k = sm.is_send ? 0 : 1;
+	if (!unmatched_runs[k]) unmatched_runs[k] = spill_file();
+	put_spilled(unmatched_runs[k], sm);
+	unmatched_spilled[k]++;
+}
+
+static void replay_unmatched(FILE *outp, FILE *run) {
+	end_run(run);
+	rewind(run);
+	SpilledMessage sm;
+	while (get_spilled(run, &sm))
+		unmatched_message(outp, sm.is_send, sm.msgid.data(), sm.msgid.size(), &sm.pm);
+	fclose(run);
+}
+
+static void merge_spilled_state(FILE *outp) {
+	if (nspills == 0) return;
+	spill_pending(std::numeric_limits<int64_t>::max());
+	fprintf(stderr, "Merging %d spills of unmatched state\n", nspills);
+	int64_t last_seq = event_seq;
+	late_records = true;
+
+	// each message ID: what reconcile would have done with its sends and receives
+	RunMerger<SpilledMessage> messages(message_runs);
+	SpilledMessage sm, half[2];   // the pending send and receive
+	bool more = messages.next(&sm);
+	while (more) {
+		std::string msgid = sm.msgid;
+		bool have[2] = { false, false };
+		for (; more && sm.msgid == msgid; more = messages.next(&sm)) {
+			int k = sm.is_send ? 0 : 1;
+			if (have[1-k]) {
+				event_seq = sm.pm.seq;
+				pair_messages(outp, msgid.data(), msgid.size(), sm.is_send ? &sm.pm : &half[0].pm,
+					sm.is_send ? &half[1].pm : &sm.pm, sm.pm.path);
+				have[1-k] = false;
+				continue;
+			}
+			if (have[k]) reused_message(sm.is_send, msgid.data(), msgid.size(), &half[k].pm, &sm.pm);
+			half[k] = sm;
+			have[k] = true;
+		}
+		for (int k=0; k<2; k++)
+			if (have[k]) unpaired_after_merge(half[k]);
+	}
+	close_runs(&message_runs);
+
+	// each path and task name: what handle_end_task would have done
+	RunMerger<SpilledTask> tasks(task_runs);
+	SpilledTask st;
+	StartList starts;
+	more = tasks.next(&st);
+	while (more) {
+		int path = st.path, name = st.name;
+		starts.clear();
+		for (; more && st.path == path && st.name == name; more = tasks.next(&st)) {
+			if (st.is_start) {
+				starts.push_back(st.mark);
+				continue;
+			}
+			assert(!starts.empty());   // defer_end saw a spilled start
+			event_seq = st.mark.seq;
+			spill_task(make_task(starts.back(), st.mark, 0), name, &path_info[path]);
+			starts.pop_back();
+		}
+		if (append)   // to be carried out
+			for (unsigned int i=0; i<starts.size(); i++)
+				push_start(&path_info[path], name, starts[i]);
+	}
+	close_runs(&task_runs);
+
+	for (unsigned int i=0; i<path_info.size(); i++) {
+		open_tasks -= path_info[i].spilled_starts.bytes();
+		path_info[i].spilled_starts.clear();
+	}
+	std::vector<unsigned int>().swap(spilled_ids);
+	event_seq = last_seq;
+}
@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include "phasestats.h"
+
+double PhaseStats::now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double cpu_seconds(long *maxrss) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	if (maxrss) *maxrss = ru.ru_maxrss;
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Bytes the process has passed to read and write calls so far, pipes
+ * and cached files included, from Linux's /proc/self/io; 0 elsewhere.
+ * Reads through mmap don't count. */
+static void io_bytes(int64_t *rd, int64_t *wr) {
+	*rd = *wr = 0;
+	FILE *fp = fopen("/proc/self/io", "r");
+	if (!fp) return;
+	char line[128];
+	long long n;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "rchar: %lld", &n) == 1) *rd = n;
+		else if (sscanf(line, "wchar: %lld", &n) == 1) *wr = n;
+	}
+	fclose(fp);
+}
+
+void PhaseStats::begin(const char *name) {
+	end();
+	cur = PhaseStat();
+	cur.name = name;
+	cur.events = 0;
+	cur.wall = now();
+	cpu_start = cpu_seconds(NULL);
+	io_bytes(&read_start, &written_start);
+	running = true;
+}
+
+void PhaseStats::end(void) {
+	if (!running) return;
+	running = false;
+	cur.wall = now() - cur.wall;
+	cur.cpu = cpu_seconds(&cur.peak_rss) - cpu_start;
+	io_bytes(&cur.bytes_read, &cur.bytes_written);
+	cur.bytes_read -= read_start;
+	cur.bytes_written -= written_start;
+	phases.push_back(cur);
+}
+
+void PhaseStats::table(const char *name, int64_t entries, int64_t bytes) {
+	if (!running) return;
+	cur.tables.push_back(name);
+	cur.entries.push_back(entries);
+	cur.bytes.push_back(bytes);
+}
+
+void PhaseStats::file(const char *fn, int64_t bytes, int64_t events, double seconds) {
+	FileStat fs;
+	fs.name = fn;
+	fs.phase = running ? cur.name : "";
+	fs.bytes = bytes;
+	fs.events = events;
+	fs.seconds = seconds;
+	files.push_back(fs);
+	if (running) cur.events += events;
+}
+
+void PhaseStats::stage(const char *name, int threads, double wall, double busy,
+		double starved, double blocked) {
+	StageStat ss;
+	ss.name = name;
+	ss.threads = threads;
+	ss.wall = wall;
+	ss.busy = busy;
+	ss.starved = starved;
+	ss.blocked = blocked;
+	stages.push_back(ss);
+}
+
+void PhaseStats::total(const char *name, int64_t value) {
+	total_names.push_back(name);
+	totals.push_back(value);
+}
+
+static double rate(double n, double seconds) {
+	return seconds > 0 ? n / seconds : 0;
+}
+
+/* a stage's seconds as a share of its threads' time */
+static double percent(double seconds, const StageStat &ss) {
+	return rate(100 * seconds, ss.threads * ss.wall);
+}
+
+static void print_json_str(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (const unsigned char *p=(const unsigned char*)s; *p; p++) {
+		if (*p == '"' || *p == '\\') fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20 || *p >= 0x7f) fprintf(fp, "\\u%04x", *p);
+		else fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+void PhaseStats::print(FILE *fp, bool json) const {
+	if (json)
+		print_json(fp);
+	else
+		print_text(fp);
+}
+
+void PhaseStats::print_text(FILE *fp) const {
+	fprintf(fp, "Phases:\n");
+	fprintf(fp, "  %-18s %9s %9s %12s %11s %11s %10s\n",
+		"", "wall (s)", "cpu (s)", "events/s", "read (MB)", "wrote (MB)", "RSS (MB)");
+	for (unsigned int i=0; i<phases.size(); i++) {
+		const PhaseStat &ph = phases[i];
+		fprintf(fp, "  %-18s %9.3f %9.3f %12.0f %11.1f %11.1f %10.1f\n", ph.name.c_str(),
+			ph.wall, ph.cpu, rate(ph.events, ph.wall), ph.bytes_read / 1048576.0,
+			ph.bytes_written / 1048576.0, ph.peak_rss / 1024.0);
+		for (unsigned int j=0; j<ph.tables.size(); j++) {
+			fprintf(fp, "    %-16s %12lld entries", ph.tables[j].c_str(), (long long)ph.entries[j]);
+			if (ph.bytes[j] >= 0) fprintf(fp, " %14lld bytes", (long long)ph.bytes[j]);
+			fputc('\n', fp);
+		}
+	}
+	if (!files.empty()) {
+		fprintf(fp, "Files:\n");
+		fprintf(fp, "  %-18s %12s %12s %9s %9s %12s\n",
+			"", "bytes", "events", "secs", "MB/s", "events/s");
+		for (unsigned int i=0; i<files.size(); i++) {
+			const FileStat &fs = files[i];
+			fprintf(fp, "  %-18s %12lld %12lld %9.3f %9.1f %12.0f  %s\n",
+				fs.phase.c_str(), (long long)fs.bytes, (long long)fs.events, fs.seconds,
+				rate(fs.bytes, fs.seconds) / 1048576.0, rate(fs.events, fs.seconds), fs.name.c_str());
+		}
+	}
+	if (!stages.empty()) {
+		fprintf(fp, "Stages:\n");
+		fprintf(fp, "  %-18s %7s %9s %7s %9s %9s\n",
+			"", "threads", "wall (s)", "busy %", "starved %", "blocked %");
+		for (unsigned int i=0; i<stages.size(); i++) {
+			const StageStat &ss = stages[i];
+			fprintf(fp, "  %-18s %7d %9.3f %7.1f %9.1f %9.1f\n", ss.name.c_str(), ss.threads,
+				ss.wall, percent(ss.busy, ss), percent(ss.starved, ss), percent(ss.blocked, ss));
+		}
+	}
+	for (unsigned int i=0; i<totals.size(); i++)
+		fprintf(fp, "  %-18s %12lld\n", total_names[i].c_str(), (long long)totals[i]);
+}
+
+void PhaseStats::print_json(FILE *fp) const {
+	fprintf(fp, "{\"phases\":[");
+	for (unsigned int i=0; i<phases.size(); i++) {
+		const PhaseStat &ph = phases[i];
+		fprintf(fp, "%s{\"name\":", i ? "," : "");
+		print_json_str(fp, ph.name.c_str());
+		fprintf(fp, ",\"wall\":%.6f,\"cpu\":%.6f,\"events\":%lld,\"events_per_sec\":%.0f,"
+			"\"bytes_read\":%lld,\"bytes_written\":%lld,\"peak_rss_kb\":%ld,\"tables\":{",
+			ph.wall, ph.cpu, (long long)ph.events, rate(ph.events, ph.wall),
+			(long long)ph.bytes_read, (long long)ph.bytes_written, ph.peak_rss);
+		for (unsigned int j=0; j<ph.tables.size(); j++) {
+			fprintf(fp, "%s", j ? "," : "");
+			print_json_str(fp, ph.tables[j].c_str());
+			fprintf(fp, ":{\"entries\":%lld", (long long)ph.entries[j]);
+			if (ph.bytes[j] >= 0) fprintf(fp, ",\"bytes\":%lld", (long long)ph.bytes[j]);
+			fputc('}', fp);
+		}
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "],\"files\":[");
+	for (unsigned int i=0; i<files.size(); i++) {
+		const FileStat &fs = files[i];
+		fprintf(fp, "%s{\"name\":", i ? "," : "");
+		print_json_str(fp, fs.name.c_str());
+		fprintf(fp, ",\"phase\":");
+		print_json_str(fp, fs.phase.c_str());
+		fprintf(fp, ",\"bytes\":%lld,\"events\":%lld,\"seconds\":%.6f}",
+			(long long)fs.bytes, (long long)fs.events, fs.seconds);
+	}
+	fprintf(fp, "],\"stages\":[");
+	for (unsigned int i=0; i<stages.size(); i++) {
+		const StageStat &ss = stages[i];
+		fprintf(fp, "%s{\"name\":", i ? "," : "");
+		print_json_str(fp, ss.name.c_str());
+		fprintf(fp, ",\"threads\":%d,\"wall\":%.6f,\"busy\":%.6f,\"starved\":%.6f,\"blocked\":%.6f}",
+			ss.threads, ss.wall, ss.busy, ss.starved, ss.blocked);
+	}
+	fprintf(fp, "],\"totals\":{");
+	for (unsigned int i=0; i<totals.size(); i++) {
+		fprintf(fp, "%s", i ? "," : "");
+		print_json_str(fp, total_names[i].c_str());
+		fprintf(fp, ":%lld", (long long)totals[i]);
+	}
+	fprintf(fp, "}}\n");
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef PHASESTATS_H
+#define PHASESTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/* Where a run's time goes, for --stats: wall and CPU time, bytes read
+ * and written, peak RSS, and events handled in each phase, with the
+ * sizes of the main tables as each phase ends, and throughput for each
+ * input file.  CPU time and I/O are the whole process's, threads
+ * included.  Not thread-safe: workers should hand their per-file
+ * numbers back to the main thread. */
+
+struct PhaseStat {
+	std::string name;
+	double wall, cpu;           // seconds
+	int64_t events, bytes_read, bytes_written;
+	long peak_rss;              // KB, for the run so far
+	std::vector<std::string> tables;
+	std::vector<int64_t> entries, bytes;
+};
+
+/* a pipeline stage: its threads' seconds, summed, spent working, waiting
+ * for input, and waiting for the next stage to take their output */
+struct StageStat {
+	std::string name;
+	int threads;
+	double wall, busy, starved, blocked;
+};
+
+struct FileStat {
+	std::string name, phase;
+	int64_t bytes, events;
+	double seconds;
+};
+
+class PhaseStats {
+public:
+	PhaseStats(void) : running(false) {}
+
+	/* Ends the current phase, if any, and starts "name". */
+	void begin(const char *name);
+	void end(void);
+	/* the size of a table as the current phase ends; bytes is -1 if
+	 * unknown */
+	void table(const char *name, int64_t entries, int64_t bytes);
+	/* One input file's part in the current phase; its events count
+	 * toward the phase. */
+	void file(const char *fn, int64_t bytes, int64_t events, double seconds);
+	/* How the threads of one pipeline stage spent "wall" seconds. */
+	void stage(const char *name, int threads, double wall, double busy,
+		double starved, double blocked);
+	/* a figure for the whole run, such as a peak */
+	void total(const char *name, int64_t value);
+
+	/* text for people, or one line of JSON */
+	void print(FILE *fp, bool json) const;
+
+	/* wall clock, in seconds */
+	static double now(void);
+
+private:
+	void print_text(FILE *fp) const;
+	void print_json(FILE *fp) const;
+
+	bool running;
+	PhaseStat cur;
+	double cpu_start;
+	int64_t read_start, written_start;
+	std::vector<PhaseStat> phases;
+	std::vector<FileStat> files;
+	std::vector<StageStat> stages;
+	std::vector<std::string> total_names;
+	std::vector<int64_t> totals;
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "pipdb.h"
+
+/* Checks every block of every section of a pipdb against the checksums
+ * in its SECTIONS table, reading the whole file, where readers check
+ * only the blocks they touch.  Given a segment manifest, checks each
+ * segment it names. */
+
+static bool quiet = false;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage:\n  %s [-q] pipdb [pipdb [pipdb [...]]]\n\n", prog);
+	fprintf(stderr, "  -q   print only damaged files\n");
+	exit(1);
+}
+
+static const char *section_name(int id) {
+	return id >= 0 && id < PIPDB_SECTION_TYPES ? pipdb_section_names[id] : "unknown section";
+}
+
+static bool verify_sections(const char *fn, const char *data, off_t size) {
+	if (size < 4 || memcmp(data, "PIP", 3) != 0) {
+		printf("%s: not a pipdb\n", fn);
+		return false;
+	}
+	if (data[3] < 3) {
+		printf("%s: version %d has no checksums\n", fn, data[3]);
+		return false;
+	}
+	if (data[3] > PIPDB_VERSION) {
+		printf("%s: unknown version %d\n", fn, data[3]);
+		return false;
+	}
+	// the header is checked below, as a section
+	PipDBHeader hdr;
+	if (!PipDBHeader::unpack(data, size, &hdr)) {
+		printf("%s: truncated or damaged header\n", fn);
+		return false;
+	}
+	if (hdr.sections_offset == 0) {
+		printf("%s: no section table\n", fn);
+		return false;
+	}
+	std::vector<PipDBSection> sections;
+	if (hdr.sections_offset > size
+			|| !pipdb_unpack_sections(data + hdr.sections_offset, data + size, &sections)) {
+		printf("%s: truncated or damaged section table\n", fn);
+		return false;
+	}
+
+	int bad = 0;
+	int64_t checked = 0;
+	for (unsigned int i=0; i<sections.size(); i++) {
+		const PipDBSection &sec = sections[i];
+		if (sec.offset + sec.length > hdr.sections_offset) {
+			printf("%s: truncated %s\n", fn, section_name(sec.id));
+			bad++;
+			continue;
+		}
+		for (unsigned int j=0; j<sec.crcs.size(); j++) {
+			int64_t start = sec.offset + (int64_t)j*PIPDB_CRC_BLOCK;
+			int64_t n = std::min((int64_t)PIPDB_CRC_BLOCK, sec.offset + sec.length - start);
+			if (pipdb_crc32c(0, data + start, n) != sec.crcs[j]) {
+				printf("%s: checksum mismatch in %s, bytes %lld-%lld\n", fn, section_name(sec.id),
+					(long long)start, (long long)(start + n - 1));
+				bad++;
+			}
+			checked += n;
+		}
+	}
+	if (bad == 0 && !quiet)
+		printf("%s: OK, %zd sections, %lld bytes\n", fn, sections.size(), (long long)checked);
+	return bad == 0;
+}
+
+static bool verify_file(const char *fn) {
+	int fd = open(fn, O_RDONLY);
+	if (fd == -1) { perror(fn); return false; }
+	struct stat st;
+	if (fstat(fd, &st) == -1) { perror(fn); close(fd); return false; }
+	if (st.st_size == 0) {
+		printf("%s: empty\n", fn);
+		close(fd);
+		return false;
+	}
+	const char *data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) { perror(fn); close(fd); return false; }
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	bool ok = verify_sections(fn, data, st.st_size);
+
+	munmap((void*)data, st.st_size);
+	close(fd);
+	return ok;
+}
+
+/* returns the number of damaged files */
+static int verify(const char *fn) {
+	PipDBManifest m;
+	if (!pipdb_read_manifest(fn, &m))
+		return !verify_file(fn);
+	int failed = 0;
+	for (unsigned int i=0; i<m.segments.size(); i++)
+		if (!verify_file(pipdb_segment_path(fn, m.segments[i].file).c_str())) failed++;
+	if (failed == 0 && !quiet)
+		printf("%s: OK, %zd segments\n", fn, m.segments.size());
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	int i, c;
+	while ((c = getopt(argc, argv, "q")) != -1) {
+		switch (c) {
+			case 'q':  quiet = true; break;
+			default:   usage(argv[0]);
+		}
+	}
+	if (argc-optind < 1)
+		usage(argv[0]);
+
+	int failed = 0;
+	for (i=optind; i<argc; i++)
+		failed += verify(argv[i]);
+	return failed > 0;
+}
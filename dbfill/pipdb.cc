@@ -1,4 +1,12 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <vector>
 #include "pipdb.h"
 
 static void str_append_int(std::string *dest, int src) {
@@ -8,10 +16,19 @@ static void str_append_int(std::string *dest, int src) {
 	dest->append(1, (src >> 24) & 0xff);
 }
 
+static void str_append_int64(std::string *dest, int64_t src) {
+	str_append_int(dest, (int)(src & 0xffffffff));
+	str_append_int(dest, (int)(src >> 32));
+}
+
 static int str_unpack_int(const char *str) {
 	return (str[0] & 0xff) | ((str[1]<<8) & 0xff00) | ((str[2]<<16) & 0xff0000) | ((str[3]<<24) & 0xff000000);
 }
 
+static int64_t str_unpack_int64(const char *str) {
+	return (int64_t)(unsigned int)str_unpack_int(str) | ((int64_t)str_unpack_int(str+4) << 32);
+}
+
 std::string PipDBHeader::pack(void) const {
 	std::string ret;
 	ret.append(magic, 3);
@@ -20,30 +37,584 @@ std::string PipDBHeader::pack(void) const {
 	str_append_int(&ret, first_ts.tv_usec);
 	str_append_int(&ret, last_ts.tv_sec);
 	str_append_int(&ret, last_ts.tv_usec);
-	str_append_int(&ret, threads_offset);
-	str_append_int(&ret, nthreads);
-	str_append_int(&ret, task_idx_offset);
-	str_append_int(&ret, ntasks);
-	str_append_int(&ret, path_idx_offset);
-	str_append_int(&ret, npaths);
+	if (version >= 3) str_append_int(&ret, 0);   // the length, filled in below
+	if (version >= 2) {
+		str_append_int64(&ret, threads_offset);
+		str_append_int64(&ret, nthreads);
+		str_append_int64(&ret, task_idx_offset);
+		str_append_int64(&ret, ntasks);
+		str_append_int64(&ret, path_idx_offset);
+		str_append_int64(&ret, npaths);
+	}
+	else {
+		str_append_int(&ret, threads_offset);
+		str_append_int(&ret, nthreads);
+		str_append_int(&ret, task_idx_offset);
+		str_append_int(&ret, ntasks);
+		str_append_int(&ret, path_idx_offset);
+		str_append_int(&ret, npaths);
+	}
+	if (version >= 3) {
+		str_append_int(&ret, compression);
+		str_append_int(&ret, 0);   // keeps later offsets aligned
+		str_append_int64(&ret, metrics_offset);
+		str_append_int64(&ret, time_idx_offset);
+		str_append_int64(&ret, names_offset);
+		str_append_int64(&ret, summary_offset);
+		str_append_int64(&ret, sections_offset);
+		std::string len;
+		str_append_int(&len, ret.size());
+		ret.replace(20, 4, len);
+	}
 	return ret;
 }
 
-PipDBHeader PipDBHeader::unpack(const char *str) {
-	PipDBHeader ret;
-	strncpy(ret.magic, &str[0], 3);
-	ret.version = str[3];
-	ret.first_ts.tv_sec = str_unpack_int(&str[4]);
-	ret.first_ts.tv_usec = str_unpack_int(&str[8]);
-	ret.last_ts.tv_sec = str_unpack_int(&str[12]);
-	ret.last_ts.tv_usec = str_unpack_int(&str[16]);
-	ret.threads_offset = str_unpack_int(&str[20]);
-	ret.nthreads = str_unpack_int(&str[24]);
-	ret.task_idx_offset = str_unpack_int(&str[28]);
-	ret.ntasks = str_unpack_int(&str[32]);
-	ret.path_idx_offset = str_unpack_int(&str[36]);
-	ret.npaths = str_unpack_int(&str[40]);
-
-	PipDBHeader a = ret;
-	return a;
+/* Versions 1 and 2 have a fixed-size header.  Version 3's holds its
+ * length, and any field after compression is read only if the header is
+ * long enough to hold it. */
+bool PipDBHeader::unpack(const char *str, int64_t size, PipDBHeader *hdr) {
+	memset(hdr, 0, sizeof(*hdr));
+	if (size < 4) return false;
+	memcpy(hdr->magic, str, 3);
+	hdr->version = str[3];
+	if (strncmp(hdr->magic, "PIP", 3) != 0 || hdr->version < 1 || hdr->version > PIPDB_VERSION)
+		return false;
+	if (size < 20) return false;
+	hdr->first_ts.tv_sec = str_unpack_int(&str[4]);
+	hdr->first_ts.tv_usec = str_unpack_int(&str[8]);
+	hdr->last_ts.tv_sec = str_unpack_int(&str[12]);
+	hdr->last_ts.tv_usec = str_unpack_int(&str[16]);
+	if (hdr->version == 1) {
+		if (size < 44) return false;
+		hdr->threads_offset = str_unpack_int(&str[20]);
+		hdr->nthreads = str_unpack_int(&str[24]);
+		hdr->task_idx_offset = str_unpack_int(&str[28]);
+		hdr->ntasks = str_unpack_int(&str[32]);
+		hdr->path_idx_offset = str_unpack_int(&str[36]);
+		hdr->npaths = str_unpack_int(&str[40]);
+		return true;
+	}
+
+	const char *p = &str[20];
+	int64_t len = 68;
+	if (hdr->version >= 3) {
+		if (size < 24) return false;
+		len = str_unpack_int(p);
+		p += 4;
+		if (len < 80) return false;
+	}
+	if (len > size) return false;
+	int64_t *counts[] = { &hdr->threads_offset, &hdr->nthreads, &hdr->task_idx_offset,
+		&hdr->ntasks, &hdr->path_idx_offset, &hdr->npaths };
+	for (int i=0; i<6; i++, p+=8)
+		*counts[i] = str_unpack_int64(p);
+	if (hdr->version < 3) return true;
+	hdr->compression = str_unpack_int(p);
+	p += 8;   // and the padding after it
+	const char *end = str + len;
+	int64_t *offsets[] = { &hdr->metrics_offset, &hdr->time_idx_offset, &hdr->names_offset,
+		&hdr->summary_offset, &hdr->sections_offset };
+	for (unsigned int i=0; i<sizeof(offsets)/sizeof(offsets[0]) && p + 8 <= end; i++, p+=8)
+		*offsets[i] = str_unpack_int64(p);
+	return true;
+}
+
+static inline void put16(std::string *dest, int v) { short s = v; dest->append((char*)&s, sizeof(s)); }
+static inline void put32(std::string *dest, int v) { dest->append((char*)&v, sizeof(v)); }
+static inline int get16(const char **p) { short s; memcpy(&s, *p, sizeof(s)); *p += sizeof(s); return s; }
+static inline int getu16(const char **p) { unsigned short s; memcpy(&s, *p, sizeof(s)); *p += sizeof(s); return s; }
+static inline int get32(const char **p) { int v; memcpy(&v, *p, sizeof(v)); *p += sizeof(v); return v; }
+static inline bool fits16(int v) { return v == (short)v; }
+
+/* Microseconds from a to b, and whether a plus that gives b back exactly
+ * (it may not if it overflows or a timestamp is not normalized). */
+static bool usec_diff(int a_sec, int a_usec, int b_sec, int b_usec, int *diff) {
+	int64_t d = (int64_t)(b_sec - a_sec) * 1000000 + (b_usec - a_usec);
+	*diff = (int)d;
+	if (*diff != d || a_usec < 0 || a_usec >= 1000000 || b_usec < 0 || b_usec >= 1000000)
+		return false;
+	return true;
+}
+
+static void usec_add(int sec, int usec, int diff, int *r_sec, int *r_usec) {
+	int64_t t = (int64_t)sec * 1000000 + usec + diff;
+	*r_sec = t / 1000000;
+	*r_usec = t % 1000000;
+	if (*r_usec < 0) { *r_usec += 1000000; (*r_sec)--; }
+}
+
+unsigned short PipDBTask::flags(bool compact, bool wide_name) const {
+	if (!compact) return 0xffff;
+	unsigned short f = TASK_PRESENT;
+	int diff;
+	if (wide_name) f |= TASK_WIDE_NAME;
+	if (!usec_diff(start_sec, start_usec, end_sec, end_usec, &diff)) f |= TASK_END_TV | TASK_REALTIME;
+	else if (realtime != diff) f |= TASK_REALTIME;
+	if (utime) f |= TASK_UTIME;
+	if (stime) f |= TASK_STIME;
+	if (minfault) f |= TASK_MINFAULT;
+	if (majfault) f |= TASK_MAJFAULT;
+	if (volcs) f |= TASK_VOLCS;
+	if (involcs) f |= TASK_INVOLCS;
+	if (!fits16(s_thread) || !fits16(e_thread)) f |= TASK_WIDE_THREAD;
+	if (e_thread != s_thread) f |= TASK_END_THREAD;
+	return f;
+}
+
+int PipDBTask::length(unsigned short f) {
+	int thread = (f & TASK_WIDE_THREAD) ? 4 : 2;
+	int len = 2 + ((f & TASK_WIDE_NAME) ? 4 : 2) + 8 + ((f & TASK_END_TV) ? 8 : 4) + thread;
+	static const int optional[] = { TASK_REALTIME, TASK_UTIME, TASK_STIME,
+		TASK_MINFAULT, TASK_MAJFAULT, TASK_VOLCS, TASK_INVOLCS };
+	for (unsigned int i=0; i<sizeof(optional)/sizeof(optional[0]); i++)
+		if (f & optional[i]) len += 4;
+	if (f & TASK_END_THREAD) len += thread;
+	return len;
+}
+
+void PipDBTask::pack(std::string *dest, unsigned short f) const {
+	int diff;
+	dest->append((char*)&f, sizeof(f));
+	if (f & TASK_WIDE_NAME) put32(dest, nameidx); else put16(dest, nameidx);
+	put32(dest, start_sec);
+	put32(dest, start_usec);
+	if (f & TASK_END_TV) {
+		put32(dest, end_sec);
+		put32(dest, end_usec);
+	}
+	else {
+		usec_diff(start_sec, start_usec, end_sec, end_usec, &diff);
+		put32(dest, diff);
+	}
+	if (f & TASK_REALTIME) put32(dest, realtime);
+	if (f & TASK_UTIME) put32(dest, utime);
+	if (f & TASK_STIME) put32(dest, stime);
+	if (f & TASK_MAJFAULT) put32(dest, majfault);
+	if (f & TASK_MINFAULT) put32(dest, minfault);
+	if (f & TASK_VOLCS) put32(dest, volcs);
+	if (f & TASK_INVOLCS) put32(dest, involcs);
+	if (f & TASK_WIDE_THREAD) put32(dest, s_thread); else put16(dest, s_thread);
+	if (f & TASK_END_THREAD) {
+		if (f & TASK_WIDE_THREAD) put32(dest, e_thread); else put16(dest, e_thread);
+	}
+}
+
+int PipDBTask::unpack(const char *p) {
+	const char *start = p;
+	unsigned short f = getu16(&p);
+	if (!f) return 0;   // empty space
+	nameidx = (f & TASK_WIDE_NAME) ? get32(&p) : getu16(&p);
+	start_sec = get32(&p);
+	start_usec = get32(&p);
+	if (f & TASK_END_TV) {
+		end_sec = get32(&p);
+		end_usec = get32(&p);
+		realtime = (int64_t)(end_sec - start_sec) * 1000000 + (end_usec - start_usec);
+	}
+	else {
+		realtime = get32(&p);
+		usec_add(start_sec, start_usec, realtime, &end_sec, &end_usec);
+	}
+	if (f & TASK_REALTIME) realtime = get32(&p);
+	utime = (f & TASK_UTIME) ? get32(&p) : 0;
+	stime = (f & TASK_STIME) ? get32(&p) : 0;
+	majfault = (f & TASK_MAJFAULT) ? get32(&p) : 0;
+	minfault = (f & TASK_MINFAULT) ? get32(&p) : 0;
+	volcs = (f & TASK_VOLCS) ? get32(&p) : 0;
+	involcs = (f & TASK_INVOLCS) ? get32(&p) : 0;
+	s_thread = (f & TASK_WIDE_THREAD) ? get32(&p) : get16(&p);
+	if (f & TASK_END_THREAD)
+		e_thread = (f & TASK_WIDE_THREAD) ? get32(&p) : get16(&p);
+	else
+		e_thread = s_thread;
+	return p - start;
+}
+
+unsigned char PipDBMessage::flags(bool compact) const {
+	if (!compact) return 0xff;
+	unsigned char f = MSG_PRESENT;
+	int diff;
+	if (!usec_diff(send_sec, send_usec, recv_sec, recv_usec, &diff)) f |= MSG_RECV_TV;
+	if (size < 0 || size > 0xffff) f |= MSG_WIDE_SIZE;
+	if (!fits16(s_thread)) f |= MSG_WIDE_SEND_THREAD;
+	if (!fits16(r_thread)) f |= MSG_WIDE_RECV_THREAD;
+	return f;
+}
+
+int PipDBMessage::length(unsigned char f, int idlen) {
+	return 1 + 2 + idlen + 8 + ((f & MSG_RECV_TV) ? 8 : 4)
+		+ ((f & MSG_WIDE_SIZE) ? 4 : 2)
+		+ ((f & MSG_WIDE_SEND_THREAD) ? 4 : 2)
+		+ ((f & MSG_WIDE_RECV_THREAD) ? 4 : 2);
+}
+
+void PipDBMessage::pack(std::string *dest, unsigned char f) const {
+	int diff;
+	dest->append(1, (char)f);
+	put16(dest, idlen);
+	dest->append(id, idlen);
+	put32(dest, send_sec);
+	put32(dest, send_usec);
+	if (f & MSG_RECV_TV) {
+		put32(dest, recv_sec);
+		put32(dest, recv_usec);
+	}
+	else {
+		usec_diff(send_sec, send_usec, recv_sec, recv_usec, &diff);
+		put32(dest, diff);
+	}
+	if (f & MSG_WIDE_SIZE) put32(dest, size); else put16(dest, size);
+	if (f & MSG_WIDE_SEND_THREAD) put32(dest, s_thread); else put16(dest, s_thread);
+	if (f & MSG_WIDE_RECV_THREAD) put32(dest, r_thread); else put16(dest, r_thread);
+}
+
+int PipDBMessage::unpack(const char *p) {
+	const char *start = p;
+	unsigned char f = *p++;
+	if (!f) return 0;   // empty space
+	idlen = getu16(&p);
+	id = p;
+	p += idlen;
+	send_sec = get32(&p);
+	send_usec = get32(&p);
+	if (f & MSG_RECV_TV) {
+		recv_sec = get32(&p);
+		recv_usec = get32(&p);
+	}
+	else
+		usec_add(send_sec, send_usec, get32(&p), &recv_sec, &recv_usec);
+	size = (f & MSG_WIDE_SIZE) ? get32(&p) : getu16(&p);
+	s_thread = (f & MSG_WIDE_SEND_THREAD) ? get32(&p) : get16(&p);
+	r_thread = (f & MSG_WIDE_RECV_THREAD) ? get32(&p) : get16(&p);
+	return p - start;
+}
+
+static inline int64_t align8(int64_t n) { return (n + 7) & ~(int64_t)7; }
+
+int64_t pipdb_task_columns_size(int64_t count) {
+	return align8(8 + 8*count + 4*PIPDB_INT_COLUMNS*count);
+}
+
+const char *pipdb_task_columns(const char *p, PipDBTaskColumns *cols) {
+	cols->count = *(const int64_t*)p;
+	cols->start = (const int64_t*)(p + 8);
+	const int *col = (const int*)(cols->start + cols->count);
+	const int **dest[PIPDB_INT_COLUMNS] = { &cols->realtime, &cols->utime, &cols->stime,
+		&cols->majfault, &cols->minfault, &cols->volcs, &cols->involcs, &cols->pathid };
+	for (int i=0; i<PIPDB_INT_COLUMNS; i++, col += cols->count)
+		*dest[i] = col;
+	return p + pipdb_task_columns_size(cols->count);
+}
+
+const char *pipdb_time_index(const char *p, int64_t npaths, PipDBTimeIndex *ti) {
+	const int64_t *q = (const int64_t*)p;
+	ti->base = q[0];
+	ti->width = q[1];
+	ti->nbuckets = q[2];
+	ti->spans = q + 3;
+	ti->path_start = ti->spans + 2*npaths;
+	ti->task_start = ti->path_start + ti->nbuckets + 1;
+	ti->paths = (const int*)(ti->task_start + ti->nbuckets + 1);
+	ti->tasks = ti->paths + ti->path_start[ti->nbuckets];
+	return p + align8((const char*)(ti->tasks + 2*ti->task_start[ti->nbuckets]) - p);
+}
+
+const char *pipdb_path_names(const char *p, int64_t npaths, PipDBPathNames *pn) {
+	const int64_t *q = (const int64_t*)p;
+	pn->ntrigrams = q[0];
+	pn->name_ofs = q + 1;
+	pn->posting_start = pn->name_ofs + npaths + 1;
+	pn->trigrams = (const int*)(pn->posting_start + pn->ntrigrams + 1);
+	pn->postings = pn->trigrams + pn->ntrigrams;
+	pn->names = (const char*)(pn->postings + pn->posting_start[pn->ntrigrams]);
+	return pn->names + align8(pn->name_ofs[npaths]);
+}
+
+int pipdb_trigram(const char *p) {
+	int ret = 0;
+	for (int i=0; i<3; i++) {
+		unsigned char c = p[i];
+		if (c < ' ' || c > '~') return -1;
+		ret = ret*95 + (c - ' ');
+	}
+	return ret;
+}
+
+const char *pipdb_section_names[PIPDB_SECTION_TYPES] = {
+	"HEADER", "THREADS", "TASK-INDEX", "PATH-INDEX", "RECORDS",
+	"TASK-METRICS", "TIME-INDEX", "PATH-NAMES", "PATH-SUMMARY"
+};
+
+/* Slicing-by-8: crc_table[k][b] is the CRC of byte b followed by k
+ * zero bytes, so the loop takes eight bytes a step. */
+static unsigned int crc_table[8][256];
+static struct CrcTableInit {
+	CrcTableInit(void) {
+		for (int b=0; b<256; b++) {
+			unsigned int c = b;
+			for (int k=0; k<8; k++)
+				c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+			crc_table[0][b] = c;
+		}
+		for (int b=0; b<256; b++)
+			for (int k=1; k<8; k++)
+				crc_table[k][b] = (crc_table[k-1][b] >> 8) ^ crc_table[0][crc_table[k-1][b] & 0xff];
+	}
+} crc_table_init;
+
+unsigned int pipdb_crc32c(unsigned int crc, const char *data, size_t len) {
+	const unsigned char *p = (const unsigned char*)data;
+	crc = ~crc;
+	for (; len && ((size_t)p & 7); len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	for (; len >= 8; len -= 8, p += 8) {
+		unsigned int lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p+4, 4);
+		lo ^= crc;   // for a little-endian host
+		crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+			^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+			^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	}
+	for (; len; len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+void pipdb_checksum_section(const char *data, PipDBSection *sec) {
+	sec->crcs.clear();
+	for (int64_t ofs=0; ofs<sec->length; ofs+=PIPDB_CRC_BLOCK)
+		sec->crcs.push_back(pipdb_crc32c(0, data + ofs, std::min((int64_t)PIPDB_CRC_BLOCK, sec->length - ofs)));
+}
+
+/* #sections[64], then each: id[32] #blocks[32] offset[64] length[64]
+ * crc[32 x #blocks] padded to 8 bytes; then the CRC of all that[32]
+ * and 4 bytes of padding */
+std::string pipdb_pack_sections(const std::vector<PipDBSection> &sections) {
+	std::string ret;
+	str_append_int64(&ret, sections.size());
+	for (unsigned int i=0; i<sections.size(); i++) {
+		const PipDBSection &sec = sections[i];
+		str_append_int(&ret, sec.id);
+		str_append_int(&ret, sec.crcs.size());
+		str_append_int64(&ret, sec.offset);
+		str_append_int64(&ret, sec.length);
+		for (unsigned int j=0; j<sec.crcs.size(); j++)
+			str_append_int(&ret, sec.crcs[j]);
+		ret.resize(align8(ret.size()), '\0');
+	}
+	str_append_int(&ret, pipdb_crc32c(0, ret.data(), ret.size()));
+	str_append_int(&ret, 0);
+	return ret;
+}
+
+bool pipdb_unpack_sections(const char *p, const char *end, std::vector<PipDBSection> *sections) {
+	const char *start = p;
+	sections->clear();
+	if (end - p < 8) return false;
+	int64_t n = str_unpack_int64(p);
+	p += 8;
+	if (n < 0 || n > (end - p) / 24) return false;
+	for (int64_t i=0; i<n; i++) {
+		if (end - p < 24) return false;
+		PipDBSection sec;
+		sec.id = str_unpack_int(p);
+		int nblocks = str_unpack_int(p+4);
+		sec.offset = str_unpack_int64(p+8);
+		sec.length = str_unpack_int64(p+16);
+		p += 24;
+		if (nblocks < 0 || nblocks > (end - p) / 4 || sec.offset < 0 || sec.length < 0
+				|| nblocks != (sec.length + PIPDB_CRC_BLOCK - 1) / PIPDB_CRC_BLOCK)
+			return false;
+		for (int j=0; j<nblocks; j++, p+=4)
+			sec.crcs.push_back(str_unpack_int(p));
+		p = start + align8(p - start);
+		sections->push_back(sec);
+	}
+	if (end - p < 8 || (unsigned int)str_unpack_int(p) != pipdb_crc32c(0, start, p - start))
+		return false;
+	return true;
+}
+
+int pipdb_compression_by_name(const char *name) {
+	if (!strcasecmp(name, "none")) return PIPDB_COMPRESS_NONE;
+	if (!strcasecmp(name, "lz4")) return PIPDB_COMPRESS_LZ4;
+	if (!strcasecmp(name, "zlib")) return PIPDB_COMPRESS_ZLIB;
+	return -1;
+}
+
+/* LZ4 block format: sequences of a token (literal count, match length),
+ * the literals, and a 16-bit back offset.  The last 5 bytes are always
+ * literals, and no match starts in the last 12. */
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+static inline unsigned int lz4_hash(const unsigned char *p, int bits) {
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - bits);
+}
+
+static void lz4_put_length(std::string *dest, size_t len) {
+	for (; len >= 255; len -= 255) dest->append(1, (char)255);
+	dest->append(1, (char)len);
+}
+
+static void lz4_put_sequence(std::string *dest, const char *lit, size_t nlit, size_t offset, size_t mlen) {
+	size_t ml = mlen ? mlen - LZ4_MIN_MATCH : 0;
+	dest->append(1, (char)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15)));
+	if (nlit >= 15) lz4_put_length(dest, nlit - 15);
+	dest->append(lit, nlit);
+	if (!mlen) return;   // the last sequence has no match
+	dest->append(1, (char)(offset & 0xff));
+	dest->append(1, (char)(offset >> 8));
+	if (ml >= 15) lz4_put_length(dest, ml - 15);
+}
+
+static void lz4_compress(const char *src, size_t len, std::string *dest) {
+	const unsigned char *in = (const unsigned char*)src;
+	size_t anchor = 0, i = 0;
+	if (len > LZ4_MF_LIMIT) {
+		// most blocks are small: size the table to the block
+		int bits = 8;
+		while (bits < 16 && ((size_t)1 << bits) < len) bits++;
+		std::vector<int> table(1 << bits, -1);
+		size_t limit = len - LZ4_MF_LIMIT, match_limit = len - LZ4_LAST_LITERALS;
+		while (i < limit) {
+			unsigned int h = lz4_hash(in+i, bits);
+			int cand = table[h];
+			table[h] = i;
+			if (cand < 0 || i - cand > 0xffff || memcmp(in+cand, in+i, LZ4_MIN_MATCH) != 0) {
+				i++;
+				continue;
+			}
+			size_t mlen = LZ4_MIN_MATCH;
+			while (i + mlen < match_limit && in[cand+mlen] == in[i+mlen]) mlen++;
+			lz4_put_sequence(dest, src+anchor, i-anchor, i-cand, mlen);
+			i += mlen;
+			anchor = i;
+		}
+	}
+	lz4_put_sequence(dest, src+anchor, len-anchor, 0, 0);
+}
+
+static bool lz4_get_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+	unsigned char b;
+	do {
+		if (*ip >= end) return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
+
+static bool lz4_decompress(const char *src, size_t len, char *dest, size_t rawlen) {
+	const unsigned char *ip = (const unsigned char*)src, *end = ip + len;
+	size_t op = 0;
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t nlit = token >> 4;
+		if (nlit == 15 && !lz4_get_length(&ip, end, &nlit)) return false;
+		if (nlit > (size_t)(end - ip) || nlit > rawlen - op) return false;
+		memcpy(dest+op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == end) break;   // the last sequence
+		if (end - ip < 2) return false;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && !lz4_get_length(&ip, end, &mlen)) return false;
+		mlen += LZ4_MIN_MATCH;
+		if (offset == 0 || offset > op || mlen > rawlen - op) return false;
+		// byte by byte: the match may overlap what it writes
+		for (size_t k=0; k<mlen; k++, op++)
+			dest[op] = dest[op-offset];
+	}
+	return op == rawlen;
+}
+
+void pipdb_compress(int method, const char *src, size_t len, std::string *dest) {
+	switch (method) {
+		case PIPDB_COMPRESS_LZ4:
+			lz4_compress(src, len, dest);
+			break;
+		case PIPDB_COMPRESS_ZLIB:{
+				uLongf zlen = compressBound(len);
+				size_t start = dest->size();
+				dest->resize(start + zlen);
+				if (compress2((Bytef*)&(*dest)[start], &zlen, (const Bytef*)src, len, Z_DEFAULT_COMPRESSION) != Z_OK)
+					abort();   // only fails on bad arguments or no memory
+				dest->resize(start + zlen);
+			}
+			break;
+		default:
+			dest->append(src, len);
+	}
+}
+
+bool pipdb_decompress(int method, const char *src, size_t len, char *dest, size_t rawlen) {
+	switch (method) {
+		case PIPDB_COMPRESS_LZ4:
+			return lz4_decompress(src, len, dest, rawlen);
+		case PIPDB_COMPRESS_ZLIB:{
+				uLongf zlen = rawlen;
+				return uncompress((Bytef*)dest, &zlen, (const Bytef*)src, len) == Z_OK && zlen == rawlen;
+			}
+		case PIPDB_COMPRESS_NONE:
+			if (len != rawlen) return false;
+			memcpy(dest, src, len);
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool pipdb_read_manifest(const char *fn, PipDBManifest *m) {
+	FILE *fp = fopen(fn, "r");
+	if (!fp) return false;
+	char line[4096];
+	bool ok = fgets(line, sizeof(line), fp)
+		&& sscanf(line, PIPDB_MANIFEST_MAGIC " %d %d", &m->next_segment, &m->next_thread) == 2;
+	m->segments.clear();
+	while (ok && fgets(line, sizeof(line), fp)) {
+		int len = strlen(line), ofs;
+		if (len > 0 && line[len-1] == '\n') line[--len] = '\0';
+		PipDBSegment seg;
+		if (sscanf(line, "%d %n", &seg.thread_base, &ofs) < 1 || ofs >= len) {
+			ok = false;
+			break;
+		}
+		seg.file = line + ofs;
+		m->segments.push_back(seg);
+	}
+	fclose(fp);
+	return ok;
+}
+
+bool pipdb_write_manifest(const char *fn, const PipDBManifest &m) {
+	std::string tmp(fn);
+	tmp.append(".tmp");
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) return false;
+	fprintf(fp, PIPDB_MANIFEST_MAGIC " %d %d\n", m.next_segment, m.next_thread);
+	for (unsigned int i=0; i<m.segments.size(); i++)
+		fprintf(fp, "%d %s\n", m.segments[i].thread_base, m.segments[i].file.c_str());
+	bool ok = !ferror(fp) && fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0) ok = false;
+	if (!ok || rename(tmp.c_str(), fn) != 0) {
+		int err = errno;
+		unlink(tmp.c_str());
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+std::string pipdb_segment_path(const char *fn, const std::string &file) {
+	const char *slash = strrchr(fn, '/');
+	if (!slash || file[0] == '/') return file;
+	return std::string(fn, slash+1 - fn) + file;
 }
@@ -1,19 +1,264 @@
 #ifndef PIPDB_H
 #define PIPDB_H
 
+#include <stdint.h>
 #include <sys/time.h>
 #include <string>
+#include <vector>
+
+/* Version 1 stores every offset and count in 32 bits, so it cannot
+ * describe a file over 2GB.  Version 2 widens them all to 64 bits, and
+ * task records refer to their name by its number in the task index
+ * instead of by offset.  Version 3 headers hold their own length, so a
+ * field added at the end is read only from files that have it.  See
+ * pip-database-format. */
+#define PIPDB_VERSION 3
 
 struct PipDBHeader {
 	char magic[3];
 	char version;
 	timeval first_ts, last_ts;
-	int threads_offset, nthreads;
-	int task_idx_offset, ntasks;
-	int path_idx_offset, npaths;
+	int64_t threads_offset, nthreads;
+	int64_t task_idx_offset, ntasks;
+	int64_t path_idx_offset, npaths;
+	/* The rest are version 3 only: 0 in earlier versions, and in a
+	 * header too short to hold them. */
+	int compression;            // PIPDB_COMPRESS_*
+	int64_t metrics_offset;     // TASK-METRICS, or 0
+	int64_t time_idx_offset;    // TIME-INDEX, or 0
+	int64_t names_offset;       // PATH-NAMES, or 0
+	int64_t summary_offset;     // PATH-SUMMARY, or 0
+	int64_t sections_offset;    // SECTIONS, or 0
+
+	/* size of offsets, counts, and index slots in this version */
+	int offset_size(void) const { return version >= 2 ? 8 : 4; }
+	/* offsets in each PATH-INDEX entry */
+	int path_offsets(void) const { return compression ? 5 : 3; }
 
 	std::string pack(void) const;
-	static PipDBHeader unpack(const char *str);
+	/* Reads the header at the start of the "size" bytes at "str".  False
+	 * if they are not a pipdb header of a version up to PIPDB_VERSION, or
+	 * are cut short; magic and version are set either way, if there. */
+	static bool unpack(const char *str, int64_t size, PipDBHeader *hdr);
+};
+
+/* Task and message records.  Version 1 writes every field of every
+ * record, with all flag bits set.  Version 2 leaves out or narrows the
+ * fields the flags say it can; the "present" bit is always set, so that
+ * the zeros left over at the end of a region never look like a record. */
+enum {
+	TASK_WIDE_NAME = 1<<0,      // nameidx is 32 bits, not 16
+	TASK_END_TV = 1<<1,         // end is a timeval, not a 32-bit diff from start
+	TASK_REALTIME = 1<<2,       // realtime is there, not end - start
+	TASK_UTIME = 1<<3,          // each of these is there, not 0
+	TASK_STIME = 1<<4,
+	TASK_MINFAULT = 1<<5,
+	TASK_MAJFAULT = 1<<6,
+	TASK_VOLCS = 1<<7,
+	TASK_INVOLCS = 1<<8,
+	TASK_WIDE_THREAD = 1<<9,    // thread numbers are 32 bits, not 16
+	TASK_END_THREAD = 1<<10,    // endthread is there, not startthread
+	TASK_PRESENT = 1<<15
+};
+enum {
+	MSG_RECV_TV = 1<<0,         // recvts is a timeval, not a 32-bit diff from sendts
+	MSG_WIDE_SIZE = 1<<1,       // size is 32 bits, not 16
+	MSG_WIDE_SEND_THREAD = 1<<2,
+	MSG_WIDE_RECV_THREAD = 1<<3,
+	MSG_PRESENT = 1<<7
+};
+
+struct PipDBTask {
+	int nameidx;
+	int start_sec, start_usec, end_sec, end_usec;
+	int realtime, utime, stime, majfault, minfault, volcs, involcs;
+	int s_thread, e_thread;
+
+	/* the smallest flags that hold this task; all ones unless "compact" */
+	unsigned short flags(bool compact, bool wide_name) const;
+	static int length(unsigned short flags);
+	void pack(std::string *dest, unsigned short flags) const;
+	/* Fills this in from the record at p.  Returns its length, or 0 at
+	 * empty space. */
+	int unpack(const char *p);
+};
+
+struct PipDBMessage {
+	const char *id;             // not NUL-terminated
+	int idlen;
+	int send_sec, send_usec, recv_sec, recv_usec;
+	int size, s_thread, r_thread;
+
+	unsigned char flags(bool compact) const;
+	static int length(unsigned char flags, int idlen);
+	void pack(std::string *dest, unsigned char flags) const;
+	/* as for PipDBTask; id points into the record */
+	int unpack(const char *p);
+};
+
+/* TASK-METRICS holds, for each task name in task index order, the same
+ * tasks as its index slots, in the same order, as columns: */
+struct PipDBTaskColumns {
+	int64_t count;
+	const int64_t *start;       // microseconds since first_ts
+	const int *realtime, *utime, *stime;    // realtime is end - start
+	const int *majfault, *minfault, *volcs, *involcs;
+	const int *pathid;          // from 1, like a PathFactory pathid
+};
+#define PIPDB_INT_COLUMNS 8     // realtime through pathid
+/* Finds the columns of the task whose entry starts at "p" and returns
+ * where the next one starts.  Entries are 8-byte aligned. */
+const char *pipdb_task_columns(const char *p, PipDBTaskColumns *cols);
+/* bytes for an entry of "count" tasks */
+int64_t pipdb_task_columns_size(int64_t count);
+
+/* TIME-INDEX splits the span of the records into nbuckets equal
+ * buckets and lists, for each, the paths with an event in it and how
+ * many tasks of each name start in it. */
+struct PipDBTimeIndex {
+	int64_t base, width, nbuckets;      // base is in absolute microseconds
+	const int64_t *spans;       // first and last event of each path, in usec since base
+	const int64_t *path_start;  // bucket b's paths are paths[path_start[b] .. path_start[b+1]]
+	const int64_t *task_start;  // and its tasks, as for paths
+	const int *paths;           // pathids, from 1, ascending within a bucket
+	const int *tasks;           // (task index number, count) pairs, ascending
+};
+/* Finds the parts of the TIME-INDEX at "p" in a file of "npaths" paths
+ * and returns where it ends. */
+const char *pipdb_time_index(const char *p, int64_t npaths, PipDBTimeIndex *ti);
+
+/* PATH-NAMES holds each path's ID as ID_to_string prints it, so that
+ * searches needn't convert every ID, and a trigram index over them. */
+struct PipDBPathNames {
+	const int64_t *name_ofs;    // npaths+1 entries into "names"
+	int64_t ntrigrams;
+	const int64_t *posting_start;   // trigram i's paths are postings[posting_start[i] ..]
+	const int *trigrams;        // ascending; see pipdb_trigram
+	const int *postings;        // pathids, from 1, ascending for each trigram
+	const char *names;          // NUL-terminated, in PATH-INDEX order
+};
+/* as pipdb_time_index */
+const char *pipdb_path_names(const char *p, int64_t npaths, PipDBPathNames *pn);
+/* The trigram starting at "p", as a number below PIPDB_TRIGRAMS, or -1
+ * if one of its characters is not printable ASCII. */
+int pipdb_trigram(const char *p);
+#define PIPDB_TRIGRAMS (95*95*95)
+
+/* PATH-SUMMARY holds, for each path in PATH-INDEX order, the totals
+ * that Path::done_inserting works out, so that a reader can have them
+ * without reading and building the path.  An entry without
+ * SUMMARY_KNOWN is a path the reconciler would not vouch for (one
+ * done_inserting would reject with an assertion, say); readers build
+ * those. */
+enum {
+	SUMMARY_KNOWN = 1<<0,       // the rest of the entry is filled in
+	SUMMARY_VALID = 1<<1        // Path::valid(); if not, only threads is set
+};
+struct PipDBPathSummary {
+	int flags;
+	int threads;                // thread pools, (host, pid) pairs
+	int64_t start, end;         // the root thread pool's, in absolute microseconds
+	int utime, stime, majfault, minfault, volcs, involcs;   // of top-level tasks
+	int size, messages, depth, hosts, latency;   // latency is summed, in usec
+	int reserved;               // 0; keeps entries 8-byte aligned
+};
+
+/* A path's totals, added up the same way by Path::tally, for a built
+ * path, and by new-reconcile, for PATH-SUMMARY.  Only top-level tasks
+ * count toward the resource totals: a task's clocks keep running
+ * through its children, so adding theirs too would count them twice. */
+struct PathTotals {
+	PathTotals(void) : utime(0), stime(0), majfault(0), minfault(0), volcs(0), involcs(0),
+		size(0), messages(0), latency(0) {}
+	void add_task(bool toplevel, int _utime, int _stime, int _majfault, int _minfault,
+			int _volcs, int _involcs) {
+		if (!toplevel) return;
+		utime += _utime;
+		stime += _stime;
+		majfault += _majfault;
+		minfault += _minfault;
+		volcs += _volcs;
+		involcs += _involcs;
+	}
+	/* latency, send to receive in usec, counts only if it was received */
+	void add_message(int _size, bool received, int64_t _latency) {
+		size += _size;
+		messages++;
+		if (received) latency += _latency;
+	}
+	int64_t utime, stime, majfault, minfault, volcs, involcs;
+	int64_t size, messages, latency;
+};
+
+/* SECTIONS lists the parts of a version 3 file, each starting 8-byte
+ * aligned, with CRC32C checksums, so that a truncated or damaged pipdb
+ * is noticed instead of misread.  Checksums cover PIPDB_CRC_BLOCK bytes
+ * each, so a reader can verify just the blocks it touches, the first
+ * time it touches them. */
+enum {
+	SECTION_HEADER, SECTION_THREADS, SECTION_TASK_INDEX, SECTION_PATH_INDEX,
+	SECTION_RECORDS, SECTION_TASK_METRICS, SECTION_TIME_INDEX, SECTION_PATH_NAMES,
+	SECTION_PATH_SUMMARY, PIPDB_SECTION_TYPES
+};
+#define PIPDB_CRC_BLOCK (1<<20)
+struct PipDBSection {
+	int id;                     // SECTION_*
+	int64_t offset, length;
+	std::vector<unsigned int> crcs;   // one per block; the last may be short
+};
+extern const char *pipdb_section_names[PIPDB_SECTION_TYPES];
+/* CRC32C (Castagnoli) of "len" bytes, continuing from "crc"; start at 0. */
+unsigned int pipdb_crc32c(unsigned int crc, const char *data, size_t len);
+/* Sets sec->crcs from the section's bytes, at "data". */
+void pipdb_checksum_section(const char *data, PipDBSection *sec);
+/* The SECTIONS table for "sections", with its own checksum. */
+std::string pipdb_pack_sections(const std::vector<PipDBSection> &sections);
+/* Reads the SECTIONS table at "p", which must end by "end".  False if it
+ * is truncated or damaged. */
+bool pipdb_unpack_sections(const char *p, const char *end, std::vector<PipDBSection> *sections);
+
+/* A compressed pipdb stores each path's tasks, notices, and messages as
+ * one independently compressed block, so a reader inflates only the
+ * paths it asks for.  Task index slots then hold the path's number in
+ * the path index in their high 32 bits and the record's offset within
+ * the uncompressed block in their low 32 bits. */
+enum {
+	PIPDB_COMPRESS_NONE = 0,
+	PIPDB_COMPRESS_LZ4 = 1,     // LZ4 block format: fast to read
+	PIPDB_COMPRESS_ZLIB = 2     // deflate: smaller, slower
+};
+
+/* -1 if unknown */
+int pipdb_compression_by_name(const char *name);
+void pipdb_compress(int method, const char *src, size_t len, std::string *dest);
+/* Inflates exactly rawlen bytes into dest.  Returns false if the block
+ * is damaged. */
+bool pipdb_decompress(int method, const char *src, size_t len, char *dest, size_t rawlen);
+
+/* A segmented pipdb is a manifest naming immutable pipdb files, the
+ * segments, which new-reconcile --append adds and --compact merges.
+ * Readers present them as one database.  The manifest is text:
+ *   PIPDB-SEGMENTS <next segment number> <next thread number>
+ *   <thread base> <segment file>
+ *   ...
+ * Segment files are relative to the manifest's directory.  Thread ids in
+ * a segment's records are global: its threads are numbered from its
+ * thread base + 1. */
+#define PIPDB_MANIFEST_MAGIC "PIPDB-SEGMENTS"
+struct PipDBSegment {
+	std::string file;
+	int thread_base;
+};
+struct PipDBManifest {
+	int next_segment, next_thread;
+	std::vector<PipDBSegment> segments;
 };
+/* False if "fn" can't be read or is not a manifest. */
+bool pipdb_read_manifest(const char *fn, PipDBManifest *m);
+/* Replaces "fn" with a new manifest by renaming, so readers see the old
+ * one or the new one.  False, with errno set, on failure. */
+bool pipdb_write_manifest(const char *fn, const PipDBManifest &m);
+/* where a segment named in manifest "fn" is */
+std::string pipdb_segment_path(const char *fn, const std::string &file);
 
 #endif
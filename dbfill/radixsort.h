@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "workqueue.h"
+
+/* LSD radix sorts of unsigned integers, a byte at a time.  A pass whose
+ * byte is the same in every key is skipped, so file offsets, which are
+ * mostly zero bytes at the top, take only a few passes.  The sorts are
+ * stable and need a scratch array as big as the input. */
+
+#define RADIX_BUCKETS 256
+#define RADIX_MIN_CHUNK (1<<16)   // smallest share of a parallel pass
+
+template<class T> static inline int radix_digit(T key, int shift) {
+	return (key >> shift) & (RADIX_BUCKETS-1);
+}
+
+/* Leaves keys[0..n) sorted, using scratch[0..n). */
+template<class T> void radix_sort(T *keys, size_t n, T *scratch) {
+	T *src = keys, *dst = scratch;
+	for (int shift=0; shift<(int)(8*sizeof(T)); shift+=8) {
+		size_t count[RADIX_BUCKETS] = { 0 };
+		size_t i;
+		for (i=0; i<n; i++)
+			count[radix_digit(src[i], shift)]++;
+		if (n == 0 || count[radix_digit(src[0], shift)] == n) continue;
+		size_t pos = 0;
+		for (i=0; i<RADIX_BUCKETS; i++) {
+			size_t c = count[i];
+			count[i] = pos;
+			pos += c;
+		}
+		for (i=0; i<n; i++)
+			dst[count[radix_digit(src[i], shift)]++] = src[i];
+		std::swap(src, dst);
+	}
+	if (src != keys) memcpy(keys, src, n*sizeof(T));
+}
+
+/* One pass of a parallel sort: chunk c counts its digits into
+ * counts[c*RADIX_BUCKETS ..], which then become where chunk c puts each
+ * digit. */
+template<class T> struct RadixPass {
+	T *src, *dst;
+	size_t n, chunk;
+	int shift;
+	std::vector<size_t> counts;
+};
+
+template<class T> static void radix_count(int c, void *arg) {
+	RadixPass<T> *rp = (RadixPass<T>*)arg;
+	size_t *count = &rp->counts[c*RADIX_BUCKETS];
+	size_t end = std::min(rp->n, (c+1)*rp->chunk);
+	for (size_t i=c*rp->chunk; i<end; i++)
+		count[radix_digit(rp->src[i], rp->shift)]++;
+}
+
+template<class T> static void radix_scatter(int c, void *arg) {
+	RadixPass<T> *rp = (RadixPass<T>*)arg;
+	size_t *pos = &rp->counts[c*RADIX_BUCKETS];
+	size_t end = std::min(rp->n, (c+1)*rp->chunk);
+	for (size_t i=c*rp->chunk; i<end; i++)
+		rp->dst[pos[radix_digit(rp->src[i], rp->shift)]++] = rp->src[i];
+}
+
+/* As radix_sort, with each pass split across up to "jobs" threads (one
+ * per CPU if jobs <= 0). */
+template<class T> void parallel_radix_sort(T *keys, size_t n, T *scratch, int jobs) {
+	if (jobs <= 0) jobs = default_jobs();
+	int nchunks = std::min((size_t)jobs, n / RADIX_MIN_CHUNK);
+	if (nchunks <= 1) {
+		radix_sort(keys, n, scratch);
+		return;
+	}
+	RadixPass<T> rp;
+	rp.src = keys;
+	rp.dst = scratch;
+	rp.n = n;
+	rp.chunk = (n + nchunks - 1) / nchunks;
+	for (rp.shift=0; rp.shift<(int)(8*sizeof(T)); rp.shift+=8) {
+		rp.counts.assign(nchunks*RADIX_BUCKETS, 0);
+		run_ordered(nchunks, jobs, radix_count<T>, NULL, &rp);
+		size_t same = 0;
+		int first = radix_digit(rp.src[0], rp.shift);
+		for (int c=0; c<nchunks; c++)
+			same += rp.counts[c*RADIX_BUCKETS + first];
+		if (same == n) continue;
+		// bucket by bucket, each chunk's share follows the last chunk's
+		size_t pos = 0;
+		for (int d=0; d<RADIX_BUCKETS; d++)
+			for (int c=0; c<nchunks; c++) {
+				size_t cnt = rp.counts[c*RADIX_BUCKETS + d];
+				rp.counts[c*RADIX_BUCKETS + d] = pos;
+				pos += cnt;
+			}
+		run_ordered(nchunks, jobs, radix_scatter<T>, NULL, &rp);
+		std::swap(rp.src, rp.dst);
+	}
+	if (rp.src != keys) memcpy(keys, rp.src, n*sizeof(T));
+}
+
+#endif
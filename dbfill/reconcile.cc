@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
@@ -27,9 +28,16 @@ std::map<std::string, std::set<Task*, ltEvP> > unpaired_tasks;
 MessageMap sends;
 MessageMap receives;
 bool save_unmatched_sends = false;
+bool skip_corrupt = false;
+PhaseStats *phase_stats = NULL;
+bool defer_indexes = false;
+int partitions = 0;
 
 static void check_unpaired_tasks(void);
 static void check_unpaired_messages(void);
+static void stats_phase(const char *name);
+static void build_indexes(void);
+static void alter_table(const std::string &table, const char *changes, const std::string &parts);
 
 long long tv_to_ts(const timeval tv) {
 	return 1000000LL*tv.tv_sec + tv.tv_usec;
@@ -43,12 +51,7 @@ void reconcile_init(const char *table_base) {
 	table_threads = base + "_threads";
 	table_paths = base + "_paths";
 
-	mysql_init(&mysql);
-	if (!mysql_real_connect(&mysql, config["db.host"], config.get("db.user", getlogin()),
-			config["db.password"], NULL, 0, NULL, 0)) {
-		fprintf(stderr, "Connection failed: %s\n", mysql_error(&mysql));
-		exit(1);
-	}
+	db_connect(&mysql, NULL);
 
 	// does the "pip" database exist?  if not, create it.
 	run_sql("SHOW DATABASES");
@@ -65,34 +68,108 @@ void reconcile_init(const char *table_base) {
 	}
 
 	run_sqlf("USE %s", dbname);
+	const char *pathid_index = defer_indexes ? "" : ", INDEX(pathid)";
 	run_sqlf("CREATE TABLE %s (pathid int, roles varchar(255), level tinyint, "
-		"name varchar(255), ts bigint, thread_id int, INDEX(pathid))",
-		table_notices.c_str());
+		"name varchar(255), ts bigint, thread_id int%s)",
+		table_notices.c_str(), pathid_index);
 	run_sqlf("CREATE TABLE %s (pathid int, roles varchar(255), level tinyint, "
 		"name varchar(255), start bigint, end bigint, tdiff int, utime int, "
 		"stime int, major_fault int, minor_fault int, vol_cs int, invol_cs int, "
-		"thread_start int, thread_end int, INDEX(pathid), INDEX(name))",
-		table_tasks.c_str());
+		"thread_start int, thread_end int%s%s)",
+		table_tasks.c_str(), pathid_index, defer_indexes ? "" : ", INDEX(name)");
 	run_sqlf("CREATE TABLE %s (thread_id int auto_increment primary key, "
 		"host varchar(255), prog varchar(255), pid int, tid int, ppid int, "
 		"uid int, start bigint, tz int)", table_threads.c_str());
 	run_sqlf("CREATE TABLE %s (pathid int, roles varchar(255), levels tinyint, "
 		"msgid varchar(255), ts_send bigint, ts_recv bigint, size int, "
-		"thread_send int, thread_recv int, INDEX(pathid))",
-		table_messages.c_str());
+		"thread_send int, thread_recv int%s)",
+		table_messages.c_str(), pathid_index);
 	run_sqlf("CREATE TABLE %s (pathid int primary key, pathblob varchar(255))",
 		table_paths.c_str());
-	run_sqlf("LOCK TABLES %s WRITE, %s WRITE, %s WRITE, %s WRITE, %s WRITE",
-		table_notices.c_str(), table_tasks.c_str(), table_threads.c_str(),
-		table_messages.c_str(), table_paths.c_str());
+	// with writer threads, each locks its own table on its own connection
+	if (SqlBuffer::writer_threads)
+		run_sqlf("LOCK TABLES %s WRITE", table_threads.c_str());
+	else
+		run_sqlf("LOCK TABLES %s WRITE, %s WRITE, %s WRITE, %s WRITE, %s WRITE",
+			table_notices.c_str(), table_tasks.c_str(), table_threads.c_str(),
+			table_messages.c_str(), table_paths.c_str());
+}
+
+/* Connects to the server in ~/.piprc, using database "db" if not NULL. */
+void db_connect(MYSQL *conn, const char *db) {
+	mysql_init(conn);
+	if (SqlBuffer::load_data)
+		mysql_options(conn, MYSQL_OPT_LOCAL_INFILE, NULL);
+	if (!mysql_real_connect(conn, config["db.host"], config.get("db.user", getlogin()),
+			config["db.password"], db, 0, NULL, 0)) {
+		fprintf(stderr, "Connection failed: %s\n", mysql_error(conn));
+		exit(1);
+	}
 }
 
 void reconcile_done(void) {
+	stats_phase("unmatched check");
 	check_unpaired_tasks();
 	check_unpaired_messages();
+	stats_phase("flush");
 	SqlBuffer::flush_all();
 	run_sql("UNLOCK TABLES");
+	if (defer_indexes || partitions > 0) {
+		stats_phase("build indexes");
+		build_indexes();
+	}
 	mysql_close(&mysql);
+	stats_phase(NULL);
+}
+
+/* Adds the indexes --defer-indexes left out and the partitions
+ * --partitions asked for, now that the path IDs are all known: one
+ * ALTER TABLE, and so one rebuild and one sorted index build, per
+ * table. */
+static void build_indexes(void) {
+	std::string parts;
+	if (partitions > 0) {
+		int npaths = path_count();
+		int per = std::max(1, (npaths + partitions - 1) / partitions);
+		parts = " PARTITION BY RANGE (pathid) (";
+		for (int i=0; i<partitions; i++) {
+			char buf[64];
+			if (i < partitions-1)
+				sprintf(buf, "PARTITION p%d VALUES LESS THAN (%d), ", i, 1 + (i+1)*per);
+			else
+				sprintf(buf, "PARTITION p%d VALUES LESS THAN MAXVALUE)", i);
+			parts.append(buf);
+		}
+	}
+	alter_table(table_notices, defer_indexes ? "ADD INDEX(pathid)" : "", parts);
+	alter_table(table_tasks, defer_indexes ? "ADD INDEX(pathid), ADD INDEX(name)" : "", parts);
+	alter_table(table_messages, defer_indexes ? "ADD INDEX(pathid)" : "", parts);
+}
+
+static void alter_table(const std::string &table, const char *changes, const std::string &parts) {
+	std::string query("ALTER TABLE ");
+	query.append(table);
+	query.append(" ");
+	query.append(changes);
+	query.append(parts);
+	run_sql(query.c_str());
+}
+
+/* Ends the current --stats phase, noting the tables it left, and starts
+ * "name", if not NULL.  std::map doesn't say how much memory it holds. */
+static void stats_phase(const char *name) {
+	if (!phase_stats) return;
+	int64_t tasks = 0;
+	std::map<std::string, std::set<Task*, ltEvP> >::const_iterator p;
+	for (p=unpaired_tasks.begin(); p!=unpaired_tasks.end(); p++)
+		tasks += p->second.size();
+	phase_stats->table("unpaired tasks", tasks, -1);
+	phase_stats->table("pending sends", sends.size(), -1);
+	phase_stats->table("pending receives", receives.size(), -1);
+	if (name)
+		phase_stats->begin(name);
+	else
+		phase_stats->end();
 }
 
 void run_sqlf(const char *fmt, ...) {
@@ -105,13 +182,17 @@ void run_sqlf(const char *fmt, ...) {
 }
 
 void run_sql(const char *cmd) {
-	if (mysql_query(&mysql, cmd) != 0) {
+	run_sql(&mysql, cmd);
+}
+
+void run_sql(MYSQL *conn, const char *cmd) {
+	if (mysql_query(conn, cmd) != 0) {
 		char buf[256];
 		strncpy(buf, cmd, 256);
 		buf[255] = '\0';
 		printf("Database error:\n");
 		printf("  QUERY: \"%s\"\n", buf);
-		printf("  MySQL error: \"%s\"\n", mysql_error(&mysql));
+		printf("  MySQL error: \"%s\"\n", mysql_error(conn));
 		exit(1);
 	}
 }
@@ -125,19 +206,18 @@ bool handle_end_task(Task *end, PathNameTaskMap &start_task) {
 	evl->pop_back();
 	assert(start->path_id.i == end->path_id.i);
 	if (evl->empty()) start_task[end->path_id.i].erase(start->name);
-	SqlBuffer::insert(table_tasks, "(%d,\"%s\",%d,\"%s\",%lld,%lld,%ld,%ld,%ld,%d,%d,%d,%d,%d,%d)",
-		start->path_id.i,
-		start->roles ? start->roles : "", start->level,
-		end->name,
-		tv_to_ts(start->tv), tv_to_ts(end->tv),
-		end->tv - start->tv,         // !! wrong, doesn't account for switchage
-		end->utime - start->utime,
-		end->stime - start->stime,
-		end->minor_fault - start->minor_fault,
-		end->major_fault - start->major_fault,
-		end->vol_cs - start->vol_cs,
-		end->invol_cs - start->invol_cs,
-		start->thread_id, end->thread_id);
+	SqlBuffer::Row(table_tasks).add(start->path_id.i)
+		.add(start->roles ? start->roles : "").add(start->level)
+		.add(end->name)
+		.add(tv_to_ts(start->tv)).add(tv_to_ts(end->tv))
+		.add(end->tv - start->tv)         // !! wrong, doesn't account for switchage
+		.add(end->utime - start->utime)
+		.add(end->stime - start->stime)
+		.add(end->minor_fault - start->minor_fault)
+		.add(end->major_fault - start->major_fault)
+		.add(end->vol_cs - start->vol_cs)
+		.add(end->invol_cs - start->invol_cs)
+		.add(start->thread_id).add(end->thread_id).end();
 	delete start;
 	delete end;
 	return true;
@@ -192,11 +272,13 @@ static void check_unpaired_messages(void) {
 	fprintf(stderr, "Unmatched send count = %zd\n", sends.size());
 	if (save_unmatched_sends) {
 		for (msgp=sends.begin(); msgp!=sends.end(); msgp++) {
-			SqlBuffer::insert(table_messages, "(%d,\"%s\",%d,'%s',%lld,NULL,%d,%d,NULL)",
-			msgp->second->path_id.i,
-			msgp->second->roles ? msgp->second->roles : "", msgp->second->level,
-			ID_to_string(msgp->second->msgid), tv_to_ts(msgp->second->tv), /* no recv time */
-			msgp->second->size, msgp->second->thread_id /* no recv thread */);
+			SqlBuffer::Row(table_messages).add(msgp->second->path_id.i)
+				.add(msgp->second->roles ? msgp->second->roles : "").add(msgp->second->level)
+				.add(ID_to_string(msgp->second->msgid)).add(tv_to_ts(msgp->second->tv))
+				.null()   /* no recv time */
+				.add(msgp->second->size).add(msgp->second->thread_id)
+				.null()   /* no recv thread */
+				.end();
 		}
 	}
 	else {
@@ -11,6 +11,7 @@
 #include <set>
 #include <string>
 #include <mysql/mysql.h>
+#include "phasestats.h"
 
 struct ltEvP {
   bool operator()(const Event* s1, const Event* s2) const {
@@ -44,12 +45,18 @@ extern std::map<std::string, std::set<Task*, ltEvP> > unpaired_tasks;
 extern MessageMap sends;
 extern MessageMap receives;
 extern bool save_unmatched_sends;
+extern bool skip_corrupt;
+extern PhaseStats *phase_stats;     // for --stats, or NULL
+extern bool defer_indexes;          // index pathid and name after loading
+extern int partitions;              // by pathid range, if > 0
 
 long long tv_to_ts(const timeval tv);
 void reconcile_init(const char *table_base);
 void reconcile_done(void);
 void run_sqlf(const char *fmt, ...) __attribute__((__format__(printf,1,2)));
 void run_sql(const char *cmd);
+void run_sql(MYSQL *conn, const char *cmd);
+void db_connect(MYSQL *conn, const char *db);
 bool handle_end_task(Task *end, PathNameTaskMap &start_task);
 
 #endif
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "events.h"
+#include "tracereader.h"
+
+/* Checks trace files frame by frame without parsing any events.  With -t,
+ * cuts each damaged file off at its first bad frame.  With -r, rewrites
+ * it without the bad regions, keeping every good frame after them, the
+ * same way --skip-corrupt reads it. */
+
+typedef enum { CHECK_ONLY, TRUNCATE, RESYNC } Repair;
+
+struct BadRegion {
+	off_t start, end;
+	const char *why;
+};
+
+static Repair repair = CHECK_ONLY;
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage:\n  %s [-t | -r] file [file [file [...]]]\n\n", prog);
+	fprintf(stderr, "  -t   truncate damaged files at the first bad frame\n");
+	fprintf(stderr, "  -r   remove bad regions from damaged files, keeping later good frames\n");
+	exit(1);
+}
+
+static inline int get_int(const unsigned char *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void scan_trace(const unsigned char *data, off_t size, int *nframes,
+		std::vector<BadRegion> *bad) {
+	std::vector<int> versions(1, -1);   // by thread, for merged streams
+	int thread = 0;
+	off_t ofs = 0;
+	*nframes = 0;
+	while (ofs < size) {
+		const char *why;
+		if (size-ofs >= 7 && data[ofs] == 0 && data[ofs+1] == 7 && data[ofs+2] == THREAD_SWITCH
+				&& (unsigned)get_int(data+ofs+3) <= 1<<24) {
+			thread = get_int(data+ofs+3);
+			if (thread >= (int)versions.size()) versions.resize(thread+1, -1);
+			(*nframes)++;
+			ofs += 7;
+			continue;
+		}
+		int &version = versions[thread];
+		int len = check_frame(version, data+ofs, size-ofs, &why);
+		if (len > 0) {
+			if (data[ofs+2] == 'H' && version == -1)
+				version = get_int(data+ofs+7);
+			(*nframes)++;
+			ofs += len;
+			continue;
+		}
+		BadRegion br = { ofs, size, len == 0 ? "truncated frame" : why };
+		if (len == -1) {
+			long next = find_frame(version, data+ofs+1, size-ofs-1, true);
+			if (next >= 0) br.end = ofs + 1 + next;
+		}
+		bad->push_back(br);
+		ofs = br.end;
+	}
+}
+
+/* copy everything but the bad regions to a new file, then replace fn */
+static bool write_repaired(const char *fn, const unsigned char *data, off_t size,
+		const std::vector<BadRegion> &bad) {
+	std::string tmp(fn);
+	tmp.append(".fsck");
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp) { perror(tmp.c_str()); return false; }
+	off_t ofs = 0;
+	bool ok = true;
+	for (unsigned int i=0; i<=bad.size() && ok; i++) {
+		off_t end = i < bad.size() ? bad[i].start : size;
+		if (end > ofs && fwrite(data+ofs, end-ofs, 1, fp) != 1) ok = false;
+		if (i < bad.size()) ofs = bad[i].end;
+	}
+	if (fclose(fp) != 0) ok = false;
+	if (!ok || rename(tmp.c_str(), fn) != 0) {
+		perror(tmp.c_str());
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/* returns true if the file is clean or was repaired */
+static bool fsck_file(const char *fn) {
+	int fd = open(fn, repair == TRUNCATE ? O_RDWR : O_RDONLY);
+	if (fd == -1) { perror(fn); return false; }
+	struct stat st;
+	if (fstat(fd, &st) == -1) { perror(fn); close(fd); return false; }
+	if (st.st_size == 0) {
+		printf("%s: empty\n", fn);
+		close(fd);
+		return false;
+	}
+	const unsigned char *data = (const unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) { perror(fn); close(fd); return false; }
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+
+	int nframes;
+	std::vector<BadRegion> bad;
+	scan_trace(data, st.st_size, &nframes, &bad);
+
+	bool ok = bad.empty();
+	if (ok)
+		printf("%s: OK, %d frames\n", fn, nframes);
+	else {
+		off_t lost = 0;
+		for (unsigned int i=0; i<bad.size(); i++) {
+			printf("%s: bad frame at offset %ld: %s; %ld bytes skipped\n",
+				fn, (long)bad[i].start, bad[i].why, (long)(bad[i].end - bad[i].start));
+			lost += bad[i].end - bad[i].start;
+		}
+		printf("%s: %d good frames, %zd bad regions, %ld bytes lost\n",
+			fn, nframes, bad.size(), (long)lost);
+
+		switch (repair) {
+			case CHECK_ONLY:
+				break;
+			case TRUNCATE:
+				if (ftruncate(fd, bad[0].start) == -1)
+					perror(fn);
+				else {
+					printf("%s: truncated to %ld bytes\n", fn, (long)bad[0].start);
+					ok = true;
+				}
+				break;
+			case RESYNC:
+				if (write_repaired(fn, data, st.st_size, bad)) {
+					printf("%s: rewrote %ld bytes\n", fn, (long)(st.st_size - lost));
+					ok = true;
+				}
+				break;
+		}
+	}
+
+	munmap((void*)data, st.st_size);
+	close(fd);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	int i, c;
+	while ((c = getopt(argc, argv, "rt")) != -1) {
+		switch (c) {
+			case 'r':  repair = RESYNC; break;
+			case 't':  repair = TRUNCATE; break;
+			default:   usage(argv[0]);
+		}
+	}
+	if (argc-optind < 1)
+		usage(argv[0]);
+
+	int failed = 0;
+	for (i=optind; i<argc; i++)
+		if (!fsck_file(argv[i])) failed++;
+	return failed > 0;
+}
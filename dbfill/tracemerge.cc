@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "events.h"
+#include "tracereader.h"
+
+/* Writes one merged stream, in timestamp order, of all the events in the
+ * given trace files (or other merged streams).  See tracereader.h for the
+ * format.  annotrans and beliefcheck read it like any trace file. */
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage:\n  %s [-o outputfile] file [file [file [...]]]\n\n", prog);
+	fprintf(stderr, "  -o FILE   write the merged stream to FILE instead of stdout\n");
+	exit(1);
+}
+
+static void put(const unsigned char *data, int len, FILE *fp) {
+	if (fwrite(data, len, 1, fp) != 1) {
+		perror("fwrite");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+	int i, c;
+	const char *outfn = NULL;
+	while ((c = getopt(argc, argv, "o:")) != -1) {
+		switch (c) {
+			case 'o':  outfn = optarg; break;
+			default:   usage(argv[0]);
+		}
+	}
+	if (argc-optind < 1)
+		usage(argv[0]);
+
+	FILE *outp = outfn ? fopen(outfn, "w") : stdout;
+	if (!outp) { perror(outfn); return 1; }
+	static char outbuf[1<<20];
+	setvbuf(outp, outbuf, _IOFBF, sizeof(outbuf));
+
+	TraceMerger merger;
+	int ninputs = 0;
+	for (i=optind; i<argc; i++)
+		if (merger.add(argv[i])) ninputs++;
+
+	int thread, current = -1, len;
+	long nevents = 0;
+	Event *e;
+	while ((e = merger.next(&thread)) != NULL) {
+		if (thread != current) {
+			unsigned char sw[7];
+			sw[0] = 0;
+			sw[1] = 7;
+			sw[2] = THREAD_SWITCH;
+			sw[3] = (thread >> 24) & 0xFF;
+			sw[4] = (thread >> 16) & 0xFF;
+			sw[5] = (thread >> 8) & 0xFF;
+			sw[6] = thread & 0xFF;
+			put(sw, sizeof(sw), outp);
+			current = thread;
+		}
+		const unsigned char *frame = merger.frame(&len);
+		put(frame, len, outp);
+		nevents++;
+		delete e;
+	}
+
+	if (fclose(outp) != 0) { perror(outfn ? outfn : "stdout"); return 1; }
+	fprintf(stderr, "Merged %ld events from %d threads in %d files\n",
+		nevents, merger.threads(), ninputs);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include "tracereader.h"
+
+bool TraceReader::open(const char *_fn) {
+	close();
+	fn = _fn;
+	fp = !strcmp(fn, "-") ? stdin : fopen(fn, "r");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", fn, strerror(errno));
+		return false;
+	}
+	thread = 0;
+	merged = false;
+	versions.assign(1, -1);
+	return true;
+}
+
+void TraceReader::close(void) {
+	if (fp && fp != stdin) fclose(fp);
+	fp = NULL;
+}
+
+Event *TraceReader::next(int *_thread) {
+	if (!fp) return NULL;
+	while (1) {
+		int c1 = getc(fp), c2 = getc(fp);
+		if (c2 == EOF) return NULL;
+		framelen = (c1 << 8) + c2;
+		if (framelen < 3 || framelen > MAX_FRAME) {
+			fprintf(stderr, "%s: bad frame length %d\n", fn, framelen);
+			return NULL;
+		}
+		buf[0] = c1;
+		buf[1] = c2;
+		if (fread(buf+2, framelen-2, 1, fp) != 1) {
+			fprintf(stderr, "%s: truncated frame\n", fn);
+			return NULL;
+		}
+
+		if (buf[2] == THREAD_SWITCH && framelen == 7) {
+			thread = (buf[3] << 24) | (buf[4] << 16) | (buf[5] << 8) | buf[6];
+			if (thread < 0 || thread > 1<<24) {
+				fprintf(stderr, "%s: bad thread number %d\n", fn, thread);
+				return NULL;
+			}
+			if (thread >= (int)versions.size()) versions.resize(thread+1, -1);
+			merged = true;
+			continue;
+		}
+
+		Event *e = parse_event(versions[thread], buf+2);
+		if (!e) return NULL;
+		if (e->type() == EV_HEADER) versions[thread] = ((Header*)e)->version;
+		*_thread = thread;
+		return e;
+	}
+}
+
+TraceMerger::~TraceMerger(void) {
+	for (unsigned int i=0; i<inputs.size(); i++) {
+		delete inputs[i]->ahead;
+		delete inputs[i];
+	}
+}
+
+bool TraceMerger::Later::operator()(int a, int b) const {
+	const timeval &ta = inputs[a]->ahead->tv, &tb = inputs[b]->ahead->tv;
+	if (ta == tb) return a > b;
+	return ta > tb;
+}
+
+bool TraceMerger::add(const char *fn) {
+	Input *in = new Input;
+	in->fn = fn;
+	in->ahead = NULL;
+	if (!in->reader.open(fn)) {
+		delete in;
+		return false;
+	}
+	inputs.push_back(in);
+	advance(inputs.size()-1);
+	return true;
+}
+
+/* read the next event of input "in" and put it back on the heap */
+void TraceMerger::advance(int in) {
+	Input *inp = inputs[in];
+	delete inp->ahead;
+	inp->ahead = inp->reader.next(&inp->ahead_thread);
+	if (!inp->ahead) {
+		inp->reader.close();
+		return;
+	}
+	heap.push_back(in);
+	std::push_heap(heap.begin(), heap.end(), Later(inputs));
+}
+
+Event *TraceMerger::next(int *thread) {
+	// the input we returned from last time still holds that event's
+	// frame; read past it only now
+	if (last >= 0) {
+		advance(last);
+		last = -1;
+	}
+	if (heap.empty()) return NULL;
+
+	std::pop_heap(heap.begin(), heap.end(), Later(inputs));
+	last = heap.back();
+	heap.pop_back();
+
+	Input *inp = inputs[last];
+	std::map<int, int>::iterator tp = inp->threads.find(inp->ahead_thread);
+	if (tp == inp->threads.end()) {
+		tp = inp->threads.insert(std::make_pair(inp->ahead_thread, nthreads++)).first;
+		Origin o = { inp, inp->ahead_thread };
+		origins.push_back(o);
+	}
+	*thread = tp->second;
+
+	Event *e = inp->ahead;
+	inp->ahead = NULL;
+	return e;
+}
+
+const unsigned char *TraceMerger::frame(int *len) const {
+	return inputs[last]->reader.frame(len);
+}
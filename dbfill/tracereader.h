@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef TRACEREADER_H
+#define TRACEREADER_H
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include "events.h"
+
+/* A merged stream, as written by tracemerge, holds the events of many
+ * threads in timestamp order.  It is framed like a trace file, with one
+ * extra record type: 'X' followed by a 4-byte thread number, which says
+ * that the frames after it belong to that thread.  Each thread's frames,
+ * starting with its header, are otherwise exactly as in its own trace. */
+#define THREAD_SWITCH 'X'
+
+/* Reads events from a trace file or a merged stream, reporting which
+ * thread each event came from (always 0 for a plain trace).  Tracks the
+ * trace version of each thread from its header. */
+class TraceReader {
+public:
+	TraceReader(void) : fp(NULL), fn(NULL), thread(0), merged(false), framelen(0) {}
+	~TraceReader(void) { close(); }
+
+	/* "-" means stdin.  Returns false, after saying why, on failure. */
+	bool open(const char *fn);
+	void close(void);
+
+	/* Returns the next event, or NULL at end of file.  The caller owns
+	 * the event. */
+	Event *next(int *thread);
+
+	/* the raw frame of the last event returned */
+	const unsigned char *frame(int *len) const { *len = framelen; return buf; }
+
+	/* true once a thread switch has been seen */
+	bool is_merged(void) const { return merged; }
+
+private:
+	FILE *fp;
+	const char *fn;
+	int thread;
+	bool merged;
+	std::vector<int> versions;   // by thread; -1 until its header
+	unsigned char buf[MAX_FRAME];
+	int framelen;
+};
+
+/* Merges any number of trace files and merged streams into one stream of
+ * events in timestamp order, holding one event of lookahead per input.
+ * Each input's own order is preserved even where its clock goes
+ * backwards; ties go to the input added first.  Threads are numbered in
+ * the order they first appear in the output. */
+class TraceMerger {
+public:
+	TraceMerger(void) : nthreads(0), last(-1) {}
+	~TraceMerger(void);
+
+	bool add(const char *fn);
+	Event *next(int *thread);
+
+	/* the raw frame of the last event returned */
+	const unsigned char *frame(int *len) const;
+
+	/* which input a thread came from, its number within that input, and
+	 * whether the input is a merged stream (so far) */
+	const char *filename(int thread) const { return origins[thread].input->fn; }
+	int input_thread(int thread) const { return origins[thread].thread; }
+	bool from_merged(int thread) const { return origins[thread].input->reader.is_merged(); }
+	int threads(void) const { return nthreads; }
+
+private:
+	struct Input {
+		const char *fn;
+		TraceReader reader;
+		Event *ahead;
+		int ahead_thread;
+		std::map<int, int> threads;   // reader thread -> merged thread
+	};
+	struct Origin {
+		const Input *input;
+		int thread;
+	};
+	struct Later {
+		Later(const std::vector<Input*> &_inputs) : inputs(_inputs) {}
+		bool operator()(int a, int b) const;
+		const std::vector<Input*> &inputs;
+	};
+
+	void advance(int in);
+
+	std::vector<Input*> inputs;
+	std::vector<int> heap;           // indices into inputs with lookahead
+	std::vector<Origin> origins;     // by merged thread
+	int nthreads, last;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "workqueue.h"
+
+struct WorkQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	void (*work)(int, void*);
+	void *arg;
+	std::vector<char> done;
+	int n, next, merged, window;
+};
+
+static void *worker(void *_wq) {
+	WorkQueue *wq = (WorkQueue*)_wq;
+	while (1) {
+		pthread_mutex_lock(&wq->lock);
+		while (wq->next < wq->n && wq->next >= wq->merged + wq->window)
+			pthread_cond_wait(&wq->cond, &wq->lock);
+		int idx = wq->next;
+		if (idx < wq->n) wq->next++;
+		pthread_mutex_unlock(&wq->lock);
+		if (idx >= wq->n) break;
+
+		wq->work(idx, wq->arg);
+
+		pthread_mutex_lock(&wq->lock);
+		wq->done[idx] = 1;
+		pthread_cond_broadcast(&wq->cond);
+		pthread_mutex_unlock(&wq->lock);
+	}
+	return NULL;
+}
+
+int default_jobs(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+void run_ordered(int n, int jobs, void (*work)(int, void*),
+		void (*merge)(int, void*), void *arg) {
+	int i;
+	if (jobs <= 0) jobs = default_jobs();
+	if (jobs > n) jobs = n;
+
+	// one job: no threads, no locking
+	if (jobs <= 1) {
+		for (i=0; i<n; i++) {
+			work(i, arg);
+			if (merge) merge(i, arg);
+		}
+		return;
+	}
+
+	WorkQueue wq;
+	pthread_mutex_init(&wq.lock, NULL);
+	pthread_cond_init(&wq.cond, NULL);
+	wq.work = work;
+	wq.arg = arg;
+	wq.done.assign(n, 0);
+	wq.n = n;
+	wq.next = wq.merged = 0;
+	wq.window = 2*jobs;
+
+	std::vector<pthread_t> workers(jobs);
+	for (i=0; i<jobs; i++)
+		if (pthread_create(&workers[i], NULL, worker, &wq) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+
+	for (i=0; i<n; i++) {
+		pthread_mutex_lock(&wq.lock);
+		while (!wq.done[i])
+			pthread_cond_wait(&wq.cond, &wq.lock);
+		pthread_mutex_unlock(&wq.lock);
+
+		if (merge) merge(i, arg);
+
+		pthread_mutex_lock(&wq.lock);
+		wq.merged++;
+		pthread_cond_broadcast(&wq.cond);
+		pthread_mutex_unlock(&wq.lock);
+	}
+
+	for (i=0; i<jobs; i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&wq.cond);
+	pthread_mutex_destroy(&wq.lock);
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2007 Patrick Reynolds.  All rights reserved.
+ * Please see COPYING for license terms.
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+/* Run work(i, arg) for every i in [0, n) on up to "jobs" worker threads,
+ * and run merge(i, arg) on the calling thread in strict order 0..n-1 as
+ * each item finishes.  Workers never get more than 2*jobs items ahead of
+ * the merge, so at most that many partial results exist at once.
+ * jobs <= 0 means one worker per CPU.  merge may be NULL. */
+void run_ordered(int n, int jobs, void (*work)(int, void*),
+	void (*merge)(int, void*), void *arg);
+
+/* number of CPUs online, at least 1 */
+int default_jobs(void);
+
+#endif
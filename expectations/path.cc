@@ -6,6 +6,7 @@
 #include <assert.h>
 #include "common.h"
 #include "path.h"
+#include "pipdb.h"
 
 #define PRINT_EXP_GROUP_THREADS
 // !! should maybe use existing comparison methods and allow threads with
@@ -242,6 +243,17 @@ void PathThread::print(FILE *fp, unsigned int depth) const {
 		(tz < 0 ? "+" : "-"), abs(tz)/60, abs(tz)%60);
 }
 
+PathSummary::PathSummary(void) {
+	memset(this, 0, sizeof(*this));
+}
+
+PathSummary::PathSummary(const Path &path)
+		: utime(path.utime), stime(path.stime), major_fault(path.major_fault),
+		minor_fault(path.minor_fault), vol_cs(path.vol_cs), invol_cs(path.invol_cs),
+		ts_start(path.ts_start), ts_end(path.ts_end), size(path.size), messages(path.messages),
+		depth(path.depth), hosts(path.hosts), latency(path.latency),
+		threads(path.thread_pools.size()), path_id(path.path_id), valid(path.valid()) {}
+
 Path::Path(void) {
 	init();
 }
@@ -610,8 +622,18 @@ void Path::done_inserting(void) {
 	ts_start = thread_pools[root_thread][0]->start();
 	ts_end = thread_pools[root_thread][thread_pools[root_thread].size()-1]->end();
 
+	PathTotals totals;
 	for (thread=thread_pools.begin(); thread!=thread_pools.end(); thread++)
-		tally(thread->second, true);
+		tally(thread->second, true, &totals);
+	utime = totals.utime;
+	stime = totals.stime;
+	major_fault = totals.majfault;
+	minor_fault = totals.minfault;
+	vol_cs = totals.volcs;
+	invol_cs = totals.involcs;
+	size = totals.size;
+	messages = totals.messages;
+	latency = totals.latency;
 
 	depth = 1;
 	std::set<std::string> host_set;
@@ -625,31 +647,24 @@ void Path::done_inserting(void) {
 	hosts = host_set.size();
 }
 
-void Path::tally(const PathEventList &list, bool toplevel) {
+void Path::tally(const PathEventList &list, bool toplevel, PathTotals *totals) const {
 	for (unsigned int i=0; i<list.size(); i++) {
 		const PathEvent *ev = list[i];
 		switch (ev->type()) {
-			case PEV_TASK:
-				// Clocks are still running for the parent, so don't add the
-				// children, too -- that's double-billing
-				if (toplevel) {
-					utime += dynamic_cast<const PathTask*>(ev)->utime;
-					stime += dynamic_cast<const PathTask*>(ev)->stime;
-					major_fault += dynamic_cast<const PathTask*>(ev)->major_fault;
-					minor_fault += dynamic_cast<const PathTask*>(ev)->minor_fault;
-					vol_cs += dynamic_cast<const PathTask*>(ev)->vol_cs;
-					invol_cs += dynamic_cast<const PathTask*>(ev)->invol_cs;
+			case PEV_TASK: {
+					const PathTask *pt = dynamic_cast<const PathTask*>(ev);
+					totals->add_task(toplevel, pt->utime, pt->stime, pt->major_fault,
+						pt->minor_fault, pt->vol_cs, pt->invol_cs);
+					tally(pt->children, false, totals);
 				}
-				tally(dynamic_cast<const PathTask*>(ev)->children, false);
 				break;
 			case PEV_NOTICE:
 				break;
 			case PEV_MESSAGE_SEND: {
 					const PathMessageSend *pms = dynamic_cast<const PathMessageSend*>(ev);
-					size += pms->size;
-					if (pms->recv) latency += pms->recv->ts - pms->ts;
+					totals->add_message(pms->size, pms->recv != NULL,
+						pms->recv ? pms->recv->ts - pms->ts : 0);
 				}
-				messages++;
 				break;
 			case PEV_MESSAGE_RECV:
 				break;
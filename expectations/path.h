@@ -161,6 +161,8 @@ public:
 // all threads, keyed by TID
 extern std::map<int, PathThread*> threads;
 
+struct PathTotals;   // pipdb.h
+
 class Path {
 public:
 	Path(void);
@@ -200,7 +202,20 @@ public:
 private:
 	void insert_task(PathTask *pt, PathEventList &where);
 	void insert_event(PathEvent *pn, PathEventList &where);  // notices, msg-send, msg-recv
-	void tally(const PathEventList &list, bool toplevel);
+	void tally(const PathEventList &list, bool toplevel, PathTotals *totals) const;
+};
+
+/* A path's totals, as done_inserting leaves them, without its events;
+ * see PathFactory::get_path_summary. */
+struct PathSummary {
+	PathSummary(void);
+	PathSummary(const Path &path);
+	int utime, stime, major_fault, minor_fault, vol_cs, invol_cs;
+	timeval ts_start, ts_end;
+	int size, messages, depth, hosts, latency;
+	int threads;                // thread pools
+	int path_id;
+	bool valid;
 };
 
 timeval ts_to_tv(long long ts);
@@ -17,7 +17,7 @@
 #include "pathfactory.h"
 #include "rcfile.h"
 
-static bool check_path(PathFactory *pf, int pathid);
+static void check_path(Path *path, void *arg);
 inline static timeval tv(long long ts) {
 	timeval ret;
 	ret.tv_sec = ts/1000000;
@@ -74,11 +74,10 @@ int main(int argc, char **argv) {
 
 	if (just_one == -1) {
 		std::vector<int> pathids = pf->get_path_ids();
-		for (std::vector<int>::const_iterator p=pathids.begin(); p!=pathids.end(); p++)
-			check_path(pf, *p);
+		pf->for_each_path(pathids, check_path, NULL);
 	}
 	else
-		check_path(pf, just_one);
+		check_path(pf->get_path(just_one), NULL);
 
 	printf("malformed paths: %d\n", malformed_paths_count);
 	for (i=0; i<=recognizers.size(); i++)
@@ -103,16 +102,16 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-static bool check_path(PathFactory *pf, int pathid) {
+static void check_path(Path *path, void *arg) {
 	std::vector<RecognizerBase*>::const_iterator rp;
 	unsigned int i;
-	Path *path = pf->get_path(pathid);
+	int pathid = path->path_id;
 
 	if (!path->valid()) {
 		printf("# path %d malformed -- not checked\n", pathid);
 		malformed_paths_count++;
 		delete path;
-		return true;
+		return;
 	}
 	int tally = 0;
 	bool invalidated = false;
@@ -168,7 +167,6 @@ static bool check_path(PathFactory *pf, int pathid) {
 	}
 	match_tally[invalidated ? 0 : tally]++;
 	delete path;
-	return tally > 0;
 }
 
 static void usage(const char *prog) {
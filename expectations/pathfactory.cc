@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <string.h>
@@ -41,6 +42,10 @@ inline bool operator< (const GraphPoint &a, const GraphPoint &b) {
 	return a.x < b.x;
 }
 
+static inline int64_t tv_to_usec(const timeval &tv) {
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static void parse_filter(const std::string &filter, const char **real_filter, bool *negate) {
 	if (filter.size() >= 2 && filter[0] == '!') {
 		*negate = true;
@@ -54,6 +59,36 @@ static void parse_filter(const std::string &filter, const char **real_filter, bo
 
 PathFactory::~PathFactory(void) {}
 
+PathSummary PathFactory::get_path_summary(int pathid) {
+	Path *path = get_path(pathid);
+	PathSummary ret(*path);
+	delete path;
+	return ret;
+}
+
+void PathFactory::get_paths(int first_id, int last_id, PathCallback cb, void *arg) {
+	for (int pathid=first_id; pathid<=last_id; pathid++)
+		cb(get_path(pathid), arg);
+}
+
+void PathFactory::for_each_path(const std::vector<int> &pathids, PathCallback cb, void *arg) {
+	unsigned int i = 0;
+	while (i < pathids.size()) {
+		unsigned int j = i + 1;
+		while (j < pathids.size() && pathids[j] == pathids[j-1] + 1) j++;
+		get_paths(pathids[i], pathids[j-1], cb, arg);
+		i = j;
+	}
+}
+
+std::vector<PathSummary> PathFactory::get_path_summaries(const std::vector<int> &pathids) {
+	std::vector<PathSummary> ret;
+	ret.reserve(pathids.size());
+	for (unsigned int i=0; i<pathids.size(); i++)
+		ret.push_back(get_path_summary(pathids[i]));
+	return ret;
+}
+
 int PathFactory::find_thread_pool(const StringInt &where) const {
 	ThreadPoolMap::const_iterator p = thread_pool_map.find(where);
 	if (p == thread_pool_map.end())
@@ -64,22 +99,30 @@ int PathFactory::find_thread_pool(const StringInt &where) const {
 
 #ifdef HAVE_MYSQL
 MySQLPathFactory::MySQLPathFactory(const char *_table_base)
-		: table_base(strdup(_table_base)) {
-	mysql_init(&mysql);
-	if (mysql_real_connect(&mysql, config["db.host"], config.get("db.user", getlogin()),
-			config["db.password"], config.get("db.name", "pip"), 0, NULL, 0)) {
+		: table_base(strdup(_table_base)), range_open(false) {
+	if (connect(&mysql)) {
 		get_threads();
 		is_valid = true;
 	}
-	else {
-		fprintf(stderr, "Connection failed: %s\n", mysql_error(&mysql));
+	else
 		is_valid = false;
-	}
 }
 
 MySQLPathFactory::~MySQLPathFactory(void) {
 	free(table_base);
 	mysql_close(&mysql);
+	if (range_open)
+		for (int i=0; i<3; i++)
+			mysql_close(&range_mysql[i]);
+}
+
+bool MySQLPathFactory::connect(MYSQL *conn) {
+	mysql_init(conn);
+	if (mysql_real_connect(conn, config["db.host"], config.get("db.user", getlogin()),
+			config["db.password"], config.get("db.name", "pip"), 0, NULL, 0))
+		return true;
+	fprintf(stderr, "Connection failed: %s\n", mysql_error(conn));
+	return false;
 }
 
 std::vector<int> MySQLPathFactory::get_path_ids(void) {
@@ -97,7 +140,7 @@ std::vector<int> MySQLPathFactory::get_path_ids(void) {
 	return pathids;
 }
 
-std::vector<NameRec> MySQLPathFactory::get_path_ids(const std::string &filter) {
+std::vector<NameRec> MySQLPathFactory::get_path_ids(const std::string &filter, int limit) {
 	MYSQL_RES *res;
 	MYSQL_ROW row;
 	std::vector<NameRec> pathids;
@@ -110,6 +153,11 @@ std::vector<NameRec> MySQLPathFactory::get_path_ids(const std::string &filter) {
 		else
 			query.append(" WHERE pathblob LIKE '%%").append(filter).append("%%'");
 	}
+	if (limit > 0) {
+		char buf[32];
+		sprintf(buf, " LIMIT %d", limit);
+		query.append(buf);
+	}
 
 	// !! we used to select from tasks+notices+messages we don't return empties
 	run_sql(&mysql, query.c_str());
@@ -121,6 +169,25 @@ std::vector<NameRec> MySQLPathFactory::get_path_ids(const std::string &filter) {
 	return pathids;
 }
 
+std::vector<int> MySQLPathFactory::get_path_ids(timeval from, timeval to) {
+	std::vector<int> pathids;
+
+	// each path's first and last event, from all three tables
+	run_sqlf(&mysql, "SELECT pathid FROM ("
+		"SELECT pathid,MIN(start) AS lo,MAX(end) AS hi FROM %s_tasks GROUP BY pathid "
+		"UNION ALL SELECT pathid,MIN(ts),MAX(ts) FROM %s_notices GROUP BY pathid "
+		"UNION ALL SELECT pathid,MIN(ts_send),MAX(GREATEST(ts_send,IFNULL(ts_recv,0))) FROM %s_messages GROUP BY pathid"
+		") AS spans GROUP BY pathid HAVING MIN(lo)<=%lld AND MAX(hi)>=%lld ORDER BY pathid",
+		table_base, table_base, table_base, (long long)tv_to_usec(to), (long long)tv_to_usec(from));
+	MYSQL_RES *res = mysql_use_result(&mysql);
+	MYSQL_ROW row;
+	while ((row = mysql_fetch_row(res)) != NULL)
+		pathids.push_back(atoi(row[0]));
+	mysql_free_result(res);
+
+	return pathids;
+}
+
 void MySQLPathFactory::get_threads(void) {
 	thread_pool_map.clear();;
 	threads.clear();
@@ -208,6 +275,30 @@ std::vector<NameRec> MySQLPathFactory::get_tasks(const std::string &filter) {
 	return tasks;
 }
 
+std::vector<NameRec> MySQLPathFactory::get_tasks(const std::string &filter, timeval from, timeval to) {
+	std::vector<NameRec> tasks;
+
+	char range[64];
+	sprintf(range, " WHERE start BETWEEN %lld AND %lld", (long long)tv_to_usec(from), (long long)tv_to_usec(to));
+	std::string query("SELECT name,COUNT(name) FROM ");
+	query.append(table_base).append("_tasks").append(range);
+	if (!filter.empty()) {
+		if (filter.size() >= 2 && filter[0] == '!')
+			query.append(" AND name NOT LIKE '%%").append(filter.substr(1)).append("%%'");
+		else
+			query.append(" AND name LIKE '%%").append(filter).append("%%'");
+	}
+	query.append(" GROUP BY name LIMIT 1000");
+	run_sql(&mysql, query.c_str());
+	MYSQL_RES *res = mysql_use_result(&mysql);
+	MYSQL_ROW row;
+	while ((row = mysql_fetch_row(res)) != NULL)
+		tasks.push_back(NameRec(row[0], atoi(row[1])));
+	mysql_free_result(res);
+
+	return tasks;
+}
+
 std::vector<ThreadPoolRec> MySQLPathFactory::get_thread_pools(const std::string &filter) {
 	std::vector<ThreadPoolRec> pools;
 	std::string query("SELECT host,pid,COUNT(host) FROM ");
@@ -309,6 +400,47 @@ std::vector<GraphPoint> MySQLPathFactory::get_task_metric(const std::string &nam
 	return data;
 }
 
+static PathTask *task_from_row(MYSQL_ROW row) {
+	return new PathTask(
+		atoi(row[0]),                          // path id
+		// row[1] is roles
+		atoi(row[2]),                          // level
+		strdup(row[3]),                        // name
+		ts_to_tv(strtoll(row[4], NULL, 10)),   // ts
+		ts_to_tv(strtoll(row[5], NULL, 10)),   // ts_end
+		atoi(row[6]),                          // tdiff
+		atoi(row[7]),                          // utime
+		atoi(row[8]),                          // stime
+		atoi(row[9]),                          // major_fault
+		atoi(row[10]),                         // minor_fault
+		atoi(row[11]),                         // vol_cs
+		atoi(row[12]),                         // invol_cs
+		atoi(row[13]));                        // thread_id
+}
+
+static PathNotice *notice_from_row(MYSQL_ROW row) {
+	return new PathNotice(
+		atoi(row[0]),                          // path id
+		// row[1] is roles
+		atoi(row[2]),                          // level
+		strdup(row[3]),                        // name
+		ts_to_tv(strtoll(row[4], NULL, 10)),   // ts
+		atoi(row[5]));                         // thread_id
+}
+
+static PathMessage *message_from_row(MYSQL_ROW row) {
+	return new PathMessage(
+		atoi(row[0]),                          // path id
+		// row[1] is roles
+		atoi(row[2]),                          // level
+		// row[3] is msgid
+		ts_to_tv(strtoll(row[4], NULL, 10)),   // ts_send
+		ts_to_tv(strtoll(row[5], NULL, 10)),   // ts_recv
+		atoi(row[6]),                          // size
+		atoi(row[7]),                          // thread_send
+		atoi(row[8]));                         // thread_recv
+}
+
 Path *MySQLPathFactory::get_path(int pathid) {
 	Path *ret = new Path();
 	ret->path_id = pathid;
@@ -319,22 +451,7 @@ Path *MySQLPathFactory::get_path(int pathid) {
 	MYSQL_ROW row;
 	while ((row = mysql_fetch_row(res)) != NULL) {
 		assert(atoi(row[0]) == pathid);
-		PathTask *pt = new PathTask(
-			atoi(row[0]),                          // path id
-			// row[1] is roles
-			atoi(row[2]),                          // level
-			strdup(row[3]),                        // name
-			ts_to_tv(strtoll(row[4], NULL, 10)),   // ts
-			ts_to_tv(strtoll(row[5], NULL, 10)),   // ts_end
-			atoi(row[6]),                          // tdiff
-			atoi(row[7]),                          // utime
-			atoi(row[8]),                          // stime
-			atoi(row[9]),                          // major_fault
-			atoi(row[10]),                         // minor_fault
-			atoi(row[11]),                         // vol_cs
-			atoi(row[12]),                         // invol_cs
-			atoi(row[13]));                        // thread_id
-		ret->insert(pt);
+		ret->insert(task_from_row(row));
 	}
 	mysql_free_result(res);
 
@@ -342,15 +459,7 @@ Path *MySQLPathFactory::get_path(int pathid) {
 	res = mysql_use_result(&mysql);
 	while ((row = mysql_fetch_row(res)) != NULL) {
 		assert(atoi(row[0]) == pathid);
-		PathNotice *pn = new PathNotice(
-			atoi(row[0]),                          // path id
-			// row[1] is roles
-			atoi(row[2]),                          // level
-			strdup(row[3]),                        // name
-			ts_to_tv(strtoll(row[4], NULL, 10)),   // ts
-			atoi(row[5]));                         // thread_id
-		//pn->print(stderr);
-		ret->insert(pn);
+		ret->insert(notice_from_row(row));
 	}
 	mysql_free_result(res);
 
@@ -358,18 +467,7 @@ Path *MySQLPathFactory::get_path(int pathid) {
 	res = mysql_use_result(&mysql);
 	while ((row = mysql_fetch_row(res)) != NULL) {
 		assert(atoi(row[0]) == pathid);
-		PathMessage *pm = new PathMessage(
-			atoi(row[0]),                          // path id
-			// row[1] is roles
-			atoi(row[2]),                          // level
-			// row[3] is msgid
-			ts_to_tv(strtoll(row[4], NULL, 10)),   // ts_send
-			ts_to_tv(strtoll(row[5], NULL, 10)),   // ts_recv
-			atoi(row[6]),                          // size
-			atoi(row[7]),                          // thread_send
-			atoi(row[8]));                         // thread_recv
-		//pm->print(stderr);
-		ret->insert(pm);
+		ret->insert(message_from_row(row));
 	}
 	mysql_free_result(res);
 
@@ -377,6 +475,61 @@ Path *MySQLPathFactory::get_path(int pathid) {
 	return ret;
 }
 
+/* One of get_paths's streams: a result read a row at a time, and the
+ * path ID of the row it is on, or INT_MAX past the end. */
+struct RowStream {
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int pathid;
+	void next(void) {
+		row = mysql_fetch_row(res);
+		pathid = row ? atoi(row[0]) : INT_MAX;
+	}
+};
+
+/* Reads the tasks, notices, and messages of the whole range at once,
+ * each sorted by path, and deals them out path by path as the three
+ * streams pass each ID.  A path with no rows comes out empty, as from
+ * get_path. */
+void MySQLPathFactory::get_paths(int first_id, int last_id, PathCallback cb, void *arg) {
+	if (!range_open) {
+		for (int i=0; i<3; i++)
+			if (!connect(&range_mysql[i])) exit(1);
+		range_open = true;
+	}
+
+	static const char *const queries[3] = {
+		"SELECT * FROM %s_tasks WHERE pathid BETWEEN %d AND %d ORDER BY pathid,start",
+		"SELECT * FROM %s_notices WHERE pathid BETWEEN %d AND %d ORDER BY pathid",
+		"SELECT * FROM %s_messages WHERE pathid BETWEEN %d AND %d ORDER BY pathid"
+	};
+	RowStream streams[3];
+	int i;
+	for (i=0; i<3; i++) {
+		run_sqlf(&range_mysql[i], queries[i], table_base, first_id, last_id);
+		streams[i].res = mysql_use_result(&range_mysql[i]);
+		streams[i].next();
+	}
+
+	for (int pathid=first_id; pathid<=last_id; pathid++) {
+		Path *path = new Path();
+		path->path_id = pathid;
+		for (; streams[0].pathid == pathid; streams[0].next())
+			path->insert(task_from_row(streams[0].row));
+		for (; streams[1].pathid == pathid; streams[1].next())
+			path->insert(notice_from_row(streams[1].row));
+		for (; streams[2].pathid == pathid; streams[2].next())
+			path->insert(message_from_row(streams[2].row));
+		path->done_inserting();
+		cb(path, arg);
+	}
+
+	for (i=0; i<3; i++) {
+		assert(streams[i].row == NULL);
+		mysql_free_result(streams[i].res);
+	}
+}
+
 std::string MySQLPathFactory::get_name(void) const {
 	return std::string("MYSQL:")+config.get("db.name", "pip")+"."+table_base;
 }
@@ -404,8 +557,13 @@ static void run_sqlf(MYSQL *mysql, const char *fmt, ...) {
 
 /**************************************************************************/
 
-PipDBPathFactory::PipDBPathFactory(const char *_filename)
-		: filename(strdup(_filename)), map(NULL) {
+static const char *section_name(int id) {
+	return id >= 0 && id < PIPDB_SECTION_TYPES ? pipdb_section_names[id] : "unknown section";
+}
+
+PipDBPathFactory::PipDBPathFactory(const char *_filename, int _thread_base)
+		: filename(strdup(_filename)), thread_base(_thread_base), map(NULL), summaries(NULL),
+		scratch_pathid(0) {
 	int fd = open(_filename, O_RDONLY);
 	is_valid = false;
 	if (fd == -1) {
@@ -423,32 +581,128 @@ PipDBPathFactory::PipDBPathFactory(const char *_filename)
 	}
 	close(fd);   // region remains mapped
 
-	pipdb_header = PipDBHeader::unpack(map);
-	if (strncmp(pipdb_header.magic, "PIP", 3) != 0) {
-		fprintf(stderr, "%s: invalid header\n", _filename);
+	if (!PipDBHeader::unpack(map, maplen, &pipdb_header)) {
+		if (strncmp(pipdb_header.magic, "PIP", 3) == 0
+				&& (pipdb_header.version < 1 || pipdb_header.version > PIPDB_VERSION))
+			fprintf(stderr, "%s: unknown pipdb version %d\n", _filename, pipdb_header.version);
+		else
+			fprintf(stderr, "%s: invalid header\n", _filename);
+		return;
+	}
+	if (pipdb_header.compression < PIPDB_COMPRESS_NONE || pipdb_header.compression > PIPDB_COMPRESS_ZLIB) {
+		fprintf(stderr, "%s: unknown compression method %d\n", _filename, pipdb_header.compression);
 		return;
 	}
-
 	//fprintf(stderr, "pipdb: version %d\n", pipdb_header.version);
+	int ofs_size = pipdb_header.offset_size();
+
+	// the indices are read now, so check them now; the rest waits
+	if (pipdb_header.sections_offset) {
+		if (pipdb_header.sections_offset > maplen
+				|| !pipdb_unpack_sections(map + pipdb_header.sections_offset, map + maplen, &sections)) {
+			fprintf(stderr, "%s: truncated or damaged section table\n", _filename);
+			return;
+		}
+		for (unsigned int i=0; i<sections.size(); i++) {
+			if (sections[i].offset + sections[i].length > pipdb_header.sections_offset) {
+				fprintf(stderr, "%s: truncated %s\n", _filename, section_name(sections[i].id));
+				return;
+			}
+			checked.push_back(std::vector<char>(sections[i].crcs.size(), 0));
+		}
+		if (!section_ok(SECTION_HEADER) || !section_ok(SECTION_THREADS)
+				|| !section_ok(SECTION_TASK_INDEX) || !section_ok(SECTION_PATH_INDEX))
+			return;
+	}
 
 	char *readp = map + pipdb_header.task_idx_offset;
 	for (int i=0; i<pipdb_header.ntasks; i++) {
 		int len = strlen(readp);
 		//fprintf(stderr, "task: \"%s\"\n", readp);
 		task_idx[readp] = readp - map + len + 1;
+		task_names.push_back(readp);
 		readp += len + 1;
-		readp += (*(int*)readp + 1) * sizeof(int);
+		readp += (read_ofs(readp) + 1) * ofs_size;
 	}
 
 	readp = map + pipdb_header.path_idx_offset;
 	for (int i=0; i<pipdb_header.npaths; i++) {
-		short namelen = *(short*)readp;
+		short namelen;
+		memcpy(&namelen, readp, sizeof(namelen));
 		//fprintf(stderr, "path: %08x\n", *(int*)(readp+2));
-		path_idx.push_back(PipDBPathIndexEnt(readp+2, namelen,
-			*(int*)(readp+2+namelen),
-			*(int*)(readp+2+namelen+sizeof(int)),
-			*(int*)(readp+2+namelen+2*sizeof(int))));
-		readp += 2 + namelen + 3*sizeof(int);
+		const char *ofsp = readp + 2 + namelen;
+		if (pipdb_header.compression)
+			// blockofs blocklen rawlen noticeofs messageofs
+			path_idx.push_back(PipDBPathIndexEnt(readp+2, namelen,
+				0, read_ofs(ofsp+3*ofs_size), read_ofs(ofsp+4*ofs_size), read_ofs(ofsp+2*ofs_size),
+				read_ofs(ofsp), read_ofs(ofsp+ofs_size)));
+		else {
+			// each path ends where the next begins
+			if (i > 0) path_idx.back().endofs = read_ofs(ofsp);
+			path_idx.push_back(PipDBPathIndexEnt(readp+2, namelen,
+				read_ofs(ofsp), read_ofs(ofsp+ofs_size), read_ofs(ofsp+2*ofs_size), maplen));
+		}
+		readp += 2 + namelen + pipdb_header.path_offsets()*ofs_size;
+	}
+	// the last path ends where the first section after the records starts
+	if (!pipdb_header.compression && !path_idx.empty()) {
+		off_t sections[5] = { pipdb_header.metrics_offset, pipdb_header.time_idx_offset, pipdb_header.names_offset,
+			pipdb_header.summary_offset, pipdb_header.sections_offset };
+		for (int i=0; i<5; i++)
+			if (sections[i] && sections[i] < path_idx.back().endofs)
+				path_idx.back().endofs = sections[i];
+	}
+
+	if (pipdb_header.metrics_offset) {
+		readp = map + pipdb_header.metrics_offset;
+		for (int i=0; i<pipdb_header.ntasks; i++) {
+			if (readp + 8 > map + maplen) break;
+			task_cols[task_names[i]] = readp;
+			PipDBTaskColumns cols;
+			readp = (char*)pipdb_task_columns(readp, &cols);
+			if (readp > map + maplen) {
+				fprintf(stderr, "%s: truncated task metrics\n", _filename);
+				task_cols.clear();
+				break;
+			}
+		}
+	}
+
+	names_idx.names = NULL;
+	if (pipdb_header.names_offset) {
+		const int64_t *q = (const int64_t*)(map + pipdb_header.names_offset);
+		const int64_t *end = (const int64_t*)(map + maplen);
+		bool ok = q + 1 <= end && q[0] >= 0 && q[0] < maplen/8
+			&& q + 1 + (pipdb_header.npaths+1) + (q[0]+1) <= end;
+		if (ok && pipdb_path_names((char*)q, pipdb_header.npaths, &names_idx) > map + maplen)
+			ok = false;
+		if (!ok) {
+			fprintf(stderr, "%s: truncated path names\n", _filename);
+			names_idx.names = NULL;
+		}
+	}
+
+	if (pipdb_header.summary_offset) {
+		if (pipdb_header.summary_offset % 8 == 0
+				&& pipdb_header.summary_offset + pipdb_header.npaths*(off_t)sizeof(PipDBPathSummary) <= maplen)
+			summaries = (const PipDBPathSummary*)(map + pipdb_header.summary_offset);
+		else
+			fprintf(stderr, "%s: truncated path summaries\n", _filename);
+	}
+
+	time_idx.nbuckets = 0;
+	if (pipdb_header.time_idx_offset) {
+		const int64_t *q = (const int64_t*)(map + pipdb_header.time_idx_offset);
+		const int64_t *end = (const int64_t*)(map + maplen);
+		// the two bucket arrays must be there before their last entries can be read
+		bool ok = q + 3 <= end && q[1] > 0 && q[2] > 0 && q[2] < maplen/8
+			&& q + 3 + 2*pipdb_header.npaths + 2*(q[2]+1) <= end;
+		if (ok && pipdb_time_index((char*)q, pipdb_header.npaths, &time_idx) > map + maplen)
+			ok = false;
+		if (!ok) {
+			fprintf(stderr, "%s: truncated time index\n", _filename);
+			time_idx.nbuckets = 0;
+		}
 	}
 
 	get_threads();
@@ -510,13 +764,30 @@ std::vector<int> PipDBPathFactory::get_path_ids(void) {
 	return pathids;
 }
 
-std::vector<NameRec> PipDBPathFactory::get_path_ids(const std::string &filter) {
+std::vector<NameRec> PipDBPathFactory::get_path_ids(const std::string &filter, int limit) {
 	std::vector<NameRec> pathids;
 	bool negate;
 	const char *real_filter;
 	parse_filter(filter, &real_filter, &negate);
 
-	for (int i=1; i<=pipdb_header.npaths; i++) {
+	if (names_idx.names && !section_ok(SECTION_PATH_NAMES)) names_idx.names = NULL;
+	if (names_idx.names) {
+		std::vector<int> matches;
+		if (!filter.empty()) matches = search_path_names(real_filter);
+		if (!filter.empty() && !negate) {
+			for (unsigned int i=0; i<matches.size() && (limit <= 0 || (int)i < limit); i++)
+				pathids.push_back(NameRec(names_idx.names + names_idx.name_ofs[matches[i]-1], matches[i]));
+			return pathids;
+		}
+		std::vector<int>::const_iterator mp = matches.begin();
+		for (int i=1; i<=pipdb_header.npaths && (limit <= 0 || (int)pathids.size() < limit); i++) {
+			if (mp != matches.end() && *mp == i) { mp++; continue; }
+			pathids.push_back(NameRec(names_idx.names + names_idx.name_ofs[i-1], i));
+		}
+		return pathids;
+	}
+
+	for (int i=1; i<=pipdb_header.npaths && (limit <= 0 || (int)pathids.size() < limit); i++) {
 		std::string txt_name = ID_to_string(std::string(path_idx[i-1].name, path_idx[i-1].namelen));
 		if (!filter.empty()) {
 			if (negate) {
@@ -532,30 +803,63 @@ std::vector<NameRec> PipDBPathFactory::get_path_ids(const std::string &filter) {
 	return pathids;
 }
 
+std::vector<int> PipDBPathFactory::get_path_ids(timeval from, timeval to) {
+	std::vector<int> pathids;
+	int64_t lo = tv_to_usec(from), hi = tv_to_usec(to);
+	if (time_idx.nbuckets && !section_ok(SECTION_TIME_INDEX)) time_idx.nbuckets = 0;
+	if (!time_idx.nbuckets) {
+		int64_t first, last;
+		for (int i=1; i<=pipdb_header.npaths; i++)
+			if (path_span(i, &first, &last) && first <= hi && last >= lo)
+				pathids.push_back(i);
+		return pathids;
+	}
+
+	// the buckets give the candidates, and each path's span the answer
+	lo -= time_idx.base;
+	hi -= time_idx.base;
+	if (hi < 0 || lo > hi) return pathids;
+	int64_t b0 = std::max(lo, (int64_t)0) / time_idx.width;
+	int64_t b1 = std::min(hi / time_idx.width, time_idx.nbuckets-1);
+	for (int64_t b=b0; b<=b1; b++)
+		for (int64_t j=time_idx.path_start[b]; j<time_idx.path_start[b+1]; j++) {
+			int pathid = time_idx.paths[j];
+			if (pathid < 1 || pathid > pipdb_header.npaths) continue;
+			const int64_t *span = time_idx.spans + 2*(pathid-1);
+			if (span[0] <= hi && span[1] >= lo)
+				pathids.push_back(pathid);
+		}
+	sort(pathids.begin(), pathids.end());
+	pathids.erase(unique(pathids.begin(), pathids.end()), pathids.end());
+	return pathids;
+}
+
 void PipDBPathFactory::get_threads(void) {
 	thread_pool_map.clear();;
-	threads.clear();
+	if (thread_base == 0) threads.clear();   // a later segment adds to the first one's
 	int next_thread_pool_id = 1;
 
 	fprintf(stderr, "Reading threads...");
 
 	char *readp = map + pipdb_header.threads_offset;
-	for (int thread_id=1; thread_id<=pipdb_header.nthreads; thread_id++) {
+	for (int thread_id=thread_base+1; thread_id<=thread_base+pipdb_header.nthreads; thread_id++) {
 		char *host = readp;
 		readp += strlen(readp) + 1;
 		char *prog = readp;
 		readp += strlen(readp) + 1;
+		int arr[7];
+		memcpy(arr, readp, sizeof(arr));
+		readp += sizeof(arr);
 		PathThread *thr = new PathThread(
 			thread_id,                                    // thread id
 			host,                                       
 			prog,                                       
-			((int*)readp)[0],                             // pid
-			((int*)readp)[1],                             // tid
-			((int*)readp)[2],                             // ppid
-			((int*)readp)[3],                             // uid
-			make_tv(((int*)readp)[4], ((int*)readp)[5]),  // ts
-			((int*)readp)[6]);                            // tz
-		readp += 7 * sizeof(int);
+			arr[0],                                       // pid
+			arr[1],                                       // tid
+			arr[2],                                       // ppid
+			arr[3],                                       // uid
+			make_tv(arr[4], arr[5]),                      // ts
+			arr[6]);                                      // tz
 		threads[thread_id] = thr;
 		StringInt key(thr->host, thr->pid);
 		ThreadPoolMap::iterator p = thread_pool_map.find(key);
@@ -577,7 +881,7 @@ std::vector<NameRec> PipDBPathFactory::get_tasks(const std::string &filter) {
 	const char *real_filter;
 	parse_filter(filter, &real_filter, &negate);
 
-	for (std::map<const char *, int, ltstr>::const_iterator idxp = task_idx.begin();
+	for (std::map<const char *, off_t, ltstr>::const_iterator idxp = task_idx.begin();
 			idxp != task_idx.end();
 			idxp++) {
 		if (!filter.empty()) {
@@ -588,18 +892,82 @@ std::vector<NameRec> PipDBPathFactory::get_tasks(const std::string &filter) {
 				if (strstr(idxp->first, real_filter) == NULL) continue;
 			}
 		}
-		tasks.push_back(NameRec(idxp->first, *(int*)(map+idxp->second)));
+		tasks.push_back(NameRec(idxp->first, read_ofs(map+idxp->second)));
 	}
 
 	return tasks;
 }
 
-std::vector<ThreadPoolRec> PipDBPathFactory::get_thread_pools(const std::string &filter) {
-	std::vector<ThreadPoolRec> pools;
+std::vector<NameRec> PipDBPathFactory::get_tasks(const std::string &filter, timeval from, timeval to) {
+	std::vector<NameRec> tasks;
 	bool negate;
 	const char *real_filter;
 	parse_filter(filter, &real_filter, &negate);
 
+	int64_t lo = tv_to_usec(from), hi = tv_to_usec(to);
+	std::vector<int> counts(pipdb_header.ntasks, 0);
+	if (time_idx.nbuckets && !section_ok(SECTION_TIME_INDEX)) time_idx.nbuckets = 0;
+	if (!task_cols.empty() && !section_ok(SECTION_TASK_METRICS)) task_cols.clear();
+	if (time_idx.nbuckets) {
+		// whole buckets, from the one holding "from" to the one holding "to"
+		lo -= time_idx.base;
+		hi -= time_idx.base;
+		if (hi >= 0 && lo <= hi) {
+			int64_t b0 = std::max(lo, (int64_t)0) / time_idx.width;
+			int64_t b1 = std::min(hi / time_idx.width, time_idx.nbuckets-1);
+			if (b0 <= b1)
+				for (int64_t j=time_idx.task_start[b0]; j<time_idx.task_start[b1+1]; j++) {
+					int nameidx = time_idx.tasks[2*j];
+					if (nameidx >= 0 && nameidx < pipdb_header.ntasks)
+						counts[nameidx] += time_idx.tasks[2*j+1];
+				}
+		}
+	}
+	else {
+		// every task's start, from its columns if there are any
+		int64_t first = tv_to_usec(pipdb_header.first_ts);
+		int ofs_size = pipdb_header.offset_size();
+		for (int i=0; i<pipdb_header.ntasks; i++) {
+			std::map<const char *, const char *, ltstr>::const_iterator colp = task_cols.find(task_names[i]);
+			if (colp != task_cols.end()) {
+				PipDBTaskColumns cols;
+				pipdb_task_columns(colp->second, &cols);
+				for (int64_t j=0; j<cols.count; j++)
+					if (first + cols.start[j] >= lo && first + cols.start[j] <= hi) counts[i]++;
+				continue;
+			}
+			const char *countp = map + task_idx[task_names[i]];
+			off_t n = read_ofs(countp);
+			for (off_t j=1; j<=n; j++) {
+				const char *rec = task_record(read_ofs(countp + j*ofs_size));
+				if (!rec) continue;
+				PipDBTask t;
+				t.unpack(rec);
+				int64_t start = (int64_t)t.start_sec * 1000000 + t.start_usec;
+				if (start >= lo && start <= hi) counts[i]++;
+			}
+		}
+	}
+
+	// task index order is name order
+	for (int i=0; i<pipdb_header.ntasks; i++) {
+		if (counts[i] == 0) continue;
+		if (!filter.empty()) {
+			if (negate) {
+				if (strstr(task_names[i], real_filter) != NULL) continue;
+			}
+			else {
+				if (strstr(task_names[i], real_filter) == NULL) continue;
+			}
+		}
+		tasks.push_back(NameRec(task_names[i], counts[i]));
+	}
+
+	return tasks;
+}
+
+static std::vector<ThreadPoolRec> thread_pools(const ThreadPoolMap &thread_pool_map) {
+	std::vector<ThreadPoolRec> pools;
 	std::map<StringInt, int> pools_count;
 	for (ThreadPoolMap::const_iterator tpp = thread_pool_map.begin();
 			tpp != thread_pool_map.end();
@@ -614,55 +982,116 @@ std::vector<ThreadPoolRec> PipDBPathFactory::get_thread_pools(const std::string
 	return pools;
 }
 
-static float get_val(GraphQuantity quant, const char *taskp, const timeval &first_ts) {
+std::vector<ThreadPoolRec> PipDBPathFactory::get_thread_pools(const std::string &filter) {
+	return thread_pools(thread_pool_map);
+}
+
+static float get_val(GraphQuantity quant, const PipDBTask &task, const timeval &first_ts) {
 	switch (quant) {
 		case QUANT_START:
-			return (*(timeval*)(taskp + 6) - first_ts) / 1000000.0;   // sec
+			return (make_tv(task.start_sec, task.start_usec) - first_ts) / 1000000.0;   // sec
 		case QUANT_REAL:
-			return ((*(timeval*)(taskp + 14) - first_ts)
-				- (*(timeval*)(taskp + 6) - first_ts)) / 1000.0;  // ms
+			return ((make_tv(task.end_sec, task.end_usec) - first_ts)
+				- (make_tv(task.start_sec, task.start_usec) - first_ts)) / 1000.0;  // ms
 		case QUANT_CPU:
-			return (*(int*)(taskp + 26))/1000.0
-				+ (*(int*)(taskp + 30))/1000.0;   // ms
+			return task.utime/1000.0 + task.stime/1000.0;   // ms
 		case QUANT_UTIME:
-			return (*(int*)(taskp + 26))/1000.0; // ms
+			return task.utime/1000.0; // ms
 		case QUANT_STIME:
-			return (*(int*)(taskp + 30))/1000.0; // ms
+			return task.stime/1000.0; // ms
 		case QUANT_MAJFLT:
-			return *(int*)(taskp + 34);
+			return task.majfault;
 		case QUANT_MINFLT:
-			return *(int*)(taskp + 38);
+			return task.minfault;
 		case QUANT_VCS:
-			return *(int*)(taskp + 42);
+			return task.volcs;
 		case QUANT_IVCS:
-			return *(int*)(taskp + 46);
+			return task.involcs;
+		default: assert(!"invalid quant");
+	}
+}
+
+/* get_val for a whole TASK-METRICS column at once, in loops simple
+ * enough for the compiler to vectorize */
+static void column_vals(GraphQuantity quant, const PipDBTaskColumns &cols, float *vals) {
+	int n = cols.count;
+	const int *col;
+	switch (quant) {
+		case QUANT_START:
+			for (int i=0; i<n; i++) vals[i] = cols.start[i] / 1000000.0;   // sec
+			return;
+		case QUANT_CPU:
+			for (int i=0; i<n; i++) vals[i] = cols.utime[i]/1000.0 + cols.stime[i]/1000.0;   // ms
+			return;
+		case QUANT_REAL:    col = cols.realtime; break;
+		case QUANT_UTIME:   col = cols.utime; break;
+		case QUANT_STIME:   col = cols.stime; break;
+		case QUANT_MAJFLT:  col = cols.majfault; break;
+		case QUANT_MINFLT:  col = cols.minfault; break;
+		case QUANT_VCS:     col = cols.volcs; break;
+		case QUANT_IVCS:    col = cols.involcs; break;
 		default: assert(!"invalid quant");
 	}
+	if (quant == QUANT_REAL || quant == QUANT_UTIME || quant == QUANT_STIME)
+		for (int i=0; i<n; i++) vals[i] = col[i] / 1000.0;   // ms
+	else
+		for (int i=0; i<n; i++) vals[i] = col[i];
 }
 
 bool operator< (const std::pair<float, int> &a, const std::pair<float, int> &b) {
 	return a.first < b.first;
 }
-std::vector<GraphPoint> PipDBPathFactory::get_task_metric(const std::string &name,
-			GraphQuantity quant, GraphStyle style, int max_points) {
-	std::vector<GraphPoint> data;
+bool PipDBPathFactory::task_samples(const std::string &name, GraphQuantity quant, TaskSamples *ts) {
+	std::map<const char *, off_t, ltstr>::const_iterator idxp = task_idx.find(name.c_str());
+	if (idxp == task_idx.end()) return false;
+	const char *countp = map + idxp->second;
+	int row_count = read_ofs(countp);
+	if (row_count <= 0) return false;
+
+	ts->vals.resize(row_count);
+	if (!task_cols.empty() && !section_ok(SECTION_TASK_METRICS)) task_cols.clear();
+	std::map<const char *, const char *, ltstr>::const_iterator colp = task_cols.find(name.c_str());
+	if (colp != task_cols.end()) {
+		PipDBTaskColumns cols;
+		pipdb_task_columns(colp->second, &cols);
+		assert(cols.count == row_count);
+		column_vals(quant, cols, &ts->vals[0]);
+		ts->pathids = cols.pathid;
+		ts->starts = cols.start;
+		return true;
+	}
 
-	if (!quant_map[quant].task_query) {
-		fprintf(stderr, "quant %d is not defined for tasks (yet?)\n", quant);
-		return data;
+	// no TASK-METRICS section: visit each record
+	ts->pathid_buf.resize(row_count);
+	ts->start_buf.resize(row_count);
+	for (int i=0; i<row_count; i++) {
+		off_t slot = read_ofs(countp + (i+1)*pipdb_header.offset_size());
+		// slots are sorted, so a compressed path's block is inflated just once
+		const char *taskp = task_record(slot);
+		if (!taskp) return false;
+		PipDBTask task;
+		task.unpack(taskp);
+		ts->vals[i] = get_val(quant, task, pipdb_header.first_ts);
+		ts->pathid_buf[i] = get_pathid_by_ofs(slot);
+		ts->start_buf[i] = make_tv(task.start_sec, task.start_usec) - pipdb_header.first_ts;
 	}
+	ts->pathids = &ts->pathid_buf[0];
+	ts->starts = &ts->start_buf[0];
+	return true;
+}
+
+/* the points of a graph of "row_count" tasks' values */
+static std::vector<GraphPoint> task_graph(const float *vals, const int *pathids, const int64_t *starts,
+		int row_count, GraphStyle style, int max_points) {
+	std::vector<GraphPoint> data;
 
-	int *idxp = (int*)(map + task_idx[name.c_str()]);
-	int row_count = *(idxp++);
-	assert(row_count > 0);
 	switch (style) {
 		case STYLE_CDF:{
 			if (row_count == 1) return data;  // don't plot invalid CDF
 
-			std::vector<std::pair<float, int> > temp_data;
+			std::vector<std::pair<float, int> > temp_data(row_count);
 			for (int i=0; i<row_count; i++)
-				temp_data.push_back(std::pair<float, int>(
-					get_val(quant, map + idxp[i], pipdb_header.first_ts), get_pathid_by_ofs(idxp[i])));
+				temp_data[i] = std::pair<float, int>(vals[i], pathids[i]);
 			sort(temp_data.begin(), temp_data.end());
 
 			int skip = row_count / (max_points - 1) + 1;
@@ -675,9 +1104,9 @@ std::vector<GraphPoint> PipDBPathFactory::get_task_metric(const std::string &nam
 		case STYLE_PDF:{
 			std::map<int, std::pair<int, int> > temp_data;  // val -> { count, pathid }
 			for (int i=0; i<row_count; i++) {
-				int val = (int)round(get_val(quant, map + idxp[i], pipdb_header.first_ts));
+				int val = (int)round(vals[i]);
 				if (temp_data[val].first++ == 1)
-					temp_data[val].second = get_pathid_by_ofs(idxp[i]);
+					temp_data[val].second = pathids[i];
 			}
 
 			int x, last_x = 1<<30;
@@ -698,9 +1127,8 @@ std::vector<GraphPoint> PipDBPathFactory::get_task_metric(const std::string &nam
 		case STYLE_TIME:
 			int skip = row_count / (max_points - 1) + 1;
 			for (int i=0; i<row_count; i+=skip) {
-				float val = get_val(quant, map + idxp[i], pipdb_header.first_ts);
-				int tdiff = *(timeval*)(map + idxp[i] + 6) - pipdb_header.first_ts;
-				data.push_back(GraphPoint(tdiff/1000000.0, val, get_pathid_by_ofs(idxp[i])));
+				int tdiff = starts[i];
+				data.push_back(GraphPoint(tdiff/1000000.0, vals[i], pathids[i]));
 			}
 			sort(data.begin(), data.end());
 	}
@@ -708,87 +1136,139 @@ std::vector<GraphPoint> PipDBPathFactory::get_task_metric(const std::string &nam
 	return data;
 }
 
+std::vector<GraphPoint> PipDBPathFactory::get_task_metric(const std::string &name,
+			GraphQuantity quant, GraphStyle style, int max_points) {
+	if (!quant_map[quant].task_query) {
+		fprintf(stderr, "quant %d is not defined for tasks (yet?)\n", quant);
+		return std::vector<GraphPoint>();
+	}
+
+	TaskSamples ts;
+	if (!task_samples(name, quant, &ts)) return std::vector<GraphPoint>();
+	return task_graph(&ts.vals[0], ts.pathids, ts.starts, ts.vals.size(), style, max_points);
+}
+
 struct _ltpt {
 	bool operator()(const PathTask *a, const PathTask *b) const { return a->ts < b->ts; }
 } ltpt;
-Path *PipDBPathFactory::get_path(int pathid) {
+/* a Path of these events, with the tasks in start order */
+static Path *make_path(int pathid, std::vector<PathTask*> &tasks,
+		const std::vector<PathNotice*> &notices, const std::vector<PathMessage*> &messages) {
 	Path *ret = new Path();
 	ret->path_id = pathid;
+	sort(tasks.begin(), tasks.end(), ltpt);
+	unsigned int i;
+	for (i=0; i<tasks.size(); i++)
+		ret->insert(tasks[i]);
+	for (i=0; i<notices.size(); i++)
+		ret->insert(notices[i]);
+	for (i=0; i<messages.size(); i++)
+		ret->insert(messages[i]);
+	ret->done_inserting();
+	return ret;
+}
 
-	char *taskofs = map + path_idx[pathid-1].taskofs;
-	char *noticeofs = map + path_idx[pathid-1].noticeofs;
-	char *messageofs = map + path_idx[pathid-1].messageofs;
-	char *end = map + ((pathid == (int)path_idx.size()) ? maplen : path_idx[pathid].taskofs);
-
-	char *readp = taskofs;
+Path *PipDBPathFactory::get_path(int pathid) {
 	std::vector<PathTask*> tasks;
+	std::vector<PathNotice*> notices;
+	std::vector<PathMessage*> messages;
+	read_path(pathid, pathid, &tasks, &notices, &messages);
+	return make_path(pathid, tasks, notices, messages);
+}
+
+void PipDBPathFactory::read_path(int pathid, int as_pathid, std::vector<PathTask*> *tasks,
+		std::vector<PathNotice*> *notices, std::vector<PathMessage*> *messages) {
+	const PipDBPathIndexEnt &ent = path_idx[pathid-1];
+	const char *base = path_base(pathid);
+	if (!base) return;
+	const char *taskofs = base + ent.taskofs;
+	const char *noticeofs = base + ent.noticeofs;
+	const char *messageofs = base + ent.messageofs;
+	const char *end = base + ent.endofs;
+
+	const char *readp = taskofs;
 	while (readp < noticeofs) {
-		unsigned short flags = *(unsigned short*)readp;
-		if (!flags) break;   // empty space
-		readp += sizeof(unsigned short);
-		int *arr = (int*)readp;
-		readp += 14 * sizeof(int);
+		PipDBTask t;
+		int len = t.unpack(readp);
+		if (!len) break;   // empty space
+		readp += len;
 		PathTask *pt = new PathTask(
-			pathid,
+			as_pathid,
 			0,                                     // level
-			map+arr[0],                            // name
-			make_tv(arr[1], arr[2]),               // ts
-			make_tv(arr[3], arr[4]),               // ts_end
-			arr[5],                                // tdiff
-			arr[6],                                // utime
-			arr[7],                                // stime
-			arr[8],                                // major_fault
-			arr[9],                                // minor_fault
-			arr[10],                               // vol_cs
-			arr[11],                               // invol_cs
-			arr[12]);                              // thread_id
+			task_name(t.nameidx),                  // name
+			make_tv(t.start_sec, t.start_usec),    // ts
+			make_tv(t.end_sec, t.end_usec),        // ts_end
+			t.realtime,                            // tdiff
+			t.utime,                               // utime
+			t.stime,                               // stime
+			t.majfault,                            // major_fault
+			t.minfault,                            // minor_fault
+			t.volcs,                               // vol_cs
+			t.involcs,                             // invol_cs
+			t.s_thread);                           // thread_id
 		//pt->print(stderr);
-		tasks.push_back(pt);
+		tasks->push_back(pt);
 	}
-	sort(tasks.begin(), tasks.end(), ltpt);
-	for (unsigned int i=0; i<tasks.size(); i++)
-		ret->insert(tasks[i]);
-	tasks.clear();
 
 	readp = noticeofs;
 	while (readp < messageofs) {
-		char *name = readp;
+		const char *name = readp;
 		if (!name[0]) break;  // empty space
 		readp += strlen(name) + 1;
-		int *arr = (int*)readp;
-		readp += 3 * sizeof(int);
+		int arr[3];
+		memcpy(arr, readp, sizeof(arr));
+		readp += sizeof(arr);
 		PathNotice *pn = new PathNotice(
-			pathid,
+			as_pathid,
 			0,                                     // level
 			strdup(name),                          // name
 			make_tv(arr[0], arr[1]),               // ts
 			arr[2]);                               // thread_id
-		ret->insert(pn);
+		notices->push_back(pn);
 	}
 
 	readp = messageofs;
 	while (readp < end) {
-		char flags = *readp;
-		if (!flags) break;   // empty space
-		readp += sizeof(char);
-		unsigned short idlen = *(unsigned short*)readp;
-		readp += sizeof(unsigned short) + idlen;
-		int *arr = (int*)readp;
-		readp += 7 * sizeof(int);
+		PipDBMessage m;
+		int len = m.unpack(readp);
+		if (!len) break;   // empty space
+		readp += len;
 		PathMessage *pm = new PathMessage(
-			pathid,
+			as_pathid,
 			0,                                     // level
-			make_tv(arr[0], arr[1]),               // ts_send
-			make_tv(arr[2], arr[3]),               // ts_recv
-			arr[4],                                // size
-			arr[5],                                // thread_send
-			arr[6]);                               // thread_recv
+			make_tv(m.send_sec, m.send_usec),      // ts_send
+			make_tv(m.recv_sec, m.recv_usec),      // ts_recv
+			m.size,                                // size
+			m.s_thread,                            // thread_send
+			m.r_thread);                           // thread_recv
 		//pm->send->print(stderr);
 		//if (pm->recv) pm->recv->print(stderr); else fprintf(stderr, "recv=NULL\n");
-		ret->insert(pm);
+		messages->push_back(pm);
 	}
+}
 
-	ret->done_inserting();
+PathSummary PipDBPathFactory::get_path_summary(int pathid) {
+	if (!summaries || !(summaries[pathid-1].flags & SUMMARY_KNOWN)
+			|| !verified(pipdb_header.summary_offset + (pathid-1)*sizeof(PipDBPathSummary), sizeof(PipDBPathSummary)))
+		return PathFactory::get_path_summary(pathid);
+	const PipDBPathSummary &ps = summaries[pathid-1];
+	PathSummary ret;
+	ret.utime = ps.utime;
+	ret.stime = ps.stime;
+	ret.major_fault = ps.majfault;
+	ret.minor_fault = ps.minfault;
+	ret.vol_cs = ps.volcs;
+	ret.invol_cs = ps.involcs;
+	ret.ts_start = make_tv(ps.start / 1000000, ps.start % 1000000);
+	ret.ts_end = make_tv(ps.end / 1000000, ps.end % 1000000);
+	ret.size = ps.size;
+	ret.messages = ps.messages;
+	ret.depth = ps.depth;
+	ret.hosts = ps.hosts;
+	ret.latency = ps.latency;
+	ret.threads = ps.threads;
+	ret.path_id = pathid;
+	ret.valid = ps.flags & SUMMARY_VALID;
 	return ret;
 }
 
@@ -796,23 +1276,409 @@ std::string PipDBPathFactory::get_name(void) const {
 	return std::string("pipdb:")+filename;
 }
 
-bool operator<(int a, const PipDBPathIndexEnt &b) { return a < b.taskofs; }
-int PipDBPathFactory::get_pathid_by_ofs(int ofs) const {
+const char *PipDBPathFactory::path_base(int pathid) {
+	const PipDBPathIndexEnt &ent = path_idx[pathid-1];
+	if (!pipdb_header.compression) {
+		if (!verified(ent.taskofs, ent.endofs - ent.taskofs)) {
+			fprintf(stderr, "%s: path %d: damaged records\n", filename, pathid);
+			return NULL;
+		}
+		return map;
+	}
+	if (!verified(ent.blockofs, ent.blocklen)) {
+		fprintf(stderr, "%s: path %d: damaged block\n", filename, pathid);
+		scratch_pathid = 0;
+		return NULL;
+	}
+	if (ent.blocklen == ent.endofs && ent.blockofs + ent.blocklen <= maplen)
+		return map + ent.blockofs;   // stored uncompressed
+	if (pathid == scratch_pathid) return &scratch[0];
+	scratch.resize(ent.endofs + 1);   // never empty
+	if (ent.blockofs + ent.blocklen > maplen
+			|| !pipdb_decompress(pipdb_header.compression, map + ent.blockofs, ent.blocklen, &scratch[0], ent.endofs)) {
+		fprintf(stderr, "%s: path %d: damaged block\n", filename, pathid);
+		scratch_pathid = 0;
+		return NULL;
+	}
+	scratch[ent.endofs] = '\0';   // readers stop at a zero flags byte
+	scratch_pathid = pathid;
+	return &scratch[0];
+}
+
+const char *PipDBPathFactory::task_record(off_t slot) {
+	if (!pipdb_header.compression)
+		return verified(slot, PipDBTask::length(0xffff)) ? map + slot : NULL;
+	const char *base = path_base(get_pathid_by_ofs(slot));
+	return base ? base + (slot & 0xffffffff) : NULL;
+}
+
+bool PipDBPathFactory::verified(off_t ofs, off_t len) {
+	if (sections.empty() || len <= 0) return true;
+	if (ofs < 0 || ofs + len > maplen) return false;
+	for (unsigned int i=0; i<sections.size(); i++) {
+		const PipDBSection &sec = sections[i];
+		off_t lo = std::max(ofs, (off_t)sec.offset), hi = std::min(ofs + len, (off_t)(sec.offset + sec.length));
+		for (off_t b=(lo - sec.offset)/PIPDB_CRC_BLOCK; lo < hi && b <= (hi - 1 - sec.offset)/PIPDB_CRC_BLOCK; b++) {
+			char &state = checked[i][b];   // 0 unchecked, 1 good, 2 damaged
+			if (state == 0) {
+				off_t start = sec.offset + b*PIPDB_CRC_BLOCK;
+				off_t n = std::min((off_t)PIPDB_CRC_BLOCK, sec.offset + sec.length - start);
+				state = pipdb_crc32c(0, map + start, n) == sec.crcs[b] ? 1 : 2;
+				if (state == 2)
+					fprintf(stderr, "%s: %s: checksum mismatch in bytes %lld-%lld\n", filename,
+						section_name(sec.id), (long long)start, (long long)(start + n - 1));
+			}
+			if (state == 2) return false;
+		}
+	}
+	return true;
+}
+
+bool PipDBPathFactory::section_ok(int id) {
+	for (unsigned int i=0; i<sections.size(); i++)
+		if (sections[i].id == id && !verified(sections[i].offset, sections[i].length)) return false;
+	return true;
+}
+
+static bool shorter(const std::pair<const int*, const int*> &a, const std::pair<const int*, const int*> &b) {
+	return a.second - a.first < b.second - b.first;
+}
+
+std::vector<int> PipDBPathFactory::search_path_names(const char *sub) const {
+	std::vector<int> ret;
+	const PipDBPathNames &pn = names_idx;
+
+	// every name containing "sub" has all of its trigrams
+	std::vector<std::pair<const int*, const int*> > lists;
+	for (int len=strlen(sub), i=0; i+3<=len; i++) {
+		int t = pipdb_trigram(sub+i);
+		const int *tp = std::lower_bound(pn.trigrams, pn.trigrams + pn.ntrigrams, t);
+		if (t < 0 || tp == pn.trigrams + pn.ntrigrams || *tp != t) return ret;   // no name has it
+		lists.push_back(std::make_pair(pn.postings + pn.posting_start[tp - pn.trigrams],
+			pn.postings + pn.posting_start[tp - pn.trigrams + 1]));
+	}
+	if (lists.empty()) {
+		// too short for the index; the names are still faster than the IDs
+		for (int i=1; i<=pipdb_header.npaths; i++)
+			if (strstr(pn.names + pn.name_ofs[i-1], sub)) ret.push_back(i);
+		return ret;
+	}
+
+	std::sort(lists.begin(), lists.end(), shorter);
+	for (const int *p=lists[0].first; p<lists[0].second; p++) {
+		unsigned int j;
+		for (j=1; j<lists.size(); j++)
+			if (!std::binary_search(lists[j].first, lists[j].second, *p)) break;
+		if (j < lists.size() || *p < 1 || *p > pipdb_header.npaths) continue;
+		if (strstr(pn.names + pn.name_ofs[*p-1], sub)) ret.push_back(*p);
+	}
+	return ret;
+}
+
+bool PipDBPathFactory::path_span(int pathid, int64_t *first, int64_t *last) {
+	const PipDBPathIndexEnt &ent = path_idx[pathid-1];
+	const char *base = path_base(pathid);
+	*first = INT64_MAX;
+	*last = INT64_MIN;
+	if (!base) return false;
+
+	const char *readp = base + ent.taskofs;
+	while (readp < base + ent.noticeofs) {
+		PipDBTask t;
+		int len = t.unpack(readp);
+		if (!len) break;   // empty space
+		readp += len;
+		int64_t start = (int64_t)t.start_sec * 1000000 + t.start_usec;
+		int64_t end = (int64_t)t.end_sec * 1000000 + t.end_usec;
+		*first = std::min(*first, std::min(start, end));
+		*last = std::max(*last, std::max(start, end));
+	}
+	readp = base + ent.noticeofs;
+	while (readp < base + ent.messageofs && readp[0]) {
+		readp += strlen(readp) + 1;
+		int arr[3];
+		memcpy(arr, readp, sizeof(arr));
+		readp += sizeof(arr);
+		int64_t ts = (int64_t)arr[0] * 1000000 + arr[1];
+		*first = std::min(*first, ts);
+		*last = std::max(*last, ts);
+	}
+	readp = base + ent.messageofs;
+	while (readp < base + ent.endofs) {
+		PipDBMessage m;
+		int len = m.unpack(readp);
+		if (!len) break;   // empty space
+		readp += len;
+		int64_t send = (int64_t)m.send_sec * 1000000 + m.send_usec;
+		int64_t recv = (int64_t)m.recv_sec * 1000000 + m.recv_usec;
+		*first = std::min(*first, std::min(send, recv));
+		*last = std::max(*last, std::max(send, recv));
+	}
+	return *first <= *last;
+}
+
+bool PipDBPathFactory::indexed_span(int pathid, int64_t *first, int64_t *last) {
+	if (time_idx.nbuckets && !section_ok(SECTION_TIME_INDEX)) time_idx.nbuckets = 0;
+	if (!time_idx.nbuckets) return path_span(pathid, first, last);
+	const int64_t *span = time_idx.spans + 2*(pathid-1);
+	*first = time_idx.base + span[0];
+	*last = time_idx.base + span[1];
+	return span[0] <= span[1];
+}
+
+bool operator<(off_t a, const PipDBPathIndexEnt &b) { return a < b.taskofs; }
+int PipDBPathFactory::get_pathid_by_ofs(off_t ofs) const {
+	if (pipdb_header.compression) return (ofs >> 32) + 1;
 	// upper_bound returns the first index strictly greater than the test
 	// value.  Thus, we want the predecessor, but we also add one because
 	// pathids are 1-based, not 0-based.  +1 and -1 cancel out.
 	return upper_bound(path_idx.begin(), path_idx.end(), ofs) - path_idx.begin();
 }
 
+/**************************************************************************/
+
+struct SegmentPath {
+	const char *name;
+	short namelen;
+	int segment, pathid;
+};
+static bool by_path_id(const SegmentPath &a, const SegmentPath &b) {
+	int c = memcmp(a.name, b.name, std::min(a.namelen, b.namelen));
+	if (c != 0) return c < 0;
+	if (a.namelen != b.namelen) return a.namelen < b.namelen;
+	return a.segment < b.segment;
+}
+
+SegmentedPathFactory::SegmentedPathFactory(const char *_manifest) : manifest(_manifest) {
+	is_valid = false;
+	PipDBManifest m;
+	if (!pipdb_read_manifest(_manifest, &m)) {
+		fprintf(stderr, "%s: invalid segment manifest\n", _manifest);
+		return;
+	}
+	threads.clear();
+	for (unsigned int i=0; i<m.segments.size(); i++) {
+		std::string fn = pipdb_segment_path(_manifest, m.segments[i].file);
+		segments.push_back(new PipDBPathFactory(fn.c_str(), m.segments[i].thread_base));
+		if (!segments.back()->valid()) return;
+	}
+
+	// a path's pieces are adjacent once sorted by ID
+	std::vector<SegmentPath> all;
+	pathid_map.resize(segments.size());
+	for (unsigned int i=0; i<segments.size(); i++) {
+		const std::vector<PipDBPathIndexEnt> &idx = segments[i]->path_idx;
+		pathid_map[i].resize(idx.size());
+		for (unsigned int j=0; j<idx.size(); j++) {
+			SegmentPath sp = { idx[j].name, idx[j].namelen, (int)i, (int)j+1 };
+			all.push_back(sp);
+		}
+	}
+	std::sort(all.begin(), all.end(), by_path_id);
+	piece_start.push_back(0);
+	for (unsigned int i=0; i<all.size(); i++) {
+		if (i > 0 && (all[i].namelen != all[i-1].namelen || memcmp(all[i].name, all[i-1].name, all[i].namelen) != 0))
+			piece_start.push_back(pieces.size());
+		pieces.push_back(std::make_pair(all[i].segment, all[i].pathid));
+		pathid_map[all[i].segment][all[i].pathid-1] = piece_start.size();
+	}
+	if (!all.empty()) piece_start.push_back(pieces.size());
+
+	get_threads();
+	is_valid = true;
+}
+
+SegmentedPathFactory::~SegmentedPathFactory(void) {
+	for (unsigned int i=0; i<segments.size(); i++)
+		delete segments[i];
+}
+
+std::vector<int> SegmentedPathFactory::get_path_ids(void) {
+	std::vector<int> pathids;
+	for (int i=1; i<(int)piece_start.size(); i++)
+		pathids.push_back(i);
+	return pathids;
+}
+
+std::vector<NameRec> SegmentedPathFactory::get_path_ids(const std::string &filter, int limit) {
+	// a path's name is the same in every segment, and so is whether it matches
+	std::map<int, std::string> found;
+	for (unsigned int i=0; i<segments.size(); i++) {
+		std::vector<NameRec> recs = segments[i]->get_path_ids(filter);
+		for (unsigned int j=0; j<recs.size(); j++)
+			found.insert(std::make_pair(pathid_map[i][recs[j].count-1], recs[j].name));
+	}
+	std::vector<NameRec> pathids;
+	for (std::map<int, std::string>::const_iterator fp=found.begin();
+			fp!=found.end() && (limit <= 0 || (int)pathids.size() < limit);
+			fp++)
+		pathids.push_back(NameRec(fp->second, fp->first));
+	return pathids;
+}
+
+std::vector<int> SegmentedPathFactory::get_path_ids(timeval from, timeval to) {
+	// A path spanning segments can cover the window with no event in any
+	// one segment's part of it, so the segments' own answers aren't enough.
+	int npaths = (int)piece_start.size() - 1;
+	if (spans.empty() && npaths > 0) {
+		spans.resize(2*npaths);
+		for (int i=0; i<npaths; i++) {
+			spans[2*i] = INT64_MAX;
+			spans[2*i+1] = INT64_MIN;
+			for (int j=piece_start[i]; j<piece_start[i+1]; j++) {
+				int64_t first, last;
+				if (!segments[pieces[j].first]->indexed_span(pieces[j].second, &first, &last)) continue;
+				spans[2*i] = std::min(spans[2*i], first);
+				spans[2*i+1] = std::max(spans[2*i+1], last);
+			}
+		}
+	}
+
+	std::vector<int> pathids;
+	int64_t lo = tv_to_usec(from), hi = tv_to_usec(to);
+	for (int i=0; i<npaths; i++)
+		if (spans[2*i] <= hi && spans[2*i+1] >= lo)
+			pathids.push_back(i+1);
+	return pathids;
+}
+
+void SegmentedPathFactory::get_threads(void) {
+	thread_pool_map.clear();
+	int next_thread_pool_id = 1;
+	for (std::map<int, PathThread*>::iterator tp=threads.begin(); tp!=threads.end(); tp++) {
+		StringInt key(tp->second->host, tp->second->pid);
+		ThreadPoolMap::iterator p = thread_pool_map.find(key);
+		if (p == thread_pool_map.end())
+			p = thread_pool_map.insert(std::make_pair(key, next_thread_pool_id++)).first;
+		tp->second->pool = p->second;
+	}
+}
+
+std::pair<timeval, timeval> SegmentedPathFactory::get_times(void) {
+	std::pair<timeval, timeval> ret(make_tv(0, 0), make_tv(0, 0));
+	for (unsigned int i=0; i<segments.size(); i++) {
+		std::pair<timeval, timeval> t = segments[i]->get_times();
+		if (i == 0 || t.first < ret.first) ret.first = t.first;
+		if (i == 0 || t.second > ret.second) ret.second = t.second;
+	}
+	return ret;
+}
+
+/* each name's total count, in name order */
+std::vector<NameRec> SegmentedPathFactory::sum_tasks(const std::vector<std::vector<NameRec> > &per_segment) const {
+	std::map<std::string, int> counts;
+	for (unsigned int i=0; i<per_segment.size(); i++)
+		for (unsigned int j=0; j<per_segment[i].size(); j++)
+			counts[per_segment[i][j].name] += per_segment[i][j].count;
+	std::vector<NameRec> tasks;
+	for (std::map<std::string, int>::const_iterator cp=counts.begin(); cp!=counts.end(); cp++)
+		tasks.push_back(NameRec(cp->first, cp->second));
+	return tasks;
+}
+
+std::vector<NameRec> SegmentedPathFactory::get_tasks(const std::string &filter) {
+	std::vector<std::vector<NameRec> > per_segment;
+	for (unsigned int i=0; i<segments.size(); i++)
+		per_segment.push_back(segments[i]->get_tasks(filter));
+	return sum_tasks(per_segment);
+}
+
+std::vector<NameRec> SegmentedPathFactory::get_tasks(const std::string &filter, timeval from, timeval to) {
+	std::vector<std::vector<NameRec> > per_segment;
+	for (unsigned int i=0; i<segments.size(); i++)
+		per_segment.push_back(segments[i]->get_tasks(filter, from, to));
+	return sum_tasks(per_segment);
+}
+
+std::vector<ThreadPoolRec> SegmentedPathFactory::get_thread_pools(const std::string &filter) {
+	return thread_pools(thread_pool_map);
+}
+
+struct ByPathid {
+	ByPathid(const std::vector<int> &_pathids) : pathids(_pathids) {}
+	bool operator()(int a, int b) const { return pathids[a] < pathids[b]; }
+	const std::vector<int> &pathids;
+};
+
+std::vector<GraphPoint> SegmentedPathFactory::get_task_metric(const std::string &name,
+			GraphQuantity quant, GraphStyle style, int max_points) {
+	if (!quant_map[quant].task_query) {
+		fprintf(stderr, "quant %d is not defined for tasks (yet?)\n", quant);
+		return std::vector<GraphPoint>();
+	}
+
+	// each segment's starts are from its own first_ts; make them from ours
+	int64_t first = tv_to_usec(get_times().first);
+	std::vector<float> vals;
+	std::vector<int> pathids;
+	std::vector<int64_t> starts;
+	for (unsigned int i=0; i<segments.size(); i++) {
+		TaskSamples ts;
+		if (!segments[i]->task_samples(name, quant, &ts)) continue;
+		int64_t shift = tv_to_usec(segments[i]->get_times().first) - first;
+		for (unsigned int j=0; j<ts.vals.size(); j++) {
+			vals.push_back(quant == QUANT_START ? ts.vals[j] + shift/1000000.0 : ts.vals[j]);
+			pathids.push_back(pathid_map[i][ts.pathids[j]-1]);
+			starts.push_back(ts.starts[j] + shift);
+		}
+	}
+	if (vals.empty()) return std::vector<GraphPoint>();
+
+	// in the order one pipdb of all the segments would have them: by path,
+	// and then by segment
+	std::vector<int> order(vals.size());
+	for (unsigned int i=0; i<order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), ByPathid(pathids));
+	std::vector<float> vals2(vals.size());
+	std::vector<int> pathids2(vals.size());
+	std::vector<int64_t> starts2(vals.size());
+	for (unsigned int i=0; i<order.size(); i++) {
+		vals2[i] = vals[order[i]];
+		pathids2[i] = pathids[order[i]];
+		starts2[i] = starts[order[i]];
+	}
+	return task_graph(&vals2[0], &pathids2[0], &starts2[0], vals2.size(), style, max_points);
+}
+
+Path *SegmentedPathFactory::get_path(int pathid) {
+	std::vector<PathTask*> tasks;
+	std::vector<PathNotice*> notices;
+	std::vector<PathMessage*> messages;
+	for (int i=piece_start[pathid-1]; i<piece_start[pathid]; i++)
+		segments[pieces[i].first]->read_path(pieces[i].second, pathid, &tasks, &notices, &messages);
+	return make_path(pathid, tasks, notices, messages);
+}
+
+/* A path in just one segment has that segment's summary. */
+PathSummary SegmentedPathFactory::get_path_summary(int pathid) {
+	if (piece_start[pathid] - piece_start[pathid-1] != 1)
+		return PathFactory::get_path_summary(pathid);
+	const std::pair<int, int> &piece = pieces[piece_start[pathid-1]];
+	PathSummary ret = segments[piece.first]->get_path_summary(piece.second);
+	ret.path_id = pathid;
+	return ret;
+}
+
+std::string SegmentedPathFactory::get_name(void) const {
+	return std::string("pipdb:")+manifest;
+}
+
+/* a segmented pipdb if "fn" is a manifest */
+static PathFactory *pipdb_factory(const char *fn) {
+	PipDBManifest m;
+	if (pipdb_read_manifest(fn, &m)) return new SegmentedPathFactory(fn);
+	return new PipDBPathFactory(fn);
+}
+
 // it's a factory factory
 PathFactory *path_factory(const char *name) {
 #ifdef HAVE_MYSQL
 	if (!strncasecmp(name, "mysql:", 6)) return new MySQLPathFactory(name+6);
-	if (!strncasecmp(name, "pipdb:", 6)) return new PipDBPathFactory(name+6);
+	if (!strncasecmp(name, "pipdb:", 6)) return pipdb_factory(name+6);
 	struct stat st;
-	if (stat(name, &st) != -1) return new PipDBPathFactory(name);
+	if (stat(name, &st) != -1) return pipdb_factory(name);
 	return new MySQLPathFactory(name);
 #else
-	return new PipDBPathFactory(name);
+	return pipdb_factory(name);
 #endif
 }
@@ -37,18 +37,38 @@ enum GraphQuantity { QUANT_START=0, QUANT_REAL, QUANT_CPU, QUANT_UTIME,
 	QUANT_LATENCY, QUANT_MESSAGES, QUANT_BYTES, QUANT_DEPTH, QUANT_THREADS, QUANT_HOSTS };
 enum GraphStyle { STYLE_CDF, STYLE_PDF, STYLE_TIME };
 
+/* Takes a path from get_paths, and owns it from then on. */
+typedef void (*PathCallback)(Path *path, void *arg);
+
 class PathFactory {
 public:
 	virtual ~PathFactory(void);
 	virtual std::vector<int> get_path_ids(void) = 0;
-	virtual std::vector<NameRec> get_path_ids(const std::string &filter) = 0;
+	// the first "limit" matches, or all of them if limit is 0
+	virtual std::vector<NameRec> get_path_ids(const std::string &filter, int limit = 0) = 0;
+	// paths with any event from "from" to "to", inclusive, in order
+	virtual std::vector<int> get_path_ids(timeval from, timeval to) = 0;
 	virtual std::pair<timeval, timeval> get_times(void) = 0;
 	virtual std::vector<NameRec> get_tasks(const std::string &filter) = 0;
+	// tasks starting from "from" to "to"; a pipdb with a time index
+	// rounds both out to its bucket boundaries
+	virtual std::vector<NameRec> get_tasks(const std::string &filter, timeval from, timeval to) = 0;
 	virtual std::vector<ThreadPoolRec> get_thread_pools(const std::string &filter) = 0;
 	virtual int find_thread_pool(const StringInt &where) const;
 	virtual std::vector<GraphPoint> get_task_metric(const std::string &name,
 			GraphQuantity quant, GraphStyle style, int max_points) = 0;
 	virtual Path *get_path(int pathid) = 0;
+	// each path from first_id to last_id, in order, as get_path would
+	// build it, passed to cb; by default, one get_path at a time
+	virtual void get_paths(int first_id, int last_id, PathCallback cb, void *arg);
+	// the same for the paths given, in that order, with one get_paths
+	// for each run of consecutive IDs
+	void for_each_path(const std::vector<int> &pathids, PathCallback cb, void *arg);
+	// a path's totals, from PATH-SUMMARY if there is one, or else by
+	// building it
+	virtual PathSummary get_path_summary(int pathid);
+	// the same for many paths, in the order given
+	virtual std::vector<PathSummary> get_path_summaries(const std::vector<int> &pathids);
 	virtual std::string get_name(void) const = 0;
 	virtual bool valid(void) { return is_valid; }
 
@@ -66,30 +86,54 @@ public:
 	MySQLPathFactory(const char *_table_base);
 	~MySQLPathFactory(void);
 	virtual std::vector<int> get_path_ids(void);
-	virtual std::vector<NameRec> get_path_ids(const std::string &filter);
+	virtual std::vector<NameRec> get_path_ids(const std::string &filter, int limit = 0);
+	virtual std::vector<int> get_path_ids(timeval from, timeval to);
 	virtual std::pair<timeval, timeval> get_times(void);
 	virtual std::vector<NameRec> get_tasks(const std::string &filter);
+	virtual std::vector<NameRec> get_tasks(const std::string &filter, timeval from, timeval to);
 	virtual std::vector<ThreadPoolRec> get_thread_pools(const std::string &filter);
 	virtual std::vector<GraphPoint> get_task_metric(const std::string &name,
 			GraphQuantity quant, GraphStyle style, int max_points);
 	virtual Path *get_path(int pathid);
+	// three queries in all, streamed side by side
+	virtual void get_paths(int first_id, int last_id, PathCallback cb, void *arg);
 	virtual std::string get_name(void) const;
 
 protected:
 	MYSQL mysql;
 	char *table_base;
+	// get_paths's tasks, notices, and messages, each on a connection of
+	// its own, opened the first time, so that mysql stays free for cb
+	MYSQL range_mysql[3];
+	bool range_open;
 
 	virtual void get_threads(void);
+	bool connect(MYSQL *conn);
 };
 #endif   // HAVE_MYSQL
 
+/* In a compressed pipdb, the record offsets are within the path's
+ * uncompressed block, and blockofs and blocklen say where that block is
+ * in the file.  Otherwise they are file offsets and blocklen is 0. */
 struct PipDBPathIndexEnt {
 	char *name;
 	short namelen;
-	int taskofs, noticeofs, messageofs;
-	PipDBPathIndexEnt(char *_name, short _namelen, int _taskofs, int _noticeofs, int _messageofs)
+	off_t taskofs, noticeofs, messageofs, endofs;
+	off_t blockofs, blocklen;
+	PipDBPathIndexEnt(char *_name, short _namelen, off_t _taskofs, off_t _noticeofs, off_t _messageofs,
+			off_t _endofs, off_t _blockofs = 0, off_t _blocklen = 0)
 			: name(_name), namelen(_namelen), taskofs(_taskofs),
-			noticeofs(_noticeofs), messageofs(_messageofs) {}
+			noticeofs(_noticeofs), messageofs(_messageofs), endofs(_endofs),
+			blockofs(_blockofs), blocklen(_blocklen) {}
+};
+
+/* One task name's graph inputs, in slot order; see get_task_metric. */
+struct TaskSamples {
+	std::vector<float> vals;
+	const int *pathids;         // into TASK-METRICS, or pathid_buf
+	const int64_t *starts;      // usec since first_ts; likewise
+	std::vector<int> pathid_buf;
+	std::vector<int64_t> start_buf;
 };
 
 struct ltstr {
@@ -98,28 +142,115 @@ struct ltstr {
 
 class PipDBPathFactory : public PathFactory {
 public:
-	PipDBPathFactory(const char *_filename);
+	// a segment's threads are numbered after _thread_base; see pipdb.h
+	PipDBPathFactory(const char *_filename, int _thread_base = 0);
 	~PipDBPathFactory(void);
 	virtual std::vector<int> get_path_ids(void);
-	virtual std::vector<NameRec> get_path_ids(const std::string &filter);
+	virtual std::vector<NameRec> get_path_ids(const std::string &filter, int limit = 0);
+	virtual std::vector<int> get_path_ids(timeval from, timeval to);
 	virtual std::pair<timeval, timeval> get_times(void);
 	virtual std::vector<NameRec> get_tasks(const std::string &filter);
+	virtual std::vector<NameRec> get_tasks(const std::string &filter, timeval from, timeval to);
 	virtual std::vector<ThreadPoolRec> get_thread_pools(const std::string &filter);
 	virtual std::vector<GraphPoint> get_task_metric(const std::string &name,
 			GraphQuantity quant, GraphStyle style, int max_points);
 	virtual Path *get_path(int pathid);
+	virtual PathSummary get_path_summary(int pathid);
 	virtual std::string get_name(void) const;
 
 protected:
+	friend class SegmentedPathFactory;
 	char *filename;
+	int thread_base;
 	char *map;
 	off_t maplen;
 	PipDBHeader pipdb_header;
-	std::map<const char *, int, ltstr> task_idx;
+	std::map<const char *, off_t, ltstr> task_idx;   // name -> offset of its count
+	std::vector<const char *> task_names;             // by number in the task index
+	std::map<const char *, const char *, ltstr> task_cols;   // name -> its TASK-METRICS
+	PipDBTimeIndex time_idx;     // nbuckets is 0 if there is none
+	PipDBPathNames names_idx;    // names is NULL if there is none
+	const PipDBPathSummary *summaries;   // NULL if there are none
 	std::vector<PipDBPathIndexEnt> path_idx;
+	std::vector<char> scratch;   // the last compressed block read
+	int scratch_pathid;
+	std::vector<PipDBSection> sections;    // empty if there is no SECTIONS table
+	std::vector<std::vector<char> > checked;   // by section, each block's state
+
+	virtual void get_threads(void);
+	virtual int get_pathid_by_ofs(off_t ofs) const;
+
+	/* Whether bytes ofs to ofs+len-1 match their checksums, verifying
+	 * each block the first time.  True if the file has none. */
+	bool verified(off_t ofs, off_t len);
+	/* the same for every section "id" (SECTION_*) */
+	bool section_ok(int id);
+	/* What a path's index offsets are relative to: the map, or its
+	 * block, inflated into "scratch".  NULL if the block is damaged. */
+	const char *path_base(int pathid);
+	/* the task record an index slot refers to */
+	const char *task_record(off_t slot);
+	/* paths whose printable names contain "sub", in order, from PATH-NAMES */
+	std::vector<int> search_path_names(const char *sub) const;
+	/* The first and last event of a path, in microseconds, read from its
+	 * records.  False if it has none. */
+	bool path_span(int pathid, int64_t *first, int64_t *last);
+	/* the same, from the time index if there is one */
+	bool indexed_span(int pathid, int64_t *first, int64_t *last);
+	/* Appends a path's records, as events of path "as_pathid". */
+	void read_path(int pathid, int as_pathid, std::vector<PathTask*> *tasks,
+		std::vector<PathNotice*> *notices, std::vector<PathMessage*> *messages);
+	/* False if there are no tasks named "name" or one is damaged. */
+	bool task_samples(const std::string &name, GraphQuantity quant, TaskSamples *ts);
+
+	/* an offset or count from an index, sized for this file's version */
+	off_t read_ofs(const char *p) const {
+		if (pipdb_header.version >= 2) {
+			int64_t v;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+		int v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	/* the name a task record's nameidx field refers to */
+	const char *task_name(int nameidx) const {
+		return pipdb_header.version >= 2 ? task_names[nameidx] : map + nameidx;
+	}
+};
+
+/* A segmented pipdb: the segments its manifest names, as one database.
+ * Paths are numbered in ID order over all of the segments' paths, and a
+ * path in several segments has all of their records. */
+class SegmentedPathFactory : public PathFactory {
+public:
+	SegmentedPathFactory(const char *_manifest);
+	~SegmentedPathFactory(void);
+	virtual std::vector<int> get_path_ids(void);
+	virtual std::vector<NameRec> get_path_ids(const std::string &filter, int limit = 0);
+	virtual std::vector<int> get_path_ids(timeval from, timeval to);
+	virtual std::pair<timeval, timeval> get_times(void);
+	virtual std::vector<NameRec> get_tasks(const std::string &filter);
+	virtual std::vector<NameRec> get_tasks(const std::string &filter, timeval from, timeval to);
+	virtual std::vector<ThreadPoolRec> get_thread_pools(const std::string &filter);
+	virtual std::vector<GraphPoint> get_task_metric(const std::string &name,
+			GraphQuantity quant, GraphStyle style, int max_points);
+	virtual Path *get_path(int pathid);
+	virtual PathSummary get_path_summary(int pathid);
+	virtual std::string get_name(void) const;
+
+protected:
+	std::string manifest;
+	std::vector<PipDBPathFactory*> segments;
+	std::vector<int> piece_start;    // path i's pieces are pieces[piece_start[i-1] .. piece_start[i]]
+	std::vector<std::pair<int, int> > pieces;   // (segment, its pathid)
+	std::vector<std::vector<int> > pathid_map;  // by segment: its pathid-1 -> ours
+	std::vector<int64_t> spans;   // each path's first and last event, once asked for
 
+	// number the thread pools over the threads all the segments read
 	virtual void get_threads(void);
-	virtual int get_pathid_by_ofs(int ofs) const;
+	std::vector<NameRec> sum_tasks(const std::vector<std::vector<NameRec> > &per_segment) const;
 };
 
 PathFactory *path_factory(const char *name);
@@ -15,7 +15,7 @@
 #include "rcfile.h"
 #include "pathfactory.h"
 
-static void read_path(PathFactory *pf, int pathid);
+static void read_path(Path *path, void *arg);
 static int malformed_paths_count = 0;
 
 int main(int argc, char **argv) {
@@ -36,11 +36,10 @@ int main(int argc, char **argv) {
 
 	if (just_one == -1) {
 		std::vector<int> pathids = pf->get_path_ids();
-		for (std::vector<int>::const_iterator p=pathids.begin(); p!=pathids.end(); p++)
-			read_path(pf, *p);
+		pf->for_each_path(pathids, read_path, NULL);
 	}
 	else
-		read_path(pf, just_one);
+		read_path(pf->get_path(just_one), NULL);
 
 	printf("malformed paths: %d\n", malformed_paths_count);
 
@@ -49,14 +48,13 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-static void read_path(PathFactory *pf, int pathid) {
-	Path *path = pf->get_path(pathid);
+static void read_path(Path *path, void *arg) {
 	if (!path->valid()) {
-		printf("# path %d malformed\n", pathid);
+		printf("# path %d malformed\n", path->path_id);
 		malformed_paths_count++;
 	}
 
-	printf("====================[ path %d ]====================\n", pathid);
+	printf("====================[ path %d ]====================\n", path->path_id);
 	path->print();
 	delete path;
 }
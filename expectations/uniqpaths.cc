@@ -15,7 +15,7 @@
 #include "pathfactory.h"
 #include "rcfile.h"
 
-static void read_path(PathFactory *pf, int pathid);
+static void read_path(Path *path, void *arg);
 struct ltPathShape {
 	bool operator()(const Path* p1, const Path* p2) const {
 		int res = p1->compare(*p2);
@@ -56,9 +56,7 @@ int main(int argc, char **argv) {
 
 	std::vector<int> pathids = pf->get_path_ids();
 
-	for (std::vector<int>::const_iterator p=pathids.begin(); p!=pathids.end(); p++) {
-		read_path(pf, *p);
-	}
+	pf->for_each_path(pathids, read_path, NULL);
 
 	printf("malformed paths: %d\n", malformed_paths_count);
 
@@ -78,10 +76,9 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-static void read_path(PathFactory *pf, int pathid) {
-	Path *path = pf->get_path(pathid);
+static void read_path(Path *path, void *arg) {
 	if (!path->valid()) {
-		printf("# path %d malformed\n", pathid);
+		printf("# path %d malformed\n", path->path_id);
 		malformed_paths_count++;
 		delete path;
 	}
@@ -5,7 +5,7 @@
 
 #include "pathstub.h"
 
-PathStub::PathStub(const Path &path, int nrecognizers)
+PathStub::PathStub(const PathSummary &path, int nrecognizers)
 		: recognizers(nrecognizers) {
 	utime = path.utime;
 	stime = path.stime;
@@ -21,9 +21,9 @@ PathStub::PathStub(const Path &path, int nrecognizers)
 	depth = path.depth;
 	hosts = path.hosts;
 	bytes = path.size;
-	threads = path.thread_pools.size();
+	threads = path.threads;
 	path_id = path.path_id;
-	valid = path.valid();
+	valid = path.valid;
 	validated = false;
 }
 
@@ -12,7 +12,8 @@
 
 class PathStub {
 public:
-	PathStub(const Path &path, int nrecognizers);
+	// a Path converts to its PathSummary
+	PathStub(const PathSummary &path, int nrecognizers);
 	void print(FILE *fp = stdout) const;
 
 	int utime, stime, major_fault, minor_fault, vol_cs, invol_cs;
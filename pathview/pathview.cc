@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <gtk/gtk.h>
 #include <glade/glade.h>
 #include "boolarray.h"
@@ -30,6 +31,7 @@
 #endif
 
 #define MAX_PATHS_DISPLAYED 5000
+#define CHECK_BATCH 256    // paths check_all_paths does per idle call
 
 #define RID_UNVALIDATED -1
 /* Task columns */        enum { T_COL_COUNT, T_COL_NAME };
@@ -74,6 +76,7 @@ static void fill_comm(GtkGraph *graph, const Path *path);
 static const char *itoa(int n);
 static gboolean check_all_paths(void *iter);
 static void check_path(int pathid);
+static void check_fetched_path(Path *path, void *arg);
 static void regraph(void);
 static const char *find_glade_file(void);
 static void set_statusbar(const char *fmt, ...);
@@ -184,6 +187,7 @@ static void times_changed(float start_time, float end_time) {
 	limit_start = first_time + (int)(1000000*start_time);
 	limit_end = first_time + (int)(1000000*end_time);
 	fill_paths();
+	fill_tasks();
 }
 
 static void start_time_changed(void) {
@@ -338,7 +342,7 @@ void fill_tasks(void) {
 	gtk_list_store_clear(list_tasks);
 	GtkTreeIter iter;
 	set_statusbar("Reading tasks");
-	std::vector<NameRec> tasks = pf->get_tasks(search);
+	std::vector<NameRec> tasks = pf->get_tasks(search, limit_start, limit_end);
 	for (unsigned int i=0; i<tasks.size(); i++) {
 		gtk_list_store_append(list_tasks, &iter);
 		gtk_list_store_set(list_tasks, &iter,
@@ -393,15 +397,30 @@ static void add_path(int pathid, const std::string &name) {
 	shown_paths.push_back(pathid);
 }
 
+static void add_paths(const std::vector<NameRec> &pathnames, unsigned int first, const std::vector<int> &in_window) {
+	for (unsigned int i=first; i<pathnames.size(); i++)
+		if (std::binary_search(in_window.begin(), in_window.end(), pathnames[i].count))
+			add_path(pathnames[i].count, pathnames[i].name);
+}
+
 // !! should only re-query if the search string or recognizer filters have changed
 void fill_paths(void) {
 	const char *search = gtk_entry_get_text(GTK_ENTRY(WID("paths_search")));
 	gtk_list_store_clear(list_paths);
 	shown_paths.clear();
 	set_statusbar("Reading paths");
-	std::vector<NameRec> pathnames = pf->get_path_ids(search);
-	for (unsigned int i=0; i<pathnames.size(); i++)
-		add_path(pathnames[i].count, pathnames[i].name);
+	// paths with any event in the window; add_path narrows it to each
+	// path's own start and end once they are known
+	std::vector<int> in_window = pf->get_path_ids(limit_start, limit_end);
+	// with no other filters, only the first matches can be shown
+	int limit = !recognizers_filter && in_window.size() == path_ids.size() ? MAX_PATHS_DISPLAYED : 0;
+	std::vector<NameRec> pathnames = pf->get_path_ids(search, limit);
+	add_paths(pathnames, 0, in_window);
+	if (limit && (int)pathnames.size() == limit && shown_paths.size() < MAX_PATHS_DISPLAYED) {
+		// add_path left out empty paths, so there is room for more
+		pathnames = pf->get_path_ids(search);
+		add_paths(pathnames, limit, in_window);
+	}
 	set_statusbar(NULL);
 }
 
@@ -1231,14 +1250,33 @@ static gboolean check_all_paths(void *iter) {
 		still_checking = false;
 		return false;
 	}
-	check_path(**p);
-	++(*p);
+	// a batch of paths per idle call, fetched together
+	int n = std::min(CHECK_BATCH, (int)(path_ids.end() - *p));
+	if (recognizers.empty())
+		for (int i=0; i<n; i++)
+			check_path((*p)[i]);
+	else
+		pf->for_each_path(std::vector<int>(*p, *p + n), check_fetched_path, NULL);
+	*p += n;
 	return true;
 }
 
 static void check_path(int pathid) {
+	if (recognizers.empty()) {
+		// nothing to match, so the graphs need only the totals
+		PathStub *ps = paths[pathid] = new PathStub(pf->get_path_summary(pathid), 1);
+		if (!ps->valid)
+			set_statusbar("Path %d malformed -- not checked", pathid);
+		else
+			invalid_paths_count++;
+		return;
+	}
+	check_fetched_path(pf->get_path(pathid), NULL);
+}
+
+static void check_fetched_path(Path *path, void *arg) {
 	unsigned int i;
-	Path *path = pf->get_path(pathid);
+	int pathid = path->path_id;
 	PathStub *ps = paths[pathid] = new PathStub(*path, recognizers.size()+1);
 
 	if (!path->valid()) {